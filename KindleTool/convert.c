@@ -20,6 +20,13 @@
 **  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// For syncfs
+#if defined(__linux__)
+#	ifndef _GNU_SOURCE
+#		define _GNU_SOURCE
+#	endif
+#endif
+
 #include "convert.h"
 
 static const char*
@@ -122,22 +129,24 @@ uint32_t
 }
 
 static int
-    kindle_read_bundle_header(UpdateHeader* header, FILE* input)
+    kindle_read_bundle_header(UpdateHeader* header, struct kt_input* input)
 {
-	if (fread(header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH, input) < 1 || ferror(input) != 0) {
+	if (kt_input_read(input, header, MAGIC_NUMBER_LENGTH) < 1 || kt_input_error(input)) {
 		return -1;
 	}
 	return 0;
 }
 
 static int
-    kindle_convert(FILE*      input,
-		   FILE*      output,
-		   FILE*      sig_output,
-		   const bool fake_sign,
-		   const bool unwrap_only,
-		   FILE*      unwrap_output,
-		   char*      header_md5)
+    kindle_convert(struct kt_convert_ctx* ctx,
+		   struct kt_input*       input,
+		   FILE*                  output,
+		   FILE*                  sig_output,
+		   const bool             fake_sign,
+		   const bool             unwrap_only,
+		   FILE*                  unwrap_output,
+		   char*                  header_md5,
+		   BundleVersion*         payload_version)
 {
 	UpdateHeader  header;
 	BundleVersion bundle_version;
@@ -147,16 +156,13 @@ static int
 	// later during the header.magic_number printf (asking for a MAGIC_NUMBER_LENGTH field width also helps) ;)).
 	memset(&header, 0, sizeof(UpdateHeader));
 
-	unsigned char buffer[BUFFER_SIZE];
-	size_t        count;
-
 	if (kindle_read_bundle_header(&header, input) < 0) {
-		fprintf(stderr, "Cannot read input file: %s.\n", strerror(errno));
+		fprintf(ctx->report, "Cannot read input file: %s.\n", strerror(errno));
 		return -1;
 	}
 	if (get_bundle_version(header.magic_number) == UnknownUpdate) {
 		// Cf. http://stackoverflow.com/questions/3555791
-		fprintf(stderr,
+		fprintf(ctx->report,
 			"Bundle         Unknown (0x%02X%02X%02X%02X [%.*s])\n",
 			(unsigned) (unsigned char) header.magic_number[0],
 			(unsigned) (unsigned char) header.magic_number[1],
@@ -165,7 +171,7 @@ static int
 			MAGIC_NUMBER_LENGTH,
 			header.magic_number);
 	} else {
-		fprintf(stderr,
+		fprintf(ctx->report,
 			"Bundle         %.*s %s\n",
 			MAGIC_NUMBER_LENGTH,
 			(get_bundle_version(header.magic_number) == UserDataPackage ? "GZIP"
@@ -173,91 +179,85 @@ static int
 										    : header.magic_number),
 			convert_magic_number(header.magic_number));
 	}
-	// NOTE: Remember if the package was wrapped in a signature... Since this is re-entrant, make it static.
-	//       (This is mainly used for cosmetic reasons with RecoveryV1H2 on Rex+).
-	static bool is_wrapped = false;
-
 	bundle_version = get_bundle_version(header.magic_number);
+	// Let the caller know what kind of payload we're dealing with, if it cares (we'll overwrite it when unwrapping)
+	if (payload_version != NULL) {
+		*payload_version = bundle_version;
+	}
 	switch (bundle_version) {
 		case OTAUpdateV2:
 			if (unwrap_only) {
-				fprintf(stderr, "Nothing to unwrap!\n");
+				fprintf(ctx->report, "Nothing to unwrap!\n");
 				return -1;
 			} else {
-				fprintf(stderr, "Bundle Type    %s\n", "OTA V2");
+				fprintf(ctx->report, "Bundle Type    %s\n", "OTA V2");
 				// No absolute size, so no struct to pass
-				return kindle_convert_ota_update_v2(input, output, fake_sign, header_md5);
+				return kindle_convert_ota_update_v2(ctx, input, output, fake_sign, header_md5);
 			}
 			break;
 		case UpdateSignature:
-			if (kindle_convert_signature(&header, input, sig_output) < 0) {
-				fprintf(stderr, "Cannot extract signature file!\n");
+			if (kindle_convert_signature(ctx, &header, input, sig_output) < 0) {
+				fprintf(ctx->report, "Cannot extract signature file!\n");
 				return -1;
 			}
 			// It's a wrap! :D
-			is_wrapped = true;
+			// NOTE: Remember it in the context, since we're re-entrant... (This is mainly used for cosmetic reasons with RecoveryV1H2 on Rex+).
+			ctx->is_wrapped = true;
 			// If we asked to simply unwrap the package, just write our unwrapped package ;).
 			if (unwrap_only) {
-				while ((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, input)) > 0) {
-					if (fwrite(buffer, sizeof(unsigned char), count, unwrap_output) < count) {
-						fprintf(stderr,
-							"Error writing unwrapped update to output: %s.\n",
-							strerror(errno));
-						return -1;
-					}
+				if (kt_input_copy(input, unwrap_output, false) < 0) {
+					fprintf(ctx->report, "Error writing unwrapped update to output: %s.\n", strerror(errno));
+					return -1;
 				}
 				// NOTE: We don't handle unwrapping nested UpdateSignature
 				return 0;
 			} else {
-				return kindle_convert(input, output, sig_output, fake_sign, 0, NULL, header_md5);
+				return kindle_convert(ctx, input, output, sig_output, fake_sign, 0, NULL, header_md5, payload_version);
 			}
 			break;
 		case OTAUpdate:
 			if (unwrap_only) {
-				fprintf(stderr, "Nothing to unwrap!\n");
+				fprintf(ctx->report, "Nothing to unwrap!\n");
 				return -1;
 			} else {
-				fprintf(stderr, "Bundle Type    %s\n", "OTA V1");
-				return kindle_convert_ota_update(&header, input, output, fake_sign, header_md5);
+				fprintf(ctx->report, "Bundle Type    %s\n", "OTA V1");
+				return kindle_convert_ota_update(ctx, &header, input, output, fake_sign, header_md5);
 			}
 			break;
 		case RecoveryUpdate:
 			if (unwrap_only) {
-				fprintf(stderr, "Nothing to unwrap!\n");
+				fprintf(ctx->report, "Nothing to unwrap!\n");
 				return -1;
 			} else {
-				fprintf(stderr, "Bundle Type    %s\n", "Recovery");
-				return kindle_convert_recovery(&header, input, output, fake_sign, header_md5, is_wrapped);
+				fprintf(ctx->report, "Bundle Type    %s\n", "Recovery");
+				return kindle_convert_recovery(ctx, &header, input, output, fake_sign, header_md5);
 			}
 			break;
 		case RecoveryUpdateV2:
 			if (unwrap_only) {
-				fprintf(stderr, "Nothing to unwrap!\n");
+				fprintf(ctx->report, "Nothing to unwrap!\n");
 				return -1;
 			} else {
-				fprintf(stderr, "Bundle Type    %s\n", "Recovery V2");
-				return kindle_convert_recovery_v2(input, output, fake_sign, header_md5);
+				fprintf(ctx->report, "Bundle Type    %s\n", "Recovery V2");
+				return kindle_convert_recovery_v2(ctx, input, output, fake_sign, header_md5);
 			}
 			break;
 		case UserDataPackage:
+			// We need the 4 bytes of 'bundle header' we consumed earlier back! (The GZIP magic number)
+			// NOTE: Do it even if we're only asking for info, so that streaming extraction gets a proper tarball.
+			kt_input_skip(input, -MAGIC_NUMBER_LENGTH);
 			// It's a straight unmunged tarball, and we aren't only asking for info, just rip it out ;).
 			if (output != NULL) {
-				// We need the 4 bytes of 'bundle header' we consumed earlier back! (The GZIP magic number)
-				fseek(input, -MAGIC_NUMBER_LENGTH, SEEK_CUR);
-				while ((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, input)) > 0) {
-					if (fwrite(buffer, sizeof(unsigned char), count, output) < count) {
-						fprintf(stderr,
-							"Error writing userdata tarball to output: %s.\n",
-							strerror(errno));
-						return -1;
-					}
+				if (kt_input_copy(input, output, false) < 0) {
+					fprintf(ctx->report, "Error writing userdata tarball to output: %s.\n", strerror(errno));
+					return -1;
 				}
 			}
 			// Usually, nothing more to do...
 			return 0;
 			break;
 		case AndroidUpdate:
-			fprintf(stderr, "Nothing to do!\n");
+			fprintf(ctx->report, "Nothing to do!\n");
 			// We can't really do anything about it...
 			// On extract, archive_read_open_file will gracefully fail with an unrecognized format error,
 			// which tracks, given that we only support tarball + gzip ;).
@@ -265,35 +265,39 @@ static int
 			break;
 		case UnknownUpdate:
 		default:
-			fprintf(stderr, "Unknown update bundle version!\n");
+			fprintf(ctx->report, "Unknown update bundle version!\n");
 			break;
 	}
 	return -1;    // If we get here, there has been an error
 }
 
 static int
-    kindle_convert_ota_update_v2(FILE* input, FILE* output, const bool fake_sign, char* header_md5)
+    kindle_convert_ota_update_v2(struct kt_convert_ctx* ctx,
+				 struct kt_input*       input,
+				 FILE*                  output,
+				 const bool             fake_sign,
+				 char*                  header_md5)
 {
-	unsigned char* data;
-	size_t         hindex = 0;
-	uint64_t       source_revision;
-	uint64_t       target_revision;
-	uint16_t       num_devices;
-	uint16_t       device;
+	const unsigned char* data;
+	size_t               hindex = 0;
+	uint64_t             source_revision;
+	uint64_t             target_revision;
+	uint16_t             num_devices;
+	uint16_t             device;
 	//uint16_t *devices;
 	uint8_t  critical;
 	uint8_t  padding;
-	char*    pkg_md5_sum;
+	char     pkg_md5_sum[MD5_HASH_LENGTH];
 	uint16_t num_metadata;
-	size_t   meta_strlen;
 	uint16_t metastring_length;
 	char*    metastring;
 	//unsigned char **metastrings;
-	size_t read_size __attribute__((unused));
 
 	// First read the set block size and determine how much to resize
-	data      = malloc(OTA_UPDATE_V2_BLOCK_SIZE * sizeof(unsigned char));
-	read_size = fread(data, sizeof(unsigned char), OTA_UPDATE_V2_BLOCK_SIZE, input);
+	// NOTE: We parse the header in place, straight from the input (i.e., from its mapping, if it's a regular file)
+	if ((data = kt_input_get(input, OTA_UPDATE_V2_BLOCK_SIZE)) == NULL) {
+		goto read_error;
+	}
 
 	// NOTE: Use memcpy to avoid unaligned accesses on ARM...
 	//       Because for some reason, even the A8 eats dirt (the alignment trap throws a SIGILL) on some vld1.64 :64
@@ -301,38 +305,38 @@ static int
 	//source_revision = *(uint64_t *)&data[hindex];
 	memcpy(&source_revision, &data[hindex], sizeof(uint64_t));
 	hindex += sizeof(uint64_t);
-	fprintf(stderr, "Minimum OTA    %llu\n", (long long unsigned int) source_revision);
+	fprintf(ctx->report, "Minimum OTA    %llu\n", (long long unsigned int) source_revision);
 	//target_revision = *(uint64_t *)&data[hindex];
 	memcpy(&target_revision, &data[hindex], sizeof(uint64_t));
 	hindex += sizeof(uint64_t);
-	fprintf(stderr, "Target OTA     %llu\n", (long long unsigned int) target_revision);
+	fprintf(ctx->report, "Target OTA     %llu\n", (long long unsigned int) target_revision);
 	//num_devices = *(uint16_t *)&data[hindex];
 	memcpy(&num_devices, &data[hindex], sizeof(uint16_t));
 	//hindex += sizeof(uint16_t);       // Shut clang's sa up
-	fprintf(stderr, "Devices        %hu\n", num_devices);
-	free(data);
+	fprintf(ctx->report, "Devices        %hu\n", num_devices);
 
 	// Now get the data
 	// NOTE: This is stored in a temp var for the express purpose of shutting up clang's sa
 	//       (uint16_t > uchar, which freaks clang. Would be dangerous if it were the other way around)...
 	size_t devices_size = num_devices * sizeof(uint16_t);
-	data                = malloc(devices_size);
-	read_size           = fread(data, sizeof(uint16_t), num_devices, input);
+	if ((data = kt_input_get(input, devices_size)) == NULL) {
+		goto read_error;
+	}
 	for (hindex = 0; hindex < num_devices * sizeof(uint16_t); hindex += sizeof(uint16_t)) {
 		//device = *(uint16_t *)&data[hindex];
 		memcpy(&device, &data[hindex], sizeof(uint16_t));
-		fprintf(stderr, "Device         ");
+		fprintf(ctx->report, "Device         ");
 		// Slightly hackish way to detect unknown devices...
 		bool is_unknown = false;
-		if (strcmp(convert_device_id(device), "Unknown") == 0) {
+		if (kt_device_lookup(device) == NULL) {
 			is_unknown = true;
-			fprintf(stderr, "Unknown (");
+			fprintf(ctx->report, "Unknown (");
 		} else {
-			fprintf(stderr, "%s", convert_device_id(device));
+			fprintf(ctx->report, "%s", convert_device_id(device));
 		}
-		if (kt_with_unknown_devcodes) {
+		if (ctx->with_unknown_devcodes) {
 			if (!is_unknown) {
-				fprintf(stderr, " (");
+				fprintf(ctx->report, " (");
 			}
 			// Handle the new device ID scheme...
 			if (device > 0xFF) {
@@ -341,7 +345,7 @@ static int
 				const char* pad = "000";
 				// NOTE: 0 padding a string with actual zeroes is fun....
 				//       (cf. https://stackoverflow.com/questions/4133318)
-				fprintf(stderr,
+				fprintf(ctx->report,
 					"%.*s%s -> ",
 					((int) strlen(pad) < (int) strlen(dev_id))    // Flawfinder: ignore
 					    ? 0
@@ -353,84 +357,91 @@ static int
 				/*
 				// Check that our base conversions work both ways...
 				uint32_t dev_code = from_base(dev_id, 32);
-				fprintf(stderr, "0x%03lX -> ", dev_code);
+				fprintf(ctx->report, "0x%03lX -> ", dev_code);
 				*/
 				free(dev_id);
 			}
 		}
-		if (is_unknown || kt_with_unknown_devcodes) {
-			fprintf(stderr, "0x%02X)", device);
+		if (is_unknown || ctx->with_unknown_devcodes) {
+			fprintf(ctx->report, "0x%02X)", device);
 		}
-		fprintf(stderr, "\n");
+		fprintf(ctx->report, "\n");
 	}
-	free(data);
 
 	// Now get second part of set sized data
-	data      = malloc(OTA_UPDATE_V2_PART_2_BLOCK_SIZE * sizeof(unsigned char));
-	read_size = fread(data, sizeof(unsigned char), OTA_UPDATE_V2_PART_2_BLOCK_SIZE, input);
-	hindex    = 0;
+	if ((data = kt_input_get(input, OTA_UPDATE_V2_PART_2_BLOCK_SIZE)) == NULL) {
+		goto read_error;
+	}
+	hindex = 0;
 
 	// NOTE: Here, the alignment is identical between critical & data, so we can get away with it safely.
-	critical = *(uint8_t*) &data[hindex];
+	critical = *(const uint8_t*) &data[hindex];
 	// Apparently critical really is supposed to be 1 byte + 1 padding byte, so obey that...
 	hindex += sizeof(uint8_t);
-	fprintf(stderr, "Critical       %hhu\n", critical);
-	padding = *(uint8_t*) &data[hindex];    // Print the (garbage?) padding byte found in official updates...
+	fprintf(ctx->report, "Critical       %hhu\n", critical);
+	padding = *(const uint8_t*) &data[hindex];    // Print the (garbage?) padding byte found in official updates...
 	hindex += sizeof(uint8_t);
-	fprintf(stderr, "Padding Byte   %hhu (0x%02X)\n", padding, padding);
-	pkg_md5_sum = (char*) &data[hindex];
+	fprintf(ctx->report, "Padding Byte   %hhu (0x%02X)\n", padding, padding);
+	memcpy(pkg_md5_sum, &data[hindex], MD5_HASH_LENGTH);
 	dm((unsigned char*) pkg_md5_sum, MD5_HASH_LENGTH);
 	hindex += MD5_HASH_LENGTH;
-	fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, pkg_md5_sum);
+	fprintf(ctx->report, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, pkg_md5_sum);
 	strncpy(header_md5, pkg_md5_sum, MD5_HASH_LENGTH);    // Flawfinder: ignore
 	//num_metadata = *(uint16_t *)&data[hindex];
 	memcpy(&num_metadata, &data[hindex], sizeof(uint16_t));
 	//hindex += sizeof(uint16_t);       // Shut clang's sa up
-	fprintf(stderr, "Metadata       %hu\n", num_metadata);
-	free(data);
+	fprintf(ctx->report, "Metadata       %hu\n", num_metadata);
 
 	// Finally, get the metastrings
 	for (hindex = 0; hindex < num_metadata; hindex++) {
 		// Get correct meta string length because of the endianness swap...
-		read_size         = fread(&((uint8_t*) &meta_strlen)[1], sizeof(uint8_t), 1, input);
-		read_size         = fread(&((uint8_t*) &meta_strlen)[0], sizeof(uint8_t), 1, input);
-		metastring_length = (uint16_t) meta_strlen;
-		metastring        = malloc(metastring_length);
-		read_size         = fread(metastring, sizeof(char), metastring_length, input);
+		if ((data = kt_input_get(input, sizeof(uint16_t))) == NULL) {
+			goto read_error;
+		}
+		metastring_length = (uint16_t) ((data[0] << 8U) | data[1]);
+		if ((data = kt_input_get(input, metastring_length)) == NULL) {
+			goto read_error;
+		}
 		// Deobfuscate string (FIXME: Should meta strings really be obfuscated?)
+		// NOTE: On a copy, our input is read-only
+		metastring = malloc(metastring_length);
+		memcpy(metastring, data, metastring_length);
 		dm((unsigned char*) metastring, metastring_length);
-		fprintf(stderr, "Metastring     %.*s\n", metastring_length, metastring);
+		fprintf(ctx->report, "Metastring     %.*s\n", metastring_length, metastring);
 		free(metastring);
 	}
 
-	if (ferror(input) != 0) {
-		fprintf(stderr, "Cannot read update correctly: %s.\n", strerror(errno));
-		return -1;
-	}
-
 	if (output == NULL) {
 		return 0;
 	}
 
 	// Now we can decrypt the data
-	return demunger(input, output, 0, fake_sign);
+	if (kt_input_copy(input, output, !fake_sign) < 0) {
+		fprintf(ctx->report, "Error demunging package: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+
+read_error:
+	fprintf(ctx->report, "Cannot read update correctly: %s.\n", strerror(errno));
+	return -1;
 }
 
 static int
-    kindle_convert_signature(UpdateHeader* header, FILE* input, FILE* output)
+    kindle_convert_signature(struct kt_convert_ctx* ctx, UpdateHeader* header, struct kt_input* input, FILE* output)
 {
-	CertificateNumber cert_num;
-	const char*       cert_name;
-	size_t            seek;
-	unsigned char*    signature;
+	CertificateNumber    cert_num;
+	const char*          cert_name;
+	size_t               seek;
+	const unsigned char* signature;
 
-	if (fread(header->data.signature_header_data, sizeof(unsigned char), UPDATE_SIGNATURE_BLOCK_SIZE, input) <
+	if (kt_input_read(input, header->data.signature_header_data, UPDATE_SIGNATURE_BLOCK_SIZE) <
 	    UPDATE_SIGNATURE_BLOCK_SIZE) {
-		fprintf(stderr, "Cannot read signature header: %s.\n", strerror(errno));
+		fprintf(ctx->report, "Cannot read signature header: %s.\n", strerror(errno));
 		return -1;
 	}
 	cert_num = (CertificateNumber)(header->data.signature.certificate_number);
-	fprintf(stderr, "Cert number    %u\n", (uint32_t) cert_num);
+	fprintf(ctx->report, "Cert number    %u\n", (uint32_t) cert_num);
 	switch (cert_num) {
 		case CertificateDeveloper:
 			cert_name = "pubdevkey01.pem (Developer)";
@@ -446,62 +457,77 @@ static int
 			break;
 		case CertificateUnknown:
 		default:
-			fprintf(stderr, "Unknown signature size, cannot continue.\n");
+			fprintf(ctx->report, "Unknown signature size, cannot continue.\n");
 			return -1;
 			break;
 	}
-	fprintf(stderr, "Cert file      %s\n", cert_name);
+	fprintf(ctx->report, "Cert file      %s\n", cert_name);
+	// If we're verifying the package, keep the signature, and hash everything that follows it
+	// NOTE: We only care about the outermost envelope.
+	if (ctx->envelope != NULL && !ctx->envelope->found) {
+		if ((signature = kt_input_get(input, seek)) == NULL) {
+			fprintf(ctx->report, "Cannot read signature! %s.\n", strerror(errno));
+			return -1;
+		}
+		memcpy(ctx->envelope->sig, signature, seek);
+		ctx->envelope->sig_size = seek;
+		ctx->envelope->found    = true;
+		kt_sha256_init(&ctx->envelope->sha256);
+		input->sha256 = &ctx->envelope->sha256;
+		input->hashed = input->consumed;
+		return 0;
+	}
 	if (output == NULL) {
-		return fseeko(input, (off_t) seek, SEEK_CUR);
+		return kt_input_skip(input, (off_t) seek);
 	} else {
-		signature = malloc(seek);
-		if (fread(signature, sizeof(unsigned char), seek, input) < seek) {
-			fprintf(stderr, "Cannot read signature! %s.\n", strerror(errno));
-			free(signature);
+		if ((signature = kt_input_get(input, seek)) == NULL) {
+			fprintf(ctx->report, "Cannot read signature! %s.\n", strerror(errno));
 			return -1;
 		}
 		if (fwrite(signature, sizeof(unsigned char), seek, output) < seek) {
-			fprintf(stderr, "Cannot write signature file! %s.\n", strerror(errno));
-			free(signature);
+			fprintf(ctx->report, "Cannot write signature file! %s.\n", strerror(errno));
 			return -1;
 		}
-		free(signature);
 	}
 	return 0;
 }
 
 static int
-    kindle_convert_ota_update(UpdateHeader* header, FILE* input, FILE* output, const bool fake_sign, char* header_md5)
+    kindle_convert_ota_update(struct kt_convert_ctx* ctx,
+			      UpdateHeader*          header,
+			      struct kt_input*       input,
+			      FILE*                  output,
+			      const bool             fake_sign,
+			      char*                  header_md5)
 {
-	if (fread(header->data.ota_header_data, sizeof(unsigned char), OTA_UPDATE_BLOCK_SIZE, input) <
-	    OTA_UPDATE_BLOCK_SIZE) {
-		fprintf(stderr, "Cannot read OTA header: %s.\n", strerror(errno));
+	if (kt_input_read(input, header->data.ota_header_data, OTA_UPDATE_BLOCK_SIZE) < OTA_UPDATE_BLOCK_SIZE) {
+		fprintf(ctx->report, "Cannot read OTA header: %s.\n", strerror(errno));
 		return -1;
 	}
 	dm((unsigned char*) header->data.ota_update.md5_sum, MD5_HASH_LENGTH);
-	fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->data.ota_update.md5_sum);
+	fprintf(ctx->report, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->data.ota_update.md5_sum);
 	strncpy(header_md5, header->data.ota_update.md5_sum, MD5_HASH_LENGTH);    // Flawfinder: ignore
-	fprintf(stderr, "Minimum OTA    %u\n", header->data.ota_update.source_revision);
-	fprintf(stderr, "Target OTA     %u\n", header->data.ota_update.target_revision);
-	fprintf(stderr, "Device         ");
+	fprintf(ctx->report, "Minimum OTA    %u\n", header->data.ota_update.source_revision);
+	fprintf(ctx->report, "Target OTA     %u\n", header->data.ota_update.target_revision);
+	fprintf(ctx->report, "Device         ");
 	// Slightly hackish way to detect unknown devices...
 	bool is_unknown = false;
-	if (strcmp(convert_device_id(header->data.ota_update.device), "Unknown") == 0) {
+	if (kt_device_lookup(header->data.ota_update.device) == NULL) {
 		is_unknown = true;
-		fprintf(stderr, "Unknown (");
+		fprintf(ctx->report, "Unknown (");
 	} else {
-		fprintf(stderr, "%s", convert_device_id(header->data.ota_update.device));
+		fprintf(ctx->report, "%s", convert_device_id(header->data.ota_update.device));
 	}
-	if (kt_with_unknown_devcodes) {
+	if (ctx->with_unknown_devcodes) {
 		if (!is_unknown) {
-			fprintf(stderr, " (");
+			fprintf(ctx->report, " (");
 		}
 		// Handle the new device ID scheme...
 		if (header->data.ota_update.device > 0xFF) {
 			char* dev_id;
 			dev_id          = to_base(header->data.ota_update.device, 32);
 			const char* pad = "000";
-			fprintf(stderr,
+			fprintf(ctx->report,
 				"%.*s%s -> ",
 				((int) strlen(pad) < (int) strlen(dev_id))    // Flawfinder: ignore
 				    ? 0
@@ -511,86 +537,90 @@ static int
 			free(dev_id);
 		}
 	}
-	if (is_unknown || kt_with_unknown_devcodes) {
-		fprintf(stderr, "0x%02X)", header->data.ota_update.device);
+	if (is_unknown || ctx->with_unknown_devcodes) {
+		fprintf(ctx->report, "0x%02X)", header->data.ota_update.device);
 	}
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Optional       %hhu\n", header->data.ota_update.optional);
+	fprintf(ctx->report, "\n");
+	fprintf(ctx->report, "Optional       %hhu\n", header->data.ota_update.optional);
 	// Print the (garbage?) padding byte... (The python tool puts 0x13 in there)
-	fprintf(stderr, "Padding Byte   %hhu (0x%02X)\n", header->data.ota_update.unused, header->data.ota_update.unused);
+	fprintf(ctx->report, "Padding Byte   %hhu (0x%02X)\n", header->data.ota_update.unused, header->data.ota_update.unused);
 
 	if (output == NULL) {
 		return 0;
 	}
 
-	return demunger(input, output, 0, fake_sign);
+	if (kt_input_copy(input, output, !fake_sign) < 0) {
+		fprintf(ctx->report, "Error demunging package: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
 static int
-    kindle_convert_recovery(UpdateHeader* header,
-			    FILE*         input,
-			    FILE*         output,
-			    const bool    fake_sign,
-			    char*         header_md5,
-			    const bool    was_wrapped)
+    kindle_convert_recovery(struct kt_convert_ctx* ctx,
+			    UpdateHeader*          header,
+			    struct kt_input*       input,
+			    FILE*                  output,
+			    const bool             fake_sign,
+			    char*                  header_md5)
 {
-	if (fread(header->data.recovery_header_data, sizeof(unsigned char), RECOVERY_UPDATE_BLOCK_SIZE, input) <
+	if (kt_input_read(input, header->data.recovery_header_data, RECOVERY_UPDATE_BLOCK_SIZE) <
 	    RECOVERY_UPDATE_BLOCK_SIZE) {
-		fprintf(stderr, "Cannot read recovery update header: %s.\n", strerror(errno));
+		fprintf(ctx->report, "Cannot read recovery update header: %s.\n", strerror(errno));
 		return -1;
 	}
 	dm((unsigned char*) header->data.recovery_update.md5_sum, MD5_HASH_LENGTH);
-	fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->data.recovery_update.md5_sum);
+	fprintf(ctx->report, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->data.recovery_update.md5_sum);
 	strncpy(header_md5, header->data.recovery_update.md5_sum, MD5_HASH_LENGTH);    // Flawfinder: ignore
-	fprintf(stderr, "Magic 1        %u\n", header->data.recovery_update.magic_1);
-	fprintf(stderr, "Magic 2        %u\n", header->data.recovery_update.magic_2);
-	fprintf(stderr, "Minor          %u\n", header->data.recovery_update.minor);
+	fprintf(ctx->report, "Magic 1        %u\n", header->data.recovery_update.magic_1);
+	fprintf(ctx->report, "Magic 2        %u\n", header->data.recovery_update.magic_2);
+	fprintf(ctx->report, "Minor          %u\n", header->data.recovery_update.minor);
 
 	// Handle V2 header rev...
 	if (header->data.recovery_h2_update.header_rev == 2) {
-		fprintf(stderr, "Header Rev     %u\n", header->data.recovery_h2_update.header_rev);
+		fprintf(ctx->report, "Header Rev     %u\n", header->data.recovery_h2_update.header_rev);
 		// NOTE: On newer platforms (Rex, possibly Zelda), it appears that a target revision field is set & honored,
 		//       at the exact same spot as in RecoveryV2 updates, in the exact same data type...
 		//       This behavior has also been retro-fitted to earlier platforms on the later end of FW >= 5.9.x.
 		//       When the field is mandatory, the package happens to always be wrapped in a signature envelope,
 		//       so we use that as a hint, only showing a question mark when we're unsure...
-		fprintf(stderr,
+		fprintf(ctx->report,
 			"Target OTA%s    %llu\n",
-			was_wrapped ? " " : "?",
+			ctx->is_wrapped ? " " : "?",
 			(long long unsigned int) header->data.recovery_h2_update.target_revision);
 		// Slightly ugly way to detect unknown platforms...
-		if (strcmp(convert_platform_id(header->data.recovery_h2_update.platform), "Unknown") == 0) {
-			fprintf(stderr, "Platform       Unknown (0x%02X)\n", header->data.recovery_h2_update.platform);
+		if (!kt_platform_known(header->data.recovery_h2_update.platform)) {
+			fprintf(ctx->report, "Platform       Unknown (0x%02X)\n", header->data.recovery_h2_update.platform);
 		} else {
 			fprintf(
 			    stderr, "Platform       %s\n", convert_platform_id(header->data.recovery_h2_update.platform));
 		}
 		// Same shtick for unknown boards...
-		if (strcmp(convert_board_id(header->data.recovery_h2_update.board), "Unknown") == 0) {
-			fprintf(stderr, "Board          Unknown (0x%02X)\n", header->data.recovery_h2_update.board);
+		if (!kt_board_known(header->data.recovery_h2_update.board)) {
+			fprintf(ctx->report, "Board          Unknown (0x%02X)\n", header->data.recovery_h2_update.board);
 		} else {
-			fprintf(stderr, "Board          %s\n", convert_board_id(header->data.recovery_h2_update.board));
+			fprintf(ctx->report, "Board          %s\n", convert_board_id(header->data.recovery_h2_update.board));
 		}
 	} else {
-		fprintf(stderr, "Device         ");
+		fprintf(ctx->report, "Device         ");
 		// Slightly hackish way to detect unknown devices...
 		bool is_unknown = false;
-		if (strcmp(convert_device_id(header->data.recovery_update.device), "Unknown") == 0) {
+		if (kt_device_lookup(header->data.recovery_update.device) == NULL) {
 			is_unknown = true;
-			fprintf(stderr, "Unknown (");
+			fprintf(ctx->report, "Unknown (");
 		} else {
-			fprintf(stderr, "%s", convert_device_id(header->data.recovery_update.device));
+			fprintf(ctx->report, "%s", convert_device_id(header->data.recovery_update.device));
 		}
-		if (kt_with_unknown_devcodes) {
+		if (ctx->with_unknown_devcodes) {
 			if (!is_unknown) {
-				fprintf(stderr, " (");
+				fprintf(ctx->report, " (");
 			}
 			// Handle the new device ID scheme...
 			if (header->data.recovery_update.device > 0xFF) {
 				char* dev_id;
 				dev_id          = to_base(header->data.recovery_update.device, 32);
 				const char* pad = "000";
-				fprintf(stderr,
+				fprintf(ctx->report,
 					"%.*s%s -> ",
 					((int) strlen(pad) < (int) strlen(dev_id))    // Flawfinder: ignore
 					    ? 0
@@ -600,115 +630,125 @@ static int
 				free(dev_id);
 			}
 		}
-		if (is_unknown || kt_with_unknown_devcodes) {
-			fprintf(stderr, "0x%02X)", header->data.recovery_update.device);
+		if (is_unknown || ctx->with_unknown_devcodes) {
+			fprintf(ctx->report, "0x%02X)", header->data.recovery_update.device);
 		}
-		fprintf(stderr, "\n");
+		fprintf(ctx->report, "\n");
 	}
 
 	if (output == NULL) {
 		return 0;
 	}
 
-	return demunger(input, output, 0, fake_sign);
+	if (kt_input_copy(input, output, !fake_sign) < 0) {
+		fprintf(ctx->report, "Error demunging package: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
 static int
-    kindle_convert_recovery_v2(FILE* input, FILE* output, const bool fake_sign, char* header_md5)
+    kindle_convert_recovery_v2(struct kt_convert_ctx* ctx,
+			       struct kt_input*       input,
+			       FILE*                  output,
+			       const bool             fake_sign,
+			       char*                  header_md5)
 {
-	unsigned char* data;
-	size_t         hindex = 0;
-	uint64_t       target_revision;
-	char*          pkg_md5_sum;
-	uint32_t       magic_1;
-	uint32_t       magic_2;
-	uint32_t       minor;
-	uint32_t       platform;
-	uint32_t       header_rev;
-	uint32_t       board;
-	uint16_t       device;
-	uint8_t        num_devices;
-	unsigned int   i;
+	const unsigned char* data;
+	size_t               hindex = 0;
+	uint64_t             target_revision;
+	char                 pkg_md5_sum[MD5_HASH_LENGTH];
+	uint32_t             magic_1;
+	uint32_t             magic_2;
+	uint32_t             minor;
+	uint32_t             platform;
+	uint32_t             header_rev;
+	uint32_t             board;
+	uint16_t             device;
+	uint8_t              num_devices;
+	unsigned int         i;
 	//uint16_t *devices;
-	size_t read_size __attribute__((unused));
 
 	// Its size is set, there's just some wonky padding involved. Read it all!
-	data      = malloc(RECOVERY_UPDATE_BLOCK_SIZE * sizeof(unsigned char));
-	read_size = fread(data, sizeof(unsigned char), RECOVERY_UPDATE_BLOCK_SIZE, input);
+	// NOTE: We parse the header in place, straight from the input (i.e., from its mapping, if it's a regular file)
+	if ((data = kt_input_get(input, RECOVERY_UPDATE_BLOCK_SIZE)) == NULL) {
+		fprintf(ctx->report, "Cannot read update correctly: %s.\n", strerror(errno));
+		return -1;
+	}
 
 	hindex += sizeof(uint32_t);    // Padding
 	//target_revision = *(uint64_t *)&data[hindex];
 	memcpy(&target_revision, &data[hindex], sizeof(uint64_t));
 	hindex += sizeof(uint64_t);
-	fprintf(stderr, "Target OTA     %llu\n", (long long unsigned int) target_revision);
-	pkg_md5_sum = (char*) &data[hindex];
+	fprintf(ctx->report, "Target OTA     %llu\n", (long long unsigned int) target_revision);
+	memcpy(pkg_md5_sum, &data[hindex], MD5_HASH_LENGTH);
 	dm((unsigned char*) pkg_md5_sum, MD5_HASH_LENGTH);
 	hindex += MD5_HASH_LENGTH;
-	fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, pkg_md5_sum);
+	fprintf(ctx->report, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, pkg_md5_sum);
 	strncpy(header_md5, pkg_md5_sum, MD5_HASH_LENGTH);    // Flawfinder: ignore
 	//magic_1 = *(uint32_t *)&data[hindex];
 	memcpy(&magic_1, &data[hindex], sizeof(uint32_t));
 	hindex += sizeof(uint32_t);
-	fprintf(stderr, "Magic 1        %u\n", magic_1);
+	fprintf(ctx->report, "Magic 1        %u\n", magic_1);
 	//magic_2 = *(uint32_t *)&data[hindex];
 	memcpy(&magic_2, &data[hindex], sizeof(uint32_t));
 	hindex += sizeof(uint32_t);
-	fprintf(stderr, "Magic 2        %u\n", magic_2);
+	fprintf(ctx->report, "Magic 2        %u\n", magic_2);
 	//minor = *(uint32_t *)&data[hindex];
 	memcpy(&minor, &data[hindex], sizeof(uint32_t));
 	hindex += sizeof(uint32_t);
-	fprintf(stderr, "Minor          %u\n", minor);
+	fprintf(ctx->report, "Minor          %u\n", minor);
 	//platform = *(uint32_t *)&data[hindex];
 	memcpy(&platform, &data[hindex], sizeof(uint32_t));
 	hindex += sizeof(uint32_t);
 	// Slightly hackish way to detect unknown platforms...
-	if (strcmp(convert_platform_id(platform), "Unknown") == 0) {
-		fprintf(stderr, "Platform       Unknown (0x%02X)\n", platform);
+	if (!kt_platform_known(platform)) {
+		fprintf(ctx->report, "Platform       Unknown (0x%02X)\n", platform);
 	} else {
-		fprintf(stderr, "Platform       %s\n", convert_platform_id(platform));
+		fprintf(ctx->report, "Platform       %s\n", convert_platform_id(platform));
 	}
 	//header_rev = *(uint32_t *)&data[hindex];
 	memcpy(&header_rev, &data[hindex], sizeof(uint32_t));
 	hindex += sizeof(uint32_t);
-	fprintf(stderr, "Header Rev     %u\n", header_rev);
+	fprintf(ctx->report, "Header Rev     %u\n", header_rev);
 	//board = *(uint32_t *)&data[hindex];
 	memcpy(&board, &data[hindex], sizeof(uint32_t));
 	hindex += sizeof(uint32_t);
 	// Slightly hackish way to detect unknown boards
 	// (Not to be confused with the 'Unspecified' board, which permits skipping the device/board check)...
-	if (strcmp(convert_board_id(board), "Unknown") == 0) {
-		fprintf(stderr, "Board          %s (0x%02X)\n", convert_board_id(board), board);
+	if (!kt_board_known(board)) {
+		fprintf(ctx->report, "Board          %s (0x%02X)\n", convert_board_id(board), board);
 	} else {
-		fprintf(stderr, "Board          %s\n", convert_board_id(board));
+		fprintf(ctx->report, "Board          %s\n", convert_board_id(board));
 	}
 	hindex += sizeof(uint32_t);    // Padding
 	hindex += sizeof(uint16_t);    // ... Padding
 	hindex += sizeof(uint8_t);     // And more weird padding
-	num_devices = *(uint8_t*) &data[hindex];
+	num_devices = *(const uint8_t*) &data[hindex];
 	hindex += sizeof(uint8_t);
-	fprintf(stderr, "Devices        %hhu\n", num_devices);
+	fprintf(ctx->report, "Devices        %hhu\n", num_devices);
 	for (i = 0; i < num_devices; i++) {
 		//device = *(uint16_t *)&data[hindex];
 		memcpy(&device, &data[hindex], sizeof(uint16_t));
-		fprintf(stderr, "Device         ");
+		fprintf(ctx->report, "Device         ");
 		// Slightly hackish way to detect unknown devices...
 		bool is_unknown = false;
-		if (strcmp(convert_device_id(device), "Unknown") == 0) {
+		if (kt_device_lookup(device) == NULL) {
 			is_unknown = true;
-			fprintf(stderr, "Unknown (");
+			fprintf(ctx->report, "Unknown (");
 		} else {
-			fprintf(stderr, "%s", convert_device_id(device));
+			fprintf(ctx->report, "%s", convert_device_id(device));
 		}
-		if (kt_with_unknown_devcodes) {
+		if (ctx->with_unknown_devcodes) {
 			if (!is_unknown) {
-				fprintf(stderr, " (");
+				fprintf(ctx->report, " (");
 			}
 			// Handle the new device ID scheme...
 			if (device > 0xFF) {
 				char* dev_id;
 				dev_id          = to_base(device, 32);
 				const char* pad = "000";
-				fprintf(stderr,
+				fprintf(ctx->report,
 					"%.*s%s -> ",
 					((int) strlen(pad) < (int) strlen(dev_id))    // Flawfinder: ignore
 					    ? 0
@@ -718,25 +758,359 @@ static int
 				free(dev_id);
 			}
 		}
-		if (is_unknown || kt_with_unknown_devcodes) {
-			fprintf(stderr, "0x%02X)", device);
+		if (is_unknown || ctx->with_unknown_devcodes) {
+			fprintf(ctx->report, "0x%02X)", device);
 		}
-		fprintf(stderr, "\n");
+		fprintf(ctx->report, "\n");
 		hindex += sizeof(uint16_t);
 	}
-	free(data);
 
-	if (ferror(input) != 0) {
-		fprintf(stderr, "Cannot read update correctly: %s.\n", strerror(errno));
+	if (output == NULL) {
+		return 0;
+	}
+
+	// Now we can decrypt the data
+	if (kt_input_copy(input, output, !fake_sign) < 0) {
+		fprintf(ctx->report, "Error demunging package: %s.\n", strerror(errno));
 		return -1;
 	}
+	return 0;
+}
 
-	if (output == NULL) {
+// Throw an LF between package reports to untangle the output (the caller holds the batch lock)
+static void
+    kindle_convert_separate(struct kt_convert_batch* batch)
+{
+	if (batch->reported) {
+		fprintf(stderr, "\n");
+	}
+	batch->reported = true;
+}
+
+// Dump a buffered report to stderr in one go, so that concurrent jobs don't end up interleaved
+static void
+    kindle_convert_flush(struct kt_convert_job* job)
+{
+	unsigned char buff[BUFSIZ];
+	size_t        len;
+
+	if (job->ctx.report == stderr) {
+		return;
+	}
+
+	rewind(job->ctx.report);
+	pthread_mutex_lock(&job->batch->lock);
+	kindle_convert_separate(job->batch);
+	while ((len = fread(buff, sizeof(unsigned char), sizeof(buff), job->ctx.report)) > 0) {
+		fwrite(buff, sizeof(unsigned char), len, stderr);
+	}
+	pthread_mutex_unlock(&job->batch->lock);
+	fclose(job->ctx.report);
+	job->ctx.report = stderr;
+}
+
+// Convert a single package. This may run on a worker thread, so, everything we print goes to the job's report.
+static void
+    kindle_convert_job(void* data)
+{
+	struct kt_convert_job*   job     = data;
+	struct kt_convert_batch* batch   = job->batch;
+	struct kt_convert_ctx*   ctx     = &job->ctx;
+	const char*              in_name = job->in_name;
+	FILE*                    input;
+	struct kt_input          in;
+	FILE*                    output         = (batch->to_stdout ? stdout : NULL);
+	FILE*                    sig_output     = NULL;
+	FILE*                    unwrap_output  = NULL;
+	char*                    out_name       = NULL;
+	char*                    sig_name       = NULL;
+	char*                    unwrapped_name = NULL;
+	size_t                   len;
+	struct stat              st;
+	unsigned int             ext_offset = 0;
+	char                     header_md5[MD5_HASH_LENGTH + 1];
+
+	// NOTE: If we can't get a scratch file to buffer the report in, just print it as we go...
+	ctx->report = NULL;
+	if (batch->buffered) {
+		ctx->report = kt_tmpfile();
+	}
+	if (ctx->report == NULL) {
+		ctx->report = stderr;
+		pthread_mutex_lock(&batch->lock);
+		kindle_convert_separate(batch);
+		pthread_mutex_unlock(&batch->lock);
+	}
+	job->fail = true;
+
+	// Check that a valid package input properly ends in .bin or .stgz,
+	// unless we just want to parse the header
+	if (!batch->info_only && (!IS_BIN(in_name) && !IS_STGZ(in_name))) {
+		fprintf(ctx->report,
+			"Input file '%s' is neither a '.bin' update package nor a '.stgz' userdata package.\n",
+			in_name);
+		kindle_convert_flush(job);
+		return;    // It's fatal, go away
+	}
+	// Set the appropriate file extension offset...
+	if (IS_STGZ(in_name)) {
+		ext_offset = 1;
+	} else {
+		ext_offset = 0;
+	}
+	// Not info only, not unwrap only AND not stdout
+	if (!batch->info_only && !batch->unwrap_only && output != stdout) {
+		len      = strlen(in_name);    // Flawfinder: ignore
+		out_name = malloc(len + 1 + (13 - ext_offset));
+		snprintf(out_name,
+			 len + 1 + (13 - ext_offset),
+			 "%.*s_%s",
+			 (int) (len - (4 + ext_offset)),
+			 in_name,
+			 "converted.tar.gz");
+		if ((output = fopen(out_name, "wb")) == NULL) {
+			fprintf(ctx->report, "Cannot open output '%s' for writing.\n", out_name);
+			free(out_name);
+			kindle_convert_flush(job);
+			return;    // It's fatal, go away
+		}
+	}
+	// We want the payload sig (implies not info only)
+	if (batch->extract_sig) {
+		len      = strlen(in_name);    // Flawfinder: ignore
+		sig_name = malloc(len + 1 + (1 - ext_offset));
+		snprintf(
+		    sig_name, len + 1 + (1 - ext_offset), "%.*s.%s", (int) (len - (4 + ext_offset)), in_name, "psig");
+		if ((sig_output = fopen(sig_name, "wb")) == NULL) {
+			fprintf(ctx->report, "Cannot open signature output '%s' for writing.\n", sig_name);
+			if (!batch->info_only && !batch->unwrap_only && output != stdout) {
+				if (output != NULL) {
+					fclose(output);
+					unlink(out_name);
+				}
+				free(out_name);
+			}
+			free(sig_name);
+			kindle_convert_flush(job);
+			return;    // It's fatal, go away
+		}
+	}
+	// We want an unwrapped package (implies not info only)
+	if (batch->unwrap_only) {
+		len            = strlen(in_name);    // Flawfinder: ignore
+		unwrapped_name = malloc(len + 1 + (10 - ext_offset));
+		// If input is an userdata package, we can safely assume we'll end up with a tarballl
+		if (ext_offset) {
+			snprintf(unwrapped_name,
+				 len + 1 + (10 - ext_offset),
+				 "%.*s_%s",
+				 (int) (len - (4 + ext_offset)),
+				 in_name,
+				 "unwrapped.tgz");
+		} else {
+			snprintf(unwrapped_name,
+				 len + 1 + (10 - ext_offset),
+				 "%.*s_%s",
+				 (int) (len - (4 + ext_offset)),
+				 in_name,
+				 "unwrapped.bin");
+		}
+		if ((unwrap_output = fopen(unwrapped_name, "wb")) == NULL) {
+			fprintf(ctx->report, "Cannot open unwrapped package output '%s' for writing.\n", unwrapped_name);
+			free(unwrapped_name);
+			if (batch->extract_sig) {
+				if (sig_output != NULL) {
+					fclose(sig_output);
+					unlink(sig_name);
+				}
+				free(sig_name);
+			}
+			kindle_convert_flush(job);
+			return;    // It's fatal, go away
+		}
+	}
+	if ((input = fopen(in_name, "rb")) == NULL) {
+		fprintf(ctx->report, "Cannot open input '%s' for reading.\n", in_name);
+		if (!batch->info_only && !batch->unwrap_only && output != stdout) {
+			// Don't leave 0-byte files behind...
+			if (output != NULL) {
+				fclose(output);
+				unlink(out_name);
+			}
+			free(out_name);
+		}
+		if (batch->extract_sig) {
+			if (sig_output != NULL) {
+				fclose(sig_output);
+				unlink(sig_name);
+			}
+			free(sig_name);
+		}
+		if (batch->unwrap_only) {
+			if (unwrap_output != NULL) {
+				fclose(unwrap_output);
+				unlink(unwrapped_name);
+			}
+			free(unwrapped_name);
+		}
+		kindle_convert_flush(job);
+		return;    // It's fatal, go away
+	}
+	// If we're outputting to stdout, set a dummy human readable output name
+	if (!batch->info_only && output == stdout) {
+		out_name = strdup("standard output");
+	}
+	// Print a recap of what we're doing
+	if (batch->list) {
+		fprintf(ctx->report,
+			"Listing %s%s package '%s'.\n",
+			(batch->fake_sign ? "fake " : ""),
+			(IS_STGZ(in_name) ? "userdata" : "update"),
+			in_name);
+	} else if (batch->info_only) {
+		fprintf(ctx->report,
+			"Checking %s%s package '%s'.\n",
+			(batch->fake_sign ? "fake " : ""),
+			(IS_STGZ(in_name) ? "userdata" : "update"),
+			in_name);
+	} else if (batch->unwrap_only) {
+		fprintf(ctx->report,
+			"Unwrapping %s package '%s' to '%s'.\n",
+			(IS_STGZ(in_name) ? "userdata" : "update"),
+			in_name,
+			unwrapped_name);
+	} else {
+		fprintf(ctx->report,
+			"Converting %s%s package '%s' to '%s' (%s, %s).\n",
+			(batch->fake_sign ? "fake " : ""),
+			(IS_STGZ(in_name) ? "userdata" : "update"),
+			in_name,
+			out_name,
+			(batch->extract_sig ? "with sig" : "without sig"),
+			(batch->keep_ori ? "keep input" : "delete input"));
+	}
+	job->fail = false;
+	kt_input_open(&in, input);
+	if (batch->list) {
+		if (kindle_list_package(ctx, &in, batch->fake_sign, (batch->list_names ? in_name : NULL)) < 0) {
+			fprintf(ctx->report,
+				"Error listing %s package '%s'.\n",
+				(IS_STGZ(in_name) ? "userdata" : "update"),
+				in_name);
+			job->fail = true;
+		} else {
+			kt_stats_add(KT_STATS_FILES, 1U);
+		}
+	} else if (kindle_convert(ctx,
+				  &in,
+				  output,
+				  sig_output,
+				  batch->fake_sign,
+				  batch->unwrap_only,
+				  unwrap_output,
+				  header_md5,
+				  NULL) < 0) {
+		fprintf(ctx->report,
+			"Error converting %s package '%s'.\n",
+			(IS_STGZ(in_name) ? "userdata" : "update"),
+			in_name);
+		if (output != NULL && output != stdout) {
+			unlink(out_name);    // Clean up our mess, if we made one
+		}
+		job->fail = true;
+	} else {
+		kt_stats_add(KT_STATS_FILES, 1U);
+	}
+	kt_input_close(&in);
+	// If we were outputting to a file, we didn't ask to keep the original, and we didn't fail to convert it,
+	// delete the original
+	if (output != stdout && !batch->info_only && !batch->keep_ori && !job->fail) {
+		unlink(in_name);
+	}
+
+	// Clean up behind us
+	if (!batch->info_only && !batch->unwrap_only) {
+		free(out_name);
+	}
+	if (output != NULL && output != stdout) {
+		fclose(output);
+	}
+	fclose(input);
+	if (sig_output != NULL) {
+		fclose(sig_output);
+	}
+	if (unwrap_output != NULL) {
+		fclose(unwrap_output);
+	}
+	// Remove empty sigs (since we have to open the fd before calling kindle_convert,
+	// we end up with an empty file for packages that aren't wrapped in an UpdateSignature)
+	if (batch->extract_sig) {
+		stat(sig_name, &st);
+		if (st.st_size == 0) {
+			unlink(sig_name);
+		}
+		free(sig_name);
+	}
+	// Same thing for unwrapped packages...
+	if (batch->unwrap_only) {
+		stat(unwrapped_name, &st);
+		if (st.st_size == 0) {
+			unlink(unwrapped_name);
+		}
+		free(unwrapped_name);
+	}
+
+	kindle_convert_flush(job);
+}
+
+// Convert the package in bin_input to its plain tarball in tgz_output, and check its integrity.
+// If tgz_output is NULL, only print the package information, like convert -i.
+// That goes to report, or nowhere if it's NULL (which is how create --incremental gets to look inside a previous build).
+// tgz_output needs to be readable & seekable, we hash it once we're done, and leave it rewound.
+int
+    kindle_convert_payload(FILE* bin_input, FILE* tgz_output, FILE* report, const bool fake_sign)
+{
+	struct kt_convert_ctx ctx = { 0 };
+	struct kt_input       in;
+	char                  header_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	char                  actual_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	int                   ret;
+
+	// If we don't care about the package information, just throw it away
+	if ((ctx.report = report) == NULL && (ctx.report = kt_tmpfile()) == NULL) {
+		fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+		return -1;
+	}
+	ctx.with_unknown_devcodes = kt_with_unknown_devcodes;
+	kt_input_open(&in, bin_input);
+	ret = kindle_convert(&ctx, &in, tgz_output, NULL, fake_sign, 0, NULL, header_md5, NULL);
+	kt_input_close(&in);
+	if (report == NULL) {
+		fclose(ctx.report);
+	}
+	if (ret < 0) {
+		return -1;
+	}
+	if (tgz_output == NULL) {
 		return 0;
 	}
 
-	// Now we can decrypt the data
-	return demunger(input, output, 0, fake_sign);
+	// Flawfinder: ignore
+	if (!fake_sign && strlen(header_md5) != 0) {
+		rewind(tgz_output);
+		if (md5_sum(tgz_output, actual_md5) < 0) {
+			fprintf(stderr, "Error calculating MD5 of package.\n");
+			return -1;
+		}
+		if (strcmp(header_md5, actual_md5) != 0) {
+			fprintf(
+			    stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
+			return -1;
+		}
+	}
+	rewind(tgz_output);
+
+	return 0;
 }
 
 int
@@ -750,45 +1124,57 @@ int
 					      { "sig", no_argument, NULL, 's' },
 					      { "unsigned", no_argument, NULL, 'u' },
 					      { "unwrap", no_argument, NULL, 'w' },
+					      { "list", no_argument, NULL, 'l' },
+					      { "jobs", required_argument, NULL, 'j' },
+					      { "stats", optional_argument, NULL, 'T' },
+					      { "mem-budget", required_argument, NULL, 'M' },
 					      { NULL, 0, NULL, 0 } };
-	FILE*                      input;
-	FILE*                      output        = NULL;
-	FILE*                      sig_output    = NULL;
-	FILE*                      unwrap_output = NULL;
-	const char*                in_name;
-	char*                      out_name       = NULL;
-	char*                      sig_name       = NULL;
-	char*                      unwrapped_name = NULL;
-	size_t                     len;
-	struct stat                st;
-	bool                       info_only   = false;
-	bool                       keep_ori    = false;
-	bool                       extract_sig = false;
-	bool                       fake_sign   = false;
-	bool                       unwrap_only = false;
-	unsigned int               ext_offset  = 0;
-	bool                       fail        = true;
-	char                       header_md5[MD5_HASH_LENGTH + 1];
-
-	while ((opt = getopt_long(argc, argv, "icksuw", opts, &opt_index)) != -1) {
+	struct kt_convert_batch    batch     = { 0 };
+	struct kt_convert_job*     job_list  = NULL;
+	struct kt_pool*            pool      = NULL;
+	unsigned int               num_files = 0U;
+	unsigned int               jobs      = 1U;
+	bool                       fail      = false;
+
+	while ((opt = getopt_long(argc, argv, "icksuwlj:", opts, &opt_index)) != -1) {
 		switch (opt) {
 			case 'i':
-				info_only = true;
+				batch.info_only = true;
 				break;
 			case 'k':
-				keep_ori = true;
+				batch.keep_ori = true;
 				break;
 			case 'c':
-				output = stdout;
+				batch.to_stdout = true;
 				break;
 			case 's':
-				extract_sig = true;
+				batch.extract_sig = true;
 				break;
 			case 'u':
-				fake_sign = true;
+				batch.fake_sign = true;
 				break;
 			case 'w':
-				unwrap_only = true;
+				batch.unwrap_only = true;
+				break;
+			case 'l':
+				batch.list = true;
+				break;
+			case 'j':
+				if (kt_parse_jobs(optarg, &jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					return -1;
+				}
+				break;
+			case 'T':
+				// NOTE: Long-only (it's not in optstring), since it takes an optional argument
+				kt_stats_enable(optarg);
+				break;
+			case 'M':
+				// NOTE: In MiB (0 means we never keep temporaries in RAM)
+				if (kt_parse_mib(optarg, &kt_mem_budget) != 0) {
+					fprintf(stderr, "Invalid memory budget, input: %s\n", optarg);
+					return -1;
+				}
 				break;
 			case ':':
 				fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
@@ -804,236 +1190,73 @@ int
 				break;
 		}
 	}
+	// Listing a package is just a slightly more thorough look at it, so it implies info only
+	if (batch.list) {
+		batch.info_only = true;
+	}
 	// Don't try to output to stdout or extract/unwrap the package sig if we asked for info only
-	if (info_only) {
-		output      = NULL;
-		extract_sig = false;
-		unwrap_only = false;
+	if (batch.info_only) {
+		batch.to_stdout   = false;
+		batch.extract_sig = false;
+		batch.unwrap_only = false;
 	}
 	// Don't try to extract or unwrap the signature of an unsiged package
-	if (fake_sign) {
-		extract_sig = false;
-		unwrap_only = false;
+	if (batch.fake_sign) {
+		batch.extract_sig = false;
+		batch.unwrap_only = false;
 	}
 	// Don't try to output anywhere if we only want to unwrap the package
-	if (unwrap_only) {
-		output = NULL;
-	}
-
-	if (optind < argc) {
-		// Iterate over non-options (the file(s) we passed)
-		// (stdout output is probably pretty dumb when passing multiple files...)
-		while (optind < argc) {
-			fail    = false;
-			in_name = argv[optind++];
-			// Check that a valid package input properly ends in .bin or .stgz,
-			// unless we just want to parse the header
-			if (!info_only && (!IS_BIN(in_name) && !IS_STGZ(in_name))) {
-				fprintf(
-				    stderr,
-				    "Input file '%s' is neither a '.bin' update package nor a '.stgz' userdata package.\n",
-				    in_name);
-				fail = true;
-				continue;    // It's fatal, go away
-			}
-			// Set the appropriate file extension offset...
-			if (IS_STGZ(in_name)) {
-				ext_offset = 1;
-			} else {
-				ext_offset = 0;
-			}
-			// Not info only, not unwrap only AND not stdout
-			if (!info_only && !unwrap_only && output != stdout) {
-				len      = strlen(in_name);    // Flawfinder: ignore
-				out_name = malloc(len + 1 + (13 - ext_offset));
-				snprintf(out_name,
-					 len + 1 + (13 - ext_offset),
-					 "%.*s_%s",
-					 (int) (len - (4 + ext_offset)),
-					 in_name,
-					 "converted.tar.gz");
-				if ((output = fopen(out_name, "wb")) == NULL) {
-					fprintf(stderr, "Cannot open output '%s' for writing.\n", out_name);
-					fail = true;
-					free(out_name);
-					continue;    // It's fatal, go away
-				}
-			}
-			// We want the payload sig (implies not info only)
-			if (extract_sig) {
-				len      = strlen(in_name);    // Flawfinder: ignore
-				sig_name = malloc(len + 1 + (1 - ext_offset));
-				snprintf(sig_name,
-					 len + 1 + (1 - ext_offset),
-					 "%.*s.%s",
-					 (int) (len - (4 + ext_offset)),
-					 in_name,
-					 "psig");
-				if ((sig_output = fopen(sig_name, "wb")) == NULL) {
-					fprintf(stderr, "Cannot open signature output '%s' for writing.\n", sig_name);
-					fail = true;
-					if (!info_only && !unwrap_only && output != stdout) {
-						if (output != NULL) {
-							fclose(output);
-							unlink(out_name);
-						}
-						free(out_name);
-					}
-					free(sig_name);
-					continue;    // It's fatal, go away
-				}
-			}
-			// We want an unwrapped package (implies not info only)
-			if (unwrap_only) {
-				len            = strlen(in_name);    // Flawfinder: ignore
-				unwrapped_name = malloc(len + 1 + (10 - ext_offset));
-				// If input is an userdata package, we can safely assume we'll end up with a tarballl
-				if (ext_offset) {
-					snprintf(unwrapped_name,
-						 len + 1 + (10 - ext_offset),
-						 "%.*s_%s",
-						 (int) (len - (4 + ext_offset)),
-						 in_name,
-						 "unwrapped.tgz");
-				} else {
-					snprintf(unwrapped_name,
-						 len + 1 + (10 - ext_offset),
-						 "%.*s_%s",
-						 (int) (len - (4 + ext_offset)),
-						 in_name,
-						 "unwrapped.bin");
-				}
-				if ((unwrap_output = fopen(unwrapped_name, "wb")) == NULL) {
-					fprintf(stderr,
-						"Cannot open unwrapped package output '%s' for writing.\n",
-						unwrapped_name);
-					fail = true;
-					free(unwrapped_name);
-					if (extract_sig) {
-						if (sig_output != NULL) {
-							fclose(sig_output);
-							unlink(sig_name);
-						}
-						free(sig_name);
-					}
-					continue;    // It's fatal, go away
-				}
-			}
-			if ((input = fopen(in_name, "rb")) == NULL) {
-				fprintf(stderr, "Cannot open input '%s' for reading.\n", in_name);
-				fail = true;
-				if (!info_only && !unwrap_only && output != stdout) {
-					// Don't leave 0-byte files behind...
-					if (output != NULL) {
-						fclose(output);
-						unlink(out_name);
-					}
-					free(out_name);
-				}
-				if (extract_sig) {
-					if (sig_output != NULL) {
-						fclose(sig_output);
-						unlink(sig_name);
-					}
-					free(sig_name);
-				}
-				if (unwrap_only) {
-					if (unwrap_output != NULL) {
-						fclose(unwrap_output);
-						unlink(unwrapped_name);
-					}
-					free(unwrapped_name);
-				}
-				continue;    // It's fatal, go away
-			}
-			// If we're outputting to stdout, set a dummy human readable output name
-			if (!info_only && output == stdout) {
-				out_name = strdup("standard output");
-			}
-			// Print a recap of what we're doing
-			if (info_only) {
-				fprintf(stderr,
-					"Checking %s%s package '%s'.\n",
-					(fake_sign ? "fake " : ""),
-					(IS_STGZ(in_name) ? "userdata" : "update"),
-					in_name);
-			} else if (unwrap_only) {
-				fprintf(stderr,
-					"Unwrapping %s package '%s' to '%s'.\n",
-					(IS_STGZ(in_name) ? "userdata" : "update"),
-					in_name,
-					unwrapped_name);
-			} else {
-				fprintf(stderr,
-					"Converting %s%s package '%s' to '%s' (%s, %s).\n",
-					(fake_sign ? "fake " : ""),
-					(IS_STGZ(in_name) ? "userdata" : "update"),
-					in_name,
-					out_name,
-					(extract_sig ? "with sig" : "without sig"),
-					(keep_ori ? "keep input" : "delete input"));
-			}
-			if (kindle_convert(input, output, sig_output, fake_sign, unwrap_only, unwrap_output, header_md5) <
-			    0) {
-				fprintf(stderr,
-					"Error converting %s package '%s'.\n",
-					(IS_STGZ(in_name) ? "userdata" : "update"),
-					in_name);
-				if (output != NULL && output != stdout) {
-					unlink(out_name);    // Clean up our mess, if we made one
-				}
-				fail = true;
-			}
-			// If we were outputting to a file, we didn't ask to keep the original, and we didn't fail to convert it,
-			// delete the original
-			if (output != stdout && !info_only && !keep_ori && !fail) {
-				unlink(in_name);
-			}
-
-			// Clean up behind us
-			if (!info_only && !unwrap_only) {
-				free(out_name);
-			}
-			if (output != NULL && output != stdout) {
-				fclose(output);
-			}
-			if (input != NULL) {
-				fclose(input);
-			}
-			if (sig_output != NULL) {
-				fclose(sig_output);
-			}
-			if (unwrap_output != NULL) {
-				fclose(unwrap_output);
-			}
-			// Remove empty sigs (since we have to open the fd before calling kindle_convert,
-			// we end up with an empty file for packages that aren't wrapped in an UpdateSignature)
-			if (extract_sig) {
-				stat(sig_name, &st);
-				if (st.st_size == 0) {
-					unlink(sig_name);
-				}
-				free(sig_name);
-			}
-			// Same thing for unwrapped packages...
-			if (unwrap_only) {
-				stat(unwrapped_name, &st);
-				if (st.st_size == 0) {
-					unlink(unwrapped_name);
-				}
-				free(unwrapped_name);
-			}
+	if (batch.unwrap_only) {
+		batch.to_stdout = false;
+	}
 
-			// If we're not the last file, throw an LF to untangle the output
-			if (optind < argc) {
-				fprintf(stderr, "\n");
-			}
-		}
-	} else {
+	if (optind >= argc) {
 		fprintf(stderr, "No input specified.\n");
 		return -1;
 	}
 
+	// Iterate over non-options (the file(s) we passed)
+	// (stdout output is probably pretty dumb when passing multiple files...)
+	num_files = (unsigned int) (argc - optind);
+	// NOTE: Concurrent writes to stdout would be even dumber, so, don't (and that goes for listings, too).
+	if (batch.to_stdout || batch.list || jobs > num_files) {
+		jobs = (batch.to_stdout || batch.list) ? 1U : num_files;
+	}
+	batch.list_names = (batch.list && num_files > 1U);
+	// Reports are only buffered when jobs might actually run concurrently
+	batch.buffered = (jobs > 1U);
+	if ((job_list = calloc(num_files, sizeof(*job_list))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for conversion jobs.\n");
+		return -1;
+	}
+	pthread_mutex_init(&batch.lock, NULL);
+	if ((pool = kt_pool_new(jobs)) == NULL) {
+		pthread_mutex_destroy(&batch.lock);
+		free(job_list);
+		return -1;
+	}
+	for (unsigned int i = 0U; i < num_files; i++) {
+		struct kt_convert_job* job = &job_list[i];
+
+		job->batch                     = &batch;
+		job->in_name                   = argv[optind + (int) i];
+		job->ctx.with_unknown_devcodes = kt_with_unknown_devcodes;
+		if (kt_pool_submit(pool, kindle_convert_job, job) != 0) {
+			job->fail = true;
+		}
+	}
+	kt_pool_wait(pool);
+	kt_pool_free(pool);
+	pthread_mutex_destroy(&batch.lock);
+
+	// NOTE: We fail if any of the packages failed to convert
+	for (unsigned int i = 0U; i < num_files; i++) {
+		if (job_list[i].fail) {
+			fail = true;
+		}
+	}
+	free(job_list);
+
 	// Return
 	if (fail) {
 		return -1;
@@ -1042,112 +1265,1607 @@ int
 	}
 }
 
-// Heavily inspired from libarchive's tar/read.c ;)
-static int
-    libarchive_extract(const char* filename, const char* prefix)
-{
-	struct archive*       a;
-	struct archive_entry* entry;
-	int                   flags;
-	int                   r;
-	const char*           path       = NULL;
-	char*                 fixed_path = NULL;
-	size_t                len;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// Regular files up to that size are buffered & handed to a writer, bigger ones are extracted inline.
+#	define KT_EXTRACT_MAX_BUFFERED (8U * 1024U * 1024U)
+// And that's how much file data we allow to be waiting for a writer at any given time.
+#	define KT_EXTRACT_MAX_IN_FLIGHT (64U * 1024U * 1024U)
 
-	// Select which attributes we want to restore.
-	flags = ARCHIVE_EXTRACT_TIME;
-	// Don't preserve permissions, as most files in kindle packages will be owned by root,
-	// and if the perms are effed up, it gets annoying.
-	// We could also just rewrite every entry in the archive with sane permissions, but that seems a bit overkill.
-	//flags |= ARCHIVE_EXTRACT_PERM;
-	//flags |= ARCHIVE_EXTRACT_ACL;
-	flags |= ARCHIVE_EXTRACT_FFLAGS;
+// Honor the entry's timestamps, like ARCHIVE_EXTRACT_TIME (i.e., use the current time for the ones that aren't set).
+static void
+    extract_entry_times(struct archive_entry* entry, struct timespec* times)
+{
+	if (archive_entry_atime_is_set(entry)) {
+		times[0].tv_sec  = archive_entry_atime(entry);
+		times[0].tv_nsec = archive_entry_atime_nsec(entry);
+	} else {
+		times[0].tv_sec  = 0;
+		times[0].tv_nsec = UTIME_NOW;
+	}
+	if (archive_entry_mtime_is_set(entry)) {
+		times[1].tv_sec  = archive_entry_mtime(entry);
+		times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+	} else {
+		times[1].tv_sec  = 0;
+		times[1].tv_nsec = UTIME_NOW;
+	}
+}
 
-	a = archive_read_new();
-	// Let's handle a wide range or tar formats, just to be on the safe side
-	archive_read_support_format_tar(a);
-	archive_read_support_format_gnutar(a);
-	archive_read_support_filter_gzip(a);
+// Make sure every parent directory of path exists, like archive_write_disk does.
+// NOTE: We don't care about failures here, if something's actually wrong, creating the entry itself will tell.
+static void
+    extract_make_parents(struct kt_extract_writer* writer, const char* path)
+{
+	char        parent[PATH_MAX];
+	const char* slash = strrchr(path, '/');
+	size_t      len;
 
-	if (filename != NULL && strcmp(filename, "-") == 0) {
-		filename = NULL;
+	if (slash == NULL || (len = (size_t) (slash - path)) == 0U || len >= sizeof(parent)) {
+		return;
 	}
-	if ((r = archive_read_open_filename(a, filename, 10240))) {
-		fprintf(stderr, "archive_read_open_file() failure: %s.\n", archive_error_string(a));
-		archive_read_free(a);
-		return 1;
+	// Entries usually come grouped by directory, so, this saves us most of the syscalls
+	if (strncmp(writer->last_parent, path, len) == 0 && writer->last_parent[len] == '\0') {
+		return;
 	}
-
-	for (;;) {
-		r = archive_read_next_header(a, &entry);
-		if (r == ARCHIVE_EOF) {
-			break;
-		}
-		if (r != ARCHIVE_OK) {
-			fprintf(stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
-		}
-		if (r < ARCHIVE_WARN) {
-			goto cleanup;
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+	for (char* p = parent + 1; *p != '\0'; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(parent, 0777);
+			*p = '/';
 		}
+	}
+	mkdir(parent, 0777);
+	memcpy(writer->last_parent, parent, len + 1U);
+}
 
-		// Print what we're extracting, like bsdtar
-		path = archive_entry_pathname(entry);
-		fprintf(stderr, "x %s\n", path);
-		// Rewrite the entry's pathname to extract in the right output directory
-		len        = strlen(prefix) + 1 + strlen(path) + 1;    // Flawfinder: ignore
-		fixed_path = malloc(len);
-		snprintf(fixed_path, len, "%s/%s", prefix, path);
-		archive_entry_copy_pathname(entry, fixed_path);
-
-		// archive_read_extract should take care of everything for us...
-		// (creating a write_disk archive, setting a standard lookup, the flags we asked for,
-		// writing our entry header & content, and destroying the write_disk archive ;))
-		r = archive_read_extract(a, entry, flags);
+// Make sure everything we wrote actually made it to the disk, in one go.
+static int
+    extract_sync(const char* path)
+{
+#	if defined(__linux__)
+	int fd;
+	int r;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "Cannot open '%s' for syncing: %s.\n", path, strerror(errno));
+		return -1;
+	}
+	if ((r = syncfs(fd)) != 0) {
+		fprintf(stderr, "Cannot sync '%s': %s.\n", path, strerror(errno));
+	}
+	close(fd);
+	return r;
+#	else
+	// NOTE: Not quite as targeted, but POSIX doesn't give us anything better short of fsync'ing every single file.
+	sync();
+	return 0;
+#	endif
+}
+
+static uint32_t
+    extract_path_hash(const char* path)
+{
+	uint32_t hash = 0x811C9DC5U;
+
+	for (const unsigned char* p = (const unsigned char*) path; *p != '\0'; p++) {
+		hash = (hash ^ (uint32_t) *p) * 0x01000193U;
+	}
+	return hash;
+}
+
+// Is there a file with that path still waiting for a writer? NOTE: Needs writer->lock.
+static bool
+    extract_writer_is_pending(const struct kt_extract_writer* writer, const char* path, uint32_t hash)
+{
+	const struct kt_extract_file* file = writer->pending[hash % KT_EXTRACT_PENDING_BUCKETS];
+
+	while (file != NULL) {
+		if (file->hash == hash && strcmp(file->path, path) == 0) {
+			return true;
+		}
+		file = file->next_pending;
+	}
+	return false;
+}
+
+// A tarball can have the same path more than once, and the last one wins: don't let the writers race each other on it.
+static void
+    extract_writer_wait_path(struct kt_extract_writer* writer, const char* path, uint32_t hash)
+{
+	pthread_mutex_lock(&writer->lock);
+	while (extract_writer_is_pending(writer, path, hash)) {
+		pthread_cond_wait(&writer->drained, &writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+}
+
+// NOTE: Needs writer->lock.
+static void
+    extract_writer_drop_pending(struct kt_extract_writer* writer, const struct kt_extract_file* file)
+{
+	struct kt_extract_file** link = &writer->pending[file->hash % KT_EXTRACT_PENDING_BUCKETS];
+
+	while (*link != NULL && *link != file) {
+		link = &(*link)->next_pending;
+	}
+	if (*link != NULL) {
+		*link = file->next_pending;
+	}
+}
+
+// Worker job: write a single regular file out of its buffered data
+static void
+    extract_write_file(void* data)
+{
+	struct kt_extract_file*   file   = data;
+	struct kt_extract_writer* writer = file->writer;
+	int                       fd;
+	bool                      fail = false;
+
+	// NOTE: Like archive_write_disk, we replace whatever's in the way, but we don't follow symlinks to do it.
+	fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, file->mode);
+	if (fd == -1 && (errno == ELOOP || errno == EMLINK) && unlink(file->path) == 0) {
+		fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, file->mode);
+	}
+	if (fd == -1) {
+		fprintf(stderr, "Cannot create '%s': %s.\n", file->path, strerror(errno));
+		fail = true;
+	} else {
+		if (kt_write_fd(fd, file->data, file->size) != 0) {
+			fprintf(stderr, "Cannot write to '%s': %s.\n", file->path, strerror(errno));
+			fail = true;
+		} else if (futimens(fd, file->times) != 0) {
+			fprintf(stderr, "Cannot restore the timestamps of '%s': %s.\n", file->path, strerror(errno));
+			fail = true;
+		}
+		if (close(fd) != 0 && !fail) {
+			fprintf(stderr, "Cannot close '%s': %s.\n", file->path, strerror(errno));
+			fail = true;
+		}
+	}
+
+	pthread_mutex_lock(&writer->lock);
+	writer->in_flight -= file->size;
+	extract_writer_drop_pending(writer, file);
+	if (fail) {
+		writer->fail = true;
+	}
+	pthread_cond_signal(&writer->drained);
+	pthread_mutex_unlock(&writer->lock);
+
+	free(file->data);
+	free(file->path);
+	free(file);
+}
+
+static int
+    extract_writer_init(struct kt_extract_writer* writer, unsigned int jobs)
+{
+	// NOTE: With a single job, the pool runs everything inline, which still gets us the deferred fixups & sync.
+	if ((writer->pool = kt_pool_new(jobs)) == NULL) {
+		return -1;
+	}
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->drained, NULL);
+	return 0;
+}
+
+// Create a directory right away (so that writers can fill it), but restore its timestamps only once we're done
+static int
+    extract_writer_dir(struct kt_extract_writer* writer, struct archive_entry* entry, const char* path)
+{
+	struct kt_extract_dir* dirs;
+	struct stat            st;
+	// NOTE: We don't preserve permissions, but we still need to be able to write in there.
+	mode_t                 mode = (archive_entry_perm(entry) & 0777) | 0700;
+
+	extract_make_parents(writer, path);
+	extract_writer_wait_path(writer, path, extract_path_hash(path));
+	if (mkdir(path, mode) != 0) {
+		if (errno != EEXIST || lstat(path, &st) != 0) {
+			fprintf(stderr, "Cannot create directory '%s': %s.\n", path, strerror(errno));
+			return -1;
+		}
+		// Replace whatever wasn't a directory
+		if (!S_ISDIR(st.st_mode) && (unlink(path) != 0 || mkdir(path, mode) != 0)) {
+			fprintf(stderr, "Cannot create directory '%s': %s.\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (writer->num_dirs == writer->dirs_capacity) {
+		size_t capacity = (writer->dirs_capacity > 0U) ? writer->dirs_capacity * 2U : 64U;
+		if ((dirs = realloc(writer->dirs, capacity * sizeof(*dirs))) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for directory list.\n");
+			return -1;
+		}
+		writer->dirs          = dirs;
+		writer->dirs_capacity = capacity;
+	}
+	if ((writer->dirs[writer->num_dirs].path = strdup(path)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for directory list.\n");
+		return -1;
+	}
+	extract_entry_times(entry, writer->dirs[writer->num_dirs].times);
+	writer->num_dirs++;
+	return 0;
+}
+
+// Buffer a regular file's data, and hand it to a writer
+static int
+    extract_writer_file(struct kt_extract_writer* writer,
+			struct archive*           a,
+			struct archive_entry*     entry,
+			const char*               path)
+{
+	struct kt_extract_file*  file;
+	struct kt_extract_file** bucket;
+	size_t                   size = (size_t) archive_entry_size(entry);
+	size_t                   done = 0U;
+	la_ssize_t               bytes_read;
+
+	if ((file = calloc(1, sizeof(*file))) == NULL || (file->path = strdup(path)) == NULL ||
+	    (file->data = malloc(size > 0U ? size : 1U)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for '%s'.\n", path);
+		if (file != NULL) {
+			free(file->path);
+		}
+		free(file);
+		return -1;
+	}
+	file->writer = writer;
+	file->hash   = extract_path_hash(path);
+	file->size   = size;
+	// NOTE: Like archive_write_disk without ARCHIVE_EXTRACT_PERM,
+	//       we let the umask do its thing, and drop the setid bits.
+	file->mode = archive_entry_perm(entry) & 0777;
+	extract_entry_times(entry, file->times);
+	extract_make_parents(writer, path);
+
+	// Don't let the writers fall too far behind
+	pthread_mutex_lock(&writer->lock);
+	while (writer->in_flight > 0U && writer->in_flight + size > KT_EXTRACT_MAX_IN_FLIGHT && !writer->fail) {
+		pthread_cond_wait(&writer->drained, &writer->lock);
+	}
+	writer->in_flight += size;
+	pthread_mutex_unlock(&writer->lock);
+
+	while (done < size) {
+		bytes_read = archive_read_data(a, file->data + done, size - done);
+		if (bytes_read <= 0) {
+			fprintf(stderr,
+				"archive_read_data() failed: %s.\n",
+				(bytes_read < 0) ? archive_error_string(a) : "Truncated archive");
+			pthread_mutex_lock(&writer->lock);
+			writer->in_flight -= size;
+			pthread_mutex_unlock(&writer->lock);
+			free(file->data);
+			free(file->path);
+			free(file);
+			return -1;
+		}
+		done += (size_t) bytes_read;
+	}
+
+	// Let an earlier copy of that file hit the disk first, if there's still one pending.
+	// NOTE: We're the only ones adding to pending, so, nothing else can sneak in between the wait & us.
+	extract_writer_wait_path(writer, path, file->hash);
+	bucket = &writer->pending[file->hash % KT_EXTRACT_PENDING_BUCKETS];
+	pthread_mutex_lock(&writer->lock);
+	file->next_pending = *bucket;
+	*bucket            = file;
+	pthread_mutex_unlock(&writer->lock);
+
+	if (kt_pool_submit(writer->pool, extract_write_file, file) != 0) {
+		pthread_mutex_lock(&writer->lock);
+		writer->in_flight -= size;
+		extract_writer_drop_pending(writer, file);
+		pthread_mutex_unlock(&writer->lock);
+		free(file->data);
+		free(file->path);
+		free(file);
+		return -1;
+	}
+	return 0;
+}
+
+// Dispatch an entry: directories & small regular files are ours, everything else goes through libarchive.
+static int
+    extract_writer_entry(struct kt_extract_writer* writer,
+			 struct archive*           a,
+			 struct archive_entry*     entry,
+			 const char*               path,
+			 int                       flags)
+{
+	unsigned long fflags_set;
+	unsigned long fflags_clear;
+	bool          failed;
+
+	pthread_mutex_lock(&writer->lock);
+	failed = writer->fail;
+	pthread_mutex_unlock(&writer->lock);
+	if (failed) {
+		return -1;
+	}
+
+	archive_entry_fflags(entry, &fflags_set, &fflags_clear);
+	if (archive_entry_hardlink(entry) == NULL && fflags_set == 0U && fflags_clear == 0U) {
+		if (archive_entry_filetype(entry) == AE_IFDIR) {
+			return extract_writer_dir(writer, entry, path);
+		}
+		if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size_is_set(entry) &&
+		    archive_entry_size(entry) <= (la_int64_t) KT_EXTRACT_MAX_BUFFERED) {
+			return extract_writer_file(writer, a, entry, path);
+		}
+	}
+
+	// Links & co might depend on what came before them, so, wait for the writers to catch up first.
+	kt_pool_wait(writer->pool);
+	if (archive_read_extract(a, entry, flags) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_read_extract() failed: %s.\n", archive_error_string(a));
+		return -1;
+	}
+	return 0;
+}
+
+// Children first, like archive_write_disk's fixups
+static int
+    extract_dir_cmp(const void* a, const void* b)
+{
+	const struct kt_extract_dir* dir_a = a;
+	const struct kt_extract_dir* dir_b = b;
+
+	return strcmp(dir_b->path, dir_a->path);
+}
+
+// Wait for the writers, then (if everything went fine) restore the directory timestamps, and sync if we were asked to.
+static int
+    extract_writer_finish(struct kt_extract_writer* writer, bool ok, bool sync, const char* prefix)
+{
+	kt_pool_wait(writer->pool);
+	kt_pool_free(writer->pool);
+	// NOTE: No more writers, no more locking
+	if (writer->fail) {
+		ok = false;
+	}
+
+	if (ok) {
+		qsort(writer->dirs, writer->num_dirs, sizeof(*writer->dirs), extract_dir_cmp);
+		for (size_t i = 0U; i < writer->num_dirs; i++) {
+			if (utimensat(AT_FDCWD, writer->dirs[i].path, writer->dirs[i].times, 0) != 0) {
+				fprintf(stderr,
+					"Cannot restore the timestamps of '%s': %s.\n",
+					writer->dirs[i].path,
+					strerror(errno));
+				ok = false;
+				break;
+			}
+		}
+	}
+	if (ok && sync && extract_sync(prefix) != 0) {
+		ok = false;
+	}
+
+	for (size_t i = 0U; i < writer->num_dirs; i++) {
+		free(writer->dirs[i].path);
+	}
+	free(writer->dirs);
+	pthread_cond_destroy(&writer->drained);
+	pthread_mutex_destroy(&writer->lock);
+
+	return ok ? 0 : -1;
+}
+#endif
+
+// Heavily inspired from libarchive's tar/read.c ;)
+static int
+    libarchive_extract_entries(struct archive* a, const char* prefix, const struct kt_convert_ctx* ctx)
+{
+	struct archive_entry* entry;
+	int                   flags;
+	int                   r;
+	int                   ret        = 0;
+	const char*           path       = NULL;
+	char*                 fixed_path = NULL;
+	size_t                len;
+	bool*                 exact_hits  = NULL;
+	size_t                num_hits    = 0U;
+	size_t                i;
+	uint64_t              stats_start = kt_stats_start();
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	struct kt_extract_writer writer     = { 0 };
+	bool                     use_writer = (prefix != NULL && (ctx->extract_jobs > 1U || ctx->extract_sync));
+#endif
+
+	// NOTE: A plain pattern matches everything below it too, so archive_match telling us they all matched something
+	//       doesn't mean we're done: we only are once each of them matched a non-directory entry by that exact name.
+	if (ctx->extract_fast_read && (exact_hits = calloc(ctx->extract_only_count, sizeof(*exact_hits))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for extraction patterns.\n");
+		return 1;
+	}
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	if (use_writer && extract_writer_init(&writer, ctx->extract_jobs) != 0) {
+		free(exact_hits);
+		return 1;
+	}
+#endif
+
+	// Select which attributes we want to restore.
+	flags = ARCHIVE_EXTRACT_TIME;
+	// Don't preserve permissions, as most files in kindle packages will be owned by root,
+	// and if the perms are effed up, it gets annoying.
+	// We could also just rewrite every entry in the archive with sane permissions, but that seems a bit overkill.
+	//flags |= ARCHIVE_EXTRACT_PERM;
+	//flags |= ARCHIVE_EXTRACT_ACL;
+	flags |= ARCHIVE_EXTRACT_FFLAGS;
+
+	for (;;) {
+		r = archive_read_next_header(a, &entry);
+		if (r == ARCHIVE_EOF) {
+			break;
+		}
 		if (r != ARCHIVE_OK) {
-			fprintf(stderr, "archive_read_extract() failed: %s.\n", archive_error_string(a));
+			fprintf(stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+		}
+		if (r < ARCHIVE_WARN) {
+			ret = 1;
+			break;
+		}
+
+		// Skip what we weren't asked for (libarchive skips its data for us on the next header)
+		if (ctx->extract_only != NULL) {
+			r = archive_match_path_excluded(ctx->extract_only, entry);
+			if (r < 0) {
+				fprintf(stderr,
+					"archive_match_path_excluded() failed: %s.\n",
+					archive_error_string(ctx->extract_only));
+				ret = 1;
+				break;
+			}
+			if (r) {
+				continue;
+			}
+		}
+
+		// Print what we're extracting, like bsdtar
+		path = archive_entry_pathname(entry);
+		fprintf(stderr, "x %s\n", path);
+		if (exact_hits != NULL && archive_entry_filetype(entry) != AE_IFDIR) {
+			for (i = 0U; i < ctx->extract_only_count; i++) {
+				if (!exact_hits[i] && strcmp(path, ctx->extract_only_paths[i]) == 0) {
+					exact_hits[i] = true;
+					num_hits++;
+				}
+			}
+		}
+		if (prefix == NULL) {
+			// We're streaming to stdout, so, only the content of regular files matters, like bsdtar -O
+			if (archive_entry_filetype(entry) == AE_IFREG) {
+				fflush(stdout);
+				if (archive_read_data_into_fd(a, STDOUT_FILENO) != ARCHIVE_OK) {
+					fprintf(stderr, "archive_read_data_into_fd() failed: %s.\n", archive_error_string(a));
+					ret = 1;
+					break;
+				}
+			}
+		} else {
+			// Rewrite the entry's pathname to extract in the right output directory
+			len        = strlen(prefix) + 1 + strlen(path) + 1;    // Flawfinder: ignore
+			fixed_path = malloc(len);
+			snprintf(fixed_path, len, "%s/%s", prefix, path);
+			archive_entry_copy_pathname(entry, fixed_path);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+			if (use_writer) {
+				r = extract_writer_entry(&writer, a, entry, fixed_path, flags);
+			} else
+#endif
+			{
+				// archive_read_extract should take care of everything for us...
+				// (creating a write_disk archive, setting a standard lookup, the flags we asked for,
+				// writing our entry header & content, and destroying the write_disk archive ;))
+				r = archive_read_extract(a, entry, flags);
+				if (r != ARCHIVE_OK) {
+					fprintf(stderr, "archive_read_extract() failed: %s.\n", archive_error_string(a));
+				}
+			}
+			// Cleanup
 			free(fixed_path);
-			goto cleanup;
+			if (r != 0) {
+				ret = 1;
+				break;
+			}
+		}
+
+		kt_stats_add(KT_STATS_FILES, 1U);
+		if (archive_entry_filetype(entry) == AE_IFREG) {
+			kt_stats_add(KT_STATS_BYTES_WRITTEN, (uint64_t) archive_entry_size(entry));
+		}
+		// If we're done with every pattern, and nobody needs the rest of the payload, stop right there
+		if (exact_hits != NULL && num_hits == ctx->extract_only_count) {
+			break;
+		}
+	}
+	// Complain about the patterns that didn't match anything, like bsdtar
+	if (ret == 0 && ctx->extract_only != NULL) {
+		const char* pattern;
+
+		while (archive_match_path_unmatched_inclusions_next(ctx->extract_only, &pattern) == ARCHIVE_OK) {
+			fprintf(stderr, "%s: Not found in package.\n", pattern);
+			ret = 1;
 		}
+	}
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	if (use_writer && extract_writer_finish(&writer, ret == 0, ctx->extract_sync, prefix) != 0) {
+		ret = 1;
+	}
+#endif
+	free(exact_hits);
+	kt_stats_stop(KT_STATS_EXTRACT, stats_start);
+
+	return ret;
+}
+
+static struct archive*
+    libarchive_extract_new(void)
+{
+	struct archive* a;
+
+	a = archive_read_new();
+	// Let's handle a wide range or tar formats, just to be on the safe side
+	archive_read_support_format_tar(a);
+	archive_read_support_format_gnutar(a);
+	archive_read_support_filter_gzip(a);
+
+	return a;
+}
+
+static int
+    libarchive_extract(const struct kt_convert_ctx* ctx, FILE* input, const char* prefix)
+{
+	struct archive* a;
+	int             r;
 
-		// Cleanup
-		free(fixed_path);
+	a = libarchive_extract_new();
+	if ((r = archive_read_open_FILE(a, input))) {
+		fprintf(stderr, "archive_read_open_FILE() failure: %s.\n", archive_error_string(a));
+		archive_read_free(a);
+		return 1;
 	}
+
+	r = libarchive_extract_entries(a, prefix, ctx);
 	archive_read_close(a);
 	archive_read_free(a);
 
+	return r;
+}
+
+// Demunge (if need be) & hash (if need be) a chunk of payload we just read
+static void
+    extract_stream_process(struct kt_extract_stream* stream, size_t len)
+{
+	if (stream->demunge) {
+		dm(stream->buff, len);
+	}
+	if (stream->hash) {
+		md5_update(&stream->md5, len, stream->buff);
+	}
+}
+
+// libarchive read callback, feeds it the payload straight from the package
+static la_ssize_t
+    extract_stream_read(struct archive* a, void* data, const void** buff)
+{
+	struct kt_extract_stream* stream = data;
+	size_t                    bytes_read;
+
+	// NOTE: If there's nothing to demunge, and the input is mapped, hand libarchive the mapping directly.
+	if (!stream->demunge && stream->input->map != NULL) {
+		bytes_read = stream->input->size - stream->input->pos;
+		if (bytes_read > MUNGE_BUFFER_SIZE) {
+			bytes_read = MUNGE_BUFFER_SIZE;
+		}
+		*buff = kt_input_get(stream->input, bytes_read);
+		if (stream->hash) {
+			md5_update(&stream->md5, bytes_read, *buff);
+		}
+		kt_stats_add(KT_STATS_BYTES_READ, bytes_read);
+		return (la_ssize_t) bytes_read;
+	}
+
+	bytes_read = kt_input_read(stream->input, stream->buff, MUNGE_BUFFER_SIZE);
+	if (bytes_read == 0 && kt_input_error(stream->input)) {
+		archive_set_error(a, errno, "Cannot read input");
+		return -1;
+	}
+	extract_stream_process(stream, bytes_read);
+	kt_stats_add(KT_STATS_BYTES_READ, bytes_read);
+	*buff = stream->buff;
+	return (la_ssize_t) bytes_read;
+}
+
+// Once libarchive is done with the payload, check its integrity against the MD5 stored in the package's header
+static int
+    extract_stream_check(struct kt_extract_stream* stream, const char* header_md5)
+{
+	char    actual_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	uint8_t digest[MD5_DIGEST_SIZE];
+	size_t  bytes_read;
+
+	if (!stream->hash) {
+		return 0;
+	}
+	// libarchive might not have read the whole payload, hash the leftovers, too
+	while ((bytes_read = kt_input_read(stream->input, stream->buff, MUNGE_BUFFER_SIZE)) > 0) {
+		extract_stream_process(stream, bytes_read);
+		kt_stats_add(KT_STATS_BYTES_READ, bytes_read);
+	}
+	if (kt_input_error(stream->input)) {
+		fprintf(stderr, "Cannot read input file: %s.\n", strerror(errno));
+		return -1;
+	}
+	md5_digest(&stream->md5, MD5_DIGEST_SIZE, digest);
+	base16_encode_update(actual_md5, MD5_DIGEST_SIZE, digest);
+	// ...And compare it against the one stored in the package's header.
+	if (strcmp(header_md5, actual_md5) != 0) {
+		fprintf(stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
+		return -1;
+	}
 	return 0;
+}
 
-cleanup:
+// List the content of a package to stdout, like bsdtar -t, demunging it straight into libarchive.
+// Members are prefixed with name, if it's set. Nothing is written to disk, and file data is only skipped over.
+static int
+    kindle_list_package(struct kt_convert_ctx* ctx, struct kt_input* bin_input, const bool fake_sign, const char* name)
+{
+	struct kt_extract_stream stream = { 0 };
+	struct archive*          a;
+	struct archive_entry*    entry;
+	BundleVersion            payload_version = UnknownUpdate;
+	// NOTE: Unlike the header themselves, we want a real NULL-terminated string here, hence the extra-space & zero-init
+	//       (to make strlen safe, among other concerns).
+	char                     header_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	int                      r;
+	int                      ret = -1;
+
+	// Parse the headers, and stop at the payload
+	if (kindle_convert(ctx, bin_input, NULL, NULL, fake_sign, 0, NULL, header_md5, &payload_version) < 0) {
+		return -1;
+	}
+
+	stream.input = bin_input;
+	// Userdata packages are straight tarballs, and unsigned packages aren't munged
+	stream.demunge = (!fake_sign && payload_version != UserDataPackage);
+	// Since we have to go through the whole payload anyway, check its integrity while we're there
+	// Flawfinder: ignore
+	stream.hash = (!fake_sign && strlen(header_md5) != 0);
+	md5_init(&stream.md5);
+	if ((stream.buff = malloc(MUNGE_BUFFER_SIZE)) == NULL) {
+		fprintf(ctx->report, "Cannot allocate memory for extraction buffer.\n");
+		return -1;
+	}
+
+	a = libarchive_extract_new();
+	if (archive_read_open(a, &stream, NULL, extract_stream_read, NULL) != ARCHIVE_OK) {
+		fprintf(ctx->report, "archive_read_open() failure: %s.\n", archive_error_string(a));
+		archive_read_free(a);
+		free(stream.buff);
+		return -1;
+	}
+	for (;;) {
+		r = archive_read_next_header(a, &entry);
+		if (r == ARCHIVE_EOF) {
+			ret = 0;
+			break;
+		}
+		if (r != ARCHIVE_OK) {
+			fprintf(ctx->report, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+		}
+		if (r < ARCHIVE_WARN) {
+			break;
+		}
+		if (name != NULL) {
+			fprintf(stdout, "%s: %s\n", name, archive_entry_pathname(entry));
+		} else {
+			fprintf(stdout, "%s\n", archive_entry_pathname(entry));
+		}
+	}
 	archive_read_close(a);
 	archive_read_free(a);
+	fflush(stdout);
+
+	if (ret == 0 && extract_stream_check(&stream, header_md5) != 0) {
+		ret = -1;
+	}
+	free(stream.buff);
+	return ret;
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// rm -rf, without following symlinks
+static int
+    remove_tree(const char* path)
+{
+	struct stat    st;
+	DIR*           dir;
+	struct dirent* dirent;
+	char           child[PATH_MAX];
+	int            ret = 0;
+
+	if (lstat(path, &st) != 0) {
+		return -1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if ((dir = opendir(path)) == NULL) {
+			return -1;
+		}
+		while ((dirent = readdir(dir)) != NULL) {
+			if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+			snprintf(child, PATH_MAX, "%s/%s", path, dirent->d_name);
+			if (remove_tree(child) != 0) {
+				ret = -1;
+			}
+		}
+		closedir(dir);
+		if (rmdir(path) != 0) {
+			ret = -1;
+		}
+	} else if (unlink(path) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+// Check if we can extract to output_dir via a staging directory, creating output_dir if need be.
+// It has to be empty (we don't merge it with what's already there), and we won't create its parents.
+static bool
+    can_stage_extract(const char* output_dir, bool* created)
+{
+	struct stat    st;
+	DIR*           dir;
+	struct dirent* dirent;
+	bool           is_empty = true;
+
+	*created = false;
+	if (stat(output_dir, &st) != 0) {
+		if (errno == ENOENT && mkdir(output_dir, 0755) == 0) {
+			*created = true;
+			return true;
+		}
+		return false;
+	}
+	if (!S_ISDIR(st.st_mode) || (dir = opendir(output_dir)) == NULL) {
+		return false;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0) {
+			is_empty = false;
+			break;
+		}
+	}
+	closedir(dir);
+	return is_empty;
+}
+
+// Move everything we extracted in the staging directory to its rightful place
+static int
+    commit_stage_extract(const char* staging_dir, const char* output_dir)
+{
+	DIR*           dir;
+	struct dirent* dirent;
+	char           from[PATH_MAX];
+	char           to[PATH_MAX];
+
+	if ((dir = opendir(staging_dir)) == NULL) {
+		fprintf(stderr, "Cannot open staging directory '%s': %s.\n", staging_dir, strerror(errno));
+		return -1;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+			continue;
+		}
+		snprintf(from, PATH_MAX, "%s/%s", staging_dir, dirent->d_name);
+		snprintf(to, PATH_MAX, "%s/%s", output_dir, dirent->d_name);
+		if (rename(from, to) != 0) {
+			fprintf(stderr, "Cannot move '%s' to '%s': %s.\n", from, to, strerror(errno));
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return rmdir(staging_dir);
+}
+
+// Demunge the package straight into libarchive, checking its integrity along the way.
+// We extract to a staging directory inside output_dir, and only move stuff in place once the MD5 checks out.
+// If output_dir is NULL, we stream the content of the files to stdout instead,
+// in which case it's a bit late to do anything about a failed integrity check besides complaining about it.
+static int
+    kindle_extract_stream(struct kt_convert_ctx* ctx,
+			  struct kt_input*       bin_input,
+			  const char*            output_dir,
+			  const bool             fake_sign,
+			  const bool             created_output_dir)
+{
+	struct kt_extract_stream stream = { 0 };
+	struct archive*          a;
+	char                     staging_dir[PATH_MAX];
+	BundleVersion            payload_version = UnknownUpdate;
+	// NOTE: Unlike the header themselves, we want a real NULL-terminated string here, hence the extra-space & zero-init
+	//       (to make strlen safe, among other concerns).
+	char                     header_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	int                      r;
+
+	// Parse the headers, and stop at the payload
+	if (kindle_convert(ctx, bin_input, NULL, NULL, fake_sign, 0, NULL, header_md5, &payload_version) < 0) {
+		goto abort;
+	}
+
+	if (output_dir != NULL) {
+		snprintf(staging_dir, PATH_MAX, "%s/%s", output_dir, ".kindletool_extract_XXXXXX");
+		if (mkdtemp(staging_dir) == NULL) {
+			fprintf(stderr, "Couldn't create staging directory: %s.\n", strerror(errno));
+			goto abort;
+		}
+	}
+
+	stream.input = bin_input;
+	// Userdata packages are straight tarballs, and unsigned packages aren't munged
+	stream.demunge = (!fake_sign && payload_version != UserDataPackage);
+	// When appropriate, check the integrity of the tarball, thanks to the md5 hash stored in the package's header...
+	// Flawfinder: ignore
+	stream.hash = (!fake_sign && !ctx->extract_unchecked && strlen(header_md5) != 0);
+	// If we have to hash the whole payload, there's no point in stopping early
+	if (stream.hash) {
+		ctx->extract_fast_read = false;
+	}
+	md5_init(&stream.md5);
+	if ((stream.buff = malloc(MUNGE_BUFFER_SIZE)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for extraction buffer.\n");
+		goto cleanup;
+	}
+
+	a = libarchive_extract_new();
+	if (archive_read_open(a, &stream, NULL, extract_stream_read, NULL) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_read_open() failure: %s.\n", archive_error_string(a));
+		archive_read_free(a);
+		goto cleanup;
+	}
+	r = libarchive_extract_entries(a, (output_dir != NULL ? staging_dir : NULL), ctx);
+	archive_read_close(a);
+	// NOTE: This is where directory timestamps get restored, so do it before moving stuff around.
+	archive_read_free(a);
+	if (r != 0) {
+		goto cleanup;
+	}
+	if (extract_stream_check(&stream, header_md5) != 0) {
+		goto cleanup;
+	}
+	if (output_dir == NULL) {
+		free(stream.buff);
+		return 0;
+	}
+
+	// It checks out, move it in place
+	if (commit_stage_extract(staging_dir, output_dir) != 0) {
+		goto cleanup;
+	}
+	free(stream.buff);
+	// NOTE: The renames happened after the sync in libarchive_extract_entries, so, make sure they stick, too.
+	if (ctx->extract_sync && extract_sync(output_dir) != 0) {
+		return -1;
+	}
+	return 0;
+
+cleanup:
+	free(stream.buff);
+	if (output_dir != NULL) {
+		remove_tree(staging_dir);
+	}
+abort:
+	if (created_output_dir) {
+		rmdir(output_dir);
+	}
+	return -1;
+}
+#endif
+
+// Extract a single package (c.f., kindle_extract_main), to output_dir, or to stdout if it's a single dash
+static int
+    kindle_extract_package(struct kt_convert_ctx* ctx,
+			   const char*            bin_filename,
+			   const char*            output_dir,
+			   const bool             fake_sign)
+{
+	FILE*           bin_input;
+	struct kt_input in;
+	FILE*           tgz_output;
+	off_t           tgz_size;
+	// NOTE: Unlike the header themselves, we want a real NULL-terminated string here, hence the extra-space & zero-init
+	//       (to make strlen safe, among other concerns).
+	char header_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	char actual_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	// NOTE: And that's what we'll call output_dir in our messages
+	const bool  to_stdout   = (strcmp(output_dir, "-") == 0);
+	const char* output_name = (to_stdout ? "standard output" : output_dir);
+
+	// Check that input properly ends in .bin or .stgz
+	if (!IS_BIN(bin_filename) && !IS_STGZ(bin_filename) && !IS_TARBALL(bin_filename) && !IS_TGZ(bin_filename)) {
+		fprintf(
+		    stderr,
+		    "Input file '%s' is neither a '.bin' update package nor a '.stgz' or '.tar.gz'/'.tgz' userdata package.\n",
+		    bin_filename);
+		return -1;
+	}
+	// NOTE: Do some sanity checks for output directory handling?
+	// The 'rewrite pathname entry' cheap method we currently use is pretty 'dumb'
+	// (it assumes the path is correct, creating it if need be),
+	// but the other (more correct?) way to handle this (chdir) would need some babysitting
+	// (cf. bsdtar's *_chdir() in tar/util.c)...
+	if ((bin_input = fopen(bin_filename, "rb")) == NULL) {
+		fprintf(
+		    stderr,
+		    "Cannot open input %s package '%s': %s.\n",
+		    ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"),
+		    bin_filename,
+		    strerror(errno));
+		return -1;
+	}
+	// We only ever convert a single package here, so, just print as we go
+	ctx->report                = stderr;
+	ctx->with_unknown_devcodes = kt_with_unknown_devcodes;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	// If we can, demunge the package straight into libarchive, without a temporary tarball
+	// (which is always the case when we're streaming to stdout).
+	bool created_output_dir = false;
+	if (to_stdout || can_stage_extract(output_dir, &created_output_dir)) {
+		fprintf(stderr,
+			"Extracting %s package '%s' to '%s'.\n",
+			((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata"
+													 : "update"),
+			bin_filename,
+			output_name);
+		kt_input_open(&in, bin_input);
+		if (kindle_extract_stream(ctx, &in, (to_stdout ? NULL : output_dir), fake_sign, created_output_dir) < 0) {
+			fprintf(stderr,
+				"Error extracting %s package '%s' to '%s'.\n",
+				((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename))
+				     ? "userdata"
+				     : "update"),
+				bin_filename,
+				output_name);
+			kt_input_close(&in);
+			fclose(bin_input);
+			return -1;
+		}
+		kt_input_close(&in);
+		fclose(bin_input);
+		return 0;
+	}
+	// Otherwise (i.e., we're extracting on top of something), do it the old-fashioned way
+#endif
+	// NOTE: The tarball only lives in RAM as long as it fits in our memory budget, then spills to kt_tempdir.
+	//       See kt_tmpfile for more details.
+	if ((tgz_output = kt_tmpfile()) == NULL) {
+		fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+		fclose(bin_input);
+		return -1;
+	}
+	// Print a recap of what we're about to do
+	fprintf(stderr,
+		"Extracting %s package '%s' to '%s'.\n",
+		((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"),
+		bin_filename,
+		output_name);
+	kt_input_open(&in, bin_input);
+	if (kindle_convert(ctx, &in, tgz_output, NULL, fake_sign, 0, NULL, header_md5, NULL) < 0) {
+		fprintf(
+		    stderr,
+		    "Error converting %s package '%s'.\n",
+		    ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"),
+		    bin_filename);
+		kt_input_close(&in);
+		fclose(bin_input);
+		fclose(tgz_output);
+		return -1;
+	}
+	kt_input_close(&in);
+	fclose(bin_input);
+	if ((tgz_size = ftello(tgz_output)) > 0) {
+		kt_stats_add(KT_STATS_TEMP_BYTES, (uint64_t) tgz_size);
+	}
+	// When appropriate, check the integrity of the tarball, thanks to the md5 hash stored in the package's header...
+	// Flawfinder: ignore
+	if (!fake_sign && !ctx->extract_unchecked && strlen(header_md5) != 0) {
+		// First, calculate the hash of what we've just extracted...
+		rewind(tgz_output);
+		if (md5_sum(tgz_output, actual_md5) < 0) {
+			fprintf(stderr, "Error calculating MD5 of package.\n");
+			fclose(tgz_output);
+			return -1;
+		}
+		// ...And compare it against the one stored in the package's header.
+		if (strcmp(header_md5, actual_md5) != 0) {
+			fprintf(
+			    stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
+			fclose(tgz_output);
+			return -1;
+		}
+	}
+	rewind(tgz_output);
+	if (libarchive_extract(ctx, tgz_output, (to_stdout ? NULL : output_dir)) != 0) {
+		fprintf(stderr, "Error extracting temp tarball to '%s'.\n", output_name);
+		fclose(tgz_output);
+		return -1;
+	}
+	fclose(tgz_output);
+	// NOTE: libarchive reads the temp tarball on its own
+	if (tgz_size > 0) {
+		kt_stats_add(KT_STATS_BYTES_READ, (uint64_t) tgz_size);
+	}
+	return 0;
+}
+
+int
+    kindle_extract_main(int argc, char* argv[])
+{
+	int                        opt;
+	int                        opt_index;
+	static const struct option opts[]    = { { "unsigned", no_argument, NULL, 'u' },
+						     { "jobs", required_argument, NULL, 'j' },
+						     { "fsync", no_argument, NULL, 'F' },
+						     { "stats", optional_argument, NULL, 'T' },
+						     { "mem-budget", required_argument, NULL, 'M' },
+						     { "only", required_argument, NULL, 'O' },
+						     { "no-check", no_argument, NULL, 'N' },
+						     { NULL, 0, NULL, 0 } };
+	bool                       fake_sign = false;
+
+	char*                 bin_filename = NULL;
+	char*                 output_dir   = NULL;
+	struct kt_convert_ctx ctx          = { 0 };
+	bool                  wildcards    = false;
+	const char**          only_paths;
+	int                   ret          = -1;
+
+	while ((opt = getopt_long(argc, argv, "uj:", opts, &opt_index)) != -1) {
+		switch (opt) {
+			case 'u':
+				fake_sign = true;
+				break;
+			case 'j':
+				if (kt_parse_jobs(optarg, &ctx.extract_jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					goto cleanup;
+				}
+				break;
+			case 'F':
+				// NOTE: Long-only (it's not in optstring)
+				ctx.extract_sync = true;
+				break;
+			case 'T':
+				// NOTE: Long-only (it's not in optstring), since it takes an optional argument
+				kt_stats_enable(optarg);
+				break;
+			case 'M':
+				// NOTE: In MiB (0 means we never keep temporaries in RAM)
+				if (kt_parse_mib(optarg, &kt_mem_budget) != 0) {
+					fprintf(stderr, "Invalid memory budget, input: %s\n", optarg);
+					goto cleanup;
+				}
+				break;
+			case 'O':
+				// NOTE: Long-only (it's not in optstring). Uses libarchive's pattern matching.
+				if (ctx.extract_only == NULL) {
+					ctx.extract_only = archive_match_new();
+				}
+				if (archive_match_include_pattern(ctx.extract_only, optarg) != ARCHIVE_OK) {
+					fprintf(stderr,
+						"archive_match_include_pattern() failed: %s.\n",
+						archive_error_string(ctx.extract_only));
+					goto cleanup;
+				}
+				if (strpbrk(optarg, "*?[\\") != NULL) {
+					wildcards = true;
+				}
+				only_paths =
+				    realloc(ctx.extract_only_paths, (ctx.extract_only_count + 1U) * sizeof(*only_paths));
+				if (only_paths == NULL) {
+					fprintf(stderr, "Cannot allocate memory for extraction patterns.\n");
+					goto cleanup;
+				}
+				ctx.extract_only_paths                           = only_paths;
+				ctx.extract_only_paths[ctx.extract_only_count++] = optarg;
+				break;
+			case 'N':
+				// NOTE: Long-only (it's not in optstring)
+				ctx.extract_unchecked = true;
+				break;
+			case ':':
+				fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+				goto cleanup;
+				break;
+			case '?':
+				fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+				goto cleanup;
+				break;
+			default:
+				fprintf(stderr, "?? Unknown option code 0%o ??\n", (unsigned int) opt);
+				goto cleanup;
+				break;
+		}
+	}
+	// If every pattern is a plain path, we know when we've got everything, so we may not have to read the rest.
+	// (kindle_extract_stream still has the final say, since it might need the whole payload for its integrity check).
+	ctx.extract_fast_read = (ctx.extract_only != NULL && !wildcards);
+
+	// We need exactly 2 non-switch options (I/O)!
+	if (optind < argc && (optind + 2) == argc) {
+		// We know exactly what we need, and in what order
+		bin_filename = argv[optind];
+		output_dir   = argv[optind + 1];
+	} else {
+		fprintf(stderr, "Invalid number of arguments (need input & output).\n");
+		goto cleanup;
+	}
+	// Double validation, and make GCC happy
+	if (bin_filename == NULL) {
+		fprintf(stderr, "Input filename isn't set!\n");
+		goto cleanup;
+	}
+	if (output_dir == NULL) {
+		fprintf(stderr, "Output directory isn't set!\n");
+		goto cleanup;
+	}
+
+	ret = kindle_extract_package(&ctx, bin_filename, output_dir, fake_sign);
+
+cleanup:
+	archive_match_free(ctx.extract_only);
+	free(ctx.extract_only_paths);
+	return ret;
+}
+
+// Append some printf-formatted text to a scan record
+static void
+    kt_scan_printf(struct nettle_buffer* record, const char* fmt, ...)
+{
+	char    buff[BUFFER_SIZE];
+	va_list args;
+	int     len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buff, sizeof(buff), fmt, args);
+	va_end(args);
+	if (len > 0) {
+		// NOTE: Everything we print is way shorter than that, save for strings, which go through kt_scan_json_string
+		nettle_buffer_write(record, (size_t) len < sizeof(buff) ? (size_t) len : sizeof(buff) - 1U, (const uint8_t*) buff);
+	}
+}
+
+// Append a quoted, escaped, JSON string, ala kt_json_write_string
+static void
+    kt_scan_json_string(struct nettle_buffer* record, const char* str, size_t len)
+{
+	const unsigned char* p = (const unsigned char*) str;
+	size_t               n;
+
+	nettle_buffer_write(record, 1U, (const uint8_t*) "\"");
+	for (size_t i = 0U; i < len; i += n) {
+		n = 1U;
+		if (p[i] == '"' || p[i] == '\\') {
+			kt_scan_printf(record, "\\%c", p[i]);
+		} else if (p[i] == '\n') {
+			nettle_buffer_write(record, 2U, (const uint8_t*) "\\n");
+		} else if (p[i] == '\t') {
+			nettle_buffer_write(record, 2U, (const uint8_t*) "\\t");
+		} else if (p[i] < 0x20U || p[i] == 0x7FU) {
+			kt_scan_printf(record, "\\u%04X", p[i]);
+		} else if ((n = kt_utf8_sequence_length(p + i, len - i)) > 0U) {
+			nettle_buffer_write(record, n, p + i);
+		} else {
+			n = 1U;
+			kt_scan_printf(record, "\\u%04X", p[i]);
+		}
+	}
+	nettle_buffer_write(record, 1U, (const uint8_t*) "\"");
+}
+
+// Read exactly len bytes at offset, without moving the file position
+static int
+    kt_scan_read(int fd, void* buff, size_t len, off_t offset)
+{
+	unsigned char* p = buff;
+	ssize_t        count;
+
+	while (len > 0U) {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+		count = pread(fd, p, len, offset);
+#else
+		// NOTE: No pread on Win32, but every job has its own fd, so this is just as safe
+		if (lseek(fd, offset, SEEK_SET) == -1) {
+			return -1;
+		}
+		count = read(fd, p, (unsigned int) len);
+#endif
+		if (count == -1 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			if (count == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		p += count;
+		len -= (size_t) count;
+		offset += count;
+	}
+	return 0;
+}
+
+static void
+    kt_scan_device(struct nettle_buffer* record, uint16_t device, bool first)
+{
+	const char* name = convert_device_id(device);
+
+	kt_scan_printf(record, "%s{\"code\":%hu,\"name\":", first ? "" : ",", device);
+	kt_scan_json_string(record, name, strlen(name));    // Flawfinder: ignore
+	kt_scan_printf(record, "}");
+}
+
+// Append the JSON fields describing the package open on fd to record, reading only the header bytes we need.
+// On failure, error is set (and whatever we appended to record is garbage).
+static int
+    kindle_scan_package(int fd, struct nettle_buffer* record, char* error, size_t error_size)
+{
+	char          magic_number[MAGIC_NUMBER_LENGTH];
+	unsigned char data[128];    // NOTE: Big enough for every fixed-size chunk of header we read
+	off_t         offset  = 0;
+	bool          wrapped = false;
+	BundleVersion bundle_version;
+	char          md5[MD5_HASH_LENGTH];
+	uint64_t      source_revision;
+	uint64_t      target_revision;
+	uint32_t      magic_1;
+	uint32_t      magic_2;
+	uint32_t      minor;
+	uint32_t      platform;
+	uint32_t      header_rev;
+	uint32_t      board;
+	uint16_t      num_devices;
+	uint16_t      device;
+	uint16_t      num_metadata;
+	uint16_t      metastring_length;
+
+	// Follow signature envelopes by offset, all the way down to the actual update
+	for (;;) {
+		if (kt_scan_read(fd, magic_number, MAGIC_NUMBER_LENGTH, offset) != 0) {
+			snprintf(error, error_size, "Cannot read bundle header: %s.", strerror(errno));
+			return -1;
+		}
+		if ((bundle_version = get_bundle_version(magic_number)) != UpdateSignature) {
+			break;
+		}
+		UpdateSignatureHeader signature;
+		size_t                cert_size;
+		if (kt_scan_read(fd, &signature, sizeof(signature), offset + MAGIC_NUMBER_LENGTH) != 0) {
+			snprintf(error, error_size, "Cannot read signature header: %s.", strerror(errno));
+			return -1;
+		}
+		switch (signature.certificate_number) {
+			case CertificateDeveloper:
+				cert_size = CERTIFICATE_DEV_SIZE;
+				break;
+			case Certificate1K:
+				cert_size = CERTIFICATE_1K_SIZE;
+				break;
+			case Certificate2K:
+				cert_size = CERTIFICATE_2K_SIZE;
+				break;
+			case CertificateUnknown:
+			default:
+				snprintf(error, error_size, "Unknown signature size, cannot continue.");
+				return -1;
+				break;
+		}
+		// NOTE: We only report the outermost envelope's certificate
+		if (!wrapped) {
+			kt_scan_printf(record, ",\"wrapped\":true,\"cert\":%u", (uint32_t) signature.certificate_number);
+			wrapped = true;
+		}
+		offset += (off_t)(MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE + cert_size);
+	}
+	if (!wrapped) {
+		kt_scan_printf(record, ",\"wrapped\":false");
+	}
+
+	switch (bundle_version) {
+		case OTAUpdateV2:
+			kt_scan_printf(record, ",\"bundle\":");
+			kt_scan_json_string(record, magic_number, MAGIC_NUMBER_LENGTH);
+			kt_scan_printf(record, ",\"type\":\"OTA V2\"");
+			offset += MAGIC_NUMBER_LENGTH;
+			if (kt_scan_read(fd, data, OTA_UPDATE_V2_BLOCK_SIZE, offset) != 0) {
+				goto read_error;
+			}
+			offset += OTA_UPDATE_V2_BLOCK_SIZE;
+			memcpy(&source_revision, &data[0], sizeof(uint64_t));
+			memcpy(&target_revision, &data[sizeof(uint64_t)], sizeof(uint64_t));
+			memcpy(&num_devices, &data[2 * sizeof(uint64_t)], sizeof(uint16_t));
+			kt_scan_printf(record,
+				       ",\"source_revision\":%llu,\"target_revision\":%llu,\"devices\":[",
+				       (long long unsigned int) source_revision,
+				       (long long unsigned int) target_revision);
+			for (uint16_t i = 0U; i < num_devices; i++) {
+				if (kt_scan_read(fd, &device, sizeof(uint16_t), offset) != 0) {
+					goto read_error;
+				}
+				offset += (off_t) sizeof(uint16_t);
+				kt_scan_device(record, device, i == 0U);
+			}
+			if (kt_scan_read(fd, data, OTA_UPDATE_V2_PART_2_BLOCK_SIZE, offset) != 0) {
+				goto read_error;
+			}
+			offset += OTA_UPDATE_V2_PART_2_BLOCK_SIZE;
+			memcpy(md5, &data[2], MD5_HASH_LENGTH);
+			dm((unsigned char*) md5, MD5_HASH_LENGTH);
+			memcpy(&num_metadata, &data[2 + MD5_HASH_LENGTH], sizeof(uint16_t));
+			kt_scan_printf(record, "],\"critical\":%hhu,\"md5\":", data[0]);
+			kt_scan_json_string(record, md5, MD5_HASH_LENGTH);
+			kt_scan_printf(record, ",\"metastrings\":[");
+			for (uint16_t i = 0U; i < num_metadata; i++) {
+				char* metastring;
+
+				// NOTE: The length is big-endian
+				if (kt_scan_read(fd, data, sizeof(uint16_t), offset) != 0) {
+					goto read_error;
+				}
+				offset += (off_t) sizeof(uint16_t);
+				metastring_length = (uint16_t)((data[0] << 8U) | data[1]);
+				if ((metastring = malloc(metastring_length + 1U)) == NULL) {
+					snprintf(error, error_size, "Cannot allocate memory for a metastring.");
+					return -1;
+				}
+				if (kt_scan_read(fd, metastring, metastring_length, offset) != 0) {
+					free(metastring);
+					goto read_error;
+				}
+				offset += metastring_length;
+				dm((unsigned char*) metastring, metastring_length);
+				if (i > 0U) {
+					kt_scan_printf(record, ",");
+				}
+				kt_scan_json_string(record, metastring, metastring_length);
+				free(metastring);
+			}
+			kt_scan_printf(record, "]");
+			break;
+		case OTAUpdate: {
+			OTAUpdateHeader ota;
+
+			kt_scan_printf(record, ",\"bundle\":");
+			kt_scan_json_string(record, magic_number, MAGIC_NUMBER_LENGTH);
+			kt_scan_printf(record, ",\"type\":\"OTA V1\"");
+			if (kt_scan_read(fd, &ota, sizeof(ota), offset + MAGIC_NUMBER_LENGTH) != 0) {
+				goto read_error;
+			}
+			dm((unsigned char*) ota.md5_sum, MD5_HASH_LENGTH);
+			kt_scan_printf(record,
+				       ",\"source_revision\":%u,\"target_revision\":%u,\"devices\":[",
+				       ota.source_revision,
+				       ota.target_revision);
+			kt_scan_device(record, ota.device, true);
+			kt_scan_printf(record, "],\"optional\":%hhu,\"md5\":", ota.optional);
+			kt_scan_json_string(record, ota.md5_sum, MD5_HASH_LENGTH);
+			break;
+		}
+		case RecoveryUpdate: {
+			// NOTE: Both header revisions fit in there, we don't need the rest of the block
+			RecoveryH2UpdateHeader recovery;
+			RecoveryUpdateHeader   recovery_v1;
+
+			kt_scan_printf(record, ",\"bundle\":");
+			kt_scan_json_string(record, magic_number, MAGIC_NUMBER_LENGTH);
+			kt_scan_printf(record, ",\"type\":\"Recovery\"");
+			if (kt_scan_read(fd, &recovery, sizeof(recovery), offset + MAGIC_NUMBER_LENGTH) != 0) {
+				goto read_error;
+			}
+			memcpy(&recovery_v1, &recovery, sizeof(recovery_v1));
+			dm((unsigned char*) recovery.md5_sum, MD5_HASH_LENGTH);
+			kt_scan_printf(record, ",\"md5\":");
+			kt_scan_json_string(record, recovery.md5_sum, MD5_HASH_LENGTH);
+			kt_scan_printf(record,
+				       ",\"magic_1\":%u,\"magic_2\":%u,\"minor\":%u",
+				       recovery.magic_1,
+				       recovery.magic_2,
+				       recovery.minor);
+			if (recovery.header_rev == 2) {
+				kt_scan_printf(record,
+					       ",\"header_rev\":%u,\"target_revision\":%llu,\"platform\":{\"code\":%u,\"name\":\"%s\"}"
+					       ",\"board\":{\"code\":%u,\"name\":\"%s\"}",
+					       recovery.header_rev,
+					       (long long unsigned int) recovery.target_revision,
+					       recovery.platform,
+					       convert_platform_id(recovery.platform),
+					       recovery.board,
+					       convert_board_id(recovery.board));
+			} else {
+				kt_scan_printf(record, ",\"devices\":[");
+				kt_scan_device(record, (uint16_t) recovery_v1.device, true);
+				kt_scan_printf(record, "]");
+			}
+			break;
+		}
+		case RecoveryUpdateV2:
+			kt_scan_printf(record, ",\"bundle\":");
+			kt_scan_json_string(record, magic_number, MAGIC_NUMBER_LENGTH);
+			kt_scan_printf(record, ",\"type\":\"Recovery V2\"");
+			offset += MAGIC_NUMBER_LENGTH;
+			// NOTE: That's everything up to the device list (padding, target revision, md5, 6 uint32_t, padding, & num_devices)
+			if (kt_scan_read(fd, data, 76U, offset) != 0) {
+				goto read_error;
+			}
+			offset += 76;
+			memcpy(&target_revision, &data[4], sizeof(uint64_t));
+			memcpy(md5, &data[12], MD5_HASH_LENGTH);
+			dm((unsigned char*) md5, MD5_HASH_LENGTH);
+			memcpy(&magic_1, &data[44], sizeof(uint32_t));
+			memcpy(&magic_2, &data[48], sizeof(uint32_t));
+			memcpy(&minor, &data[52], sizeof(uint32_t));
+			memcpy(&platform, &data[56], sizeof(uint32_t));
+			memcpy(&header_rev, &data[60], sizeof(uint32_t));
+			memcpy(&board, &data[64], sizeof(uint32_t));
+			num_devices = data[75];
+			kt_scan_printf(record, ",\"target_revision\":%llu,\"md5\":", (long long unsigned int) target_revision);
+			kt_scan_json_string(record, md5, MD5_HASH_LENGTH);
+			kt_scan_printf(record,
+				       ",\"magic_1\":%u,\"magic_2\":%u,\"minor\":%u,\"platform\":{\"code\":%u,\"name\":\"%s\"}"
+				       ",\"header_rev\":%u,\"board\":{\"code\":%u,\"name\":\"%s\"},\"devices\":[",
+				       magic_1,
+				       magic_2,
+				       minor,
+				       platform,
+				       convert_platform_id(platform),
+				       header_rev,
+				       board,
+				       convert_board_id(board));
+			for (uint16_t i = 0U; i < num_devices; i++) {
+				if (kt_scan_read(fd, &device, sizeof(uint16_t), offset) != 0) {
+					goto read_error;
+				}
+				offset += (off_t) sizeof(uint16_t);
+				kt_scan_device(record, device, i == 0U);
+			}
+			kt_scan_printf(record, "]");
+			break;
+		case UserDataPackage:
+			kt_scan_printf(record, ",\"bundle\":\"GZIP\",\"type\":\"Userdata\"");
+			break;
+		case AndroidUpdate:
+			kt_scan_printf(record, ",\"bundle\":\"ZIP\",\"type\":\"Android\"");
+			break;
+		case UpdateSignature:
+		case UnknownUpdate:
+		default:
+			snprintf(error,
+				 error_size,
+				 "Unknown update bundle version (0x%02X%02X%02X%02X).",
+				 (unsigned) (unsigned char) magic_number[0],
+				 (unsigned) (unsigned char) magic_number[1],
+				 (unsigned) (unsigned char) magic_number[2],
+				 (unsigned) (unsigned char) magic_number[3]);
+			return -1;
+			break;
+	}
+	return 0;
+
+read_error:
+	snprintf(error, error_size, "Cannot read update header correctly: %s.", strerror(errno));
+	return -1;
+}
+
+// Scan a single package. This may run on a worker thread, and records are printed in order, as soon as possible.
+static void
+    kindle_scan_job(void* data)
+{
+	struct kt_scan_job*   job   = data;
+	struct kt_scan_batch* batch = job->batch;
+	char                  error[BUFFER_SIZE];
+	size_t                mark;
+	int                   fd;
+
+	nettle_buffer_init(&job->record);
+	kt_scan_printf(&job->record, "{\"file\":");
+	kt_scan_json_string(&job->record, job->in_name, strlen(job->in_name));    // Flawfinder: ignore
+	mark = job->record.size;
+	if ((fd = open(job->in_name, O_RDONLY)) == -1) {
+		snprintf(error, sizeof(error), "Cannot open input package: %s.", strerror(errno));
+		job->fail = true;
+	} else {
+		job->fail = (kindle_scan_package(fd, &job->record, error, sizeof(error)) != 0);
+		close(fd);
+	}
+	// Drop whatever we got before failing
+	if (job->fail) {
+		job->record.size = mark;
+		kt_scan_printf(&job->record, ",\"error\":");
+		kt_scan_json_string(&job->record, error, strlen(error));    // Flawfinder: ignore
+	}
+	kt_scan_printf(&job->record, "}\n");
+
+	pthread_mutex_lock(&batch->lock);
+	job->done = true;
+	while (batch->next < batch->num_jobs && batch->jobs[batch->next].done) {
+		struct kt_scan_job* next = &batch->jobs[batch->next++];
+
+		fwrite(next->record.contents, sizeof(unsigned char), next->record.size, stdout);
+		nettle_buffer_clear(&next->record);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
 
-	return 1;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// Walk a directory tree (in a stable order), and add every update or userdata package (by extension) to the list
+static int
+    kindle_scan_collect(const char* dir_name, char*** list, unsigned int* num_files)
+{
+	struct dirent** entries;
+	int             num_entries;
+	char            path[PATH_MAX];
+	struct stat     st;
+	int             ret = 0;
+
+	if ((num_entries = scandir(dir_name, &entries, NULL, alphasort)) == -1) {
+		fprintf(stderr, "Cannot open directory '%s': %s.\n", dir_name, strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < num_entries; i++) {
+		const char* name = entries[i]->d_name;
+
+		if (ret == 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+			snprintf(path, sizeof(path), "%s/%s", dir_name, name);
+			// NOTE: Don't follow symlinks to directories, we don't want to loop forever
+			if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+				ret = kindle_scan_collect(path, list, num_files);
+			} else if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && (IS_BIN(name) || IS_STGZ(name))) {
+				*list                     = realloc(*list, (*num_files + 1U) * sizeof(char*));
+				(*list)[(*num_files)++] = strdup(path);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	return ret;
 }
+#endif
 
 int
-    kindle_extract_main(int argc, char* argv[])
+    kindle_scan_main(int argc, char* argv[])
 {
 	int                        opt;
 	int                        opt_index;
-	static const struct option opts[]    = { { "unsigned", no_argument, NULL, 'u' }, { NULL, 0, NULL, 0 } };
-	bool                       fake_sign = false;
-
-	char* bin_filename = NULL;
-	char  tgz_filename[PATH_MAX];
-	snprintf(tgz_filename, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_extract_tgz_XXXXXX");
-	char* output_dir = NULL;
-	FILE* bin_input;
-	int   tgz_fd;
-	FILE* tgz_output;
-	// NOTE: Unlike the header themselves, we want a real NULL-terminated string here, hence the extra-space & zero-init
-	//       (to make strlen safe, among other concerns).
-	char header_md5[MD5_HASH_LENGTH + 1] = { 0 };
-	char actual_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	static const struct option opts[] = { { "jobs", required_argument, NULL, 'j' }, { NULL, 0, NULL, 0 } };
+	struct kt_scan_batch       batch  = { 0 };
+	char**                     files  = NULL;
+	unsigned int               num_files = 0U;
+	unsigned int               jobs      = kt_online_cpus();
+	struct kt_pool*            pool;
+	struct stat                st;
+	bool                       fail = false;
 
-	while ((opt = getopt_long(argc, argv, "u", opts, &opt_index)) != -1) {
+	while ((opt = getopt_long(argc, argv, "j:", opts, &opt_index)) != -1) {
 		switch (opt) {
-			case 'u':
-				fake_sign = true;
+			case 'j':
+				if (kt_parse_jobs(optarg, &jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					return -1;
+				}
 				break;
 			case ':':
 				fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
@@ -1164,108 +2882,612 @@ int
 		}
 	}
 
-	// We need exactly 2 non-switch options (I/O)!
-	if (optind < argc && (optind + 2) == argc) {
-		// We know exactly what we need, and in what order
-		bin_filename = argv[optind];
-		output_dir   = argv[optind + 1];
-	} else {
-		fprintf(stderr, "Invalid number of arguments (need input & output).\n");
+	if (optind >= argc) {
+		fprintf(stderr, "No input specified.\n");
 		return -1;
 	}
-	// Double validation, and make GCC happy
-	if (bin_filename == NULL) {
-		fprintf(stderr, "Input filename isn't set!\n");
-		return -1;
+
+	// Build the list of packages: files are taken as-is, directories are walked
+	for (int i = optind; i < argc; i++) {
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+			if (kindle_scan_collect(argv[i], &files, &num_files) != 0) {
+				fail = true;
+				goto cleanup;
+			}
+#else
+			fprintf(stderr, "Scanning directories is not supported on this platform, skipping '%s'.\n", argv[i]);
+			fail = true;
+#endif
+		} else {
+			files              = realloc(files, (num_files + 1U) * sizeof(char*));
+			files[num_files++] = strdup(argv[i]);
+		}
 	}
-	if (output_dir == NULL) {
-		fprintf(stderr, "Output directory isn't set!\n");
-		return -1;
+	if (num_files == 0U) {
+		goto cleanup;
 	}
 
-	// Check that input properly ends in .bin or .stgz
-	if (!IS_BIN(bin_filename) && !IS_STGZ(bin_filename) && !IS_TARBALL(bin_filename) && !IS_TGZ(bin_filename)) {
-		fprintf(
-		    stderr,
-		    "Input file '%s' is neither a '.bin' update package nor a '.stgz' or '.tar.gz'/'.tgz' userdata package.\n",
-		    bin_filename);
-		return -1;
+	if (jobs > num_files) {
+		jobs = num_files;
 	}
-	// NOTE: Do some sanity checks for output directory handling?
-	// The 'rewrite pathname entry' cheap method we currently use is pretty 'dumb'
-	// (it assumes the path is correct, creating it if need be),
-	// but the other (more correct?) way to handle this (chdir) would need some babysitting
-	// (cf. bsdtar's *_chdir() in tar/util.c)...
-	if ((bin_input = fopen(bin_filename, "rb")) == NULL) {
-		fprintf(
-		    stderr,
-		    "Cannot open input %s package '%s': %s.\n",
-		    ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"),
-		    bin_filename,
-		    strerror(errno));
+	if ((batch.jobs = calloc(num_files, sizeof(*batch.jobs))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for scan jobs.\n");
+		fail = true;
+		goto cleanup;
+	}
+	batch.num_jobs = num_files;
+	pthread_mutex_init(&batch.lock, NULL);
+	if ((pool = kt_pool_new(jobs)) == NULL) {
+		pthread_mutex_destroy(&batch.lock);
+		fail = true;
+		goto cleanup;
+	}
+	for (unsigned int i = 0U; i < num_files; i++) {
+		batch.jobs[i].batch   = &batch;
+		batch.jobs[i].in_name = files[i];
+	}
+	for (unsigned int i = 0U; i < num_files; i++) {
+		if (kt_pool_submit(pool, kindle_scan_job, &batch.jobs[i]) != 0) {
+			// NOTE: Run it here instead, so that the records behind it still get printed
+			kindle_scan_job(&batch.jobs[i]);
+		}
+	}
+	kt_pool_wait(pool);
+	kt_pool_free(pool);
+	pthread_mutex_destroy(&batch.lock);
+	fflush(stdout);
+
+	// NOTE: We fail if any of the packages couldn't be scanned
+	for (unsigned int i = 0U; i < num_files; i++) {
+		if (batch.jobs[i].fail) {
+			fail = true;
+		}
+	}
+
+cleanup:
+	free(batch.jobs);
+	for (unsigned int i = 0U; i < num_files; i++) {
+		free(files[i]);
+	}
+	free(files);
+
+	// Return
+	if (fail) {
 		return -1;
+	} else {
+		return 0;
 	}
-	// Use a non-racey tempfile, hopefully... (Heavily inspired from http://www.tldp.org/HOWTO/Secure-Programs-HOWTO/avoid-race.html)
-	// We always create them in P_tmpdir (usually /tmp or /var/tmp), and rely on the OS implementation to handle the umask,
-	// it'll cost us less LOC that way since I don't really want to introduce a dedicated utility function for tempfile handling...
-	// NOTE: Probably still racey on MinGW, according to libarchive, but, meh, and we're not multithreaded...
-	//       See the ifdef in kindle_tool.h for more details.
-	tgz_fd = mkstemp(tgz_filename);
-	if (tgz_fd == -1) {
-		fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
-		fclose(bin_input);
+}
+
+// Check a raw RSA-SHA256 signature of digest against our key
+static bool
+    kt_verify_signature(const struct rsa_public_key* rsa_pub,
+			const uint8_t*               digest,
+			const unsigned char*         raw_sig,
+			size_t                       sig_size)
+{
+	mpz_t    sig;
+	bool     ok;
+	uint64_t stats_start;
+
+	// A signature made with a key of another size can't possibly match
+	if (sig_size != rsa_pub->size) {
+		return false;
+	}
+
+	mpz_init(sig);
+	// NOTE: Same layout as what we mpz_export when signing: most significant byte first.
+	mpz_import(sig, sig_size, 1, sizeof(unsigned char), 1, 0, raw_sig);
+	stats_start = kt_stats_start();
+	ok          = (rsa_sha256_verify_digest(rsa_pub, digest, sig) != 0);
+	kt_stats_stop(KT_STATS_SIGN, stats_start);
+	kt_stats_add(KT_STATS_RSA_OPS, 1U);
+	mpz_clear(sig);
+
+	return ok;
+}
+
+// Append a problem to a verify report, tagged with the path it's about (if any)
+static void
+    kt_verify_problem(struct nettle_buffer* problems, const char* path, const char* problem)
+{
+	nettle_buffer_write(problems, 1U, (const uint8_t*) "\t");
+	if (path != NULL) {
+		nettle_buffer_write(problems, strlen(path), (const uint8_t*) path);    // Flawfinder: ignore
+		nettle_buffer_write(problems, 2U, (const uint8_t*) ": ");
+	}
+	nettle_buffer_write(problems, strlen(problem), (const uint8_t*) problem);    // Flawfinder: ignore
+	nettle_buffer_write(problems, 1U, (const uint8_t*) "\n");
+}
+
+// The bundle index lives at the root of the payload, but a tarball rebuilt by hand might have it as ./update-filelist.dat
+static bool
+    kt_verify_is_index(const char* path)
+{
+	return (strcmp(path, INDEX_FILE_NAME) == 0 || strcmp(path, "./" INDEX_FILE_NAME) == 0);
+}
+
+static int
+    kt_verify_member_cmp(const void* a, const void* b)
+{
+	return strcmp(((const struct kt_verify_member*) a)->path, ((const struct kt_verify_member*) b)->path);
+}
+
+static int
+    kt_verify_member_key_cmp(const void* key, const void* member)
+{
+	return strcmp((const char*) key, ((const struct kt_verify_member*) member)->path);
+}
+
+// Hash a regular file straight out of the archive, keeping its content around if it's a sigfile, or the bundle index
+static int
+    kindle_verify_read_member(struct archive* a, struct kt_verify_member* member, struct nettle_buffer* index)
+{
+	unsigned char        buff[BUFFER_SIZE * 16U];
+	struct md5_ctx       md5;
+	struct kt_sha256_ctx sha256;
+	uint8_t              digest[MD5_DIGEST_SIZE];
+	la_ssize_t           len;
+	size_t               total       = 0U;
+	uint64_t             stats_start = kt_stats_start();
+
+	md5_init(&md5);
+	kt_sha256_init(&sha256);
+	while ((len = archive_read_data(a, buff, sizeof(buff))) > 0) {
+		md5_update(&md5, (size_t) len, buff);
+		kt_sha256_update(&sha256, (size_t) len, buff);
+		// Like we said when signing, sigfiles are 2K at most
+		if (member->sig != NULL) {
+			if (total + (size_t) len <= CERTIFICATE_2K_SIZE) {
+				memcpy(member->sig + total, buff, (size_t) len);
+			}
+		} else if (index != NULL) {
+			nettle_buffer_write(index, (size_t) len, buff);
+		}
+		total += (size_t) len;
+	}
+	if (len < 0) {
 		return -1;
 	}
-	if ((tgz_output = fdopen(tgz_fd, "w+b")) == NULL) {
-		fprintf(stderr, "Cannot open temp output '%s' for writing: %s.\n", tgz_filename, strerror(errno));
-		fclose(bin_input);
-		close(tgz_fd);
-		unlink(tgz_filename);
+	md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+	base16_encode_update(member->md5, MD5_DIGEST_SIZE, digest);
+	member->md5[MD5_HASH_LENGTH] = '\0';
+	kt_sha256_digest(&sha256, member->sha256);
+	member->sig_size = total;
+	kt_stats_stop(KT_STATS_HASH, stats_start);
+
+	return 0;
+}
+
+// Check the sigfiles & the bundle index against the files they're about
+static void
+    kindle_verify_members(const struct rsa_public_key* rsa_pub,
+			  struct kt_verify_member*     members,
+			  size_t                       num_members,
+			  struct nettle_buffer*        index,
+			  struct nettle_buffer*        problems)
+{
+	struct kt_verify_member* member;
+	char                     path[PATH_MAX];
+	char                     md5[MD5_HASH_LENGTH + 1];
+	char*                    line;
+	char*                    next_line;
+	char*                    line_path;
+	int                      offset;
+	bool                     has_index = false;
+
+	qsort(members, num_members, sizeof(*members), kt_verify_member_cmp);
+
+	// Every sigfile has to match the file it's named after
+	for (size_t i = 0U; i < num_members; i++) {
+		if (!members[i].is_sig) {
+			continue;
+		}
+		// Strip the .sig suffix
+		snprintf(path, sizeof(path), "%.*s", (int) (strlen(members[i].path) - 4U), members[i].path);    // Flawfinder: ignore
+		member = bsearch(path, members, num_members, sizeof(*members), kt_verify_member_key_cmp);
+		if (member == NULL || member->is_sig) {
+			kt_verify_problem(problems, members[i].path, "Signature of a file that isn't in the package.");
+			continue;
+		}
+		member->has_sig = true;
+		if (!kt_verify_signature(rsa_pub, member->sha256, members[i].sig, members[i].sig_size)) {
+			kt_verify_problem(problems, member->path, "Bad signature.");
+		}
+	}
+	for (size_t i = 0U; i < num_members; i++) {
+		if (kt_verify_is_index(members[i].path)) {
+			has_index = true;
+		}
+		if (!members[i].is_sig && !members[i].has_sig) {
+			kt_verify_problem(problems, members[i].path, "Not signed.");
+		}
+	}
+
+	// And every line of the index has to match a file of the package (c.f., kindle_create_load_previous)
+	//   file_type_id md5sum file_name blocksize file_display_name
+	if (!has_index) {
+		kt_verify_problem(problems, INDEX_FILE_NAME, "Missing.");
+		return;
+	}
+	nettle_buffer_write(index, 1U, (const uint8_t*) "");
+	for (line = (char*) index->contents; line != NULL && *line != '\0'; line = next_line) {
+		if ((next_line = strchr(line, '\n')) != NULL) {
+			*next_line++ = '\0';
+		}
+		if (sscanf(line, "%*u %32s %n", md5, &offset) != 1 || strlen(md5) != MD5_HASH_LENGTH) {    // Flawfinder: ignore
+			kt_verify_problem(problems, INDEX_FILE_NAME, "Malformed line.");
+			continue;
+		}
+		// Only keep the file_name field
+		line_path                          = line + offset;
+		line_path[strcspn(line_path, " ")] = '\0';
+
+		member = bsearch(line_path, members, num_members, sizeof(*members), kt_verify_member_key_cmp);
+		if (member == NULL || member->is_sig) {
+			kt_verify_problem(problems, line_path, "Listed in the index, but not in the package.");
+			continue;
+		}
+		member->indexed = true;
+		if (strcasecmp(member->md5, md5) != 0) {
+			kt_verify_problem(problems, member->path, "MD5 doesn't match the index.");
+		}
+	}
+	for (size_t i = 0U; i < num_members; i++) {
+		if (!members[i].is_sig && !members[i].indexed && !kt_verify_is_index(members[i].path)) {
+			kt_verify_problem(problems, members[i].path, "Not listed in the index.");
+		}
+	}
+}
+
+// Verify a single package, in a single pass over it, straight from the input (nothing ever touches the disk):
+// the envelope's signature, the payload's MD5, and unless that's a userdata package, every sigfile & the bundle index.
+// Every problem we find is appended to problems. Returns -1 if there were any.
+static int
+    kindle_verify_package(const struct rsa_public_key* rsa_pub,
+			  const char*                  in_name,
+			  struct nettle_buffer*        problems,
+			  size_t*                      num_files)
+{
+	struct kt_convert_ctx     ctx      = { 0 };
+	struct kt_verify_envelope envelope = { 0 };
+	struct kt_extract_stream  stream   = { 0 };
+	struct kt_input           input;
+	struct kt_verify_member*  members     = NULL;
+	size_t                    num_members = 0U;
+	struct nettle_buffer      index;
+	struct archive*           a = NULL;
+	struct archive_entry*     entry;
+	BundleVersion             payload_version = UnknownUpdate;
+	// NOTE: Unlike the header themselves, we want a real NULL-terminated string here
+	char                      header_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	char                      actual_md5[MD5_HASH_LENGTH + 1] = { 0 };
+	uint8_t                   digest[SHA256_DIGEST_SIZE];
+	char                      line[BUFFER_SIZE];
+	FILE*                     bin_input;
+	FILE*                     report;
+	const char*               pathname;
+	size_t                    bytes_read;
+	size_t                    mark = problems->size;
+	int                       r;
+
+	nettle_buffer_init(&index);
+	*num_files = 0U;
+	if ((bin_input = fopen(in_name, "rb")) == NULL) {
+		snprintf(line, sizeof(line), "Cannot open package: %s.", strerror(errno));
+		kt_verify_problem(problems, NULL, line);
 		return -1;
 	}
-	// Print a recap of what we're about to do
-	fprintf(stderr,
-		"Extracting %s package '%s' to '%s'.\n",
-		((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"),
-		bin_filename,
-		output_dir);
-	if (kindle_convert(bin_input, tgz_output, NULL, fake_sign, 0, NULL, header_md5) < 0) {
-		fprintf(
-		    stderr,
-		    "Error converting %s package '%s'.\n",
-		    ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"),
-		    bin_filename);
+	// NOTE: We don't care about the package information,
+	//       save for its last line, which explains why we failed, if we did.
+	if ((report = kt_tmpfile()) == NULL) {
+		kt_verify_problem(problems, NULL, "Cannot create a temporary file.");
 		fclose(bin_input);
-		fclose(tgz_output);
 		return -1;
 	}
-	fclose(bin_input);
-	// When appropriate, check the integrity of the tarball, thanks to the md5 hash stored in the package's header...
+	ctx.report   = report;
+	ctx.envelope = &envelope;
+	kt_input_open(&input, bin_input);
+
+	// Parse the headers, and stop at the payload
+	if (kindle_convert(&ctx, &input, NULL, NULL, false, 0, NULL, header_md5, &payload_version) < 0) {
+		snprintf(line, sizeof(line), "Cannot parse package headers.");
+		rewind(report);
+		while (fgets(line, sizeof(line), report) != NULL) {
+			;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		kt_verify_problem(problems, NULL, line);
+		goto cleanup;
+	}
+
+	stream.input = &input;
+	// Userdata packages are straight tarballs
+	stream.demunge = (payload_version != UserDataPackage);
 	// Flawfinder: ignore
-	if (!fake_sign && strlen(header_md5) != 0) {
-		// First, calculate the hash of what we've just extracted...
-		rewind(tgz_output);
-		if (md5_sum(tgz_output, actual_md5) < 0) {
-			fprintf(stderr, "Error calculating MD5 of package.\n");
-			fclose(tgz_output);
-			unlink(tgz_filename);
-			return -1;
+	stream.hash = (strlen(header_md5) != 0);
+	md5_init(&stream.md5);
+	if ((stream.buff = malloc(MUNGE_BUFFER_SIZE)) == NULL) {
+		kt_verify_problem(problems, NULL, "Cannot allocate memory for the payload.");
+		goto cleanup;
+	}
+
+	a = libarchive_extract_new();
+	if (archive_read_open(a, &stream, NULL, extract_stream_read, NULL) != ARCHIVE_OK) {
+		snprintf(line, sizeof(line), "Cannot read payload: %s.", archive_error_string(a));
+		kt_verify_problem(problems, NULL, line);
+		goto cleanup;
+	}
+	while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN) {
+		struct kt_verify_member* member;
+		struct kt_verify_member* grown;
+
+		if (archive_entry_filetype(entry) != AE_IFREG) {
+			continue;
 		}
-		// ...And compare it against the one stored in the package's header.
+		pathname = archive_entry_pathname(entry);
+		if ((grown = realloc(members, (num_members + 1U) * sizeof(*members))) == NULL) {
+			kt_verify_problem(problems, pathname, "Cannot allocate memory.");
+			goto cleanup;
+		}
+		members = grown;
+		member  = &members[num_members++];
+		memset(member, 0, sizeof(*member));
+		if ((member->path = strdup(pathname)) == NULL) {
+			kt_verify_problem(problems, pathname, "Cannot allocate memory.");
+			goto cleanup;
+		}
+		// Flawfinder: ignore
+		member->is_sig = (strlen(pathname) > 4U && IS_SIG(pathname));
+		if (member->is_sig && (member->sig = malloc(CERTIFICATE_2K_SIZE)) == NULL) {
+			kt_verify_problem(problems, pathname, "Cannot allocate memory for the signature.");
+			goto cleanup;
+		}
+		if (kindle_verify_read_member(a, member, kt_verify_is_index(pathname) ? &index : NULL) != 0) {
+			snprintf(line, sizeof(line), "Cannot read payload: %s.", archive_error_string(a));
+			kt_verify_problem(problems, pathname, line);
+			goto cleanup;
+		}
+		kt_stats_add(KT_STATS_FILES, 1U);
+	}
+	if (r != ARCHIVE_EOF) {
+		snprintf(line, sizeof(line), "Cannot read payload: %s.", archive_error_string(a));
+		kt_verify_problem(problems, NULL, line);
+		goto cleanup;
+	}
+
+	// libarchive might not have read the whole payload, hash the leftovers, too
+	while ((bytes_read = kt_input_read(&input, stream.buff, MUNGE_BUFFER_SIZE)) > 0) {
+		extract_stream_process(&stream, bytes_read);
+		kt_stats_add(KT_STATS_BYTES_READ, bytes_read);
+	}
+	if (kt_input_error(&input)) {
+		snprintf(line, sizeof(line), "Cannot read package: %s.", strerror(errno));
+		kt_verify_problem(problems, NULL, line);
+		goto cleanup;
+	}
+	if (stream.hash) {
+		md5_digest(&stream.md5, MD5_DIGEST_SIZE, digest);
+		base16_encode_update(actual_md5, MD5_DIGEST_SIZE, digest);
 		if (strcmp(header_md5, actual_md5) != 0) {
-			fprintf(
-			    stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
-			fclose(tgz_output);
-			unlink(tgz_filename);
-			return -1;
+			snprintf(
+			    line, sizeof(line), "Integrity check failed! Header: '%s' vs Package: '%s'.", header_md5, actual_md5);
+			kt_verify_problem(problems, NULL, line);
 		}
 	}
-	fclose(tgz_output);
-	if (libarchive_extract(tgz_filename, output_dir) < 0) {
-		fprintf(stderr, "Error extracting temp tarball '%s' to '%s'.\n", tgz_filename, output_dir);
-		unlink(tgz_filename);
+	if (envelope.found) {
+		kt_sha256_digest(&envelope.sha256, digest);
+		if (!kt_verify_signature(rsa_pub, digest, envelope.sig, envelope.sig_size)) {
+			kt_verify_problem(problems, NULL, "Bad package signature.");
+		}
+	}
+	// Userdata tarballs are whatever the user made them to be, there's nothing else to check
+	if (payload_version != UserDataPackage) {
+		kindle_verify_members(rsa_pub, members, num_members, &index, problems);
+	}
+	for (size_t i = 0U; i < num_members; i++) {
+		if (!members[i].is_sig) {
+			(*num_files)++;
+		}
+	}
+
+cleanup:
+	if (a != NULL) {
+		archive_read_close(a);
+		archive_read_free(a);
+	}
+	free(stream.buff);
+	for (size_t i = 0U; i < num_members; i++) {
+		free(members[i].path);
+		free(members[i].sig);
+	}
+	free(members);
+	nettle_buffer_clear(&index);
+	input.sha256 = NULL;
+	kt_input_close(&input);
+	fclose(bin_input);
+	fclose(report);
+
+	return (problems->size == mark) ? 0 : -1;
+}
+
+// Verify a single package. This may run on a worker thread, and records are printed in order, as soon as possible.
+static void
+    kindle_verify_job(void* data)
+{
+	struct kt_verify_job*   job   = data;
+	struct kt_verify_batch* batch = job->batch;
+	struct nettle_buffer    problems;
+	size_t                  num_files;
+
+	nettle_buffer_init(&job->record);
+	nettle_buffer_init(&problems);
+	job->fail = (kindle_verify_package(batch->rsa_pub, job->in_name, &problems, &num_files) != 0);
+	nettle_buffer_write(&job->record, strlen(job->in_name), (const uint8_t*) job->in_name);    // Flawfinder: ignore
+	if (job->fail) {
+		kt_scan_printf(&job->record, ": FAILED\n");
+		nettle_buffer_write(&job->record, problems.size, problems.contents);
+	} else {
+		kt_scan_printf(&job->record, ": OK (%zu files)\n", num_files);
+	}
+	nettle_buffer_clear(&problems);
+
+	pthread_mutex_lock(&batch->lock);
+	job->done = true;
+	while (batch->next < batch->num_jobs && batch->jobs[batch->next].done) {
+		struct kt_verify_job* next = &batch->jobs[batch->next++];
+
+		fwrite(next->record.contents, sizeof(unsigned char), next->record.size, stdout);
+		nettle_buffer_clear(&next->record);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+int
+    kindle_verify_main(int argc, char* argv[])
+{
+	int                        opt;
+	int                        opt_index;
+	static const struct option opts[] = { { "key", required_argument, NULL, 'k' },
+					      { "jobs", required_argument, NULL, 'j' },
+					      { "stats", optional_argument, NULL, 'T' },
+					      { NULL, 0, NULL, 0 } };
+	struct kt_verify_batch     batch  = { 0 };
+	struct rsa_public_key      rsa_pub;
+	char**                     files     = NULL;
+	unsigned int               num_files = 0U;
+	unsigned int               jobs      = kt_online_cpus();
+	struct kt_pool*            pool;
+	struct stat                st;
+	bool                       fail = false;
+
+	// Signatures are checked against our default key, unless we're told otherwise
+	rsa_public_key_init(&rsa_pub);
+	kindle_create_default_pubkey(&rsa_pub);
+	while ((opt = getopt_long(argc, argv, "k:j:", opts, &opt_index)) != -1) {
+		switch (opt) {
+			case 'k':
+				rsa_public_key_clear(&rsa_pub);
+				rsa_public_key_init(&rsa_pub);
+				if (nettle_rsa_pubkey_from_pem(optarg, &rsa_pub) != 0) {
+					fprintf(stderr, "Key %s cannot be loaded.\n", optarg);
+					rsa_public_key_clear(&rsa_pub);
+					return -1;
+				}
+				break;
+			case 'j':
+				if (kt_parse_jobs(optarg, &jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					rsa_public_key_clear(&rsa_pub);
+					return -1;
+				}
+				break;
+			case 'T':
+				// NOTE: Long-only (it's not in optstring), since it takes an optional argument
+				kt_stats_enable(optarg);
+				break;
+			case ':':
+				fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+				rsa_public_key_clear(&rsa_pub);
+				return -1;
+				break;
+			case '?':
+				fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+				rsa_public_key_clear(&rsa_pub);
+				return -1;
+				break;
+			default:
+				fprintf(stderr, "?? Unknown option code 0%o ??\n", (unsigned int) opt);
+				rsa_public_key_clear(&rsa_pub);
+				return -1;
+				break;
+		}
+	}
+	// Like we said when signing, handle 2K keys at most!
+	if (rsa_pub.size > CERTIFICATE_2K_SIZE) {
+		fprintf(stderr, "RSA key is too large (2K at most)!\n");
+		rsa_public_key_clear(&rsa_pub);
 		return -1;
 	}
-	unlink(tgz_filename);
-	return 0;
+	batch.rsa_pub = &rsa_pub;
+
+	if (optind >= argc) {
+		fprintf(stderr, "No input specified.\n");
+		rsa_public_key_clear(&rsa_pub);
+		return -1;
+	}
+
+	// Build the list of packages: files are taken as-is, directories are walked
+	for (int i = optind; i < argc; i++) {
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+			if (kindle_scan_collect(argv[i], &files, &num_files) != 0) {
+				fail = true;
+				goto cleanup;
+			}
+#else
+			fprintf(stderr, "Verifying directories is not supported on this platform, skipping '%s'.\n", argv[i]);
+			fail = true;
+#endif
+		} else {
+			files              = realloc(files, (num_files + 1U) * sizeof(char*));
+			files[num_files++] = strdup(argv[i]);
+		}
+	}
+	if (num_files == 0U) {
+		goto cleanup;
+	}
+
+	if (jobs > num_files) {
+		jobs = num_files;
+	}
+	if ((batch.jobs = calloc(num_files, sizeof(*batch.jobs))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for verify jobs.\n");
+		fail = true;
+		goto cleanup;
+	}
+	batch.num_jobs = num_files;
+	pthread_mutex_init(&batch.lock, NULL);
+	if ((pool = kt_pool_new(jobs)) == NULL) {
+		pthread_mutex_destroy(&batch.lock);
+		fail = true;
+		goto cleanup;
+	}
+	for (unsigned int i = 0U; i < num_files; i++) {
+		batch.jobs[i].batch   = &batch;
+		batch.jobs[i].in_name = files[i];
+	}
+	for (unsigned int i = 0U; i < num_files; i++) {
+		if (kt_pool_submit(pool, kindle_verify_job, &batch.jobs[i]) != 0) {
+			// NOTE: Run it here instead, so that the records behind it still get printed
+			kindle_verify_job(&batch.jobs[i]);
+		}
+	}
+	kt_pool_wait(pool);
+	kt_pool_free(pool);
+	pthread_mutex_destroy(&batch.lock);
+	fflush(stdout);
+
+	// NOTE: We fail if any of the packages didn't check out
+	for (unsigned int i = 0U; i < num_files; i++) {
+		if (batch.jobs[i].fail) {
+			fail = true;
+		}
+	}
+
+cleanup:
+	free(batch.jobs);
+	for (unsigned int i = 0U; i < num_files; i++) {
+		free(files[i]);
+	}
+	free(files);
+	rsa_public_key_clear(&rsa_pub);
+
+	// Return
+	if (fail) {
+		return -1;
+	} else {
+		return 0;
+	}
 }
@@ -25,18 +25,231 @@
 
 #include "kindle_tool.h"
 
+// What verify needs to check an UpdateSignature envelope, whose signature covers everything that follows it
+struct kt_verify_envelope
+{
+	bool                 found;
+	unsigned char        sig[CERTIFICATE_2K_SIZE];
+	size_t               sig_size;
+	struct kt_sha256_ctx sha256;
+};
+
+// Per-package conversion state, so that we can convert several packages at once
+struct kt_convert_ctx
+{
+	FILE*                      report;                   // Where the package information goes
+	bool                       is_wrapped;               // Whether the package was wrapped in an UpdateSignature
+	bool                       with_unknown_devcodes;    // Snapshot of kt_with_unknown_devcodes
+	unsigned int               extract_jobs;             // How many threads write the files we extract
+	bool                       extract_sync;             // Whether we make sure what we extracted hit the disk
+	bool                       extract_unchecked;        // Whether we skip the payload's integrity check
+	struct archive*            extract_only;             // If set, we only extract the entries it matches (--only)
+	const char**               extract_only_paths;       // The patterns we fed extract_only, as-is
+	size_t                     extract_only_count;       // How many of them there are
+	bool                       extract_fast_read;        // Whether we can stop once extract_only matched it all
+	struct kt_verify_envelope* envelope;                 // If set, where verify wants the envelope's signature
+};
+
+// State shared by every package of a single convert invocation
+struct kt_convert_batch
+{
+	bool            info_only;
+	bool            keep_ori;
+	bool            to_stdout;
+	bool            extract_sig;
+	bool            fake_sign;
+	bool            unwrap_only;
+	bool            list;
+	bool            list_names;    // Whether listings are prefixed with the package's name (i.e., if there's several)
+	bool            buffered;      // Whether reports are buffered, and only flushed once the package is done
+	bool            reported;      // Whether we've already printed a report (so we know to separate the next one)
+	pthread_mutex_t lock;          // Protects stderr & reported
+};
+
+struct kt_convert_job
+{
+	struct kt_convert_batch* batch;
+	const char*              in_name;
+	struct kt_convert_ctx    ctx;
+	bool                     fail;
+};
+
+// State shared by every package of a single scan invocation
+struct kt_scan_batch
+{
+	struct kt_scan_job* jobs;
+	unsigned int        num_jobs;
+	unsigned int        next;    // The next record to print, so that they come out in order
+	pthread_mutex_t     lock;    // Protects stdout, next & every job's done flag
+};
+
+struct kt_scan_job
+{
+	struct kt_scan_batch* batch;
+	char*                 in_name;
+	struct nettle_buffer  record;    // A single line of JSON
+	bool                  done;
+	bool                  fail;
+};
+
+// State shared by every package of a single verify invocation
+struct kt_verify_batch
+{
+	const struct rsa_public_key* rsa_pub;
+	struct kt_verify_job*        jobs;
+	unsigned int                 num_jobs;
+	unsigned int                 next;    // The next record to print, so that they come out in order
+	pthread_mutex_t              lock;    // Protects stdout, next & every job's done flag
+};
+
+struct kt_verify_job
+{
+	struct kt_verify_batch* batch;
+	char*                   in_name;
+	struct nettle_buffer    record;
+	bool                    done;
+	bool                    fail;
+};
+
+// A regular file found in the payload of a package we verify
+struct kt_verify_member
+{
+	char*          path;
+	char           md5[MD5_HASH_LENGTH + 1];
+	uint8_t        sha256[SHA256_DIGEST_SIZE];
+	bool           is_sig;
+	unsigned char* sig;    // The raw signature, if it's a sigfile of a sensible size
+	size_t         sig_size;
+	bool           has_sig;
+	bool           indexed;
+};
+
+// Streaming extraction state: the payload is demunged & hashed as libarchive reads it
+struct kt_extract_stream
+{
+	struct kt_input* input;
+	unsigned char*   buff;
+	bool             demunge;
+	bool             hash;
+	struct md5_ctx   md5;
+};
+
+// Parallel extraction state: entries are still read (and decompressed) by a single thread,
+// but regular files are written by a pool of writers, while directories are only fixed up once everything's in place.
+struct kt_extract_dir
+{
+	char*           path;
+	struct timespec times[2];
+};
+
+// The files that have been handed to a writer but aren't written yet, hashed by path
+#define KT_EXTRACT_PENDING_BUCKETS 1024U
+
+struct kt_extract_file;
+
+struct kt_extract_writer
+{
+	struct kt_pool*         pool;
+	pthread_mutex_t         lock;         // Protects in_flight, pending & fail
+	pthread_cond_t          drained;      // Signaled when a writer is done with its buffer
+	size_t                  in_flight;    // How much file data is waiting to be written
+	struct kt_extract_file* pending[KT_EXTRACT_PENDING_BUCKETS];
+	bool                    fail;
+	struct kt_extract_dir*  dirs;
+	size_t                  num_dirs;
+	size_t                  dirs_capacity;
+	char                    last_parent[PATH_MAX];    // The last directory we made sure existed
+};
+
+struct kt_extract_file
+{
+	struct kt_extract_writer* writer;
+	struct kt_extract_file*   next_pending;    // In the same pending bucket
+	uint32_t                  hash;            // Of path
+	char*                     path;
+	unsigned char*            data;
+	size_t                    size;
+	mode_t                    mode;
+	struct timespec           times[2];
+};
+
 static const char* convert_magic_number(const char*);
 
 static char* to_base(int64_t, uint8_t);
 
-static int kindle_read_bundle_header(UpdateHeader*, FILE*);
-static int kindle_convert(FILE*, FILE*, FILE*, const bool, const bool, FILE*, char*);
-static int kindle_convert_ota_update_v2(FILE*, FILE*, const bool, char*);
-static int kindle_convert_signature(UpdateHeader*, FILE*, FILE*);
-static int kindle_convert_ota_update(UpdateHeader*, FILE*, FILE*, const bool, char*);
-static int kindle_convert_recovery(UpdateHeader*, FILE*, FILE*, const bool, char*, const bool);
-static int kindle_convert_recovery_v2(FILE*, FILE*, const bool, char*);
+static int kindle_read_bundle_header(UpdateHeader*, struct kt_input*);
+static int kindle_convert(struct kt_convert_ctx*,
+			  struct kt_input*,
+			  FILE*,
+			  FILE*,
+			  const bool,
+			  const bool,
+			  FILE*,
+			  char*,
+			  BundleVersion*);
+static int kindle_convert_ota_update_v2(struct kt_convert_ctx*, struct kt_input*, FILE*, const bool, char*);
+static int kindle_convert_signature(struct kt_convert_ctx*, UpdateHeader*, struct kt_input*, FILE*);
+static int kindle_convert_ota_update(struct kt_convert_ctx*, UpdateHeader*, struct kt_input*, FILE*, const bool, char*);
+static int kindle_convert_recovery(struct kt_convert_ctx*, UpdateHeader*, struct kt_input*, FILE*, const bool, char*);
+static int kindle_convert_recovery_v2(struct kt_convert_ctx*, struct kt_input*, FILE*, const bool, char*);
+
+static void kindle_convert_separate(struct kt_convert_batch*);
+static void kindle_convert_flush(struct kt_convert_job*);
+static void kindle_convert_job(void*);
 
-static int libarchive_extract(const char*, const char*);
+static void kt_scan_printf(struct nettle_buffer*, const char*, ...) __attribute__((format(printf, 2, 3)));
+static void kt_scan_json_string(struct nettle_buffer*, const char*, size_t);
+static int  kt_scan_read(int, void*, size_t, off_t);
+static void kt_scan_device(struct nettle_buffer*, uint16_t, bool);
+static int  kindle_scan_package(int, struct nettle_buffer*, char*, size_t);
+static void kindle_scan_job(void*);
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static int kindle_scan_collect(const char*, char***, unsigned int*);
+#endif
+
+static bool kt_verify_signature(const struct rsa_public_key*, const uint8_t*, const unsigned char*, size_t);
+static void kt_verify_problem(struct nettle_buffer*, const char*, const char*);
+static bool kt_verify_is_index(const char*);
+static int  kt_verify_member_cmp(const void*, const void*);
+static int  kt_verify_member_key_cmp(const void*, const void*);
+static int  kindle_verify_read_member(struct archive*, struct kt_verify_member*, struct nettle_buffer*);
+static void kindle_verify_members(const struct rsa_public_key*,
+				  struct kt_verify_member*,
+				  size_t,
+				  struct nettle_buffer*,
+				  struct nettle_buffer*);
+static int  kindle_verify_package(const struct rsa_public_key*, const char*, struct nettle_buffer*, size_t*);
+static void kindle_verify_job(void*);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static void     extract_entry_times(struct archive_entry*, struct timespec*);
+static void     extract_make_parents(struct kt_extract_writer*, const char*);
+static int      extract_sync(const char*);
+static uint32_t extract_path_hash(const char*);
+static bool     extract_writer_is_pending(const struct kt_extract_writer*, const char*, uint32_t);
+static void     extract_writer_wait_path(struct kt_extract_writer*, const char*, uint32_t);
+static void     extract_writer_drop_pending(struct kt_extract_writer*, const struct kt_extract_file*);
+static void     extract_write_file(void*);
+static int      extract_writer_init(struct kt_extract_writer*, unsigned int);
+static int      extract_writer_dir(struct kt_extract_writer*, struct archive_entry*, const char*);
+static int      extract_writer_file(struct kt_extract_writer*, struct archive*, struct archive_entry*, const char*);
+static int      extract_writer_entry(struct kt_extract_writer*, struct archive*, struct archive_entry*, const char*, int);
+static int      extract_dir_cmp(const void*, const void*);
+static int      extract_writer_finish(struct kt_extract_writer*, bool, bool, const char*);
+#endif
+static int             libarchive_extract_entries(struct archive*, const char*, const struct kt_convert_ctx*);
+static struct archive* libarchive_extract_new(void);
+static int             libarchive_extract(const struct kt_convert_ctx*, FILE*, const char*);
+static void            extract_stream_process(struct kt_extract_stream*, size_t);
+static la_ssize_t      extract_stream_read(struct archive*, void*, const void**);
+static int             extract_stream_check(struct kt_extract_stream*, const char*);
+static int             kindle_list_package(struct kt_convert_ctx*, struct kt_input*, const bool, const char*);
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static int        remove_tree(const char*);
+static bool       can_stage_extract(const char*, bool*);
+static int        commit_stage_extract(const char*, const char*);
+static int        kindle_extract_stream(struct kt_convert_ctx*, struct kt_input*, const char*, const bool, const bool);
+#endif
+static int kindle_extract_package(struct kt_convert_ctx*, const char*, const char*, const bool);
 
 #endif
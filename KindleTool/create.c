@@ -42,8 +42,14 @@ static const char*
 	}
 }
 
-static struct rsa_private_key
-    get_default_key(void)
+// NOTE: Only parse it once (serve's workers inherit it that way, and library callers may race for it),
+//       and hand out copies, since callers clear theirs.
+static struct rsa_private_key default_pkey;
+static struct rsa_public_key  default_pubkey;    // The matching public key, for verify
+static pthread_once_t         default_pkey_once = PTHREAD_ONCE_INIT;
+
+static void
+    parse_default_key(void)
 {
 	// Make nettle happy... (Array created from the bin2h (grub2 has one) output of pkcs1-conv on our pem file)
 	static const uint8_t sign_key_sexp[] = {
@@ -89,27 +95,44 @@ static struct rsa_private_key
 		0x1a, 0x37, 0x26, 0xa6, 0xac, 0xda, 0xea, 0xd4, 0x6e, 0xb5, 0xac, 0x3c, 0xcc, 0x29, 0x29, 0x29
 	};
 
-	struct rsa_private_key rsa_pkey;
-	rsa_private_key_init(&rsa_pkey);
-
-	if (!rsa_keypair_from_sexp(NULL, &rsa_pkey, 0, sizeof(sign_key_sexp), sign_key_sexp)) {
+	rsa_public_key_init(&default_pubkey);
+	rsa_private_key_init(&default_pkey);
+	if (!rsa_keypair_from_sexp(&default_pubkey, &default_pkey, 0, sizeof(sign_key_sexp), sign_key_sexp)) {
 		fprintf(stderr, "Invalid default private key!\n");
 		// In the unlikely event this ever happens, it'll be caught later on in sign_file ;).
 	}
+}
+
+static struct rsa_private_key
+    get_default_key(void)
+{
+	struct rsa_private_key rsa_pkey;
+
+	pthread_once(&default_pkey_once, parse_default_key);
+	rsa_private_key_init(&rsa_pkey);
+	kt_rsa_private_key_copy(&rsa_pkey, &default_pkey);
 
 	return rsa_pkey;
 }
 
+// Copy the public half of our default key into an already initialized key
+void
+    kindle_create_default_pubkey(struct rsa_public_key* rsa_pub)
+{
+	pthread_once(&default_pkey_once, parse_default_key);
+	rsa_pub->size = default_pubkey.size;
+	mpz_set(rsa_pub->n, default_pubkey.n);
+	mpz_set(rsa_pub->e, default_pubkey.e);
+}
+
+// Sign a SHA-256 digest, and store the raw signature in raw_sig (which needs to be able to hold rsa_pkey->size bytes).
+// NOTE: This only ever reads from the key, so it's safe to call from multiple threads at once.
 static int
-    sign_file(FILE* in_file, const struct rsa_private_key* rsa_pkey, FILE* sigout_file)
+    sign_sha256_digest(const uint8_t* digest, const struct rsa_private_key* rsa_pkey, unsigned char* raw_sig)
 {
-	unsigned char     buffer[BUFFER_SIZE];
-	size_t            len;
-	struct sha256_ctx hash;
-	mpz_t             sig;
-	// NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway...
-	unsigned char raw_sig[CERTIFICATE_2K_SIZE];
-	size_t        siglen;
+	mpz_t    sig;
+	size_t   siglen;
+	uint64_t stats_start;
 
 	// Like we just said, handle 2K keys at most!
 	if (rsa_pkey->size > CERTIFICATE_2K_SIZE) {
@@ -117,20 +140,15 @@ static int
 		return -1;
 	}
 
-	sha256_init(&hash);
-	while ((len = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, in_file)) > 0) {
-		sha256_update(&hash, len, buffer);
-	}
-	if (ferror(in_file) != 0) {
-		fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
-		return -1;
-	}
 	mpz_init(sig);
-	if (!rsa_sha256_sign(rsa_pkey, &hash, sig)) {
+	stats_start = kt_stats_start();
+	if (!rsa_sha256_sign_digest(rsa_pkey, digest, sig)) {
 		fprintf(stderr, "RSA key is too small!\n");
 		mpz_clear(sig);
 		return -1;
 	}
+	kt_stats_stop(KT_STATS_SIGN, stats_start);
+	kt_stats_add(KT_STATS_RSA_OPS, 1U);
 
 	// NOTE: mpz_out_raw outputs a format that doesn't quite fit our needs (it prepends 4 bytes of size info)...
 	//       Do it ourselves with mpz_export! That's:
@@ -143,6 +161,37 @@ static int
 		return -1;
 	}
 
+	return 0;
+}
+
+static int
+    sign_file(FILE* in_file, const struct rsa_private_key* rsa_pkey, FILE* sigout_file)
+{
+	unsigned char        buffer[BUFFER_SIZE];
+	size_t               len;
+	struct kt_sha256_ctx hash;
+	uint8_t              digest[SHA256_DIGEST_SIZE];
+	// NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway...
+	unsigned char raw_sig[CERTIFICATE_2K_SIZE];
+	uint64_t      total       = 0U;
+	uint64_t      stats_start = kt_stats_start();
+
+	kt_sha256_init(&hash);
+	while ((len = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, in_file)) > 0) {
+		kt_sha256_update(&hash, len, buffer);
+		total += len;
+	}
+	kt_stats_add(KT_STATS_BYTES_READ, total);
+	kt_stats_stop(KT_STATS_HASH, stats_start);
+	if (ferror(in_file) != 0) {
+		fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
+		return -1;
+	}
+	kt_sha256_digest(&hash, digest);
+	if (sign_sha256_digest(digest, rsa_pkey, raw_sig) < 0) {
+		return -1;
+	}
+
 	// And finally, write our sig!
 	if (fwrite(raw_sig, sizeof(unsigned char), rsa_pkey->size, sigout_file) < rsa_pkey->size) {
 		fprintf(stderr, "Error writing signature file: %s.\n", strerror(errno));
@@ -152,71 +201,296 @@ static int
 	return 0;
 }
 
-// As usual, largely based on libarchive's doc, examples, and source ;)
+// Worker pool job, signs a single payload entry
+static void
+    sign_entry_job(void* data)
+{
+	struct kttar_sig* sig = data;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	if (sig->cache != NULL && sig_cache_lookup(sig->cache, sig)) {
+		sig->cached = true;
+		sig->status = 0;
+		return;
+	}
+#endif
+	sig->status = sign_sha256_digest(sig->digest, sig->rsa_pkey, sig->raw_sig);
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	if (sig->status == 0 && sig->cache != NULL) {
+		sig_cache_store(sig->cache, sig);
+	}
+#endif
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// Setup our signature cache in dir (which we'll create if need be), for signatures made with rsa_pkey.
+// The key is identified by a SHA-256 of its prime factors, so we can't ever hand out a signature made with another key.
 static int
-    metadata_filter(struct archive* a, void* _data __attribute__((unused)), struct archive_entry* entry)
+    sig_cache_init(struct kt_sig_cache*          cache,
+		   const char*                   dir,
+		   uint64_t                      max_size,
+		   const struct rsa_private_key* rsa_pkey)
+{
+	struct kt_sha256_ctx hash;
+	uint8_t              digest[SHA256_DIGEST_SIZE];
+	unsigned char        factor[CERTIFICATE_2K_SIZE];
+	size_t               len;
+	struct stat          st;
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create signature cache directory '%s': %s.\n", dir, strerror(errno));
+		return -1;
+	}
+	if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "Signature cache '%s' is not a directory.\n", dir);
+		return -1;
+	}
+	// NOTE: Both factors are half the size of the key, and sign_sha256_digest will reject keys > 2K anyway.
+	if (mpz_sizeinbase(rsa_pkey->p, 2) > CERTIFICATE_2K_SIZE * 8U ||
+	    mpz_sizeinbase(rsa_pkey->q, 2) > CERTIFICATE_2K_SIZE * 8U) {
+		fprintf(stderr, "RSA key is too large (2K at most)!\n");
+		return -1;
+	}
+
+	kt_sha256_init(&hash);
+	mpz_export(factor, &len, 1, sizeof(unsigned char), 1, 0, rsa_pkey->p);
+	kt_sha256_update(&hash, len, factor);
+	mpz_export(factor, &len, 1, sizeof(unsigned char), 1, 0, rsa_pkey->q);
+	kt_sha256_update(&hash, len, factor);
+	kt_sha256_digest(&hash, digest);
+	base16_encode_update(cache->key_id, KT_SIG_CACHE_KEY_ID_SIZE, digest);
+	cache->key_id[KT_SIG_CACHE_KEY_ID_SIZE * 2] = 0;
+	cache->dir                                   = dir;
+	cache->max_size                              = max_size;
+
+	return 0;
+}
+
+// Entries are named after the hex SHA-256 of the payload file, and the key's id (path needs to hold PATH_MAX bytes)
+static void
+    sig_cache_path(const struct kt_sig_cache* cache, const uint8_t* digest, char* path)
+{
+	char digest_hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+	base16_encode_update(digest_hex, SHA256_DIGEST_SIZE, digest);
+	digest_hex[SHA256_DIGEST_SIZE * 2] = 0;
+	snprintf(path, PATH_MAX, "%s/%s-%s", cache->dir, digest_hex, cache->key_id);
+}
+
+// Look sig up in the cache, and fill its raw_sig on a hit.
+// NOTE: Entries are never modified once they're in place, so anything that isn't exactly the right size,
+//       or that doesn't agree with the MD5 we just computed, is simply treated as a miss.
+static bool
+    sig_cache_lookup(const struct kt_sig_cache* cache, struct kttar_sig* sig)
+{
+	char          path[PATH_MAX];
+	unsigned char entry[KT_SIG_CACHE_HEADER_SIZE + CERTIFICATE_2K_SIZE + 1];
+	FILE*         entry_file;
+	size_t        len;
+
+	sig_cache_path(cache, sig->digest, path);
+	if ((entry_file = fopen(path, "rb")) == NULL) {
+		return false;
+	}
+	len = fread(entry, sizeof(unsigned char), sizeof(entry), entry_file);
+	fclose(entry_file);
+	if (len != KT_SIG_CACHE_HEADER_SIZE + sig->rsa_pkey->size ||
+	    memcmp(entry, KT_SIG_CACHE_MAGIC, KT_SIG_CACHE_MAGIC_LENGTH) != 0 ||
+	    memcmp(entry + KT_SIG_CACHE_MAGIC_LENGTH, sig->md5, MD5_HASH_LENGTH) != 0) {
+		return false;
+	}
+	memcpy(sig->raw_sig, entry + KT_SIG_CACHE_HEADER_SIZE, sig->rsa_pkey->size);
+	// Keep track of when it was last used, so we evict the stalest entries first
+	utime(path, NULL);
+
+	return true;
+}
+
+// Store a fresh signature in the cache. This is best effort, we simply skip it on failure.
+// NOTE: We write it to a tempfile first, and rename it in place,
+//       so that concurrent builds never get to see a partial entry.
+static void
+    sig_cache_store(const struct kt_sig_cache* cache, const struct kttar_sig* sig)
+{
+	char          path[PATH_MAX];
+	char          tmp_path[PATH_MAX];
+	unsigned char entry[KT_SIG_CACHE_HEADER_SIZE + CERTIFICATE_2K_SIZE];
+	size_t        len = KT_SIG_CACHE_HEADER_SIZE + sig->rsa_pkey->size;
+	int           fd;
+
+	memcpy(entry, KT_SIG_CACHE_MAGIC, KT_SIG_CACHE_MAGIC_LENGTH);
+	memcpy(entry + KT_SIG_CACHE_MAGIC_LENGTH, sig->md5, MD5_HASH_LENGTH);
+	memcpy(entry + KT_SIG_CACHE_HEADER_SIZE, sig->raw_sig, sig->rsa_pkey->size);
+
+	sig_cache_path(cache, sig->digest, path);
+	// NOTE: Tempfiles are hidden, that's how eviction tells them apart from actual entries
+	snprintf(tmp_path, PATH_MAX, "%s/.kindletool_sig_XXXXXX", cache->dir);
+	if ((fd = mkstemp(tmp_path)) == -1) {
+		return;
+	}
+	fchmod(fd, 0644);
+	if (kt_write_fd(fd, entry, len) != 0) {
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+	if (close(fd) != 0 || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+	}
+}
+
+static int
+    sig_cache_entry_cmp(const void* a, const void* b)
+{
+	const struct kt_sig_cache_entry* entry_a = a;
+	const struct kt_sig_cache_entry* entry_b = b;
+
+	return (entry_a->mtime > entry_b->mtime) - (entry_a->mtime < entry_b->mtime);
+}
+
+// Keep the cache under its size limit, by evicting the least recently used entries first.
+// NOTE: This is safe to run concurrently with other builds: an entry that's being read survives its unlinking,
+//       and at worst, two evictions running at the same time will both unlink the same entries.
+//       The limit only accounts for the actual size of the entries, not for the blocks they take on disk.
+static void
+    sig_cache_evict(const struct kt_sig_cache* cache)
+{
+	DIR*                       dir;
+	struct dirent*             dirent;
+	struct stat                st;
+	char                       path[PATH_MAX];
+	struct kt_sig_cache_entry* entries     = NULL;
+	struct kt_sig_cache_entry* grown;
+	size_t                     num_entries = 0U;
+	size_t                     i;
+	uint64_t                   total_size = 0U;
+	time_t                     now        = time(NULL);
+
+	if ((dir = opendir(cache->dir)) == NULL) {
+		return;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+			continue;
+		}
+		snprintf(path, PATH_MAX, "%s/%s", cache->dir, dirent->d_name);
+		if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		// Leftover tempfile from a build that died before it could store its entry, give those a day.
+		if (dirent->d_name[0] == '.') {
+			if (now - st.st_mtime > 24 * 60 * 60) {
+				unlink(path);
+			}
+			continue;
+		}
+		// NOTE: This is just housekeeping, if we run out of memory, we'll try again next time.
+		if ((grown = realloc(entries, (num_entries + 1U) * sizeof(*entries))) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for signature cache eviction, skipping it.\n");
+			closedir(dir);
+			goto cleanup;
+		}
+		entries = grown;
+		if ((entries[num_entries].name = strdup(dirent->d_name)) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for signature cache eviction, skipping it.\n");
+			closedir(dir);
+			goto cleanup;
+		}
+		entries[num_entries].mtime = st.st_mtime;
+		entries[num_entries].size  = st.st_size;
+		num_entries++;
+		total_size += (uint64_t) st.st_size;
+	}
+	closedir(dir);
+
+	if (total_size > cache->max_size) {
+		qsort(entries, num_entries, sizeof(*entries), sig_cache_entry_cmp);
+		for (i = 0U; i < num_entries && total_size > cache->max_size; i++) {
+			snprintf(path, PATH_MAX, "%s/%s", cache->dir, entries[i].name);
+			// NOTE: If it's already gone, someone else beat us to it, which is just as good.
+			unlink(path);
+			total_size -= (uint64_t) entries[i].size;
+		}
+	}
+
+cleanup:
+	for (i = 0U; i < num_entries; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
+#endif
+
+// Check an entry's pathname against our exclude list (sigfiles, bundlefiles & the like).
+// Returns 1 (and says so) if it should be left out, 0 if it's a nice, proper file, and -1 on error.
+static int
+    kttar_path_excluded(struct archive_entry* entry)
 {
 	struct archive* matching;
 	int             r;
 
+	matching = archive_match_new();
+	// Exclude *.sig files in a case insensitive way, to avoid duplicates
+	if (archive_match_exclude_pattern(matching, "./*\\.[Ss][Ii][Gg]$") != ARCHIVE_OK) {
+		fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+	}
+	// Exclude *.dat too, to avoid ending up with multiple bundlefiles!
+	// NOTE: If we wanted to be more lenient, we could exclude "./update*\\.[Dd][Aa][Tt]$" instead
+	if (archive_match_exclude_pattern(matching, "./*\\.[Dd][Aa][Tt]$") != ARCHIVE_OK) {
+		fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+	}
+	// Exclude *nix hidden files, too?
+	// NOTE: The ARCHIVE_READDISK_MAC_COPYFILE flag for read_disk is disabled by default,
+	//       so we should already be creating 'sane' archives on OS X, without the crazy ._* acl/xattr files ;)
+	//       On the other hand, if the user passed us a self-built tarball, we can't do anything about it.
+	//       OS X users: export COPYFILE_DISABLE=1 is your friend!
+	/*
+	if(archive_match_exclude_pattern(matching, "./\\.*$") != ARCHIVE_OK) {
+		fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+	}
+	*/
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	// NOTE: Exclude our own tempfiles, since we may create them in PWD, because otherwise,
+	//       depending on what the user uses as input (i.e., * or .), we might inadvertently snarf them up.
+	//       Right now, the only one susceptible of being part of our directory walking
+	//       is our own tarball temporary file...
+	if (archive_match_exclude_pattern(matching, "^kindletool_create_tarball_*") != ARCHIVE_OK) {
+		fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+	}
+#endif
+
+	r = archive_match_path_excluded(matching, entry);
+	if (r < 0) {
+		fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(matching));
+		archive_match_free(matching);
+		return -1;
+	}
+	if (r) {
+		// Skip original bundle/sig files to avoid duplicates
+		fprintf(stderr, "! %s\n", archive_entry_pathname(entry));
+	}
+	archive_match_free(matching);
+	return r ? 1 : 0;
+}
+
+// As usual, largely based on libarchive's doc, examples, and source ;)
+static int
+    metadata_filter(struct archive* a, void* _data __attribute__((unused)), struct archive_entry* entry)
+{
 	// Don't exclude directories!
 	if (archive_read_disk_can_descend(a)) {
 		// It's a directory, don't even try to perform pattern matching, just walk it
 		archive_read_disk_descend(a);
 		return 1;
 	} else {
-		// Exclude *.sig files in a case insensitive way, to avoid duplicates
-		matching = archive_match_new();
-		if (archive_match_exclude_pattern(matching, "./*\\.[Ss][Ii][Gg]$") != ARCHIVE_OK) {
-			fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-		}
-		// Exclude *.dat too, to avoid ending up with multiple bundlefiles!
-		// NOTE: If we wanted to be more lenient, we could exclude "./update*\\.[Dd][Aa][Tt]$" instead
-		if (archive_match_exclude_pattern(matching, "./*\\.[Dd][Aa][Tt]$") != ARCHIVE_OK) {
-			fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-		}
-		// Exclude *nix hidden files, too?
-		// NOTE: The ARCHIVE_READDISK_MAC_COPYFILE flag for read_disk is disabled by default,
-		//       so we should already be creating 'sane' archives on OS X, without the crazy ._* acl/xattr files ;)
-		//       On the other hand, if the user passed us a self-built tarball, we can't do anything about it.
-		//       OS X users: export COPYFILE_DISABLE=1 is your friend!
-		/*
-		if(archive_match_exclude_pattern(matching, "./\\.*$") != ARCHIVE_OK) {
-			fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-		}
-		*/
-#if defined(_WIN32) && !defined(__CYGWIN__)
-		// NOTE: Exclude our own tempfiles, since we may create them in PWD, because otherwise,
-		//       depending on what the user uses as input (i.e., * or .), we might inadvertently snarf them up.
-		//       Right now, the only one susceptible of being part of our directory walking
-		//       is our own tarball temporary file...
-		if (archive_match_exclude_pattern(matching, "^kindletool_create_tarball_*") != ARCHIVE_OK) {
-			fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-		}
-#endif
-
-		r = archive_match_path_excluded(matching, entry);
-		if (r < 0) {
-			fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(matching));
-			archive_match_free(matching);
-			return 0;
-		}
-		if (r) {
-			// Skip original bundle/sig files to avoid duplicates
-			fprintf(stderr, "! %s\n", archive_entry_pathname(entry));
-			archive_match_free(matching);
-			return 0;
-		} else {
-			// We're a nice, proper file, carry on ;)
-			archive_match_free(matching);
-			return 1;
-		}
+		// We're a nice, proper file if we're not on the exclude list, carry on ;)
+		return kttar_path_excluded(entry) == 0;
 	}
 }
 
 // Write a single file (or directory or other filesystem object) to the archive [from libarchive's tar/write.c].
 static int
-    write_file(const struct kttar* kttar, struct archive* a, struct archive* in_a, struct archive_entry* entry)
+    write_file(struct kttar* kttar, struct archive* a, struct archive* in_a, struct archive_entry* entry)
 {
 	if (write_entry(kttar, a, in_a, entry) != 0) {
 		return 1;
@@ -226,7 +500,7 @@ static int
 
 // Write a single entry to the archive [from libarchive's tar/write.c].
 static int
-    write_entry(const struct kttar* kttar, struct archive* a, struct archive* in_a, struct archive_entry* entry)
+    write_entry(struct kttar* kttar, struct archive* a, struct archive* in_a, struct archive_entry* entry)
 {
 	int e;
 
@@ -253,7 +527,7 @@ static int
 
 // Helper function to copy file to archive [from libarchive's tar/write.c].
 static int
-    copy_file_data_block(const struct kttar* kttar, struct archive* a, struct archive* in_a, struct archive_entry* entry)
+    copy_file_data_block(struct kttar* kttar, struct archive* a, struct archive* in_a, struct archive_entry* entry)
 {
 	size_t         bytes_read;
 	ssize_t        bytes_written;
@@ -263,6 +537,7 @@ static int
 	int            r;
 
 	while ((r = archive_read_data_block(in_a, &buff, &bytes_read, &offset)) == ARCHIVE_OK) {
+		kt_stats_add(KT_STATS_BYTES_READ, bytes_read);
 		if (offset > progress) {
 			int64_t sparse = offset - progress;
 			size_t  ns;
@@ -279,6 +554,10 @@ static int
 					ns = (size_t) sparse;
 				}
 				bytes_written = archive_write_data(a, null_buff, ns);
+				if (bytes_written > 0 && kttar->hash_entry &&
+				    kttar_hash_data(kttar, null_buff, (size_t) bytes_written) != 0) {
+					return -1;
+				}
 				if (bytes_written < 0) {
 					// Write failed; this is bad
 					fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
@@ -297,6 +576,10 @@ static int
 		}
 
 		bytes_written = archive_write_data(a, buff, bytes_read);
+		// Feed what we just archived to the hashes we need for the index & the sigfile, while we have it at hand
+		if (bytes_written > 0 && kttar->hash_entry && kttar_hash_data(kttar, buff, (size_t) bytes_written) != 0) {
+			return -1;
+		}
 		if (bytes_written < 0) {
 			// Write failed; this is bad
 			fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
@@ -318,1065 +601,3538 @@ static int
 	return 0;
 }
 
-// Helper function to populate & write entries from a read_disk_open loop, tailored to our needs.
-// Helps avoid code duplication, since we're doing this in two passes.
+// Write a file we built in memory (i.e., a sigfile or the bundle index) to the archive,
+// with the same metadata we'd have given it if we had picked it up from the disk.
 static int
-    create_from_archive_read_disk(struct kttar*      kttar,
-				  struct archive*    a,
-				  const char*        input_filename,
-				  bool               first_pass,
-				  const char*        signame,
-				  const unsigned int real_blocksize)
+    write_memory_entry(struct archive* a, const char* pathname, const void* data, size_t size, mode_t perm)
 {
-	int   r;
-	bool  is_exec       = false;
-	bool  is_kernel     = false;
-	char* original_path = NULL;
-	char* tweaked_path  = NULL;
-
-	struct archive*       disk;
 	struct archive_entry* entry;
+	ssize_t               bytes_written;
+	int                   e;
 
-	disk  = archive_read_disk_new();
 	entry = archive_entry_new();
+	archive_entry_copy_pathname(entry, pathname);
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, perm);
+	archive_entry_set_uid(entry, 0);
+	archive_entry_set_uname(entry, "root");
+	archive_entry_set_gid(entry, 0);
+	archive_entry_set_gname(entry, "root");
+	archive_entry_set_mtime(entry, time(NULL), 0);
+	archive_entry_set_size(entry, (int64_t) size);
+
+	// Print what we're adding, ala bsdtar
+	fprintf(stderr, "a %s\n", pathname);
 
-	if (first_pass) {
-		// Perform pattern matching in a metadata filter to apply our exclude list to reguar files.
-		// NOTE: We're not using archive_read_disk_set_matching anymore
-		//       because it does *pattern* matching too early to determine if we're a directory...
-		archive_read_disk_set_metadata_filter_callback(disk, metadata_filter, NULL);
+	e = archive_write_header(a, entry);
+	if (e != ARCHIVE_OK) {
+		fprintf(stderr, "archive_write_header() failed: %s.\n", archive_error_string(a));
 	}
-	archive_read_disk_set_standard_lookup(disk);
-
-	r = archive_read_disk_open(disk, input_filename);
-	if (r != ARCHIVE_OK) {
-		fprintf(stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
-		archive_read_free(disk);
+	if (e == ARCHIVE_FATAL) {
 		archive_entry_free(entry);
 		return 1;
 	}
 
-	for (;;) {
-		archive_entry_clear(entry);
-		r = archive_read_next_header2(disk, entry);
-		if (r == ARCHIVE_EOF) {
-			break;
-		} else if (r != ARCHIVE_OK) {
-			fprintf(stderr, "archive_read_next_header2() failed: %s", archive_error_string(disk));
-			if (r == ARCHIVE_FATAL) {
-				fprintf(stderr, " (FATAL).\n");
-				goto cleanup;
-			} else if (r < ARCHIVE_WARN) {
-				fprintf(stderr, " (FAILED).\n");
-				// NOTE: We don't want to end up with an incomplete archive, abort.
-				goto cleanup;
-			}
-		}
-
-		if (!first_pass) {
-			// Fix the entry pathname, we used a tempfile...
-			// (if we're in legacy mode, signame has already been set to the tweaked path ;))
-			archive_entry_copy_pathname(entry, signame);
-		} else {
-			// Tweak the pathname if we were asked to behave like Yifan's KindleTool...
-			if (kttar->tweak_pointer_index != 0) {
-				// Handle the 'root' source directory itself..
-				// NOTE: We check that strlen <= pointer_index
-				//       because libarchive strips trailing path separators in the entry pathname,
-				//       but we might have passed one on the CL,
-				//       so pointer_index might be larger than strlen ;)
-				if (archive_entry_filetype(entry) == AE_IFDIR &&
-				    // Flawfinder: ignore
-				    strlen(archive_entry_pathname(entry)) <= kttar->tweak_pointer_index) {
-					// Print what we're stripping, ala GNU tar...
-					fprintf(stderr,
-						"kindletool: Removing leading '%s/' from member names.\n",
-						archive_entry_pathname(entry));
-					// Just skip it, we don't need a redundant and explicit root directory entry in our tarball...
-					archive_read_disk_descend(disk);
-					continue;
-				} else {
-					original_path = strdup(archive_entry_pathname(entry));
-					// Try to handle a trailing path separator properly...
-					// NOTE: This probably isn't very robust.
-					//       Also, no need to handle MinGW,
-					//       it already spectacularly fails to handle this case ^^
-					if (original_path[kttar->tweak_pointer_index] == '/') {
-						// We found a path separator, skip it, too
-						tweaked_path = original_path + (kttar->tweak_pointer_index + 1);
-					} else {
-						tweaked_path = original_path + kttar->tweak_pointer_index;
-					}
-					archive_entry_copy_pathname(entry, tweaked_path);
-				}
-			}
+	if (e >= ARCHIVE_WARN && size > 0) {
+		bytes_written = archive_write_data(a, data, size);
+		if (bytes_written < 0 || (size_t) bytes_written < size) {
+			fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
+			archive_entry_free(entry);
+			return 1;
 		}
+	}
 
-		// And then override a bunch of stuff (namely, uid/gid/chmod)
-		archive_entry_set_uid(entry, 0);
-		archive_entry_set_uname(entry, "root");
-		archive_entry_set_gid(entry, 0);
-		archive_entry_set_gname(entry, "root");
-
-		if (first_pass) {
-			// If we have a regular file, and it's a script, make it executable (probably overkill, but hey :))
-			if (archive_entry_filetype(entry) == AE_IFREG &&
-			    (IS_SCRIPT(archive_entry_pathname(entry)) || IS_SHELL(archive_entry_pathname(entry)))) {
-				archive_entry_set_perm(entry, 0755);
-				// It's a script, keep track of it
-				is_exec           = true;
-				kttar->has_script = is_exec;
-				is_kernel         = false;
-			}
-			// If we have a regular file, and it's a kernel, and we're a recovery update, keep track of it
-			else if (archive_entry_filetype(entry) == AE_IFREG && real_blocksize == RECOVERY_BLOCK_SIZE &&
-				 IS_UIMAGE(archive_entry_pathname(entry))) {
-				archive_entry_set_perm(entry, 0644);
-				is_exec = false;
-				// It's a kernel, keep track of it
-				is_kernel = true;
-			}
-			// If we have a directory, make it searchable...
-			else if (archive_entry_filetype(entry) == AE_IFDIR) {
-				archive_entry_set_perm(entry, 0755);
-				is_exec   = false;
-				is_kernel = false;
-			} else {
-				archive_entry_set_perm(entry, 0644);
-				is_exec   = false;
-				is_kernel = false;
-			}
+	archive_entry_free(entry);
+	return 0;
+}
 
-			// Non-regular files get archived with zero size.
-			if (archive_entry_filetype(entry) != AE_IFREG) {
-				archive_entry_set_size(entry, 0);
-			}
-		} else {
-			archive_entry_set_perm(entry, 0644);
-		}
+// Write an unchanged file to the archive, with the data we stashed from the previous build instead of the file's.
+static int
+    write_previous_entry(struct kttar*               kttar,
+			 struct archive*             a,
+			 const struct kt_prev_entry* prev_entry,
+			 struct archive_entry*       entry)
+{
+	int64_t remaining;
+	size_t  len;
+	ssize_t bytes_written;
+	int     e;
 
-		archive_read_disk_descend(disk);
-		// Print what we're adding, ala bsdtar
-		fprintf(stderr,
-			"a %s%s\n",
-			archive_entry_pathname(entry),
-			(is_kernel ? "\t\t|<" : (is_exec ? "\t\t<-" : "")));
+	e = archive_write_header(a, entry);
+	if (e != ARCHIVE_OK) {
+		fprintf(stderr, "archive_write_header() failed: %s.\n", archive_error_string(a));
+	}
+	if (e == ARCHIVE_FATAL) {
+		return 1;
+	}
+	if (e < ARCHIVE_WARN || archive_entry_size(entry) <= 0) {
+		return 0;
+	}
 
-		// Write our entry to the archive, completely via libarchive,
-		// to avoid having to open our entry file again, which would fail on non-POSIX systems...
-		if (write_file(kttar, a, disk, entry) != 0) {
-			goto cleanup;
+	if (fseeko(kttar->prev->payload, prev_entry->data_offset, SEEK_SET) != 0) {
+		fprintf(stderr, "Cannot seek in the previous build's payload: %s.\n", strerror(errno));
+		return 1;
+	}
+	for (remaining = archive_entry_size(entry); remaining > 0; remaining -= (int64_t) len) {
+		len = remaining > (int64_t) kttar->buff_size ? kttar->buff_size : (size_t) remaining;
+		if (fread(kttar->buff, sizeof(unsigned char), len, kttar->prev->payload) < len) {
+			fprintf(stderr, "Cannot read '%s' back from the previous build.\n", prev_entry->pathname);
+			return 1;
 		}
-
-		if (first_pass) {
-			// If we just added a regular file, hash it, sign it, add it to the index, and put the sig in our tarball
-			if (archive_entry_filetype(entry) == AE_IFREG) {
-				// But just build a filelist for now, and do it later,
-				// I'm not up to refactoring sign_file & md5_sum to be useable during copy_file_data_block...
-				// We can't just do it now with the current sign_file & md5_sum implementation
-				// because we'd need to open() the input file (to sign & hash it),
-				// while it's already open through libarchive's read_disk API.
-				// That's apparently not possible on non POSIX systems.
-				// (You get a very helpful 'Permission denied' error on Windows...)
-				kttar->to_sign_and_bundle_list = realloc(kttar->to_sign_and_bundle_list,
-									 ++kttar->sign_and_bundle_index * sizeof(char*));
-				// And do the same with our tweaked pathname for legacy mode...
-				kttar->tweaked_to_sign_and_bundle_list = realloc(
-				    kttar->tweaked_to_sign_and_bundle_list, kttar->sign_and_bundle_index * sizeof(char*));
-				// Use the correct paths if we tweaked the entry pathname...
-				if (kttar->tweak_pointer_index != 0) {
-					kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] =
-					    strdup(original_path);
-					kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] =
-					    strdup(tweaked_path);
-				} else {
-					kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] =
-					    strdup(archive_entry_pathname(entry));
-					kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] =
-					    strdup(archive_entry_pathname(entry));
-				}
-			}
-		} else {
-			// Delete the file once we're done, be it a signature or the bundlefile
-			unlink(input_filename);
+		bytes_written = archive_write_data(a, kttar->buff, len);
+		if (bytes_written < 0 || (size_t) bytes_written < len) {
+			fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
+			return 1;
 		}
-		free(original_path);
-		tweaked_path = NULL;
 	}
-
-	archive_read_close(disk);
-	archive_read_free(disk);
-	archive_entry_free(entry);
-
 	return 0;
+}
 
-cleanup:
-	free(original_path);
-	tweaked_path = NULL;
-	archive_read_close(disk);
-	archive_read_free(disk);
-	archive_entry_free(entry);
+// Helper function to populate & write entries from a read_disk_open loop, tailored to our needs.
+static int
+    kt_prev_entry_cmp(const void* a, const void* b)
+{
+	const struct kt_prev_entry* entry_a = a;
+	const struct kt_prev_entry* entry_b = b;
 
-	return 1;
+	return strcmp(entry_a->pathname, entry_b->pathname);
 }
 
-// Archiving code inspired from libarchive tar/write.c ;).
 static int
-    kindle_create_package_archive(const int                     outfd,
-				  char**                        filename,
-				  const unsigned int            total_files,
-				  const struct rsa_private_key* rsa_pkey_file,
-				  const unsigned int            legacy,
-				  const unsigned int            real_blocksize)
+    kt_prev_entry_key_cmp(const void* key, const void* b)
 {
-	struct archive* a;
-	struct kttar *  kttar, kttar_storage;
-	unsigned int    i;
-	FILE*           file;
-	FILE*           sigfile;
-	char            md5[MD5_HASH_LENGTH + 1];
-	uint8_t         bundlefile_status = 0;
-	size_t          pathlen;
-	char*           signame = NULL;
-	char            sigabsolutepath[PATH_MAX];
-	snprintf(sigabsolutepath, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_create_sig_XXXXXX");
-	int   sigfd;
-	char* pathnamecpy = NULL;
-	char  bundle_filename[PATH_MAX];
-	snprintf(bundle_filename, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_create_idx_XXXXXX");
-	int         bundle_fd  = -1;
-	FILE*       bundlefile = NULL;
-	struct stat st;
+	const struct kt_prev_entry* entry = b;
 
-	// Use a pointer for consistency, but stack-allocated storage for ease of cleanup.
-	kttar = &kttar_storage;
-	memset(kttar, 0, sizeof(*kttar));
-	// Choose a suitable copy buffer size
-	kttar->buff_size = 64 * 1024;
-	while (kttar->buff_size < (size_t) DEFAULT_BYTES_PER_BLOCK) {
-		kttar->buff_size *= 2;
-	}
-	// Try to compensate for space we'll lose to alignment.
-	kttar->buff_size += 16 * 1024;
+	return strcmp(key, entry->pathname);
+}
 
-	// Allocate a buffer for file data.
-	if ((kttar->buff = malloc(kttar->buff_size)) == NULL) {
-		fprintf(stderr, "Cannot allocate memory for archive copy buffer.\n");
-		return 1;
+// Look for an unchanged copy of entry in the previous build
+static struct kt_prev_entry*
+    kindle_create_find_previous(const struct kt_prev_build* prev, struct archive_entry* entry)
+{
+	struct kt_prev_entry* prev_entry;
+
+	prev_entry = bsearch(archive_entry_pathname(entry),
+			     prev->entries,
+			     prev->num_entries,
+			     sizeof(*prev->entries),
+			     kt_prev_entry_key_cmp);
+	// NOTE: Like make, we trust the mtime: that's the whole point, we don't even read the file.
+	//       We need both a signature & an index entry to reuse anything, though.
+	if (prev_entry == NULL || prev_entry->size != archive_entry_size(entry) ||
+	    prev_entry->mtime != archive_entry_mtime(entry) || !prev_entry->has_sig || prev_entry->md5[0] == '\0') {
+		return NULL;
 	}
+	return prev_entry;
+}
 
-	a = archive_write_new();
-	archive_write_add_filter_gzip(a);
-	archive_write_set_format_gnutar(a);
+// Read the data of the current archive member in a NUL-terminated buffer
+static unsigned char*
+    kindle_create_read_member(struct archive* a, struct archive_entry* entry, size_t* len)
+{
+	unsigned char* data;
+	la_ssize_t     bytes_read;
+	size_t         size;
 
-	// These should be the default (cf. archive_write_new @ libarchive/archive_write.c), but reset them to be on the safe side...
-	archive_write_set_bytes_per_block(a, DEFAULT_BYTES_PER_BLOCK);
-	archive_write_set_bytes_in_last_block(a, -1);
+	if (archive_entry_size(entry) < 0) {
+		return NULL;
+	}
+	size = (size_t) archive_entry_size(entry);
+	if ((data = malloc(size + 1U)) == NULL) {
+		return NULL;
+	}
+	*len = 0U;
+	while (*len < size && (bytes_read = archive_read_data(a, data + *len, size - *len)) > 0) {
+		*len += (size_t) bytes_read;
+	}
+	if (*len != size) {
+		free(data);
+		return NULL;
+	}
+	data[size] = '\0';
+	return data;
+}
 
-	archive_write_open_fd(a, outfd);
+// Append the data of the current archive member to payload, and tell where it starts
+static int
+    kindle_create_stash_member(struct archive* a, FILE* payload, unsigned char* buff, off_t* offset)
+{
+	la_ssize_t len;
 
-	// Loop over our input files/directories...
-	for (i = 0; i < total_files; i++) {
-		// Don't tweak entries pathname by default
-		kttar->tweak_pointer_index = 0;
-		// Check if we want to behave like Yifan's KindleTool
-		if (legacy) {
-			if (stat(filename[i], &st) == 0) {
-				if (S_ISDIR(st.st_mode)) {
-					kttar->tweak_pointer_index = strlen(filename[i]);    // Flawfinder: ignore
-				}
-			}
+	if ((*offset = ftello(payload)) < 0) {
+		return -1;
+	}
+	while ((len = archive_read_data(a, buff, MUNGE_BUFFER_SIZE)) > 0) {
+		if (fwrite(buff, sizeof(unsigned char), (size_t) len, payload) < (size_t) len) {
+			return -1;
 		}
+	}
+	return len < 0 ? -1 : 0;
+}
 
-		// Populate & write our entries from read_disk_open's directory walking...
-		if (create_from_archive_read_disk(kttar, a, filename[i], true, NULL, real_blocksize) != 0) {
-			goto cleanup;
+// Gather what we need to reuse the unchanged files of a previous build (either a package, or its intermediate tarball):
+// their size & mtime, their data, their MD5 from the bundle index, and their signature.
+// If it wasn't signed with the same key, we can't reuse anything, and we just warn about it.
+// NOTE: Once its index signature checks out with our own key, we trust it like any of our own builds,
+//       we don't check its payload against its index (the device will, anyway).
+static int
+    kindle_create_load_previous(const char*                   filename,
+				const struct rsa_private_key* rsa_pkey,
+				const bool                    fake_sign,
+				struct kt_prev_build*         prev)
+{
+	FILE*                 tgz_input;
+	FILE*                 bin_input;
+	struct archive*       a;
+	struct archive_entry* entry;
+	struct kt_prev_build  sigs = { 0 };
+	struct kt_prev_entry* prev_entry;
+	struct kt_prev_entry* entries;
+	unsigned char*        buff       = NULL;
+	unsigned char*        data       = NULL;
+	unsigned char*        index      = NULL;
+	size_t                index_size = 0U;
+	unsigned char         index_sig[CERTIFICATE_2K_SIZE];
+	bool                  has_index_sig = false;
+	unsigned char         raw_sig[CERTIFICATE_2K_SIZE];
+	struct kt_sha256_ctx  hash;
+	uint8_t               digest[SHA256_DIGEST_SIZE];
+	const char*           pathname;
+	size_t                len;
+	size_t                i;
+	char*                 line;
+	char*                 next_line;
+	char*                 line_path;
+	char                  md5[MD5_HASH_LENGTH + 1];
+	int                   offset;
+	int                   r;
+	int                   ret = -1;
+
+	memset(prev, 0, sizeof(*prev));
+	if (IS_BIN(filename)) {
+		if ((bin_input = fopen(filename, "rb")) == NULL) {
+			fprintf(stderr, "Cannot open previous build '%s': %s.\n", filename, strerror(errno));
+			return -1;
+		}
+		if ((tgz_input = kt_tmpfile()) == NULL) {
+			fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+			fclose(bin_input);
+			return -1;
 		}
+		if (kindle_convert_payload(bin_input, tgz_input, NULL, fake_sign) != 0) {
+			fprintf(stderr, "Cannot convert previous build '%s'.\n", filename);
+			fclose(bin_input);
+			fclose(tgz_input);
+			return -1;
+		}
+		fclose(bin_input);
+	} else if ((tgz_input = fopen(filename, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open previous build '%s': %s.\n", filename, strerror(errno));
+		return -1;
 	}
 
-	// Add our bundle index to the end of the list...
-	// And we'll be creating it in a tempfile, to add to the fun...
-	bundle_fd = mkstemp(bundle_filename);
-	if (bundle_fd == -1) {
-		fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+	a = archive_read_new();
+	archive_read_support_format_tar(a);
+	archive_read_support_format_gnutar(a);
+	archive_read_support_filter_gzip(a);
+	if (archive_read_open_FILE(a, tgz_input) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_read_open_FILE() failure: %s.\n", archive_error_string(a));
 		goto cleanup;
 	}
-	if ((bundlefile = fdopen(bundle_fd, "w+b")) == NULL) {
-		fprintf(stderr, "Cannot open temp bundlefile '%s' for writing: %s.\n", bundle_filename, strerror(errno));
-		close(bundle_fd);
-		unlink(bundle_filename);
+	// We'll need the payload's data later, and we'll have read it all anyway by the time we get to the index
+	if ((buff = malloc(MUNGE_BUFFER_SIZE)) == NULL || (prev->payload = kt_tmpfile()) == NULL) {
+		fprintf(stderr, "Cannot stash the payload of previous build '%s': %s.\n", filename, strerror(errno));
 		goto cleanup;
 	}
-	// Now that it's there, mark it as open and created
-	bundlefile_status = BUNDLE_OPEN | BUNDLE_CREATED;
-	// And append it as the last file...
-	kttar->to_sign_and_bundle_list =
-	    realloc(kttar->to_sign_and_bundle_list, ++kttar->sign_and_bundle_index * sizeof(char*));
-	kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(bundle_filename);
-	// We'll never tweak the bundlefile pathname, but we rely on this being sane & consistent, so set it
-	kttar->tweaked_to_sign_and_bundle_list =
-	    realloc(kttar->tweaked_to_sign_and_bundle_list, kttar->sign_and_bundle_index * sizeof(char*));
-	kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(bundle_filename);
-
-	// And now loop again over the stuff we need to sign, hash & bundle...
-	for (i = 0; i <= kttar->sign_and_bundle_index; i++) {
-		// Dirty hack ahoy. If we're the last file in our list, that means we're the bundlefile, close our fd
-		if (i == kttar->sign_and_bundle_index - 1) {
-			fclose(bundlefile);
-			// It's closed, remove our flag
-			bundlefile_status &= (uint8_t) ~BUNDLE_OPEN;
-		}
-
-		// Dirty hack, the return. We loop twice on the bundlefile, once to sign it, and once to archive it...
-		if (i == kttar->sign_and_bundle_index) {
-			// It's the second time we're looping over the bundlefile, just archive it
-			// Just set the correct pathnames...
-			signame = strdup(INDEX_FILE_NAME);
-			// NOTE: Fragile, sigabsolutepath & bundle_filename need to be of the same length...
-			//       Slightly less of a concern now that both are using PATH_MAX, but, still...
-			strcpy(sigabsolutepath, bundle_filename);
-		} else {
-			// First things first, if we're not the bundlefile,
-			// we're gonna need our size for a field of the bundlefile, so get on that...
-			if ((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN) {
-				// We're out of a libarchive read loop, so do a stat call ourselves
-				stat(kttar->to_sign_and_bundle_list[i], &st);
-			}
-
-			// Go on as usual, hash, sign & bundle :)
-			if ((file = fopen(kttar->to_sign_and_bundle_list[i], "rb")) == NULL) {
-				fprintf(stderr,
-					"Cannot open '%s' for reading: %s!\n",
-					kttar->to_sign_and_bundle_list[i],
-					strerror(errno));
-				// Avoid a double free (beginning from the second iteration,
-				// since we freed signame at the end of the first iteration,
-				// but it's not allocated yet, and cleanup will try to free...)
-				signame = NULL;
+	while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+		if (archive_entry_filetype(entry) != AE_IFREG) {
+			continue;
+		}
+		pathname = archive_entry_pathname(entry);
+		if (strcmp(pathname, INDEX_FILE_NAME) == 0) {
+			free(index);
+			if ((index = kindle_create_read_member(a, entry, &index_size)) == NULL) {
+				fprintf(stderr, "Cannot read '%s' from previous build '%s'.\n", pathname, filename);
 				goto cleanup;
 			}
-			// Don't hash our bundlefile
-			if ((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN) {
-				if (md5_sum(file, md5) != 0) {
-					fprintf(stderr,
-						"Cannot calculate hash sum for '%s'.\n",
-						kttar->to_sign_and_bundle_list[i]);
-					fclose(file);
-					// Avoid a double free, bis.
-					signame = NULL;
-					goto cleanup;
-				}
-				md5[MD5_HASH_LENGTH] = 0;
-				rewind(file);
+		} else if (IS_SIG(pathname)) {
+			// We only care about signatures made with a key of the right size
+			if (archive_entry_size(entry) != (int64_t) rsa_pkey->size) {
+				continue;
 			}
-
-			// If we're the bundlefile, fix the relative path to not use the tempfile path...
-			if ((bundlefile_status & BUNDLE_OPEN) != BUNDLE_OPEN) {
-				pathlen = strlen(INDEX_FILE_NAME);    // Flawfinder: ignore
-				signame = malloc(pathlen + 4 + 1);
-				snprintf(signame, pathlen + 4 + 1, "%s.%s", INDEX_FILE_NAME, "sig");
+			if ((data = kindle_create_read_member(a, entry, &len)) == NULL) {
+				fprintf(stderr, "Cannot read '%s' from previous build '%s'.\n", pathname, filename);
+				goto cleanup;
+			}
+			if (strcmp(pathname, INDEX_FILE_NAME ".sig") == 0) {
+				memcpy(index_sig, data, len);
+				has_index_sig = true;
 			} else {
-				// Always use the tweaked paths
-				// (they're properly set to the real path when we're not in legacy mode)
-				pathlen = strlen(kttar->tweaked_to_sign_and_bundle_list[i]);    // Flawfinder: ignore
-				signame = malloc(pathlen + 4 + 1);
-				snprintf(
-				    signame, pathlen + 4 + 1, "%s.%s", kttar->tweaked_to_sign_and_bundle_list[i], "sig");
-			}
-			// Create our sigfile in a tempfile
-			// We have to make sure mkstemp's template is reset first...
-			snprintf(sigabsolutepath, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_create_sig_XXXXXX");
-			sigfd = mkstemp(sigabsolutepath);
-			if (sigfd == -1) {
-				fprintf(stderr, "Couldn't open temporary signature file: %s.\n", strerror(errno));
-				fclose(file);
+				sigs.entries = realloc(sigs.entries, (sigs.num_entries + 1U) * sizeof(*sigs.entries));
+				prev_entry   = &sigs.entries[sigs.num_entries++];
+				memset(prev_entry, 0, sizeof(*prev_entry));
+				// Strip the .sig suffix
+				prev_entry->pathname = strdup(pathname);
+				// Flawfinder: ignore
+				prev_entry->pathname[strlen(pathname) - 4U] = '\0';
+				memcpy(prev_entry->raw_sig, data, len);
+				prev_entry->has_sig = true;
+			}
+			free(data);
+			data = NULL;
+		} else {
+			entries = realloc(prev->entries, (prev->num_entries + 1U) * sizeof(*prev->entries));
+			if (entries == NULL) {
+				fprintf(stderr, "Cannot allocate memory for the previous build's entries.\n");
 				goto cleanup;
 			}
-			if ((sigfile = fdopen(sigfd, "wb")) == NULL) {
-				fprintf(stderr,
-					"Cannot open temp signature file '%s' for writing: %s.\n",
-					signame,
-					strerror(errno));
-				fclose(file);
-				close(sigfd);
-				unlink(sigabsolutepath);
+			prev->entries = entries;
+			prev_entry    = &prev->entries[prev->num_entries];
+			memset(prev_entry, 0, sizeof(*prev_entry));
+			if ((prev_entry->pathname = strdup(pathname)) == NULL) {
+				fprintf(stderr, "Cannot allocate memory for the previous build's entries.\n");
 				goto cleanup;
 			}
-			if (sign_file(file, rsa_pkey_file, sigfile) < 0) {
-				fprintf(stderr, "Cannot sign '%s'.\n", kttar->to_sign_and_bundle_list[i]);
-				fclose(file);
-				fclose(sigfile);
-				unlink(sigabsolutepath);    // Delete empty/broken sigfile
+			prev->num_entries++;
+			prev_entry->size  = archive_entry_size(entry);
+			prev_entry->mtime = archive_entry_mtime(entry);
+			if (kindle_create_stash_member(a, prev->payload, buff, &prev_entry->data_offset) != 0) {
+				fprintf(stderr, "Cannot stash '%s' from previous build '%s'.\n", pathname, filename);
 				goto cleanup;
 			}
+		}
+	}
+	if (r != ARCHIVE_EOF) {
+		fprintf(stderr, "Cannot read previous build '%s': %s.\n", filename, archive_error_string(a));
+		goto cleanup;
+	}
+	if (index == NULL || !has_index_sig) {
+		fprintf(stderr, "Previous build '%s' doesn't look like a signed KindleTool package.\n", filename);
+		goto cleanup;
+	}
 
-			// Don't add the bundlefile to itself
-			if ((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN) {
-				// The last field is a display name, take a hint from the Python tool,
-				// and use the file's basename with a simple suffix.
-				// Use a copy of to_sign_and_bundle_list[i] to get our basename,
-				// since the POSIX implementation may alter its arg, and that would be very bad...
-				// And we're using the tweaked pathname in case we're in legacy mode ;)
-				pathnamecpy = strdup(kttar->to_sign_and_bundle_list[i]);
-				// Only flag kernels in recovery update...
-				// FWIW, the format is as follows:
-				//   file_type_id md5sum file_name blocksize file_display_name
-				// where the id is 1 for kernel images (in recovery updates only),
-				// 129 for install scripts, and 128 for assets,
-				// and the blocksize is based on the file size relative to the update type blocksize.
-				if (fprintf(bundlefile,
-					    "%u %s %s %jd %s_ktool_file\n",
-					    ((real_blocksize == RECOVERY_BLOCK_SIZE &&
-						      IS_UIMAGE(kttar->to_sign_and_bundle_list[i])
-						  ? 1U
-					      : (IS_SCRIPT(kttar->to_sign_and_bundle_list[i]) ||
-						 IS_SHELL(kttar->to_sign_and_bundle_list[i]))
-						  ? 129U
-						  : 128U)),
-					    md5,
-					    kttar->tweaked_to_sign_and_bundle_list[i],
-					    (intmax_t) st.st_size / real_blocksize,
-					    basename(pathnamecpy)) < 0) {
-					fprintf(stderr, "Cannot write to bundle index file.\n");
-					// Cleanup a bit before crapping out
-					fclose(file);
-					fclose(sigfile);
-					unlink(sigabsolutepath);
-					free(pathnamecpy);
-					goto cleanup;
-				}
-				free(pathnamecpy);
-			}
+	// RSA signatures are deterministic, if we can't reproduce the index's, it was signed with another key.
+	kt_sha256_init(&hash);
+	kt_sha256_update(&hash, index_size, index);
+	kt_sha256_digest(&hash, digest);
+	if (sign_sha256_digest(digest, rsa_pkey, raw_sig) < 0) {
+		goto cleanup;
+	}
+	if (memcmp(raw_sig, index_sig, rsa_pkey->size) != 0) {
+		fprintf(stderr,
+			"Previous build '%s' was signed with another key, rebuilding everything from scratch.\n",
+			filename);
+		kindle_create_free_previous(prev);
+		ret = 0;
+		goto cleanup;
+	}
 
-			// Cleanup
-			fclose(file);
-			fclose(sigfile);
+	qsort(prev->entries, prev->num_entries, sizeof(*prev->entries), kt_prev_entry_cmp);
+	// Pair the signatures with their files...
+	for (i = 0U; i < sigs.num_entries; i++) {
+		prev_entry = bsearch(sigs.entries[i].pathname,
+				     prev->entries,
+				     prev->num_entries,
+				     sizeof(*prev->entries),
+				     kt_prev_entry_key_cmp);
+		if (prev_entry != NULL) {
+			memcpy(prev_entry->raw_sig, sigs.entries[i].raw_sig, rsa_pkey->size);
+			prev_entry->has_sig = true;
 		}
-
-		// And now, for the fun part! Append our sigfile to the archive...
-		// Populate & write our entries...
-		if (create_from_archive_read_disk(kttar, a, sigabsolutepath, false, signame, real_blocksize) != 0) {
-			unlink(sigabsolutepath);
-			goto cleanup;
+	}
+	// ...and with their MD5 from the index
+	//   file_type_id md5sum file_name blocksize file_display_name
+	for (line = (char*) index; line != NULL && *line != '\0'; line = next_line) {
+		if ((next_line = strchr(line, '\n')) != NULL) {
+			*next_line++ = '\0';
+		}
+		if (sscanf(line, "%*u %32s %n", md5, &offset) != 1 || strlen(md5) != MD5_HASH_LENGTH) {
+			continue;
 		}
+		// Only keep the file_name field
+		line_path                          = line + offset;
+		line_path[strcspn(line_path, " ")] = '\0';
+
+		prev_entry = bsearch(
+		    line_path, prev->entries, prev->num_entries, sizeof(*prev->entries), kt_prev_entry_key_cmp);
+		if (prev_entry != NULL) {
+			memcpy(prev_entry->md5, md5, sizeof(md5));
+		}
+	}
+	ret = 0;
 
-		// Cleanup
-		free(signame);
+cleanup:
+	if (ret != 0) {
+		kindle_create_free_previous(prev);
 	}
+	kindle_create_free_previous(&sigs);
+	free(index);
+	free(data);
+	free(buff);
+	archive_read_close(a);
+	archive_read_free(a);
+	fclose(tgz_input);
+
+	return ret;
+}
 
-	free(kttar->buff);
-	for (i = 0; i < kttar->sign_and_bundle_index; i++) {
-		free(kttar->to_sign_and_bundle_list[i]);
+static void
+    kindle_create_free_previous(struct kt_prev_build* prev)
+{
+	size_t i;
+
+	for (i = 0U; i < prev->num_entries; i++) {
+		free(prev->entries[i].pathname);
 	}
-	free(kttar->to_sign_and_bundle_list);
-	for (i = 0; i < kttar->sign_and_bundle_index; i++) {
-		free(kttar->tweaked_to_sign_and_bundle_list[i]);
+	free(prev->entries);
+	prev->entries     = NULL;
+	prev->num_entries = 0U;
+	if (prev->payload != NULL) {
+		fclose(prev->payload);
+		prev->payload = NULL;
 	}
-	free(kttar->tweaked_to_sign_and_bundle_list);
-	archive_write_close(a);
-	archive_write_free(a);
+}
 
-	// Print a warning if no scripts were detected (in an OTA update)...
-	if (!kttar->has_script && real_blocksize == BLOCK_SIZE) {
-		fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-		fprintf(stderr, "@ No script was detected in your input, this update package won't do a thing! @\n");
-		fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-	}
-	// If we're building a recovery update, warn that this possibly isn't the brightest idea, given the very specific requirements...
-	if (real_blocksize == RECOVERY_BLOCK_SIZE) {
-		fprintf(stderr,
-			"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-		fprintf(stderr,
-			"@ You're building a recovery update from scratch! Make sure you know what you're doing... @\n");
-		fprintf(stderr,
-			"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+// Strip the leading ./ or / from pathname, so that trees, packages & legacy mode tarballs all agree on it
+static const char*
+    kt_delta_path(const char* pathname)
+{
+	while (pathname[0] == '/' || (pathname[0] == '.' && pathname[1] == '/')) {
+		pathname += (pathname[0] == '/') ? 1 : 2;
 	}
+	return pathname;
+}
 
-	return 0;
+// Figure out what an input directory becomes at the start of our archive's pathnames (sans trailing /),
+// and store its length in prefix_len (0 if it doesn't leave anything behind, like the current one).
+// Returns false if input isn't a directory.
+static bool
+    kt_delta_input_prefix(const char* input, char* prefix, size_t* prefix_len)
+{
+	struct stat st;
 
-cleanup:
-	// Close & remove the bundlefile if we crapped out in the middle of processing
-	if ((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN) {
-		fclose(bundlefile);
-		unlink(bundle_filename);
-	} else {
-		// And if it's not open anymore, but was created, remove it too
-		// (that's a short window of time, namely, when we're looping over the bundlefile itself & its sigfile)
-		if ((bundlefile_status & BUNDLE_CREATED) == BUNDLE_CREATED) {
-			unlink(bundle_filename);
-		}
+	prefix[0]   = '\0';
+	*prefix_len = 0U;
+	if (stat(input, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		return false;
 	}
-	// Free what we might have alloc'ed
-	free(signame);
-	// The big stuff, too...
-	free(kttar->buff);
-	if (kttar->sign_and_bundle_index > 0) {
-		for (i = 0; i < kttar->sign_and_bundle_index; i++) {
-			free(kttar->to_sign_and_bundle_list[i]);
-		}
-		free(kttar->to_sign_and_bundle_list);
-		for (i = 0; i < kttar->sign_and_bundle_index; i++) {
-			free(kttar->tweaked_to_sign_and_bundle_list[i]);
-		}
-		free(kttar->tweaked_to_sign_and_bundle_list);
+	snprintf(prefix, PATH_MAX, "%s", kt_delta_path(input));
+	// libarchive doesn't keep trailing path separators, either
+	*prefix_len = strlen(prefix);    // Flawfinder: ignore
+	while (*prefix_len > 0U && prefix[*prefix_len - 1U] == '/') {
+		prefix[--(*prefix_len)] = '\0';
 	}
-	archive_write_close(a);
-	archive_write_free(a);
-	return 1;
+	if (strcmp(prefix, ".") == 0) {
+		prefix[0]   = '\0';
+		*prefix_len = 0U;
+	}
+	return true;
 }
 
 static int
-    kindle_create(const UpdateInformation* info, FILE* input_tgz, FILE* output, const bool fake_sign)
+    kt_delta_entry_cmp(const void* a, const void* b)
 {
-	unsigned char buffer[BUFFER_SIZE];
-	size_t        count;
-	FILE*         temp;
+	const struct kt_delta_entry* entry_a = a;
+	const struct kt_delta_entry* entry_b = b;
 
-	switch (info->version) {
-		case OTAUpdateV2:
-			if ((temp = tmpfile()) == NULL) {
-				fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-				return -1;
-			}
-			// Create the update
-			if (kindle_create_ota_update_v2(info, input_tgz, temp, fake_sign) < 0) {
-				fprintf(stderr, "Error creating update package.\n");
-				fclose(temp);
-				return -1;
-			}
-			rewind(temp);    // Rewind the file before reading back
-			if (!fake_sign) {
-				// Write the signature (unless we asked for an unsigned package)
-				if (kindle_create_signature(info, temp, output) < 0) {
-					fprintf(stderr, "Error signing update package.\n");
-					fclose(temp);
-					return -1;
-				}
-				rewind(temp);    // Rewind the file before writing it to output
-			}
-			// Write the update
-			while ((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0) {
-				if (fwrite(buffer, sizeof(unsigned char), count, output) < count) {
-					fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
-					fclose(temp);
-					return -1;
-				}
-			}
-			if (ferror(temp) != 0) {
-				fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
-				fclose(temp);
-				return -1;
-			}
-			fclose(temp);
-			return 0;
-			break;
-		case OTAUpdate:
-			return kindle_create_ota_update(info, input_tgz, output, fake_sign);
-			break;
-		case RecoveryUpdate:
-			// NOTE: I was assuming that this, even FB02 @ rev. 2, shouldn't be wrapped in an UpdateSignature...
-			//       That happened to be the case until Rex, where the target ota field also appeared...
-			//       So wrap FB02h2 by default, you can always unwrap it later if need be...
-			if (memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2) {
-				if ((temp = tmpfile()) == NULL) {
-					fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-					return -1;
-				}
-				if (kindle_create_recovery(info, input_tgz, temp, fake_sign) < 0) {
-					fprintf(stderr, "Error creating update package.\n");
-					fclose(temp);
-					return -1;
-				}
-				rewind(temp);
-				if (!fake_sign) {
-					if (kindle_create_signature(info, temp, output) < 0) {
-						fprintf(stderr, "Error signing update package.\n");
-						fclose(temp);
-						return -1;
-					}
-					rewind(temp);
-				}
-				while ((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0) {
-					if (fwrite(buffer, sizeof(unsigned char), count, output) < count) {
-						fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
-						fclose(temp);
-						return -1;
-					}
-				}
-				if (ferror(temp) != 0) {
-					fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
-					fclose(temp);
-					return -1;
-				}
-				fclose(temp);
-				return 0;
-			} else {
-				return kindle_create_recovery(info, input_tgz, output, fake_sign);
-			}
-			break;
-		case RecoveryUpdateV2:
-			if ((temp = tmpfile()) == NULL) {
-				fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-				return -1;
-			}
-			if (kindle_create_recovery_v2(info, input_tgz, temp, fake_sign) < 0) {
-				fprintf(stderr, "Error creating update package.\n");
-				fclose(temp);
-				return -1;
-			}
-			rewind(temp);
-			if (!fake_sign) {
-				if (kindle_create_signature(info, temp, output) < 0) {
-					fprintf(stderr, "Error signing update package.\n");
-					fclose(temp);
-					return -1;
-				}
-				rewind(temp);
-			}
-			while ((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0) {
-				if (fwrite(buffer, sizeof(unsigned char), count, output) < count) {
-					fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
-					fclose(temp);
-					return -1;
-				}
-			}
-			if (ferror(temp) != 0) {
-				fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
-				fclose(temp);
-				return -1;
-			}
-			fclose(temp);
-			return 0;
-			break;
-		case UpdateSignature:
-			// NOTE: Should only be reached when building a signed userdata package
-			// We only need to sign the input tarball...
-			if (kindle_create_signature(info, input_tgz, output) < 0) {
-				fprintf(stderr, "Error signing userdata package.\n");
-				return -1;
-			}
-			rewind(input_tgz);
-			// ...And then simply append the input tarball as-is
-			while ((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, input_tgz)) > 0) {
-				if (fwrite(buffer, sizeof(unsigned char), count, output) < count) {
-					fprintf(
-					    stderr, "Error appending userdata tarball to output: %s.\n", strerror(errno));
-					return -1;
-				}
-			}
-			if (ferror(input_tgz) != 0) {
-				fprintf(stderr, "Error reading original userdata tarball update: %s.\n", strerror(errno));
-				return -1;
-			}
-			return 0;
-			break;
-		case UnknownUpdate:
-		default:
-			fprintf(stderr, "Unknown update type.\n");
-			break;
-	}
-	return -1;
+	return strcmp(entry_a->pathname, entry_b->pathname);
 }
 
 static int
-    kindle_create_ota_update_v2(const UpdateInformation* info, FILE* input_tgz, FILE* output, const bool fake_sign)
+    kt_delta_entry_key_cmp(const void* key, const void* b)
 {
-	size_t         header_size;
-	unsigned char* header;
-	size_t         hindex = 0;
-	int            i;
-	FILE*          demunged_tgz;
-	size_t         str_len;
+	const struct kt_delta_entry* entry = b;
 
-	demunged_tgz = NULL;
+	return strcmp(key, entry->pathname);
+}
 
-	// First part of the set sized data
-	header_size = MAGIC_NUMBER_LENGTH + OTA_UPDATE_V2_BLOCK_SIZE;
-	header      = malloc(header_size);
-	strncpy((char*) header, info->magic_number, MAGIC_NUMBER_LENGTH);    // Flawfinder: ignore
-	hindex += MAGIC_NUMBER_LENGTH;
-	memcpy(&header[hindex], &info->source_revision, sizeof(uint64_t));    // Source
-	hindex += sizeof(uint64_t);
-	memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t));    // Target
-	hindex += sizeof(uint64_t);
-	memcpy(&header[hindex], &info->num_devices, sizeof(uint16_t));    // Device count
-	hindex += sizeof(uint16_t);
+// Compute the MD5 of a file on disk, ala md5sum
+static int
+    kt_delta_md5_file(const char* path, unsigned char* buff, size_t buff_size, char* md5)
+{
+	FILE*          file;
+	struct md5_ctx hash;
+	uint8_t        digest[MD5_DIGEST_SIZE];
+	size_t         len;
 
-	// Next, we write the devices
-	header_size += info->num_devices * sizeof(uint16_t);
-	header = realloc(header, header_size);
-	for (i = 0; i < info->num_devices; i++) {
-		memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t));    // Device
-		hindex += sizeof(uint16_t);
+	if ((file = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open '%s' for hashing: %s.\n", path, strerror(errno));
+		return -1;
+	}
+	md5_init(&hash);
+	while ((len = fread(buff, sizeof(unsigned char), buff_size, file)) > 0) {
+		md5_update(&hash, len, buff);
+		kt_stats_add(KT_STATS_BYTES_READ, len);
+	}
+	if (ferror(file)) {
+		fprintf(stderr, "Error reading '%s' for hashing.\n", path);
+		fclose(file);
+		return -1;
 	}
+	fclose(file);
+	md5_digest(&hash, MD5_DIGEST_SIZE, digest);
+	base16_encode_update(md5, MD5_DIGEST_SIZE, digest);
+	md5[MD5_HASH_LENGTH] = '\0';
+	return 0;
+}
 
-	// Part two of the set sized data
-	header_size += OTA_UPDATE_V2_PART_2_BLOCK_SIZE;
-	header = realloc(header, header_size);
-	memcpy(&header[hindex], &info->critical, sizeof(uint8_t));    // Critical
-	hindex += sizeof(uint8_t);
-	memset(&header[hindex], 0, sizeof(uint8_t));    // 1 byte padding
-	hindex += sizeof(uint8_t);
+// Compute the MD5 of the current archive member
+static int
+    kt_delta_md5_member(struct archive* a, unsigned char* buff, size_t buff_size, char* md5)
+{
+	struct md5_ctx hash;
+	uint8_t        digest[MD5_DIGEST_SIZE];
+	la_ssize_t     len;
 
-	// Even if we asked for a fake package, the Kindle still expects a proper package...
-	// md5 hash a temp deobfuscated tarball to fake it ;)
-	if (fake_sign) {
-		if ((demunged_tgz = tmpfile()) == NULL) {
-			fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-			free(header);
+	md5_init(&hash);
+	while ((len = archive_read_data(a, buff, buff_size)) > 0) {
+		md5_update(&hash, (size_t) len, buff);
+	}
+	if (len < 0) {
+		return -1;
+	}
+	md5_digest(&hash, MD5_DIGEST_SIZE, digest);
+	base16_encode_update(md5, MD5_DIGEST_SIZE, digest);
+	md5[MD5_HASH_LENGTH] = '\0';
+	return 0;
+}
+
+// Gather the payload files of the delta base (either a tree, a package, or its intermediate tarball).
+// A tarball has to be read anyway, so we hash its files right away, while a tree's are only hashed when needed.
+// NOTE: A tree's pathnames are relative to the tree itself, while, outside of legacy mode,
+//       our input's keep the directory they come from. So, prepend it, in order to match the archive's layout.
+//       On the other hand, the cleanup script needs them relative to the tree, so remember where that part starts.
+static int
+    kindle_create_load_delta(const char*        filename,
+			     char**             input_list,
+			     const unsigned int input_index,
+			     const bool         legacy,
+			     const bool         fake_sign,
+			     struct kt_delta*   delta)
+{
+	struct stat            st;
+	char                   prefix[PATH_MAX];
+	char                   prefixed_path[PATH_MAX];
+	size_t                 prefix_len;
+	size_t                 tree_prefix_len = 0U;
+	size_t                 best_len;
+	unsigned int           ui;
+	FILE*                  tgz_input = NULL;
+	FILE*                  bin_input;
+	struct archive*        a;
+	struct archive_entry*  entry;
+	struct kt_delta_entry* delta_entry;
+	const char*            pathname;
+	struct kt_delta_entry* entries;
+	unsigned char*         buff;
+	size_t                 root_len;
+	bool                   is_tree;
+	int                    r;
+	int                    ret         = -1;
+	uint64_t               stats_start = kt_stats_start();
+
+	memset(delta, 0, sizeof(*delta));
+	if (stat(filename, &st) != 0) {
+		fprintf(stderr, "Cannot open delta base '%s': %s.\n", filename, strerror(errno));
+		return -1;
+	}
+	if ((buff = malloc(MUNGE_BUFFER_SIZE)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for delta base hashing buffer.\n");
+		return -1;
+	}
+	is_tree = S_ISDIR(st.st_mode);
+	if (is_tree && !legacy) {
+		if (input_index != 1U) {
+			fprintf(stderr,
+				"A delta base tree can only be matched against a single input directory (or in legacy mode).\n");
+			free(buff);
 			return -1;
 		}
-		demunger(input_tgz, demunged_tgz, 0, false);
-		rewind(input_tgz);
-		rewind(demunged_tgz);
-		if (md5_sum(demunged_tgz, (char*) &header[hindex]) < 0) {
-			fprintf(stderr, "Error calculating MD5 of fake package.\n");
-			free(header);
-			return -1;
+		kt_delta_input_prefix(input_list[0], prefix, &tree_prefix_len);
+	}
+	if (is_tree) {
+		a = archive_read_disk_new();
+		// Apply the same exclude list as for our input
+		archive_read_disk_set_metadata_filter_callback(a, metadata_filter, NULL);
+		if (archive_read_disk_open(a, filename) != ARCHIVE_OK) {
+			fprintf(stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(a));
+			goto cleanup;
 		}
-		fclose(demunged_tgz);
 	} else {
-		if (md5_sum(input_tgz, (char*) &header[hindex]) < 0)    // md5 hash
-		{
-			fprintf(stderr, "Error calculating MD5 of package.\n");
-			free(header);
-			return -1;
-		}
-		rewind(input_tgz);    // Reset input for later reading
+		if (IS_BIN(filename) || IS_STGZ(filename)) {
+			if ((bin_input = fopen(filename, "rb")) == NULL) {
+				fprintf(stderr, "Cannot open delta base '%s': %s.\n", filename, strerror(errno));
+				free(buff);
+				return -1;
+			}
+			if ((tgz_input = kt_tmpfile()) == NULL) {
+				fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+				fclose(bin_input);
+				free(buff);
+				return -1;
+			}
+			if (kindle_convert_payload(bin_input, tgz_input, NULL, fake_sign) != 0) {
+				fprintf(stderr, "Cannot convert delta base '%s'.\n", filename);
+				fclose(bin_input);
+				fclose(tgz_input);
+				free(buff);
+				return -1;
+			}
+			fclose(bin_input);
+		} else if ((tgz_input = fopen(filename, "rb")) == NULL) {
+			fprintf(stderr, "Cannot open delta base '%s': %s.\n", filename, strerror(errno));
+			free(buff);
+			return -1;
+		}
+		a = archive_read_new();
+		archive_read_support_format_tar(a);
+		archive_read_support_format_gnutar(a);
+		archive_read_support_filter_gzip(a);
+		if (archive_read_open_FILE(a, tgz_input) != ARCHIVE_OK) {
+			fprintf(stderr, "archive_read_open_FILE() failure: %s.\n", archive_error_string(a));
+			goto cleanup;
+		}
 	}
 
-	md(&header[hindex], MD5_HASH_LENGTH);    // Obfuscate md5 hash
-	hindex += MD5_HASH_LENGTH;
-	memcpy(&header[hindex], &info->num_meta, sizeof(uint16_t));    // num_meta, cannot be cast
-	hindex += sizeof(uint16_t);
+	root_len = strlen(filename);    // Flawfinder: ignore
+	while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+		if (is_tree) {
+			archive_read_disk_descend(a);
+		}
+		if (archive_entry_filetype(entry) != AE_IFREG) {
+			continue;
+		}
+		pathname = archive_entry_pathname(entry);
+		// Make a tree's pathnames relative to its root
+		if (is_tree && strlen(pathname) > root_len) {    // Flawfinder: ignore
+			pathname += root_len;
+		}
+		pathname = kt_delta_path(pathname);
+		if (tree_prefix_len > 0U) {
+			snprintf(prefixed_path, PATH_MAX, "%s/%s", prefix, pathname);
+			pathname = prefixed_path;
+		}
+		// Our own sigfiles, bundle index & cleanup script don't count
+		if (IS_SIG(pathname) || IS_DAT(pathname) || strcmp(pathname, KT_DELTA_SCRIPT_NAME) == 0) {
+			continue;
+		}
 
-	// Next, we write the meta strings
-	for (i = 0; i < info->num_meta; i++) {
-		str_len = strlen(info->metastrings[i]);    // Flawfinder: ignore
-		header_size += str_len + sizeof(uint16_t);
-		header = realloc(header, header_size);
-		// String length: little endian -> big endian
-		// FIXME: While otaup expects this endianness switch, it would seem that otacheck doesn't,
-		//        and chokes with an headerTooShortInMetadataField error as soon as we pass more than one metastring...
-		//        If we don't switch the endianness, otacheck passes, but otaup chokes... >_<"
-		memcpy(&header[hindex], &((uint8_t*) &str_len)[1], sizeof(uint8_t));
-		hindex += sizeof(uint8_t);
-		memcpy(&header[hindex], &((uint8_t*) &str_len)[0], sizeof(uint8_t));
-		hindex += sizeof(uint8_t);
-		// Obfuscate meta string
-		md((unsigned char*) info->metastrings[i], str_len);
-		// FIXME: Should this really be munged? Following otaup would point to yes,
-		//        but I've never seen an update with meta strings in the wild,
-		//        and the aforementionned issue with the string length doesn't help...
-		strncpy((char*) &header[hindex], info->metastrings[i], str_len);    // Flawfinder: ignore
-		hindex += str_len;
+		entries = realloc(delta->entries, (delta->num_entries + 1U) * sizeof(*delta->entries));
+		if (entries == NULL) {
+			fprintf(stderr, "Cannot allocate memory for delta base entries.\n");
+			goto cleanup;
+		}
+		delta->entries = entries;
+		delta_entry    = &delta->entries[delta->num_entries];
+		memset(delta_entry, 0, sizeof(*delta_entry));
+		if ((delta_entry->pathname = strdup(pathname)) == NULL ||
+		    (is_tree && (delta_entry->sourcepath = strdup(archive_entry_sourcepath(entry))) == NULL)) {
+			fprintf(stderr, "Cannot allocate memory for delta base entries.\n");
+			free(delta_entry->pathname);
+			goto cleanup;
+		}
+		delta->num_entries++;
+		delta_entry->size = archive_entry_size(entry);
+		// Legacy mode already strips the input directories from our pathnames
+		if (legacy) {
+			delta_entry->relpath = delta_entry->pathname;
+		} else if (is_tree) {
+			delta_entry->relpath = delta_entry->pathname + (tree_prefix_len > 0U ? tree_prefix_len + 1U : 0U);
+		} else {
+			// Otherwise, pick the (innermost) input directory it lives in, if any
+			best_len = 0U;
+			for (ui = 0U; ui < input_index; ui++) {
+				if (!kt_delta_input_prefix(input_list[ui], prefix, &prefix_len) ||
+				    prefix_len < best_len || strncmp(pathname, prefix, prefix_len) != 0) {
+					continue;
+				}
+				if (prefix_len == 0U) {
+					delta_entry->relpath = delta_entry->pathname;
+				} else if (pathname[prefix_len] == '/') {
+					delta_entry->relpath = delta_entry->pathname + prefix_len + 1U;
+				} else {
+					continue;
+				}
+				best_len = prefix_len;
+			}
+		}
+		if (!is_tree && kt_delta_md5_member(a, buff, MUNGE_BUFFER_SIZE, delta_entry->md5) != 0) {
+			fprintf(stderr,
+				"Cannot read '%s' from delta base '%s': %s.\n",
+				pathname,
+				filename,
+				archive_error_string(a));
+			goto cleanup;
+		}
 	}
+	if (r != ARCHIVE_EOF) {
+		fprintf(stderr, "Cannot read delta base '%s': %s.\n", filename, archive_error_string(a));
+		goto cleanup;
+	}
+	qsort(delta->entries, delta->num_entries, sizeof(*delta->entries), kt_delta_entry_cmp);
+	ret = 0;
 
-	// Now, we write the header to the file
-	if (fwrite(header, sizeof(unsigned char), header_size, output) < header_size) {
-		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-		free(header);
-		return -1;
+cleanup:
+	if (ret != 0) {
+		kindle_create_free_delta(delta);
+	}
+	archive_read_close(a);
+	archive_read_free(a);
+	if (tgz_input != NULL) {
+		fclose(tgz_input);
 	}
+	free(buff);
+	kt_stats_stop(KT_STATS_HASH, stats_start);
 
-	// Write the actual update
-	free(header);
-	return munger(input_tgz, output, 0, fake_sign);
+	return ret;
+}
+
+static void
+    kindle_create_free_delta(struct kt_delta* delta)
+{
+	size_t i;
+
+	for (i = 0U; i < delta->num_entries; i++) {
+		free(delta->entries[i].pathname);
+		free(delta->entries[i].sourcepath);
+	}
+	free(delta->entries);
+	delta->entries     = NULL;
+	delta->num_entries = 0U;
+}
+
+// Check whether entry has the same content as its counterpart in the delta base (and remember that it's still there)
+static bool
+    kindle_create_delta_unchanged(struct kttar* kttar, struct archive_entry* entry)
+{
+	struct kt_delta_entry* delta_entry;
+	char                   md5[MD5_HASH_LENGTH + 1];
+
+	delta_entry = bsearch(kt_delta_path(archive_entry_pathname(entry)),
+			      kttar->delta->entries,
+			      kttar->delta->num_entries,
+			      sizeof(*kttar->delta->entries),
+			      kt_delta_entry_key_cmp);
+	if (delta_entry == NULL) {
+		return false;
+	}
+	delta_entry->seen = true;
+	// Don't bother hashing anything if the size already tells us it changed
+	if (delta_entry->size != archive_entry_size(entry)) {
+		return false;
+	}
+	if (delta_entry->md5[0] == '\0' &&
+	    kt_delta_md5_file(delta_entry->sourcepath, kttar->buff, kttar->buff_size, delta_entry->md5) != 0) {
+		delta_entry->md5[0] = '\0';
+		return false;
+	}
+	if (kt_delta_md5_file(archive_entry_sourcepath(entry), kttar->buff, kttar->buff_size, md5) != 0) {
+		return false;
+	}
+	return strcmp(md5, delta_entry->md5) == 0;
+}
+
+// Single-quote str, so that the shell doesn't interpret any of it
+static bool
+    kt_delta_write_quoted(struct nettle_buffer* script, const char* str)
+{
+	const char* p;
+	bool        ok;
+
+	ok = NETTLE_BUFFER_PUTC(script, (uint8_t) '\'');
+	for (p = str; ok && *p != '\0'; p++) {
+		if (*p == '\'') {
+			ok = nettle_buffer_write(script, 4U, (const uint8_t*) "'\\''");
+		} else {
+			ok = NETTLE_BUFFER_PUTC(script, (uint8_t) *p);
+		}
+	}
+	return ok && NETTLE_BUFFER_PUTC(script, (uint8_t) '\'');
 }
 
+// Append the script removing whatever is gone since the delta base to the archive, sign it & index it like any other.
+// NOTE: Where the payload ends up is up to the package's own scripts, so we can't guess it:
+//       the script removes paths relative to the input directory, from the device root we were given (--delta-root).
 static int
-    kindle_create_signature(const UpdateInformation* info, FILE* input_bin, FILE* output)
+    kindle_create_delta_script(struct kttar* kttar, struct archive* a, const unsigned int legacy)
 {
-	UpdateHeader header;    // Header to write
+	struct nettle_buffer script;
+	struct md5_ctx       hash;
+	struct kt_sha256_ctx sha256;
+	uint8_t              digest[MD5_DIGEST_SIZE];
+	struct kttar_file*   file;
+	struct kttar_sig*    sig;
+	const char*          relpath;
+	// Blend in with the rest of the archive
+	const char*          script_name = legacy ? KT_DELTA_SCRIPT_NAME : "./" KT_DELTA_SCRIPT_NAME;
+	unsigned int         removed     = 0U;
+	size_t               i;
+	bool                 ok;
+	int                  ret = 1;
+
+	// If nothing matched, the base is very probably laid out differently than our input,
+	// and we'd end up shipping everything *and* deleting it all, so don't.
+	for (i = 0U; i < kttar->delta->num_entries && !kttar->delta->entries[i].seen; i++) {
+		;
+	}
+	if (kttar->delta->num_entries > 0U && i == kttar->delta->num_entries) {
+		fprintf(stderr,
+			"None of the files from the delta base were found in the input, are they laid out the same way?\n");
+		return 1;
+	}
 
-	memset(&header, 0, sizeof(UpdateHeader));                                          // Zero init
-	memcpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH);                          // Write magic number
-	header.data.signature.certificate_number = (uint32_t) info->certificate_number;    // 4 byte certificate number
-	if (fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE, output) <
-	    MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE) {
-		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-		return -1;
+	nettle_buffer_init(&script);
+	ok = nettle_buffer_write(
+	    &script, sizeof(KT_DELTA_SCRIPT_HEADER) - 1U, (const uint8_t*) KT_DELTA_SCRIPT_HEADER);
+	ok = ok && kt_delta_write_quoted(&script, kttar->delta->root);
+	ok = ok && nettle_buffer_write(&script, 2U, (const uint8_t*) "\n\n");
+	for (i = 0U; ok && i < kttar->delta->num_entries; i++) {
+		if (kttar->delta->entries[i].seen) {
+			continue;
+		}
+		relpath = kttar->delta->entries[i].relpath;
+		// We have no idea where something that isn't in any of our input directories would end up, leave it be
+		if (relpath == NULL || relpath[0] == '\0') {
+			fprintf(stderr,
+				"'%s' isn't in any of the input directories, not removing it.\n",
+				kttar->delta->entries[i].pathname);
+			continue;
+		}
+		fprintf(stderr, "- %s\n", relpath);
+		removed++;
+		ok = nettle_buffer_write(&script, sizeof(KT_DELTA_SCRIPT_RM) - 1U, (const uint8_t*) KT_DELTA_SCRIPT_RM);
+		ok = ok && kt_delta_write_quoted(&script, relpath);
+		ok = ok && NETTLE_BUFFER_PUTC(&script, (uint8_t) '\n');
 	}
-	// Write signature to output
-	if (sign_file(input_bin, &info->sign_pkey, output) < 0) {
-		fprintf(stderr, "Error signing update package payload.\n");
+	if (!ok) {
+		fprintf(stderr, "Cannot allocate memory for '%s'.\n", KT_DELTA_SCRIPT_NAME);
+		goto cleanup;
+	}
+	fprintf(stderr,
+		"Left out %u unchanged payload files, and removing %u since the delta base.\n",
+		kttar->delta->unchanged,
+		removed);
+	// Nothing's gone, no need for a script
+	if (removed == 0U) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	// Hash it & sign it in the background, ala create_from_archive_read_disk
+	if ((file = kttar_track_file(kttar, script_name, script_name, (int64_t) script.size)) == NULL) {
+		goto cleanup;
+	}
+	sig = file->sig;
+	md5_init(&hash);
+	md5_update(&hash, script.size, script.contents);
+	md5_digest(&hash, MD5_DIGEST_SIZE, digest);
+	base16_encode_update(sig->md5, MD5_DIGEST_SIZE, digest);
+	sig->md5[MD5_HASH_LENGTH] = 0;
+	kt_sha256_init(&sha256);
+	kt_sha256_update(&sha256, script.size, script.contents);
+	kt_sha256_digest(&sha256, sig->digest);
+	sig->rsa_pkey = kttar->rsa_pkey;
+	sig->cache    = kttar->sig_cache;
+	if (kt_pool_submit(kttar->pool, sign_entry_job, sig) != 0) {
+		goto cleanup;
+	}
+	kttar->has_script = true;
+
+	if (write_memory_entry(a, script_name, script.contents, script.size, 0755) != 0) {
+		goto cleanup;
+	}
+	ret = 0;
+
+cleanup:
+	nettle_buffer_clear(&script);
+	return ret;
+}
+
+// Make sure *buff can hold at least size bytes, growing it geometrically, so that it can be reused for every file
+static int
+    kttar_scratch(char** buff, size_t* buff_size, size_t size)
+{
+	size_t new_size = *buff_size > 0U ? *buff_size : 256U;
+	char*  new_buff;
+
+	if (size <= *buff_size) {
+		return 0;
+	}
+	while (new_size < size) {
+		new_size *= 2U;
+	}
+	if ((new_buff = realloc(*buff, new_size)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for pathname buffer.\n");
 		return -1;
 	}
+	*buff      = new_buff;
+	*buff_size = new_size;
+	return 0;
+}
+
+// Keep track of a regular file we just archived, in order to write its sigfile & its index entry once we're done.
+// Returns its entry, with a blank sig for the caller to fill, or NULL if we ran out of memory.
+static struct kttar_file*
+    kttar_track_file(struct kttar* kttar, const char* pathname, const char* tweaked_pathname, int64_t size)
+{
+	struct kttar_file* file;
+
+	if (kttar->num_files == kttar->files_capacity) {
+		unsigned int       capacity = kttar->files_capacity > 0U ? kttar->files_capacity * 2U : 64U;
+		struct kttar_file* files    = realloc(kttar->files, capacity * sizeof(*files));
+		if (files == NULL) {
+			fprintf(stderr, "Cannot allocate memory for the list of archived files.\n");
+			return NULL;
+		}
+		kttar->files          = files;
+		kttar->files_capacity = capacity;
+	}
+
+	file           = &kttar->files[kttar->num_files];
+	file->pathname = kt_arena_strdup(&kttar->arena, pathname);
+	// Don't store the same path twice when we don't tweak anything
+	file->tweaked_pathname = strcmp(pathname, tweaked_pathname) == 0
+				     ? file->pathname
+				     : kt_arena_strdup(&kttar->arena, tweaked_pathname);
+	file->size = size;
+	file->sig  = kt_arena_alloc(&kttar->arena, sizeof(*file->sig));
+	if (file->pathname == NULL || file->tweaked_pathname == NULL || file->sig == NULL) {
+		fprintf(stderr, "Cannot allocate memory for the list of archived files.\n");
+		return NULL;
+	}
+	kttar->num_files++;
+
+	return file;
+}
+
+// Feed a chunk of the entry being archived to its hashes, or to the current batch if it's small enough to be batched
+static int
+    kttar_hash_data(struct kttar* kttar, const void* data, size_t len)
+{
+	struct kttar_batch* batch = &kttar->batch;
+
+	if (!kttar->batch_entry) {
+		md5_update(&kttar->md5, len, data);
+		kt_sha256_update(&kttar->sha256, len, data);
+		return 0;
+	}
+	if (batch->used + len > batch->size) {
+		size_t         new_size = batch->size > 0U ? batch->size : KTTAR_BATCH_MAX_SIZE;
+		unsigned char* new_data;
+
+		while (new_size < batch->used + len) {
+			new_size *= 2U;
+		}
+		if ((new_data = realloc(batch->data, new_size)) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for the hashing batch.\n");
+			return -1;
+		}
+		batch->data = new_data;
+		batch->size = new_size;
+	}
+	memcpy(batch->data + batch->used, data, len);
+	batch->used += len;
+	return 0;
+}
+
+// Hash every file in the current batch, and hand their signatures over to our worker pool
+static int
+    kttar_batch_flush(struct kttar* kttar)
+{
+	struct kttar_batch* batch = &kttar->batch;
+
+	if (batch->count == 0U) {
+		return 0;
+	}
+	for (unsigned int i = 0U; i < batch->count; i++) {
+		batch->jobs[i].data = batch->data + batch->offsets[i];
+	}
+	kt_hash_batch(batch->jobs, batch->count);
+	for (unsigned int i = 0U; i < batch->count; i++) {
+		struct kttar_sig* sig = batch->sigs[i];
+
+		base16_encode_update(sig->md5, MD5_DIGEST_SIZE, batch->jobs[i].md5);
+		sig->md5[MD5_HASH_LENGTH] = 0;
+		memcpy(sig->digest, batch->jobs[i].sha256, SHA256_DIGEST_SIZE);
+		sig->rsa_pkey = kttar->rsa_pkey;
+		sig->cache    = kttar->sig_cache;
+		if (kt_pool_submit(kttar->pool, sign_entry_job, sig) != 0) {
+			return -1;
+		}
+	}
+	batch->count = 0U;
+	batch->used  = 0U;
+	return 0;
+}
+
+// Archive a single entry (read from in_a, which is either a directory walk or a tar stream), with our usual tweaks.
+// If it's a regular file, it gets hashed as we go, signed by our worker pool, and tracked for the index.
+// pathname is where we found it, the entry's own pathname is where it ends up in the archive.
+static int
+    kttar_add_entry(struct kttar*         kttar,
+		    struct archive*       a,
+		    struct archive*       in_a,
+		    struct archive_entry* entry,
+		    const char*           pathname,
+		    const unsigned int    real_blocksize)
+{
+	bool                  is_exec   = false;
+	bool                  is_kernel = false;
+	struct kt_prev_entry* prev_entry;
+
+	// And then override a bunch of stuff (namely, uid/gid/chmod)
+	archive_entry_set_uid(entry, 0);
+	archive_entry_set_uname(entry, "root");
+	archive_entry_set_gid(entry, 0);
+	archive_entry_set_gname(entry, "root");
+
+	// If we have a regular file, and it's a script, make it executable (probably overkill, but hey :))
+	if (archive_entry_filetype(entry) == AE_IFREG &&
+	    (IS_SCRIPT(archive_entry_pathname(entry)) || IS_SHELL(archive_entry_pathname(entry)))) {
+		archive_entry_set_perm(entry, 0755);
+		// It's a script, keep track of it
+		is_exec           = true;
+		kttar->has_script = is_exec;
+		is_kernel         = false;
+	}
+	// If we have a regular file, and it's a kernel, and we're a recovery update, keep track of it
+	else if (archive_entry_filetype(entry) == AE_IFREG && real_blocksize == RECOVERY_BLOCK_SIZE &&
+		 IS_UIMAGE(archive_entry_pathname(entry))) {
+		archive_entry_set_perm(entry, 0644);
+		is_exec = false;
+		// It's a kernel, keep track of it
+		is_kernel = true;
+	}
+	// If we have a directory, make it searchable...
+	else if (archive_entry_filetype(entry) == AE_IFDIR) {
+		archive_entry_set_perm(entry, 0755);
+		is_exec   = false;
+		is_kernel = false;
+	} else {
+		archive_entry_set_perm(entry, 0644);
+		is_exec   = false;
+		is_kernel = false;
+	}
+
+	// Non-regular files get archived with zero size.
+	if (archive_entry_filetype(entry) != AE_IFREG) {
+		archive_entry_set_size(entry, 0);
+	}
+
+	// Leave out the regular files that didn't change since the delta base.
+	// NOTE: Scripts always make it in, since they're what actually installs the package.
+	if (kttar->delta != NULL && archive_entry_filetype(entry) == AE_IFREG &&
+	    kindle_create_delta_unchanged(kttar, entry) && !is_exec) {
+		fprintf(stderr, "= %s\n", archive_entry_pathname(entry));
+		kttar->delta->unchanged++;
+		kt_prefetch_consume(kttar->prefetch, archive_entry_size(entry));
+		return 0;
+	}
+	// Print what we're adding, ala bsdtar
+	fprintf(stderr,
+		"a %s%s\n",
+		archive_entry_pathname(entry),
+		(is_kernel ? "\t\t|<" : (is_exec ? "\t\t<-" : "")));
+
+	// If it's a regular file, we'll need its hashes for the index & its sigfile, set that up
+	kttar->hash_entry = (archive_entry_filetype(entry) == AE_IFREG);
+	// Unless it hasn't changed since the previous build, in which case we already know them
+	prev_entry = NULL;
+	if (kttar->hash_entry && kttar->prev != NULL &&
+	    (prev_entry = kindle_create_find_previous(kttar->prev, entry)) != NULL) {
+		kttar->hash_entry = false;
+	}
+	// Small files get hashed in batches, the rest as we go
+	kttar->batch_entry = kttar->hash_entry && archive_entry_size(entry) <= KTTAR_BATCH_MAX_SIZE;
+	if (kttar->batch_entry) {
+		kttar->batch.offsets[kttar->batch.count] = kttar->batch.used;
+	} else if (kttar->hash_entry) {
+		md5_init(&kttar->md5);
+		kt_sha256_init(&kttar->sha256);
+	}
+
+	// Write our entry to the archive, completely via libarchive,
+	// to avoid having to open our entry file again, which would fail on non-POSIX systems...
+	// (Or straight from the previous build, since we're not even supposed to read an unchanged file).
+	if (prev_entry != NULL) {
+		if (write_previous_entry(kttar, a, prev_entry, entry) != 0) {
+			return 1;
+		}
+	} else if (write_file(kttar, a, in_a, entry) != 0) {
+		return 1;
+	}
+
+	// If we just added a regular file, hash it, sign it, add it to the index, and put the sig in our tarball
+	if (archive_entry_filetype(entry) == AE_IFREG) {
+		// Hash it right now, since copy_file_data_block fed it to our hashes for us,
+		// and hand its signature over to our worker pool.
+		// We'll write the index & the sigfiles later, they have to go after the payload.
+		uint8_t            digest[MD5_DIGEST_SIZE];
+		struct kttar_file* file;
+		struct kttar_sig*  sig;
+
+		kt_stats_add(KT_STATS_FILES, 1U);
+		kt_prefetch_consume(kttar->prefetch, archive_entry_size(entry));
+		file = kttar_track_file(kttar, pathname, archive_entry_pathname(entry), archive_entry_size(entry));
+		if (file == NULL) {
+			return 1;
+		}
+		sig = file->sig;
+		if (prev_entry != NULL) {
+			// Reuse what we got from the previous build
+			memcpy(sig->md5, prev_entry->md5, sizeof(sig->md5));
+			memcpy(sig->raw_sig, prev_entry->raw_sig, kttar->rsa_pkey->size);
+			kttar->reused++;
+		} else if (kttar->batch_entry) {
+			// We'll get to it once the batch is full
+			kttar->batch.sigs[kttar->batch.count] = sig;
+			kttar->batch.jobs[kttar->batch.count].size =
+			    kttar->batch.used - kttar->batch.offsets[kttar->batch.count];
+			if (++kttar->batch.count == KTTAR_BATCH_FILES && kttar_batch_flush(kttar) != 0) {
+				return 1;
+			}
+		} else {
+			md5_digest(&kttar->md5, MD5_DIGEST_SIZE, digest);
+			base16_encode_update(sig->md5, MD5_DIGEST_SIZE, digest);
+			sig->md5[MD5_HASH_LENGTH] = 0;
+			kt_sha256_digest(&kttar->sha256, sig->digest);
+			sig->rsa_pkey = kttar->rsa_pkey;
+			sig->cache    = kttar->sig_cache;
+			if (kt_pool_submit(kttar->pool, sign_entry_job, sig) != 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+    create_from_archive_read_disk(struct kttar*      kttar,
+				  struct archive*    a,
+				  const char*        input_filename,
+				  const unsigned int real_blocksize)
+{
+	int   r;
+	char* original_path = NULL;
+	char* tweaked_path  = NULL;
+
+	struct archive*       disk;
+	struct archive_entry* entry;
+	uint64_t              stats_start = kt_stats_start();
+
+	disk  = archive_read_disk_new();
+	entry = archive_entry_new();
+
+	// Perform pattern matching in a metadata filter to apply our exclude list to reguar files.
+	// NOTE: We're not using archive_read_disk_set_matching anymore
+	//       because it does *pattern* matching too early to determine if we're a directory...
+	archive_read_disk_set_metadata_filter_callback(disk, metadata_filter, NULL);
+	archive_read_disk_set_standard_lookup(disk);
+
+	r = archive_read_disk_open(disk, input_filename);
+	if (r != ARCHIVE_OK) {
+		fprintf(stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
+		archive_read_free(disk);
+		archive_entry_free(entry);
+		return 1;
+	}
+
+	for (;;) {
+		archive_entry_clear(entry);
+		r = archive_read_next_header2(disk, entry);
+		if (r == ARCHIVE_EOF) {
+			break;
+		} else if (r != ARCHIVE_OK) {
+			fprintf(stderr, "archive_read_next_header2() failed: %s", archive_error_string(disk));
+			if (r == ARCHIVE_FATAL) {
+				fprintf(stderr, " (FATAL).\n");
+				goto cleanup;
+			} else if (r < ARCHIVE_WARN) {
+				fprintf(stderr, " (FAILED).\n");
+				// NOTE: We don't want to end up with an incomplete archive, abort.
+				goto cleanup;
+			}
+		}
+
+		// Tweak the pathname if we were asked to behave like Yifan's KindleTool...
+		if (kttar->tweak_pointer_index != 0) {
+			// Handle the 'root' source directory itself..
+			// NOTE: We check that strlen <= pointer_index
+			//       because libarchive strips trailing path separators in the entry pathname,
+			//       but we might have passed one on the CL,
+			//       so pointer_index might be larger than strlen ;)
+			if (archive_entry_filetype(entry) == AE_IFDIR &&
+			    // Flawfinder: ignore
+			    strlen(archive_entry_pathname(entry)) <= kttar->tweak_pointer_index) {
+				// Print what we're stripping, ala GNU tar...
+				fprintf(stderr,
+					"kindletool: Removing leading '%s/' from member names.\n",
+					archive_entry_pathname(entry));
+				// Just skip it, we don't need a redundant and explicit root directory entry in our tarball...
+				archive_read_disk_descend(disk);
+				continue;
+			} else {
+				original_path = strdup(archive_entry_pathname(entry));
+				// Try to handle a trailing path separator properly...
+				// NOTE: This probably isn't very robust.
+				//       Also, no need to handle MinGW,
+				//       it already spectacularly fails to handle this case ^^
+				if (original_path[kttar->tweak_pointer_index] == '/') {
+					// We found a path separator, skip it, too
+					tweaked_path = original_path + (kttar->tweak_pointer_index + 1);
+				} else {
+					tweaked_path = original_path + kttar->tweak_pointer_index;
+				}
+				archive_entry_copy_pathname(entry, tweaked_path);
+			}
+		}
+
+		archive_read_disk_descend(disk);
+		// Use the correct paths if we tweaked the entry pathname...
+		if (kttar_add_entry(kttar,
+				    a,
+				    disk,
+				    entry,
+				    kttar->tweak_pointer_index != 0 ? original_path : archive_entry_pathname(entry),
+				    real_blocksize) != 0) {
+			goto cleanup;
+		}
+		free(original_path);
+		original_path = NULL;
+		tweaked_path  = NULL;
+	}
+
+	archive_read_close(disk);
+	archive_read_free(disk);
+	archive_entry_free(entry);
+	kt_stats_stop(KT_STATS_WALK, stats_start);
+
 	return 0;
+
+cleanup:
+	free(original_path);
+	tweaked_path = NULL;
+	archive_read_close(disk);
+	archive_read_free(disk);
+	archive_entry_free(entry);
+
+	return 1;
+}
+
+// Same thing, but for a tar (or tar.gz) stream on stdin. Entries are signed & indexed as they stream by,
+// the only thing we need to hold on to until the end is the tarball we're building, which already lives in a tempfile.
+static int
+    create_from_archive_read_stream(struct kttar* kttar, struct archive* a, const unsigned int real_blocksize)
+{
+	int r;
+
+	struct archive*       in_a;
+	struct archive_entry* entry;
+	uint64_t              stats_start = kt_stats_start();
+
+	in_a = archive_read_new();
+	archive_read_support_format_tar(in_a);
+	archive_read_support_filter_gzip(in_a);
+
+	r = archive_read_open_fd(in_a, STDIN_FILENO, DEFAULT_BYTES_PER_BLOCK);
+	if (r != ARCHIVE_OK) {
+		fprintf(stderr, "archive_read_open_fd() failed: %s.\n", archive_error_string(in_a));
+		archive_read_free(in_a);
+		return 1;
+	}
+
+	for (;;) {
+		r = archive_read_next_header(in_a, &entry);
+		if (r == ARCHIVE_EOF) {
+			break;
+		} else if (r != ARCHIVE_OK) {
+			fprintf(stderr, "archive_read_next_header() failed: %s", archive_error_string(in_a));
+			if (r == ARCHIVE_FATAL) {
+				fprintf(stderr, " (FATAL).\n");
+				goto cleanup;
+			} else if (r < ARCHIVE_WARN) {
+				fprintf(stderr, " (FAILED).\n");
+				// NOTE: We don't want to end up with an incomplete archive, abort.
+				goto cleanup;
+			}
+		}
+
+		// Apply our exclude list, like metadata_filter does for directory walks
+		r = kttar_path_excluded(entry);
+		if (r < 0) {
+			goto cleanup;
+		} else if (r) {
+			continue;
+		}
+		// NOTE: A hardlink has no data of its own in a tar stream, and we can't go back for its target's,
+		//       so we'd end up with an empty file, signature & all. Don't.
+		if (archive_entry_hardlink(entry) != NULL) {
+			fprintf(stderr,
+				"Hardlink '%s' -> '%s' in the input stream is not supported, archive the file itself instead.\n",
+				archive_entry_pathname(entry),
+				archive_entry_hardlink(entry));
+			goto cleanup;
+		}
+
+		if (kttar_add_entry(kttar, a, in_a, entry, archive_entry_pathname(entry), real_blocksize) != 0) {
+			goto cleanup;
+		}
+	}
+
+	archive_read_close(in_a);
+	archive_read_free(in_a);
+	kt_stats_stop(KT_STATS_WALK, stats_start);
+
+	return 0;
+
+cleanup:
+	archive_read_close(in_a);
+	archive_read_free(in_a);
+
+	return 1;
+}
+
+// Compress a single block of the tarball to a raw deflate stream, primed with the tail of the previous block.
+// Every block but the last one ends with a sync flush, so that they end on a byte boundary,
+// and can simply be concatenated into a single deflate stream, like pigz does.
+static void
+    ktgz_deflate_block(struct ktgz_block* block)
+{
+	z_stream strm;
+	size_t   bound;
+	int      ret;
+	uint64_t stats_start = kt_stats_start();
+
+	block->status = -1;
+	block->crc    = crc32(0L, block->in, (uInt) block->in_len);
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, block->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return;
+	}
+	if (block->dict_len > 0 && deflateSetDictionary(&strm, block->dict, (uInt) block->dict_len) != Z_OK) {
+		deflateEnd(&strm);
+		return;
+	}
+	// NOTE: deflateBound doesn't account for the sync flush marker, hence the extra headroom.
+	bound = deflateBound(&strm, (uLong) block->in_len) + 16U;
+	if (bound > block->out_size) {
+		unsigned char* out = realloc(block->out, bound);
+		if (out == NULL) {
+			deflateEnd(&strm);
+			return;
+		}
+		block->out      = out;
+		block->out_size = bound;
+	}
+
+	strm.next_in   = block->in;
+	strm.avail_in  = (uInt) block->in_len;
+	strm.next_out  = block->out;
+	strm.avail_out = (uInt) bound;
+	ret            = deflate(&strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if ((block->last && ret == Z_STREAM_END) ||
+	    (!block->last && ret == Z_OK && strm.avail_in == 0 && strm.avail_out > 0)) {
+		block->out_len = bound - strm.avail_out;
+		block->status  = 0;
+	}
+	deflateEnd(&strm);
+	kt_stats_stop(KT_STATS_COMPRESS, stats_start);
+}
+
+// Our worker pool's end of it: compress the block, and let the writer thread know it can go out.
+static void
+    ktgz_compress_block(void* data)
+{
+	struct ktgz_block* block = data;
+
+	ktgz_deflate_block(block);
+
+	pthread_mutex_lock(&block->ktgz->lock);
+	block->done = true;
+	pthread_cond_broadcast(&block->ktgz->cond);
+	pthread_mutex_unlock(&block->ktgz->lock);
+}
+
+// fwrite(), but with the same semantics as kt_write_fd.
+static int
+    ktgz_write_file(FILE* file, const unsigned char* buff, size_t len)
+{
+	if (fwrite(buff, sizeof(unsigned char), len, file) < len) {
+		return -1;
+	}
+	return 0;
+}
+
+// Our writer thread: write the compressed blocks out in order, as soon as they're ready, and recycle them.
+// NOTE: Once something went wrong, we keep recycling blocks without writing them, so that nobody waits on us forever.
+static void*
+    ktgz_writer(void* data)
+{
+	struct ktgz*       ktgz = data;
+	struct ktgz_block* block;
+	int                err;
+	// Magic, deflate, no flags, no mtime, no extra flags, Unix
+	static const unsigned char header[] = { 0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03 };
+
+	pthread_mutex_lock(&ktgz->lock);
+	for (;;) {
+		block = &ktgz->blocks[ktgz->written % ktgz->num_blocks];
+		while (!(ktgz->written < ktgz->filled && block->done) &&
+		       !(ktgz->finished && ktgz->written == ktgz->filled)) {
+			pthread_cond_wait(&ktgz->cond, &ktgz->lock);
+		}
+		if (ktgz->written == ktgz->filled) {
+			// We're done
+			break;
+		}
+		err = ktgz->error;
+		pthread_mutex_unlock(&ktgz->lock);
+
+		if (err == 0 && block->status != 0) {
+			err = ENOMEM;
+		}
+		if (err == 0 && !ktgz->header_written) {
+			if (ktgz_write_file(ktgz->file, header, sizeof(header)) != 0) {
+				err = errno != 0 ? errno : EIO;
+			}
+			ktgz->header_written = true;
+		}
+		if (err == 0) {
+			if (ktgz_write_file(ktgz->file, block->out, block->out_len) != 0) {
+				err = errno != 0 ? errno : EIO;
+			}
+			ktgz->crc = crc32_combine(ktgz->crc, block->crc, (z_off_t) block->in_len);
+			ktgz->isize += (uint32_t) block->in_len;
+		}
+
+		pthread_mutex_lock(&ktgz->lock);
+		if (err != 0 && ktgz->error == 0) {
+			ktgz->error = err;
+		}
+		block->done = false;
+		ktgz->written++;
+		pthread_cond_broadcast(&ktgz->cond);
+	}
+	pthread_mutex_unlock(&ktgz->lock);
+
+	return NULL;
+}
+
+// Hand the block we just filled over to our worker pool, and move on to the next one once it's been written out.
+// If last is set, that block ends the deflate stream.
+static int
+    ktgz_submit(struct ktgz* ktgz, bool last)
+{
+	struct ktgz_block*       block = &ktgz->blocks[ktgz->filled % ktgz->num_blocks];
+	const struct ktgz_block* prev;
+	int                      err;
+
+	// Prime it with the tail of the previous block, which we haven't had a chance to recycle yet
+	block->dict_len = 0U;
+	if (ktgz->filled > 0U) {
+		prev            = &ktgz->blocks[(ktgz->filled - 1U) % ktgz->num_blocks];
+		block->dict_len = prev->in_len < KTGZ_DICT_SIZE ? prev->in_len : KTGZ_DICT_SIZE;
+		memcpy(block->dict, prev->in + (prev->in_len - block->dict_len), block->dict_len);
+	}
+	block->level = ktgz->level;
+	block->last  = last;
+	if (kt_pool_submit(ktgz->pool, ktgz_compress_block, block) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ktgz->lock);
+	ktgz->filled++;
+	pthread_cond_broadcast(&ktgz->cond);
+	// The ring is full, wait for the writer to free up the next block
+	while (ktgz->filled - ktgz->written >= ktgz->num_blocks) {
+		pthread_cond_wait(&ktgz->cond, &ktgz->lock);
+	}
+	err = ktgz->error;
+	pthread_mutex_unlock(&ktgz->lock);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	ktgz->blocks[ktgz->filled % ktgz->num_blocks].in_len = 0U;
+	return 0;
+}
+
+// Let the writer thread drain the ring & exit
+static int
+    ktgz_finish(struct ktgz* ktgz)
+{
+	if (!ktgz->writer_running) {
+		return 0;
+	}
+	pthread_mutex_lock(&ktgz->lock);
+	ktgz->finished = true;
+	pthread_cond_broadcast(&ktgz->cond);
+	pthread_mutex_unlock(&ktgz->lock);
+	pthread_join(ktgz->writer, NULL);
+	ktgz->writer_running = false;
+
+	if (ktgz->error != 0) {
+		errno = ktgz->error;
+		return -1;
+	}
+	return 0;
+}
+
+// libarchive client write callback, splits the tarball into blocks
+static la_ssize_t
+    ktgz_write(struct archive* a, void* data, const void* buff, size_t length)
+{
+	struct ktgz*         ktgz = data;
+	const unsigned char* p    = buff;
+	size_t               left = length;
+	size_t               len;
+
+	while (left > 0) {
+		struct ktgz_block* block = &ktgz->blocks[ktgz->filled % ktgz->num_blocks];
+
+		len = KTGZ_BLOCK_SIZE - block->in_len;
+		if (len > left) {
+			len = left;
+		}
+		memcpy(block->in + block->in_len, p, len);
+		block->in_len += len;
+		p += len;
+		left -= len;
+
+		// Hand it over to the compression stage once it's full
+		if (block->in_len == KTGZ_BLOCK_SIZE && ktgz_submit(ktgz, false) != 0) {
+			archive_set_error(a, errno, "Cannot write compressed archive");
+			return -1;
+		}
+	}
+	return (la_ssize_t) length;
+}
+
+// libarchive client close callback, compresses whatever's left & ends the gzip stream
+static int
+    ktgz_close(struct archive* a, void* data)
+{
+	struct ktgz*  ktgz = data;
+	unsigned char trailer[8];
+	unsigned int  i;
+
+	if (ktgz_submit(ktgz, true) != 0 || ktgz_finish(ktgz) != 0) {
+		archive_set_error(a, errno, "Cannot write compressed archive");
+		return ARCHIVE_FATAL;
+	}
+	// CRC-32 & input size, in little-endian
+	for (i = 0; i < 4; i++) {
+		trailer[i]     = (unsigned char) ((ktgz->crc >> (8U * i)) & 0xFFU);
+		trailer[i + 4] = (unsigned char) ((ktgz->isize >> (8U * i)) & 0xFFU);
+	}
+	if (ktgz_write_file(ktgz->file, trailer, sizeof(trailer)) != 0) {
+		archive_set_error(a, errno, "Cannot write compressed archive");
+		return ARCHIVE_FATAL;
+	}
+	return ARCHIVE_OK;
+}
+
+static int
+    ktgz_init(struct ktgz* ktgz, FILE* file, int level, struct kt_pool* pool, unsigned int jobs)
+{
+	unsigned int i;
+
+	memset(ktgz, 0, sizeof(*ktgz));
+	ktgz->file  = file;
+	ktgz->level = level;
+	ktgz->pool  = pool;
+	ktgz->crc   = crc32(0L, Z_NULL, 0);
+	// Give every thread a few blocks to chew on, so that the ring doesn't fill up every time the writer hiccups
+	ktgz->num_blocks = jobs * 4U;
+	if ((ktgz->blocks = calloc(ktgz->num_blocks, sizeof(*ktgz->blocks))) == NULL) {
+		return -1;
+	}
+	pthread_mutex_init(&ktgz->lock, NULL);
+	pthread_cond_init(&ktgz->cond, NULL);
+	for (i = 0; i < ktgz->num_blocks; i++) {
+		ktgz->blocks[i].ktgz = ktgz;
+		if ((ktgz->blocks[i].in = malloc(KTGZ_BLOCK_SIZE)) == NULL) {
+			return -1;
+		}
+	}
+	if (pthread_create(&ktgz->writer, NULL, ktgz_writer, ktgz) != 0) {
+		fprintf(stderr, "Cannot spawn writer thread: %s.\n", strerror(errno));
+		return -1;
+	}
+	ktgz->writer_running = true;
+	return 0;
+}
+
+static void
+    ktgz_free(struct ktgz* ktgz)
+{
+	unsigned int i;
+
+	if (ktgz->blocks == NULL) {
+		return;
+	}
+	// NOTE: Our pool is already gone by now, so there's nothing left in flight, and the writer won't wait for long.
+	ktgz_finish(ktgz);
+	for (i = 0; i < ktgz->num_blocks; i++) {
+		free(ktgz->blocks[i].in);
+		free(ktgz->blocks[i].out);
+	}
+	free(ktgz->blocks);
+	ktgz->blocks = NULL;
+	pthread_cond_destroy(&ktgz->cond);
+	pthread_mutex_destroy(&ktgz->lock);
+}
+
+#if defined(POSIX_FADV_WILLNEED) || defined(F_RDADVISE)
+// Ask the kernel to start reading (the beginning of) that file in the background
+static void
+    kt_prefetch_hint(const char* path, int64_t size)
+{
+	int fd;
+
+	if (size > (int64_t) KT_PREFETCH_WINDOW) {
+		size = (int64_t) KT_PREFETCH_WINDOW;
+	}
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return;
+	}
+#	if defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(fd, 0, (off_t) size, POSIX_FADV_WILLNEED);
+#	else
+	struct radvisory ra = { .ra_offset = 0, .ra_count = (int) size };
+	fcntl(fd, F_RDADVISE, &ra);
+#	endif
+	close(fd);
+}
+
+// Walk one of our inputs like create_from_archive_read_disk does, staying at most KT_PREFETCH_WINDOW ahead of it.
+// Returns true if we were asked to stop.
+static bool
+    kt_prefetch_walk(struct kt_prefetch* prefetch, const char* input_filename)
+{
+	struct archive*       disk;
+	struct archive_entry* entry;
+	const char*           pathname;
+	bool                  stop = false;
+
+	disk = archive_read_disk_new();
+	if (archive_read_disk_open(disk, input_filename) != ARCHIVE_OK) {
+		archive_read_free(disk);
+		return false;
+	}
+	while (!stop && archive_read_next_header(disk, &entry) == ARCHIVE_OK) {
+		archive_read_disk_descend(disk);
+		pathname = archive_entry_pathname(entry);
+		// Skip what metadata_filter excludes, so that we stay in sync with the archiver
+		if (archive_entry_filetype(entry) != AE_IFREG || IS_SIG(pathname) || IS_DAT(pathname)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&prefetch->lock);
+		while (prefetch->hinted > prefetch->consumed + KT_PREFETCH_WINDOW && !prefetch->stop) {
+			pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+		}
+		stop = prefetch->stop;
+		prefetch->hinted += (uint64_t) archive_entry_size(entry);
+		pthread_mutex_unlock(&prefetch->lock);
+
+		if (!stop) {
+			kt_prefetch_hint(archive_entry_sourcepath(entry), archive_entry_size(entry));
+		}
+	}
+	archive_read_close(disk);
+	archive_read_free(disk);
+
+	return stop;
+}
+
+static void*
+    kt_prefetch_thread(void* data)
+{
+	struct kt_prefetch* prefetch = data;
+	unsigned int        i;
+
+	for (i = 0U; i < prefetch->total_files; i++) {
+		// There's nothing we can do to speed up stdin
+		if (strcmp(prefetch->filename[i], "-") == 0) {
+			continue;
+		}
+		if (kt_prefetch_walk(prefetch, prefetch->filename[i])) {
+			break;
+		}
+	}
+	return NULL;
+}
+#endif
+
+// Spawn our readahead stage, if that's something this platform can do
+static void
+    kt_prefetch_start(struct kt_prefetch* prefetch, char** filename, const unsigned int total_files)
+{
+	memset(prefetch, 0, sizeof(*prefetch));
+#if defined(POSIX_FADV_WILLNEED) || defined(F_RDADVISE)
+	prefetch->filename    = filename;
+	prefetch->total_files = total_files;
+	pthread_mutex_init(&prefetch->lock, NULL);
+	pthread_cond_init(&prefetch->cond, NULL);
+	if (pthread_create(&prefetch->thread, NULL, kt_prefetch_thread, prefetch) != 0) {
+		// It's just an optimization, we can live without it
+		pthread_cond_destroy(&prefetch->cond);
+		pthread_mutex_destroy(&prefetch->lock);
+		return;
+	}
+	prefetch->running = true;
+#else
+	(void) filename;
+	(void) total_files;
+#endif
+}
+
+// Let our readahead stage know that the archiver went through another file
+static void
+    kt_prefetch_consume(struct kt_prefetch* prefetch, int64_t size)
+{
+	if (prefetch == NULL || !prefetch->running) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->consumed += (uint64_t) size;
+	pthread_cond_signal(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+static void
+    kt_prefetch_stop(struct kt_prefetch* prefetch)
+{
+	if (!prefetch->running) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->stop = true;
+	pthread_cond_signal(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->lock);
+	pthread_join(prefetch->thread, NULL);
+	prefetch->running = false;
+	pthread_cond_destroy(&prefetch->cond);
+	pthread_mutex_destroy(&prefetch->lock);
+}
+
+// Archiving code inspired from libarchive tar/write.c ;).
+static int
+    kindle_create_package_archive(FILE*                         output,
+				  char**                        filename,
+				  const unsigned int            total_files,
+				  const struct rsa_private_key* rsa_pkey_file,
+				  const unsigned int            legacy,
+				  const unsigned int            real_blocksize,
+				  const unsigned int            jobs,
+				  const int                     compression_level,
+				  const struct kt_sig_cache*    sig_cache,
+				  const struct kt_prev_build*   prev,
+				  struct kt_delta*              delta)
+{
+	struct archive* a;
+	struct kttar *       kttar, kttar_storage;
+	unsigned int         i;
+	size_t               pathlen;
+	char*                signame          = NULL;
+	size_t               signame_size     = 0U;
+	char*                pathnamecpy      = NULL;
+	size_t               pathnamecpy_size = 0U;
+	const char*          display_name;
+	unsigned int         file_type_id;
+	int                  len;
+	char*                line;
+	struct kt_sha256_ctx hash;
+	uint8_t              digest[SHA256_DIGEST_SIZE];
+	unsigned char        raw_sig[CERTIFICATE_2K_SIZE];
+	struct nettle_buffer bundle_index;
+	struct stat          st;
+	struct ktgz          ktgz     = { 0 };
+	struct kt_prefetch   prefetch = { 0 };
+	char                 level_str[4];
+	unsigned int         cache_hits = 0U;
+
+	// Use a pointer for consistency, but stack-allocated storage for ease of cleanup.
+	kttar = &kttar_storage;
+	memset(kttar, 0, sizeof(*kttar));
+	nettle_buffer_init(&bundle_index);
+	// We sign files as we archive them, in the background
+	kttar->rsa_pkey  = rsa_pkey_file;
+	kttar->sig_cache = sig_cache;
+	kttar->prev      = prev;
+	kttar->delta     = delta;
+	if ((kttar->pool = kt_pool_new(jobs)) == NULL) {
+		return 1;
+	}
+	// Choose a suitable copy buffer size
+	kttar->buff_size = 64 * 1024;
+	while (kttar->buff_size < (size_t) DEFAULT_BYTES_PER_BLOCK) {
+		kttar->buff_size *= 2;
+	}
+	// Try to compensate for space we'll lose to alignment.
+	kttar->buff_size += 16 * 1024;
+
+	// Allocate a buffer for file data.
+	if ((kttar->buff = malloc(kttar->buff_size)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for archive copy buffer.\n");
+		kt_pool_free(kttar->pool);
+		return 1;
+	}
+
+	a = archive_write_new();
+	// If we have multiple threads at our disposal, we'll handle the compression ourselves
+	if (jobs <= 1U) {
+		archive_write_add_filter_gzip(a);
+		if (compression_level >= 0) {
+			snprintf(level_str, sizeof(level_str), "%d", compression_level);
+			archive_write_set_filter_option(a, "gzip", "compression-level", level_str);
+		}
+	}
+	archive_write_set_format_gnutar(a);
+
+	// These should be the default (cf. archive_write_new @ libarchive/archive_write.c), but reset them to be on the safe side...
+	archive_write_set_bytes_per_block(a, DEFAULT_BYTES_PER_BLOCK);
+	// NOTE: Unlike archive_write_open_fd, archive_write_open_FILE doesn't check whether we're writing to a regular file,
+	//       so the default (-1) would zero-pad the gzip stream to a full block. Don't.
+	archive_write_set_bytes_in_last_block(a, 1);
+
+	if (jobs <= 1U) {
+		archive_write_open_FILE(a, output);
+	} else {
+		if (ktgz_init(&ktgz,
+			      output,
+			      compression_level >= 0 ? compression_level : Z_DEFAULT_COMPRESSION,
+			      kttar->pool,
+			      jobs) != 0) {
+			fprintf(stderr, "Cannot allocate memory for archive compression buffers.\n");
+			goto cleanup;
+		}
+		archive_write_open(a, &ktgz, NULL, ktgz_write, ktgz_close);
+	}
+
+	// If we have threads to spare, read ahead of ourselves, so that the disk doesn't sit idle while we compress
+	if (jobs > 1U) {
+		kt_prefetch_start(&prefetch, filename, total_files);
+		kttar->prefetch = &prefetch;
+	}
+
+	// Loop over our input files/directories...
+	for (i = 0; i < total_files; i++) {
+		// Don't tweak entries pathname by default
+		kttar->tweak_pointer_index = 0;
+		// Check if we want to behave like Yifan's KindleTool
+		if (legacy && strcmp(filename[i], "-") != 0) {
+			if (stat(filename[i], &st) == 0) {
+				if (S_ISDIR(st.st_mode)) {
+					kttar->tweak_pointer_index = strlen(filename[i]);    // Flawfinder: ignore
+				}
+			}
+		}
+
+		// Populate & write our entries from a tar stream on stdin...
+		if (strcmp(filename[i], "-") == 0) {
+			if (create_from_archive_read_stream(kttar, a, real_blocksize) != 0) {
+				goto cleanup;
+			}
+			continue;
+		}
+		// Or from read_disk_open's directory walking...
+		if (create_from_archive_read_disk(kttar, a, filename[i], real_blocksize) != 0) {
+			goto cleanup;
+		}
+	}
+	kt_prefetch_stop(&prefetch);
+	// Hash whatever is left in the last batch
+	if (kttar_batch_flush(kttar) != 0) {
+		goto cleanup;
+	}
+	// And remove whatever is gone since the delta base
+	if (delta != NULL && kindle_create_delta_script(kttar, a, legacy) != 0) {
+		goto cleanup;
+	}
+
+	// Wait for the signatures, and check that they all went fine
+	kt_pool_wait(kttar->pool);
+	for (i = 0; i < kttar->num_files; i++) {
+		if (kttar->files[i].sig->status != 0) {
+			fprintf(stderr, "Cannot sign '%s'.\n", kttar->files[i].pathname);
+			goto cleanup;
+		}
+		if (kttar->files[i].sig->cached) {
+			cache_hits++;
+		}
+	}
+	if (prev != NULL) {
+		fprintf(stderr, "Reused %u of %u payload files from the previous build.\n", kttar->reused, kttar->num_files);
+	}
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	if (sig_cache != NULL) {
+		fprintf(stderr,
+			"Reused %u of %u signatures from the cache in '%s'.\n",
+			cache_hits,
+			kttar->num_files - kttar->reused,
+			sig_cache->dir);
+		// Only bother trimming the cache if we actually added something to it
+		if (cache_hits + kttar->reused < kttar->num_files) {
+			sig_cache_evict(sig_cache);
+		}
+	}
+#endif
+
+	// And now loop again over the stuff we signed, to append the sigfiles to the archive, and build the bundle index.
+	// We do all of that in memory, there's no need for tempfiles for such small things.
+	for (i = 0; i < kttar->num_files; i++) {
+		const struct kttar_file* file = &kttar->files[i];
+
+		// Always use the tweaked paths
+		// (they're properly set to the real path when we're not in legacy mode)
+		pathlen = strlen(file->tweaked_pathname);    // Flawfinder: ignore
+		if (kttar_scratch(&signame, &signame_size, pathlen + 4 + 1) != 0) {
+			goto cleanup;
+		}
+		snprintf(signame, pathlen + 4 + 1, "%s.%s", file->tweaked_pathname, "sig");
+		// The payload was hashed & signed while we were archiving it, we just have to write it down
+		if (write_memory_entry(a, signame, file->sig->raw_sig, rsa_pkey_file->size, 0644) != 0) {
+			goto cleanup;
+		}
+
+		// The last field is a display name, take a hint from the Python tool,
+		// and use the file's basename with a simple suffix.
+		// Use a copy of the pathname to get our basename,
+		// since the POSIX implementation may alter its arg, and that would be very bad...
+		pathlen = strlen(file->pathname);    // Flawfinder: ignore
+		if (kttar_scratch(&pathnamecpy, &pathnamecpy_size, pathlen + 1) != 0) {
+			goto cleanup;
+		}
+		memcpy(pathnamecpy, file->pathname, pathlen + 1);
+		display_name = basename(pathnamecpy);
+		// Only flag kernels in recovery update...
+		// FWIW, the format is as follows:
+		//   file_type_id md5sum file_name blocksize file_display_name
+		// where the id is 1 for kernel images (in recovery updates only),
+		// 129 for install scripts, and 128 for assets,
+		// and the blocksize is based on the file size relative to the update type blocksize.
+		file_type_id =
+		    (real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(file->pathname))
+			? 1U
+		    : (IS_SCRIPT(file->pathname) || IS_SHELL(file->pathname))
+			? 129U
+			: 128U;
+		// Figure out how much room we need first, so we can print straight into the buffer
+		len = snprintf(NULL,
+			       0,
+			       "%u %s %s %jd %s_ktool_file\n",
+			       file_type_id,
+			       file->sig->md5,
+			       file->tweaked_pathname,
+			       (intmax_t) file->size / real_blocksize,
+			       display_name);
+		if (len < 0 || (line = (char*) nettle_buffer_space(&bundle_index, (size_t) len + 1U)) == NULL) {
+			fprintf(stderr, "Cannot write to bundle index file.\n");
+			goto cleanup;
+		}
+		snprintf(line,
+			 (size_t) len + 1U,
+			 "%u %s %s %jd %s_ktool_file\n",
+			 file_type_id,
+			 file->sig->md5,
+			 file->tweaked_pathname,
+			 (intmax_t) file->size / real_blocksize,
+			 display_name);
+		// Don't keep the NUL, the next line will overwrite it
+		bundle_index.size--;
+	}
+	free(signame);
+	signame = NULL;
+	free(pathnamecpy);
+	pathnamecpy = NULL;
+
+	// Now that the bundle index is complete, sign it, and append it & its sigfile to the archive
+	kt_sha256_init(&hash);
+	kt_sha256_update(&hash, bundle_index.size, bundle_index.contents);
+	kt_sha256_digest(&hash, digest);
+	if (sign_sha256_digest(digest, rsa_pkey_file, raw_sig) < 0) {
+		fprintf(stderr, "Cannot sign '%s'.\n", INDEX_FILE_NAME);
+		goto cleanup;
+	}
+	if (write_memory_entry(a, INDEX_FILE_NAME ".sig", raw_sig, rsa_pkey_file->size, 0644) != 0) {
+		goto cleanup;
+	}
+	if (write_memory_entry(a, INDEX_FILE_NAME, bundle_index.contents, bundle_index.size, 0644) != 0) {
+		goto cleanup;
+	}
+	nettle_buffer_clear(&bundle_index);
+
+	free(kttar->buff);
+	free(kttar->files);
+	free(kttar->batch.data);
+	kt_arena_free(&kttar->arena);
+	// NOTE: Closing the archive may still need the pool to compress the tail end of it
+	if (archive_write_close(a) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_write_close() failed: %s.\n", archive_error_string(a));
+		archive_write_free(a);
+		kt_pool_free(kttar->pool);
+		ktgz_free(&ktgz);
+		return 1;
+	}
+	archive_write_free(a);
+	kt_pool_free(kttar->pool);
+	ktgz_free(&ktgz);
+
+	// Print a warning if no scripts were detected (in an OTA update)...
+	if (!kttar->has_script && real_blocksize == BLOCK_SIZE) {
+		fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+		fprintf(stderr, "@ No script was detected in your input, this update package won't do a thing! @\n");
+		fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+	}
+	// If we're building a recovery update, warn that this possibly isn't the brightest idea, given the very specific requirements...
+	if (real_blocksize == RECOVERY_BLOCK_SIZE) {
+		fprintf(stderr,
+			"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+		fprintf(stderr,
+			"@ You're building a recovery update from scratch! Make sure you know what you're doing... @\n");
+		fprintf(stderr,
+			"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+	}
+
+	return 0;
+
+cleanup:
+	kt_prefetch_stop(&prefetch);
+	archive_write_close(a);
+	archive_write_free(a);
+	// NOTE: This waits for pending jobs, which is what we want, since they point to stuff we're about to free...
+	kt_pool_free(kttar->pool);
+	ktgz_free(&ktgz);
+	nettle_buffer_clear(&bundle_index);
+	// Free what we might have alloc'ed
+	free(signame);
+	free(pathnamecpy);
+	// The big stuff, too...
+	free(kttar->buff);
+	free(kttar->files);
+	free(kttar->batch.data);
+	kt_arena_free(&kttar->arena);
+	return 1;
+}
+
+// Build an update wrapped in a signature envelope (i.e., SP01 header + signature, followed by the actual update).
+// If output is seekable, we reserve the envelope, stream the update straight to output while hashing it,
+// and back-patch the signature in place once we're done.
+// Otherwise, we have to go through a tempfile, since the envelope needs to be written first.
+static int
+    kindle_create_wrapped(const UpdateInformation* info,
+			  FILE*                    input_tgz,
+			  FILE*                    output,
+			  const bool               fake_sign,
+			  int (*create_update)(const UpdateInformation*, FILE*, FILE*, const bool, struct kt_sha256_ctx*))
+{
+	struct kt_input in;
+	FILE*           temp;
+	off_t           sig_pos;
+	off_t           temp_size;
+	int             r;
+
+	// If we asked for an unsigned package, there's no envelope to speak of, just write the update
+	if (fake_sign) {
+		if (create_update(info, input_tgz, output, fake_sign, NULL) < 0) {
+			fprintf(stderr, "Error creating update package.\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	sig_pos = ftello(output);
+	if (sig_pos != -1 && fseeko(output, sig_pos, SEEK_SET) == 0) {
+		struct kt_sha256_ctx hash;
+		uint8_t              digest[SHA256_DIGEST_SIZE];
+		// NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway...
+		unsigned char        raw_sig[CERTIFICATE_2K_SIZE] = { 0 };
+		off_t                end_pos;
+
+		if (info->sign_pkey.size > sizeof(raw_sig)) {
+			fprintf(stderr, "Invalid RSA key size (%zu > %zu).\n", info->sign_pkey.size, sizeof(raw_sig));
+			return -1;
+		}
+		// Reserve the envelope, we'll come back for the signature
+		if (kindle_write_signature_header(info, output) < 0) {
+			return -1;
+		}
+		if (fwrite(raw_sig, sizeof(unsigned char), info->sign_pkey.size, output) < info->sign_pkey.size) {
+			fprintf(stderr, "Error writing update signature: %s.\n", strerror(errno));
+			return -1;
+		}
+		// Create the update, hashing it as it's written
+		kt_sha256_init(&hash);
+		if (create_update(info, input_tgz, output, fake_sign, &hash) < 0) {
+			fprintf(stderr, "Error creating update package.\n");
+			return -1;
+		}
+		kt_sha256_digest(&hash, digest);
+		if (sign_sha256_digest(digest, &info->sign_pkey, raw_sig) < 0) {
+			fprintf(stderr, "Error signing update package.\n");
+			return -1;
+		}
+		// Back-patch it
+		if ((end_pos = ftello(output)) == -1 ||
+		    fseeko(output, sig_pos + MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE, SEEK_SET) != 0 ||
+		    fwrite(raw_sig, sizeof(unsigned char), info->sign_pkey.size, output) < info->sign_pkey.size ||
+		    fseeko(output, end_pos, SEEK_SET) != 0) {
+			fprintf(stderr, "Error writing update signature: %s.\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	if ((temp = kt_tmpfile()) == NULL) {
+		fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
+		return -1;
+	}
+	// Create the update
+	if (create_update(info, input_tgz, temp, fake_sign, NULL) < 0) {
+		fprintf(stderr, "Error creating update package.\n");
+		fclose(temp);
+		return -1;
+	}
+	if ((temp_size = ftello(temp)) > 0) {
+		kt_stats_add(KT_STATS_TEMP_BYTES, (uint64_t) temp_size);
+	}
+	rewind(temp);    // Rewind the file before reading back
+	// Write the signature
+	if (kindle_create_signature(info, temp, output) < 0) {
+		fprintf(stderr, "Error signing update package.\n");
+		fclose(temp);
+		return -1;
+	}
+	rewind(temp);    // Rewind the file before writing it to output
+	// Write the update
+	kt_input_open(&in, temp);
+	r = kt_input_copy(&in, output, false);
+	kt_input_close(&in);
+	if (r < 0) {
+		fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
+		fclose(temp);
+		return -1;
+	}
+	fclose(temp);
+	return 0;
+}
+
+static int
+    kindle_create(const UpdateInformation* info, FILE* input_tgz, FILE* output, const bool fake_sign)
+{
+	struct kt_input in;
+	int             r;
+
+	switch (info->version) {
+		case OTAUpdateV2:
+			return kindle_create_wrapped(info, input_tgz, output, fake_sign, kindle_create_ota_update_v2);
+			break;
+		case OTAUpdate:
+			return kindle_create_ota_update(info, input_tgz, output, fake_sign, NULL);
+			break;
+		case RecoveryUpdate:
+			// NOTE: I was assuming that this, even FB02 @ rev. 2, shouldn't be wrapped in an UpdateSignature...
+			//       That happened to be the case until Rex, where the target ota field also appeared...
+			//       So wrap FB02h2 by default, you can always unwrap it later if need be...
+			if (memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2) {
+				return kindle_create_wrapped(info, input_tgz, output, fake_sign, kindle_create_recovery);
+			} else {
+				return kindle_create_recovery(info, input_tgz, output, fake_sign, NULL);
+			}
+			break;
+		case RecoveryUpdateV2:
+			return kindle_create_wrapped(info, input_tgz, output, fake_sign, kindle_create_recovery_v2);
+			break;
+		case UpdateSignature:
+			// NOTE: Should only be reached when building a signed userdata package
+			// We only need to sign the input tarball...
+			if (kindle_create_signature(info, input_tgz, output) < 0) {
+				fprintf(stderr, "Error signing userdata package.\n");
+				return -1;
+			}
+			rewind(input_tgz);
+			// ...And then simply append the input tarball as-is (possibly without it ever leaving the kernel)
+			kt_input_open(&in, input_tgz);
+			r = kt_input_copy(&in, output, false);
+			kt_input_close(&in);
+			if (r < 0) {
+				fprintf(stderr, "Error appending userdata tarball to output: %s.\n", strerror(errno));
+				return -1;
+			}
+			return 0;
+			break;
+		case UnknownUpdate:
+		default:
+			fprintf(stderr, "Unknown update type.\n");
+			break;
+	}
+	return -1;
+}
+
+// Write the header, followed by the (munged) payload, and fill in the MD5 of the demunged payload the header expects.
+// If output is seekable, that's done in a single pass: the MD5 is computed while the payload streams through,
+// and back-patched in the header's slot (at md5_offset) afterwards.
+// Otherwise, we have to hash the payload first, and munge it in a second pass.
+// If sha256 is set, it's fed everything we write, in order, so we can't back-patch anything, and always take the latter route.
+// If payload_md5 is set, we don't have to hash anything ourselves, and simply use it.
+static int
+    kindle_write_update(unsigned char*        header,
+			size_t                header_size,
+			size_t                md5_offset,
+			FILE*                 input_tgz,
+			FILE*                 output,
+			const bool            fake_sign,
+			const char*           payload_md5,
+			struct kt_sha256_ctx* sha256)
+{
+	// If we already know the MD5 of the payload (f.g., when building variants), we can write everything in one go
+	if (payload_md5 != NULL) {
+		memcpy(&header[md5_offset], payload_md5, MD5_HASH_LENGTH);
+		md(&header[md5_offset], MD5_HASH_LENGTH);    // Obfuscate md5 hash
+		if (fwrite(header, sizeof(unsigned char), header_size, output) < header_size) {
+			fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+			return -1;
+		}
+		if (sha256 != NULL) {
+			kt_sha256_update(sha256, header_size, header);
+		}
+		return munger_md5(input_tgz, output, fake_sign, NULL, sha256);
+	}
+
+	off_t header_pos = (sha256 == NULL) ? ftello(output) : -1;
+	if (header_pos != -1 && fseeko(output, header_pos, SEEK_SET) == 0) {
+		off_t end_pos;
+
+		// Reserve the slot, we'll come back for it
+		memset(&header[md5_offset], 0, MD5_HASH_LENGTH);
+		if (fwrite(header, sizeof(unsigned char), header_size, output) < header_size) {
+			fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+			return -1;
+		}
+		if (munger_md5(input_tgz, output, fake_sign, (char*) &header[md5_offset], NULL) < 0) {
+			fprintf(stderr, "Error calculating MD5 of package.\n");
+			return -1;
+		}
+		md(&header[md5_offset], MD5_HASH_LENGTH);    // Obfuscate md5 hash
+		// Back-patch it
+		if ((end_pos = ftello(output)) == -1 || fseeko(output, header_pos + (off_t) md5_offset, SEEK_SET) != 0 ||
+		    fwrite(&header[md5_offset], sizeof(unsigned char), MD5_HASH_LENGTH, output) < MD5_HASH_LENGTH ||
+		    fseeko(output, end_pos, SEEK_SET) != 0) {
+			fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	// Even if we asked for a fake package, the Kindle still expects a proper package...
+	// munger_md5 takes care of hashing the deobfuscated tarball to fake it ;)
+	if (munger_md5(input_tgz, NULL, fake_sign, (char*) &header[md5_offset], NULL) < 0) {
+		fprintf(stderr, "Error calculating MD5 of package.\n");
+		return -1;
+	}
+	rewind(input_tgz);                           // Reset input for later reading
+	md(&header[md5_offset], MD5_HASH_LENGTH);    // Obfuscate md5 hash
+
+	// Now, we write the header to the file
+	if (fwrite(header, sizeof(unsigned char), header_size, output) < header_size) {
+		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+		return -1;
+	}
+	if (sha256 != NULL) {
+		kt_sha256_update(sha256, header_size, header);
+	}
+
+	// Write the actual update
+	return munger_md5(input_tgz, output, fake_sign, NULL, sha256);
+}
+
+static int
+    kindle_create_ota_update_v2(const UpdateInformation* info,
+				FILE*                    input_tgz,
+				FILE*                    output,
+				const bool               fake_sign,
+				struct kt_sha256_ctx*    sha256)
+{
+	size_t         header_size;
+	unsigned char* header;
+	size_t         hindex = 0;
+	int            i;
+	size_t         md5_offset;
+	size_t         str_len;
+	int            ret;
+
+	// First part of the set sized data
+	header_size = MAGIC_NUMBER_LENGTH + OTA_UPDATE_V2_BLOCK_SIZE;
+	header      = malloc(header_size);
+	strncpy((char*) header, info->magic_number, MAGIC_NUMBER_LENGTH);    // Flawfinder: ignore
+	hindex += MAGIC_NUMBER_LENGTH;
+	memcpy(&header[hindex], &info->source_revision, sizeof(uint64_t));    // Source
+	hindex += sizeof(uint64_t);
+	memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t));    // Target
+	hindex += sizeof(uint64_t);
+	memcpy(&header[hindex], &info->num_devices, sizeof(uint16_t));    // Device count
+	hindex += sizeof(uint16_t);
+
+	// Next, we write the devices
+	header_size += info->num_devices * sizeof(uint16_t);
+	header = realloc(header, header_size);
+	for (i = 0; i < info->num_devices; i++) {
+		memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t));    // Device
+		hindex += sizeof(uint16_t);
+	}
+
+	// Part two of the set sized data
+	header_size += OTA_UPDATE_V2_PART_2_BLOCK_SIZE;
+	header = realloc(header, header_size);
+	memcpy(&header[hindex], &info->critical, sizeof(uint8_t));    // Critical
+	hindex += sizeof(uint8_t);
+	memset(&header[hindex], 0, sizeof(uint8_t));    // 1 byte padding
+	hindex += sizeof(uint8_t);
+
+	// The md5 hash of the payload, filled in by kindle_write_update
+	md5_offset = hindex;
+	hindex += MD5_HASH_LENGTH;
+	memcpy(&header[hindex], &info->num_meta, sizeof(uint16_t));    // num_meta, cannot be cast
+	hindex += sizeof(uint16_t);
+
+	// Next, we write the meta strings
+	for (i = 0; i < info->num_meta; i++) {
+		str_len = strlen(info->metastrings[i]);    // Flawfinder: ignore
+		header_size += str_len + sizeof(uint16_t);
+		header = realloc(header, header_size);
+		// String length: little endian -> big endian
+		// FIXME: While otaup expects this endianness switch, it would seem that otacheck doesn't,
+		//        and chokes with an headerTooShortInMetadataField error as soon as we pass more than one metastring...
+		//        If we don't switch the endianness, otacheck passes, but otaup chokes... >_<"
+		memcpy(&header[hindex], &((uint8_t*) &str_len)[1], sizeof(uint8_t));
+		hindex += sizeof(uint8_t);
+		memcpy(&header[hindex], &((uint8_t*) &str_len)[0], sizeof(uint8_t));
+		hindex += sizeof(uint8_t);
+		// Obfuscate meta string
+		// FIXME: Should this really be munged? Following otaup would point to yes,
+		//        but I've never seen an update with meta strings in the wild,
+		//        and the aforementionned issue with the string length doesn't help...
+		// NOTE: Do it in the header, not in place, since info may be used to write more than one package.
+		memcpy(&header[hindex], info->metastrings[i], str_len);
+		md(&header[hindex], str_len);
+		hindex += str_len;
+	}
+
+	// Now, we write the header & the actual update to the file
+	ret = kindle_write_update(
+	    header, header_size, md5_offset, input_tgz, output, fake_sign, info->payload_md5, sha256);
+	free(header);
+	return ret;
+}
+
+static int
+    kindle_write_signature_header(const UpdateInformation* info, FILE* output)
+{
+	UpdateHeader header;    // Header to write
+
+	memset(&header, 0, sizeof(UpdateHeader));                                          // Zero init
+	memcpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH);                          // Write magic number
+	header.data.signature.certificate_number = (uint32_t) info->certificate_number;    // 4 byte certificate number
+	if (fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE, output) <
+	    MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE) {
+		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+    kindle_create_signature(const UpdateInformation* info, FILE* input_bin, FILE* output)
+{
+	if (kindle_write_signature_header(info, output) < 0) {
+		return -1;
+	}
+	// Write signature to output
+	if (sign_file(input_bin, &info->sign_pkey, output) < 0) {
+		fprintf(stderr, "Error signing update package payload.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+    kindle_create_ota_update(const UpdateInformation* info,
+			     FILE*                    input_tgz,
+			     FILE*                    output,
+			     const bool               fake_sign,
+			     struct kt_sha256_ctx*    sha256)
+{
+	UpdateHeader header;
+
+	memset(&header, 0, sizeof(UpdateHeader));    // Zero init
+	// Flawfinder: ignore
+	strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);        // Magic number
+	header.data.ota_update.source_revision = (uint32_t) info->source_revision;    // Source
+	header.data.ota_update.target_revision = (uint32_t) info->target_revision;    // Target
+	header.data.ota_update.device          = (uint16_t) info->devices[0];         // Device
+	header.data.ota_update.optional        = (unsigned char) info->optional;      // Optional
+
+	// Write header & package to output
+	return kindle_write_update((unsigned char*) &header,
+				   MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE,
+				   offsetof(UpdateHeader, data.ota_update.md5_sum),
+				   input_tgz,
+				   output,
+				   fake_sign,
+				   info->payload_md5,
+				   sha256);
+}
+
+static int
+    kindle_create_recovery(const UpdateInformation* info,
+			   FILE*                    input_tgz,
+			   FILE*                    output,
+			   const bool               fake_sign,
+			   struct kt_sha256_ctx*    sha256)
+{
+	UpdateHeader header;
+
+	memset(&header, 0, sizeof(UpdateHeader));    // Zero init
+
+	// Flawfinder: ignore
+	strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);    // Magic number
+	header.data.recovery_update.magic_1 = (uint32_t) info->magic_1;           // Magic 1
+	header.data.recovery_update.magic_2 = (uint32_t) info->magic_2;           // Magic 2
+	header.data.recovery_update.minor   = (uint32_t) info->minor;             // Minor
+
+	// Handle FB02 with a V2 Header Rev. Different length, but still fixed...
+	if (info->header_rev == 2) {
+		// NOTE: It expects some new stuff that I'm not too sure about... Here be dragons.
+		// NOTE: Target OTA is optional, appeared (and is mandatory there) on Rex
+		//       (where those are also wrapped in a signature envelope!)
+		header.data.recovery_h2_update.target_revision = (uint64_t) info->target_revision;
+		header.data.recovery_h2_update.platform        = (uint32_t) info->platform;
+		header.data.recovery_h2_update.header_rev      = (uint32_t) info->header_rev;
+		header.data.recovery_h2_update.board           = (uint32_t) info->board;
+	} else {
+		// Assume what we did before was okay, and put a device id in there...
+		header.data.recovery_update.device = (uint32_t) info->devices[0];    // Device
+	}
+
+	// Write header & package to output
+	// NOTE: The md5 lives at the same offset in both header revisions
+	return kindle_write_update((unsigned char*) &header,
+				   MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE,
+				   offsetof(UpdateHeader, data.recovery_update.md5_sum),
+				   input_tgz,
+				   output,
+				   fake_sign,
+				   info->payload_md5,
+				   sha256);
+}
+
+static int
+    kindle_create_recovery_v2(const UpdateInformation* info,
+			      FILE*                    input_tgz,
+			      FILE*                    output,
+			      const bool               fake_sign,
+			      struct kt_sha256_ctx*    sha256)
+{
+	size_t         header_size;
+	unsigned char* header;
+	size_t         hindex = 0;
+	int            i;
+	size_t         md5_offset;
+	unsigned char  recovery_num_devices;
+	int            ret;
+
+	// Its total size is fixed, but some stuff inside is variable/padded...
+	header_size = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
+	header      = malloc(header_size);
+	// Zero init everything first...
+	memset(header, 0, header_size);
+
+	// Flawfinder: ignore
+	strncpy((char*) header, info->magic_number, MAGIC_NUMBER_LENGTH);
+	hindex += MAGIC_NUMBER_LENGTH;
+	hindex += sizeof(uint32_t);                                           // Padding
+	memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t));    // Target
+	hindex += sizeof(uint64_t);
+
+	// The md5 hash of the payload, filled in by kindle_write_update
+	md5_offset = hindex;
+	hindex += MD5_HASH_LENGTH;
+
+	memcpy(&header[hindex], &info->magic_1, sizeof(uint32_t));    // Magic 1
+	hindex += sizeof(uint32_t);
+	memcpy(&header[hindex], &info->magic_2, sizeof(uint32_t));    // Magic 2
+	hindex += sizeof(uint32_t);
+	memcpy(&header[hindex], &info->minor, sizeof(uint32_t));    // Minor
+	hindex += sizeof(uint32_t);
+	memcpy(&header[hindex], &info->platform, sizeof(uint32_t));    // Platform
+	hindex += sizeof(uint32_t);
+	memcpy(&header[hindex], &info->header_rev, sizeof(uint32_t));    // Header rev
+	hindex += sizeof(uint32_t);
+	memcpy(&header[hindex], &info->board, sizeof(uint32_t));    // Board
+	hindex += sizeof(uint32_t);
+
+	hindex += sizeof(uint32_t);                                         // Padding
+	hindex += sizeof(uint16_t);                                         // ... Padding
+	hindex += sizeof(uint8_t);                                          // And more weird padding
+	recovery_num_devices = (uint8_t) info->num_devices;                 // u16 to u8...
+	memcpy(&header[hindex], &recovery_num_devices, sizeof(uint8_t));    // Device count
+	hindex += sizeof(uint8_t);
+
+	for (i = 0; i < info->num_devices; i++) {
+		memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t));    // Device
+		hindex += sizeof(uint16_t);
+	}
+
+	// Now, we write the header & the actual update to the file
+	ret = kindle_write_update(
+	    header, header_size, md5_offset, input_tgz, output, fake_sign, info->payload_md5, sha256);
+	free(header);
+	return ret;
+}
+
+// Append the device(s) matching name to info's device list, and guess a sensible magic number for them.
+// name can be a device, an alias, an hex device code, a serial fragment, or auto.
+static int
+    parse_device(UpdateInformation* info, const char* name)
+{
+	const struct kt_device_alias* alias = kt_device_alias_lookup(name);
+
+	// Named devices & aliases come from the device table, and handle their memory allocation in one shot.
+	if (alias != NULL && (!alias->unknown_only || kt_with_unknown_devcodes)) {
+		if (alias->magic_number[0] != '\0') {
+			memcpy(info->magic_number, alias->magic_number, MAGIC_NUMBER_LENGTH);
+		}
+		info->devices = realloc(info->devices, (info->num_devices + alias->count) * sizeof(Device));
+		info->num_devices =
+		    (uint16_t)(info->num_devices + kt_device_alias_expand(alias, info->devices + info->num_devices));
+	} else {
+		info->devices = realloc(info->devices, ++info->num_devices * sizeof(Device));
+		// N/A
+		if (strcasecmp(name, "none") == 0) {
+			info->devices[info->num_devices - 1] = KindleUnknown;
+			// We *really* mean no devices, so reset num_devices ;).
+			info->num_devices = 0;
+		} else if (strcasecmp(name, "auto") == 0 || strcasecmp(name, "current") == 0) {
+			// Detect the current Kindle model
+			FILE* kindle_usid;
+			// NOTE: Newer devices also have /proc/serial?
+			if ((kindle_usid = fopen("/proc/usid", "rb")) == NULL) {
+				fprintf(
+				    stderr,
+				    "Cannot open /proc/usid (not running on a Kindle?): %s.\n",
+				    strerror(errno));
+				return -1;
+			}
+			unsigned char serial_no[SERIAL_NO_LENGTH];
+			if (fread(serial_no, sizeof(unsigned char), SERIAL_NO_LENGTH, kindle_usid) < SERIAL_NO_LENGTH ||
+			    ferror(kindle_usid) != 0) {
+				fprintf(stderr, "Error reading /proc/usid: %s.\n", strerror(errno));
+				fclose(kindle_usid);
+				return -1;
+			}
+			fclose(kindle_usid);
+			// Get the device code...
+			char   device_code[3 + 1] = { 0 };
+			Device dev_code           = KindleUnknown;
+			// NOTE: If the S/N starts with B or 9,
+			//       assume it's an older device with an hexadecimal device code
+			if (serial_no[0] == 'B' || serial_no[0] == '9') {
+				snprintf(device_code, 2 + 1, "%.*s", 2, serial_no + 2);
+				dev_code = (Device) strtoul(device_code, NULL, 16);
+				// ... And finally, unless we're feeling adventurous,
+				// check if it's really a valid device...
+				if (!kt_with_unknown_devcodes && kt_device_lookup(dev_code) == NULL) {
+					fprintf(stderr,
+						"Unknown device %s (0x%02X) [%.6s].\n",
+						device_code,
+						dev_code,
+						serial_no);
+					return -1;
+				}
+			} else {
+				// ... try the new device ID scheme if it doesn't...
+				snprintf(device_code, 3 + 1, "%.*s", 3, serial_no + 3);
+				dev_code = (Device) from_base(device_code, 32);
+				// ... And finally, unless we're feeling adventurous,
+				// check if it's really a valid device...
+				if (!kt_with_unknown_devcodes && kt_device_lookup(dev_code) == NULL) {
+					fprintf(stderr,
+						"Unknown device %s (0x%03X) [%.6s].\n",
+						device_code,
+						dev_code,
+						serial_no);
+					return -1;
+				}
+			}
+			// Yay, known valid device code :)
+			info->devices[info->num_devices - 1] = dev_code;
+			// Roughly guess a decent magic number...
+			if (dev_code < Kindle4NonTouch) {
+				memcpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+			} else if (dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack) {
+				memcpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+			} else {
+				memcpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+			}
+		} else {
+			// Check if we passed a device code, be it as a ready-to-use hex value,
+			// or a to-be-decoded serial fragment...
+			char*  endptr;
+			Device dev_code = (Device) strtoul(name, &endptr, 16);
+			// Check that it even remotely looks like a device code, old or new, first...
+			// NOTE: The range is 01 to 0VF for now, update as needed!
+			if (*endptr != '\0' || dev_code <= 0x00 || dev_code > 0x3AF) {
+				// That was either an out of range hexadecimal value,
+				// or not an hexadecimal value at all...
+				if (kt_device_lookup(dev_code) == NULL) {
+					// ... in which case, try to see if that was
+					// a serial fragment following the new device id scheme...
+					dev_code = (Device) from_base(name, 32);
+					// Unless we're feeling adventurous,
+					// check if it's a valid device...
+					if (!kt_with_unknown_devcodes &&
+					    kt_device_lookup(dev_code) == NULL) {
+						fprintf(stderr, "Unknown device %s (0x%03X).\n", name, dev_code);
+						return -1;
+					}
+				}
+			} else {
+				// Okay, that looked like an in-range hex value,
+				// make sure it matches an hex-only device id if
+				// we're not bypassing device checks...
+				if (!kt_with_unknown_devcodes && kt_device_lookup(dev_code) == NULL) {
+					fprintf(stderr, "Unknown device %s (0x%02X).\n", name, dev_code);
+					return -1;
+				}
+			}
+			// Yay, known valid device code :)
+			info->devices[info->num_devices - 1] = dev_code;
+			// Roughly guess a decent magic number...
+			if (dev_code < Kindle4NonTouch) {
+				memcpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+			} else if (dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack) {
+				memcpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+			} else {
+				memcpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int
+    parse_platform(UpdateInformation* info, const char* name)
+{
+	if (strcasecmp(name, "unspecified") == 0) {
+		info->platform = Plat_Unspecified;
+	} else if (strcasecmp(name, "mario") == 0) {
+		info->platform = MarioDeprecated;
+	} else if (strcasecmp(name, "luigi") == 0) {
+		info->platform = Luigi;
+	} else if (strcasecmp(name, "banjo") == 0) {
+		info->platform = Banjo;
+	} else if (strcasecmp(name, "yoshi") == 0) {
+		info->platform = Yoshi;
+	} else if (strcasecmp(name, "yoshime-proto") == 0 || strcasecmp(name, "yoshime-p") == 0) {
+		info->platform = YoshimeProto;
+	} else if (strcasecmp(name, "yoshime") == 0) {
+		info->platform = Yoshime;
+	} else if (strcasecmp(name, "wario") == 0) {
+		info->platform = Wario;
+	} else if (strcasecmp(name, "duet") == 0) {
+		info->platform = Duet;
+	} else if (strcasecmp(name, "heisenberg") == 0) {
+		info->platform = Heisenberg;
+	} else if (strcasecmp(name, "zelda") == 0) {
+		info->platform = Zelda;
+	} else if (strcasecmp(name, "rex") == 0) {
+		info->platform = Rex;
+	} else if (strcasecmp(name, "bellatrix") == 0) {
+		info->platform = Bellatrix;
+	} else {
+		fprintf(stderr, "Unknown platform %s.\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+    parse_board(UpdateInformation* info, const char* name)
+{
+	if (strcasecmp(name, "unspecified") == 0) {
+		info->board = Board_Unspecified;
+	} else if (strcasecmp(name, "tequila") == 0) {
+		info->board = Tequila;
+	} else if (strcasecmp(name, "whitney") == 0) {
+		info->board = Whitney;
+	} else {
+		fprintf(stderr, "Unknown board %s.\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Set info up for the given update type (ota2, ota, recovery2, recovery or sig)
+static int
+    kindle_create_set_type(UpdateInformation* info, const char* type, unsigned int* real_blocksize)
+{
+	if (strncmp(type, "ota2", 4) == 0) {
+		info->version = OTAUpdateV2;
+		memcpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+		*real_blocksize = BLOCK_SIZE;
+	} else if (strncmp(type, "ota", 3) == 0) {
+		info->version = OTAUpdate;
+		memcpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+		info->target_revision = UINT32_MAX;
+		*real_blocksize       = BLOCK_SIZE;
+	} else if (strncmp(type, "recovery2", 9) == 0) {
+		info->version = RecoveryUpdateV2;
+		memcpy(info->magic_number, "FB03", MAGIC_NUMBER_LENGTH);
+		*real_blocksize = RECOVERY_BLOCK_SIZE;
+		// FB03 is at header_rev 0, don't force it to 2
+	} else if (strncmp(type, "recovery", 8) == 0) {
+		info->version = RecoveryUpdate;
+		memcpy(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH);
+		info->target_revision = UINT32_MAX;
+		*real_blocksize       = RECOVERY_BLOCK_SIZE;
+	} else if (strncmp(type, "sig", 3) == 0) {
+		info->version = UpdateSignature;
+		// For reference only, since we only support converting an existing tarball, we don't really care about that...
+		//memcpy(info->magic_number, "SP01", MAGIC_NUMBER_LENGTH);
+		*real_blocksize = BLOCK_SIZE;
+	} else {
+		fprintf(stderr, "'%s' is not a valid update type.\n", type);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Our commandline switches (the variants manifest & libkindletool use a subset of them)
+static const struct option kindle_create_opts[] = { { "device", required_argument, NULL, 'd' },
+						    { "key", required_argument, NULL, 'k' },
+						    { "bundle", required_argument, NULL, 'b' },
+						    { "srcrev", required_argument, NULL, 's' },
+						    { "tgtrev", required_argument, NULL, 't' },
+						    { "magic1", required_argument, NULL, '1' },
+						    { "magic2", required_argument, NULL, '2' },
+						    { "minor", required_argument, NULL, 'm' },
+						    { "platform", required_argument, NULL, 'p' },
+						    { "board", required_argument, NULL, 'B' },
+						    { "hdrrev", required_argument, NULL, 'h' },
+						    { "cert", required_argument, NULL, 'c' },
+						    { "opt", required_argument, NULL, 'o' },
+						    { "crit", required_argument, NULL, 'r' },
+						    { "meta", required_argument, NULL, 'x' },
+						    { "archive", no_argument, NULL, 'a' },
+						    { "unsigned", no_argument, NULL, 'u' },
+						    { "userdata", no_argument, NULL, 'U' },
+						    { "ota", no_argument, NULL, 'O' },
+						    { "legacy", no_argument, NULL, 'C' },
+						    { "packaging", no_argument, NULL, 'X' },
+						    { "jobs", required_argument, NULL, 'j' },
+						    { "compression-level", required_argument, NULL, 'z' },
+						    { "variants", required_argument, NULL, 'V' },
+						    { "sig-cache", required_argument, NULL, 'K' },
+						    { "sig-cache-size", required_argument, NULL, 'S' },
+						    { "incremental", required_argument, NULL, 'I' },
+						    { "delta-from", required_argument, NULL, 'D' },
+						    { "delta-root", required_argument, NULL, 'R' },
+						    { "stats", optional_argument, NULL, 'T' },
+						    { "mem-budget", required_argument, NULL, 'M' },
+						    { NULL, 0, NULL, 0 } };
+
+// Apply one of the switches describing the update header to info
+// (shared by the commandline & the variants manifest, since the latter accepts the same switches).
+static int
+    kindle_create_set_option(UpdateInformation* info,
+			     int                opt,
+			     const char*        arg,
+			     bool*              enforce_source_rev,
+			     bool*              enforce_target_rev)
+{
+	switch (opt) {
+		case 'd':
+			return parse_device(info, arg);
+			break;
+		case 'p':
+			return parse_platform(info, arg);
+			break;
+		case 'B':
+			return parse_board(info, arg);
+			break;
+		case 'h':
+			info->header_rev = (uint32_t) atoi(arg);
+			break;
+		case 'b':
+			strncpy(info->magic_number, arg, MAGIC_NUMBER_LENGTH);    // Flawfinder: ignore
+			if ((info->version = get_bundle_version(arg)) == UnknownUpdate) {
+				fprintf(stderr, "Invalid bundle version %s.\n", arg);
+				return -1;
+			}
+			break;
+		case 's':
+			// Handle "min" as a special value
+			if (strcasecmp(arg, "min") == 0) {
+				info->source_revision = 0;
+			} else {
+				info->source_revision = strtoull(arg, NULL, 0);
+			}
+			*enforce_source_rev = true;
+			break;
+		case 't':
+			// And, arguably more useful, handle "max" as a special value
+			if (strcasecmp(arg, "max") == 0) {
+				// NOTE: Given the way we handle commands vs. args, by now, info->version should be accurate.
+				if (info->version == OTAUpdateV2 || info->version == RecoveryUpdateV2 ||
+				    (info->version == RecoveryUpdate && info->header_rev == 2)) {
+					info->target_revision = UINT64_MAX;
+				} else {
+					info->target_revision = UINT32_MAX;
+				}
+			} else {
+				info->target_revision = strtoull(arg, NULL, 0);
+			}
+			*enforce_target_rev = true;
+			break;
+		case '1':
+			info->magic_1 = (uint32_t) atoi(arg);
+			break;
+		case '2':
+			info->magic_2 = (uint32_t) atoi(arg);
+			break;
+		case 'm':
+			info->minor = (uint32_t) atoi(arg);
+			break;
+		case 'c':
+			info->certificate_number = (CertificateNumber) atoi(arg);
+			break;
+		case 'o':
+			info->optional = (uint8_t) atoi(arg);
+			break;
+		case 'r':
+			info->critical = (uint8_t) atoi(arg);
+			break;
+		case 'x':
+			// A metastring must contain an '=' character (remember, it's a key=value pair ;))
+			if (strchr(arg, '=') == NULL) {
+				fprintf(stderr, "Invalid metastring. Format: key=value, input: %s\n", arg);
+				return -1;
+			}
+			// Flawfinder: ignore
+			if (strlen(arg) > 0xFFFFu) {
+				fprintf(stderr,
+					"Metastring too long. Max length: %u, input length: %zu\n",
+					0xFFFFu,
+					strlen(arg));    // Flawfinder: ignore
+				return -1;
+			}
+			info->metastrings = realloc(info->metastrings, ++info->num_meta * sizeof(char*));
+			info->metastrings[info->num_meta - 1] = strdup(arg);
+			break;
+		default:
+			fprintf(stderr, "?? Unknown option code 0%o ??\n", (unsigned int) opt);
+			return -1;
+			break;
+	}
+
+	return 0;
+}
+
+// Validate (and fix up, when it makes sense) the header settings of an update package
+static int
+    kindle_create_check_info(UpdateInformation* info,
+			     const bool         userdata_only,
+			     const bool         enforce_ota,
+			     const bool         enforce_source_rev,
+			     const bool         enforce_target_rev)
+{
+	// Signed userdata packages are very peculiar, handle them on their own...
+	if (userdata_only) {
+		// Needs to be a signed package
+		if (info->version != UpdateSignature) {
+			fprintf(stderr,
+				"Invalid update type (%s) for an userdata package.\n",
+				convert_bundle_version(info->version));
+			return -1;
+		}
+	} else {
+		// Did we want to enforce an OTA bundle type?
+		if (enforce_ota) {
+			// Only makes sense for ota2...
+			if (info->version != OTAUpdateV2) {
+				fprintf(
+				    stderr,
+				    "Invalid update type (%s). Enforcing the versioned OTA bundle type only makes sense for OTA V2.\n",
+				    convert_bundle_version(info->version));
+				return -1;
+			}
+			// We of course need the versioned ota bundle type...
+			memcpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+			// But also a source & target version!
+			if (!enforce_source_rev) {
+				info->source_revision = 2443670049U;    // FW 5.5.0
+			}
+			if (!enforce_target_rev) {
+				info->target_revision = 3732030038U + 1U;    // FW 5.13.6 (KT3)
+			}
+			// NOTE: Don't expect those to be entirely consistent when crossing devices
+			//       (f.g., the Touch's FW 5.3.7.3 has a higher OTA build number than the KV's FW 5.5.0)
+			// NOTE: The VoiceView packages may sometimes have a slightly higher Target OTA flag, f.g.,
+			//       while FW 5.10.1.2 was at 3360340004, the PW4 VoiceView packages targeted 3372830002,
+			//       which turned out to be FW 5.10.1.3
+			// NOTE: In a fun, new, twist, FW 5.12.2.1.1 appears to prevent same-to-same updates, hence the + 1...
+		}
+		// Musn't be *only* a sig envelope...
+		if (info->version == UpdateSignature) {
+			fprintf(stderr,
+				"Invalid update type (%s) for an update package.\n",
+				convert_bundle_version(info->version));
+			return -1;
+		}
+		// Validation (Allow 0 devices in Recovery V2 & FB02 h2, allow multiple devices in OTA V2 & Recovery V2)
+		if ((info->num_devices < 1 &&
+		     (info->version != RecoveryUpdateV2 && !(info->version == RecoveryUpdate && info->header_rev == 2))) ||
+		    ((info->version != OTAUpdateV2 && info->version != RecoveryUpdateV2) && info->num_devices > 1)) {
+			fprintf(stderr,
+				"Invalid number of supported devices (%hu) for this update type (%s).\n",
+				info->num_devices,
+				convert_bundle_version(info->version));
+			return -1;
+		}
+		if ((info->version != OTAUpdateV2 && info->version != RecoveryUpdateV2 &&
+		     !(info->version == RecoveryUpdate && info->header_rev == 2)) &&
+		    (info->source_revision > UINT32_MAX || info->target_revision > UINT32_MAX)) {
+			fprintf(stderr,
+				"Source/target revision for this update type (%s) cannot exceed %u.\n",
+				convert_bundle_version(info->version),
+				UINT32_MAX);
+			return -1;
+		}
+		// When building an ota update with ota2 only devices, don't try to use non ota v1 bundle versions,
+		// reset it to FC02, or shit happens.
+		if (info->version == OTAUpdate) {
+			// OTA V1 only supports one device, we don't need to loop (fix anything newer than a K3GB)
+			if (info->devices[0] > Kindle3WiFi3GEurope &&
+			    (memcmp(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH) != 0 &&
+			     memcmp(info->magic_number, "FD03", MAGIC_NUMBER_LENGTH) != 0)) {
+				// FC04 is hardcoded when we set K4 as a device, and FD04 when we ask for a K5 and up, so fix it silently.
+				memcpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+			}
+		}
+		// Same thing with recovery updates
+		if (info->version == RecoveryUpdate) {
+			// It's called FB02.2 for a reason...
+			// Plus, we can have a null/none device with it, so we avoid the same blowup as the RecoveryV2 check ;).
+			if ((info->header_rev == 2 || info->devices[0] > Kindle3WiFi3GEurope) &&
+			    (memcmp(info->magic_number, "FB01", MAGIC_NUMBER_LENGTH) != 0 &&
+			     memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) != 0)) {
+				memcpy(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH);
+			}
+		}
+		// Same thing with recovery updates v2
+		if (info->version == RecoveryUpdateV2) {
+			// Make sure we have a sane magic number...
+			// We either don't yet have one set when not specifying any device,
+			// or what's set corresponds to OTA update types when specifying anything since the K4...
+			if (memcmp(info->magic_number, "FB03", MAGIC_NUMBER_LENGTH) != 0) {
+				// NOTE: This effectively prevents us from setting a custom magic number.
+				//       Which is not really something you'd want to do in this case anyway...
+				memcpy(info->magic_number, "FB03", MAGIC_NUMBER_LENGTH);
+			}
+		}
+		// We need a platform id, board id (& header rev?) for recovery2
+		if (info->version == RecoveryUpdateV2) {
+			if (!kt_platform_known(info->platform)) {
+				fprintf(stderr,
+					"You need to set a platform for this update type (%s).\n",
+					convert_bundle_version(info->version));
+				return -1;
+			}
+			if (!kt_board_known(info->board)) {
+				fprintf(stderr,
+					"You need to set a board for this update type (%s).\n",
+					convert_bundle_version(info->version));
+				return -1;
+			}
+			// Don't bother for header rev? We don't for other potentially optional flags in recovery, so...
+		}
+		// We need a platform id & board id for recovery FB02 V2
+		if (info->version == RecoveryUpdate) {
+			if (memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2 &&
+			    !kt_platform_known(info->platform)) {
+				fprintf(stderr,
+					"You need to set a platform for this update type (%s).\n",
+					convert_bundle_version(info->version));
+				return -1;
+			}
+			if (memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2 &&
+			    !kt_board_known(info->board)) {
+				fprintf(stderr,
+					"You need to set a board for this update type (%s).\n",
+					convert_bundle_version(info->version));
+				return -1;
+			}
+		}
+		// Right now, we don't use device at all for FB02.2, so reset it to none to have a consistent recap... FIXME?
+		if (info->version == RecoveryUpdate) {
+			if (memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2 &&
+			    info->num_devices > 0) {
+				info->num_devices               = 0;
+				info->devices[info->num_devices] = KindleUnknown;
+			}
+		}
+		// We of course need a full magic number...
+		// As magic_number is not NULL terminated, we cannot use strlen,
+		// so let one of our helper functions do the job...
+		if (get_bundle_version(info->magic_number) == UnknownUpdate) {
+			fprintf(stderr,
+				"You need to set a valid bundle version for this update type (%s), '%s' is invalid.\n",
+				convert_bundle_version(info->version),
+				info->magic_number);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Check that our output name follows the proper naming scheme when creating a valid update package
+static int
+    kindle_create_check_output_name(const UpdateInformation* info,
+				    const char*              output_filename,
+				    const bool               fake_sign,
+				    const bool               userdata_only)
+{
+	char*                 valid_update_file_pattern = NULL;
+	struct archive_entry* entry;
+	struct archive*       match;
+	int                   r;
+
+	// Use libarchive's pattern matching, because it handles ./ in a smart way
+	match = archive_match_new();
+	entry = archive_entry_new();
+
+	// Handle signed & fake userdata packages...
+	if (fake_sign || userdata_only) {
+		valid_update_file_pattern = strdup("./data\\.stgz$");
+	} else {
+		// NOTE: Recovery updates must be lowercase!
+		if (info->version == RecoveryUpdate || info->version == RecoveryUpdateV2) {
+			valid_update_file_pattern = strdup("./update*\\.bin$");
+		} else {
+			valid_update_file_pattern = strdup("./[Uu]pdate*\\.bin$");
+		}
+	}
+	if (archive_match_exclude_pattern(match, valid_update_file_pattern) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(match));
+	}
+	free(valid_update_file_pattern);
+
+	archive_entry_copy_pathname(entry, output_filename);
+
+	r = archive_match_path_excluded(match, entry);
+	if (r != 1) {
+		if (r < 0) {
+			fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(match));
+		}
+		fprintf(
+		    stderr,
+		    "Your output file '%s' needs to follow the proper naming scheme (%s) in order to be picked up by the Kindle.\n",
+		    output_filename,
+		    (fake_sign || userdata_only) ? "data.stgz" : "update*.bin");
+#if defined(_WIN32) && !defined(__CYGWIN__)
+		fprintf(
+		    stderr,
+		    "As an added quirk, on Windows, make sure you're using UNIX-style forward slashes ('/') in your output file path, instead of Windows-style backward slashes ('\\'), and do NOT leave any trailing slashes.\n");
+#endif
+		archive_entry_free(entry);
+		archive_match_free(match);
+		return -1;
+	}
+
+	// Cleanup
+	archive_entry_free(entry);
+	archive_match_free(match);
+
+	return 0;
+}
+
+// Recap (to stderr, in order not to mess stuff up if we output to stdout) what we're building
+static void
+    kindle_create_print_recap(const UpdateInformation* info,
+			      const char*              output_filename,
+			      const char*              tarball_filename,
+			      const bool               legacy,
+			      const bool               fake_sign,
+			      const bool               skip_archive,
+			      const bool               userdata_only)
+{
+	int i;
+
+	// Again, a signed userdata package is the ugly duckling...
+	if (userdata_only) {
+		fprintf(stderr,
+			"Building userdata package '%s' directly from '%s' (signed with cert %u).\n",
+			output_filename,
+			tarball_filename,
+			(uint32_t) info->certificate_number);
+	} else {
+		fprintf(stderr,
+			"Building %s%s%s (%.*s) update package '%s'%s%s%s%s for",
+			(legacy ? "(in legacy mode) " : ""),
+			(fake_sign ? "fake " : ""),
+			(convert_bundle_version(info->version)),
+			MAGIC_NUMBER_LENGTH,
+			info->magic_number,
+			output_filename,
+			(skip_archive ? " directly from " : ""),
+			(skip_archive ? "'" : ""),
+			(skip_archive ? tarball_filename : ""),
+			(skip_archive ? "'" : ""));
+		// If we have specific device IDs, list them
+		if (info->num_devices > 0) {
+			fprintf(stderr, " %hu device%s:\n", info->num_devices, (info->num_devices > 1 ? "s" : ""));
+			// Loop over devices
+			for (i = 0; i < info->num_devices; i++) {
+				fprintf(stderr, "\t%s", convert_device_id(info->devices[i]));
+				if (i != info->num_devices - 1) {
+					fprintf(stderr, "\n");
+				}
+			}
+			fprintf(stderr, "\n");
+		} else {
+			fprintf(stderr, " no specific device\n");
+		}
+		// Don't print settings not applicable to our update type...
+		switch (info->version) {
+			case OTAUpdateV2:
+				if (info->target_revision == UINT64_MAX) {
+					fprintf(
+					    stderr,
+					    "With the following flags: Min. OTA: %llu, Target OTA: MAX, Critical: %hhu, Cert: %u & %hu Metadata strings%s",
+					    (long long unsigned int) info->source_revision,
+					    info->critical,
+					    (uint32_t) info->certificate_number,
+					    info->num_meta,
+					    (info->num_meta ? " (" : ".\n"));
+				} else {
+					fprintf(
+					    stderr,
+					    "With the following flags: Min. OTA: %llu, Target OTA: %llu, Critical: %hhu, Cert: %u & %hu Metadata strings%s",
+					    (long long unsigned int) info->source_revision,
+					    (long long unsigned int) info->target_revision,
+					    info->critical,
+					    (uint32_t) info->certificate_number,
+					    info->num_meta,
+					    (info->num_meta ? " (" : ".\n"));
+				}
+				// Loop over meta
+				for (i = 0; i < info->num_meta; i++) {
+					fprintf(stderr, "%s", info->metastrings[i]);
+					if (i != info->num_meta - 1) {
+						fprintf(stderr, "; ");
+					} else {
+						fprintf(stderr, ").\n");
+					}
+				}
+				break;
+			case OTAUpdate:
+				if (info->target_revision == UINT32_MAX) {
+					fprintf(
+					    stderr,
+					    "With the following flags: Min. OTA: %llu, Target OTA: MAX, Optional: %hhu.\n",
+					    (long long unsigned int) info->source_revision,
+					    info->optional);
+				} else {
+					fprintf(
+					    stderr,
+					    "With the following flags: Min. OTA: %llu, Target OTA: %llu, Optional: %hhu.\n",
+					    (long long unsigned int) info->source_revision,
+					    (long long unsigned int) info->target_revision,
+					    info->optional);
+				}
+				break;
+			case RecoveryUpdate:
+				fprintf(stderr,
+					"With the following flags: Minor: %u, Magic 1: %u, Magic 2: %u",
+					info->minor,
+					info->magic_1,
+					info->magic_2);
+				if (memcmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2) {
+					if (info->target_revision == UINT64_MAX) {
+						fprintf(stderr,
+							", Header Rev: %u, Target OTA: MAX, Platform: %s, Board: %s.\n",
+							info->header_rev,
+							convert_platform_id(info->platform),
+							convert_board_id(info->board));
+					} else {
+						fprintf(stderr,
+							", Header Rev: %u, Target OTA: %llu, Platform: %s, Board: %s.\n",
+							info->header_rev,
+							(long long unsigned int) info->target_revision,
+							convert_platform_id(info->platform),
+							convert_board_id(info->board));
+					}
+				} else {
+					fprintf(stderr, ".\n");
+				}
+				break;
+			case RecoveryUpdateV2:
+				fprintf(stderr, "With the following flags:");
+				if (info->target_revision == UINT64_MAX) {
+					fprintf(stderr, " Target OTA: MAX");
+				} else {
+					fprintf(
+					    stderr, " Target OTA: %llu", (long long unsigned int) info->target_revision);
+				}
+				fprintf(
+				    stderr,
+				    ", Minor: %u, Magic 1: %u, Magic 2: %u, Header Rev: %u, Cert: %u, Platform: %s, Board: %s.\n",
+				    info->minor,
+				    info->magic_1,
+				    info->magic_2,
+				    info->header_rev,
+				    (uint32_t) info->certificate_number,
+				    convert_platform_id(info->platform),
+				    convert_board_id(info->board));
+				break;
+			case UnknownUpdate:
+			default:
+				fprintf(stderr, "\n\n!!!!\nUnknown update type, we shouldn't ever hit this!\n!!!!\n");
+				break;
+		}
+	}
 }
 
+// Apply a list of header switches (same syntax as on the commandline, f.g., -d pw2 --tgtrev=max) to info.
+// The first device switch replaces info's device list, the next ones add to it.
 static int
-    kindle_create_ota_update(const UpdateInformation* info, FILE* input_tgz, FILE* output, const bool fake_sign)
+    kindle_create_apply_switches(UpdateInformation* info,
+				 const char* const* args,
+				 int                num_args,
+				 bool*              enforce_source_rev,
+				 bool*              enforce_target_rev)
 {
-	UpdateHeader header;
-	FILE*        obfuscated_tgz;
-
-	obfuscated_tgz = NULL;
+	bool reset_devices = true;
 
-	memset(&header, 0, sizeof(UpdateHeader));    // Zero init
-	// Flawfinder: ignore
-	strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);        // Magic number
-	header.data.ota_update.source_revision = (uint32_t) info->source_revision;    // Source
-	header.data.ota_update.target_revision = (uint32_t) info->target_revision;    // Target
-	header.data.ota_update.device          = (uint16_t) info->devices[0];         // Device
-	header.data.ota_update.optional        = (unsigned char) info->optional;      // Optional
+	for (int i = 0; i < num_args; i++) {
+		const char* value = NULL;
+		int         opt   = 0;
 
-	if (fake_sign) {
-		if ((obfuscated_tgz = tmpfile()) == NULL) {
-			fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-			return -1;
+		if (strncmp(args[i], "--", 2) == 0) {
+			const char* name     = args[i] + 2;
+			size_t      name_len = strcspn(name, "=");
+			for (const struct option* o = kindle_create_opts; o->name != NULL; o++) {
+				// Flawfinder: ignore
+				if (strlen(o->name) == name_len && strncmp(o->name, name, name_len) == 0) {
+					opt = o->val;
+					break;
+				}
+			}
+			if (name[name_len] == '=') {
+				value = name + name_len + 1;
+			}
+		} else if (args[i][0] == '-' && args[i][1] != '\0') {
+			opt = args[i][1];
+			if (args[i][2] != '\0') {
+				value = args[i] + 2;
+			}
 		}
-		demunger(input_tgz, obfuscated_tgz, 0, false);
-		rewind(input_tgz);
-		rewind(obfuscated_tgz);
-		if (md5_sum(obfuscated_tgz, header.data.ota_update.md5_sum) < 0) {
-			fprintf(stderr, "Error calculating MD5 of package.\n");
+		if (opt == 0 || opt == ':' || strchr(VARIANT_SWITCHES, opt) == NULL) {
+			fprintf(stderr, "Unsupported switch '%s'.\n", args[i]);
 			return -1;
 		}
-		fclose(obfuscated_tgz);
-	} else {
-		if (md5_sum(input_tgz, header.data.ota_update.md5_sum) < 0) {
-			fprintf(stderr, "Error calculating MD5 of input tgz.\n");
+		if (value == NULL) {
+			if (++i == num_args) {
+				fprintf(stderr, "Missing argument for switch '%s'.\n", args[i - 1]);
+				return -1;
+			}
+			value = args[i];
+		}
+		if (opt == 'd' && reset_devices) {
+			free(info->devices);
+			info->devices     = NULL;
+			info->num_devices = 0;
+			reset_devices     = false;
+		}
+		if (kindle_create_set_option(info, opt, value, enforce_source_rev, enforce_target_rev) != 0) {
 			return -1;
 		}
-		rewind(input_tgz);    // Rewind input
-	}
-	md((unsigned char*) header.data.ota_update.md5_sum, MD5_HASH_LENGTH);    // Obfuscate md5 hash
-
-	// Write header to output
-	if (fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE, output) <
-	    MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE) {
-		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-		return -1;
 	}
 
-	// Write package to output
-	return munger(input_tgz, output, 0, fake_sign);
+	return 0;
 }
 
+// Parse a variants manifest: one package per line, starting with its output filename,
+// followed by the header switches that differ from the commandline (f.g., update_pw2.bin -d pw2 -d kt2 -t max).
+// Everything else is inherited from the commandline. Blank lines & lines starting with a # are skipped.
 static int
-    kindle_create_recovery(const UpdateInformation* info, FILE* input_tgz, FILE* output, const bool fake_sign)
+    kindle_create_parse_variants(const char*                manifest_filename,
+				 const UpdateInformation*   base,
+				 const bool                 enforce_source_rev,
+				 const bool                 enforce_target_rev,
+				 struct kt_create_variant** variants,
+				 unsigned int*              num_variants)
 {
-	UpdateHeader header;
-	FILE*        obfuscated_tgz;
-
-	obfuscated_tgz = NULL;
-
-	memset(&header, 0, sizeof(UpdateHeader));    // Zero init
-
-	// Flawfinder: ignore
-	strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);    // Magic number
-	header.data.recovery_update.magic_1 = (uint32_t) info->magic_1;           // Magic 1
-	header.data.recovery_update.magic_2 = (uint32_t) info->magic_2;           // Magic 2
-	header.data.recovery_update.minor   = (uint32_t) info->minor;             // Minor
-
-	// Handle FB02 with a V2 Header Rev. Different length, but still fixed...
-	if (info->header_rev == 2) {
-		// NOTE: It expects some new stuff that I'm not too sure about... Here be dragons.
-		// NOTE: Target OTA is optional, appeared (and is mandatory there) on Rex
-		//       (where those are also wrapped in a signature envelope!)
-		header.data.recovery_h2_update.target_revision = (uint64_t) info->target_revision;
-		header.data.recovery_h2_update.platform        = (uint32_t) info->platform;
-		header.data.recovery_h2_update.header_rev      = (uint32_t) info->header_rev;
-		header.data.recovery_h2_update.board           = (uint32_t) info->board;
-	} else {
-		// Assume what we did before was okay, and put a device id in there...
-		header.data.recovery_update.device = (uint32_t) info->devices[0];    // Device
+	FILE*        manifest;
+	char         line[VARIANT_LINE_MAX];
+	char*        args[VARIANT_ARGS_MAX];
+	int          num_args;
+	unsigned int line_number = 0U;
+	int          i;
+
+	if ((manifest = fopen(manifest_filename, "rb")) == NULL) {
+		fprintf(stderr, "Cannot open variants manifest '%s': %s.\n", manifest_filename, strerror(errno));
+		return -1;
 	}
+	while (fgets(line, sizeof(line), manifest) != NULL) {
+		struct kt_create_variant* variant;
 
-	if (fake_sign) {
-		if ((obfuscated_tgz = tmpfile()) == NULL) {
-			fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-			return -1;
+		line_number++;
+		if (strchr(line, '\n') == NULL && !feof(manifest)) {
+			fprintf(stderr, "Line %u of variants manifest '%s' is too long.\n", line_number, manifest_filename);
+			goto cleanup;
 		}
-		demunger(input_tgz, obfuscated_tgz, 0, false);
-		rewind(input_tgz);
-		rewind(obfuscated_tgz);
-		if (md5_sum(obfuscated_tgz, header.data.recovery_update.md5_sum) < 0) {
-			fprintf(stderr, "Error calculating MD5 of package.\n");
-			return -1;
+		// Split it on whitespace
+		num_args = 0;
+		for (char* p = line; *p != '\0';) {
+			while (isspace((unsigned char) *p)) {
+				p++;
+			}
+			if (*p == '\0') {
+				break;
+			}
+			if (num_args == VARIANT_ARGS_MAX) {
+				fprintf(stderr,
+					"Too many switches on line %u of variants manifest '%s'.\n",
+					line_number,
+					manifest_filename);
+				goto cleanup;
+			}
+			args[num_args++] = p;
+			while (*p != '\0' && !isspace((unsigned char) *p)) {
+				p++;
+			}
+			if (*p != '\0') {
+				*p++ = '\0';
+			}
 		}
-		fclose(obfuscated_tgz);
-	} else {
-		if (md5_sum(input_tgz, header.data.recovery_update.md5_sum) < 0) {
-			fprintf(stderr, "Error calculating MD5 of input tgz.\n");
-			return -1;
+		if (num_args == 0 || args[0][0] == '#') {
+			continue;
+		}
+
+		// Start from what we got on the commandline...
+		*variants = realloc(*variants, (*num_variants + 1U) * sizeof(**variants));
+		variant   = &(*variants)[(*num_variants)++];
+		memset(variant, 0, sizeof(*variant));
+		variant->info               = *base;
+		variant->info.devices       = NULL;
+		variant->info.num_devices   = 0;
+		variant->info.metastrings   = NULL;
+		variant->info.num_meta      = 0;
+		variant->output_filename    = strdup(args[0]);
+		variant->enforce_source_rev = enforce_source_rev;
+		variant->enforce_target_rev = enforce_target_rev;
+		if (base->num_devices > 0) {
+			variant->info.devices = malloc(base->num_devices * sizeof(Device));
+			memcpy(variant->info.devices, base->devices, base->num_devices * sizeof(Device));
+			variant->info.num_devices = base->num_devices;
+		}
+		if (base->num_meta > 0) {
+			variant->info.metastrings = malloc(base->num_meta * sizeof(char*));
+			for (i = 0; i < base->num_meta; i++) {
+				variant->info.metastrings[i] = strdup(base->metastrings[i]);
+			}
+			variant->info.num_meta = base->num_meta;
+		}
+
+		// ...and apply the line's switches on top of it
+		if (kindle_create_apply_switches(&variant->info,
+						 (const char* const*) &args[1],
+						 num_args - 1,
+						 &variant->enforce_source_rev,
+						 &variant->enforce_target_rev) != 0) {
+			fprintf(stderr, "On line %u of variants manifest '%s'.\n", line_number, manifest_filename);
+			goto cleanup;
 		}
-		rewind(input_tgz);    // Rewind input
 	}
-	md((unsigned char*) header.data.recovery_update.md5_sum, MD5_HASH_LENGTH);    // Obfuscate md5 hash
+	if (ferror(manifest) != 0) {
+		fprintf(stderr, "Error reading variants manifest '%s': %s.\n", manifest_filename, strerror(errno));
+		goto cleanup;
+	}
+	fclose(manifest);
 
-	// Write header to output
-	if (fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE, output) <
-	    MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE) {
-		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+	if (*num_variants == 0U) {
+		fprintf(stderr, "Variants manifest '%s' doesn't describe any package.\n", manifest_filename);
 		return -1;
 	}
+	return 0;
 
-	// Write package to output
-	return munger(input_tgz, output, 0, fake_sign);
+cleanup:
+	// NOTE: The caller is in charge of freeing whatever we managed to parse
+	fclose(manifest);
+	return -1;
 }
 
-static int
-    kindle_create_recovery_v2(const UpdateInformation* info, FILE* input_tgz, FILE* output, const bool fake_sign)
+static void
+    kindle_create_free_variants(struct kt_create_variant* variants, unsigned int num_variants)
 {
-	size_t         header_size;
-	unsigned char* header;
-	size_t         hindex = 0;
-	int            i;
-	FILE*          demunged_tgz;
-	unsigned char  recovery_num_devices;
-
-	demunged_tgz = NULL;
-
-	// Its total size is fixed, but some stuff inside is variable/padded...
-	header_size = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
-	header      = malloc(header_size);
-	// Zero init everything first...
-	memset(header, 0, header_size);
-
-	// Flawfinder: ignore
-	strncpy((char*) header, info->magic_number, MAGIC_NUMBER_LENGTH);
-	hindex += MAGIC_NUMBER_LENGTH;
-	hindex += sizeof(uint32_t);                                           // Padding
-	memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t));    // Target
-	hindex += sizeof(uint64_t);
+	int i;
 
-	// Even if we asked for a fake package, the Kindle still expects a proper package...
-	// md5 hash a temp deobfuscated tarball to fake it ;)
-	if (fake_sign) {
-		if ((demunged_tgz = tmpfile()) == NULL) {
-			fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-			free(header);
-			return -1;
-		}
-		demunger(input_tgz, demunged_tgz, 0, false);
-		rewind(input_tgz);
-		rewind(demunged_tgz);
-		if (md5_sum(demunged_tgz, (char*) &header[hindex]) < 0) {
-			fprintf(stderr, "Error calculating MD5 of fake package.\n");
-			free(header);
-			return -1;
+	for (unsigned int v = 0U; v < num_variants; v++) {
+		free(variants[v].info.devices);
+		for (i = 0; i < variants[v].info.num_meta; i++) {
+			free(variants[v].info.metastrings[i]);
 		}
-		fclose(demunged_tgz);
-	} else {
-		if (md5_sum(input_tgz, (char*) &header[hindex]) < 0)    // md5 hash
-		{
-			fprintf(stderr, "Error calculating MD5 of package.\n");
-			free(header);
-			return -1;
-		}
-		rewind(input_tgz);    // Reset input for later reading
+		free(variants[v].info.metastrings);
+		free(variants[v].output_filename);
 	}
+	free(variants);
+}
 
-	md(&header[hindex], MD5_HASH_LENGTH);    // Obfuscate md5 hash
-	hindex += MD5_HASH_LENGTH;
-
-	memcpy(&header[hindex], &info->magic_1, sizeof(uint32_t));    // Magic 1
-	hindex += sizeof(uint32_t);
-	memcpy(&header[hindex], &info->magic_2, sizeof(uint32_t));    // Magic 2
-	hindex += sizeof(uint32_t);
-	memcpy(&header[hindex], &info->minor, sizeof(uint32_t));    // Minor
-	hindex += sizeof(uint32_t);
-	memcpy(&header[hindex], &info->platform, sizeof(uint32_t));    // Platform
-	hindex += sizeof(uint32_t);
-	memcpy(&header[hindex], &info->header_rev, sizeof(uint32_t));    // Header rev
-	hindex += sizeof(uint32_t);
-	memcpy(&header[hindex], &info->board, sizeof(uint32_t));    // Board
-	hindex += sizeof(uint32_t);
+// Do the expensive one-time setup (i.e., parsing our default key) right now, for serve's sake
+void
+    kindle_create_preload(void)
+{
+	struct rsa_private_key rsa_pkey = get_default_key();
 
-	hindex += sizeof(uint32_t);                                         // Padding
-	hindex += sizeof(uint16_t);                                         // ... Padding
-	hindex += sizeof(uint8_t);                                          // And more weird padding
-	recovery_num_devices = (uint8_t) info->num_devices;                 // u16 to u8...
-	memcpy(&header[hindex], &recovery_num_devices, sizeof(uint8_t));    // Device count
-	hindex += sizeof(uint8_t);
+	rsa_private_key_clear(&rsa_pkey);
+}
 
-	for (i = 0; i < info->num_devices; i++) {
-		memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t));    // Device
-		hindex += sizeof(uint16_t);
+// Build a package of the given type out of an already packaged tarball (i.e., like create does with a single tarball as input),
+// with the same header switches as a variants manifest line (switches is NULL terminated, and may be NULL).
+// This is what libkindletool is built on: input_tgz needs to be seekable, and so does output, unless we're building a fake package.
+int
+    kindle_create_payload(const char*        type,
+			  const char* const* switches,
+			  FILE*              input_tgz,
+			  FILE*              output,
+			  const bool         fake_sign)
+{
+	UpdateInformation info = { "\0\0\0\0",
+				   UnknownUpdate,
+				   get_default_key(),
+				   0,
+				   UINT64_MAX,
+				   0,
+				   0,
+				   0,
+				   0,
+				   NULL,
+				   0,
+				   0,
+				   0,
+				   CertificateDeveloper,
+				   0,
+				   0,
+				   0,
+				   NULL,
+				   NULL };
+	unsigned int      real_blocksize;
+	int               num_switches       = 0;
+	bool              enforce_source_rev = false;
+	bool              enforce_target_rev = false;
+	int               ret                = -1;
+	int               i;
+
+	if (kindle_create_set_type(&info, type, &real_blocksize) != 0) {
+		goto cleanup;
 	}
-
-	// Now, we write the header to the file
-	if (fwrite(header, sizeof(unsigned char), header_size, output) < header_size) {
-		fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-		free(header);
-		return -1;
+	while (switches != NULL && switches[num_switches] != NULL) {
+		num_switches++;
+	}
+	if (kindle_create_apply_switches(&info, switches, num_switches, &enforce_source_rev, &enforce_target_rev) != 0) {
+		goto cleanup;
 	}
+	// NOTE: We only ever build signed userdata packages out of the sig type
+	if (kindle_create_check_info(
+		&info, info.version == UpdateSignature, false, enforce_source_rev, enforce_target_rev) != 0) {
+		goto cleanup;
+	}
+	ret = kindle_create(&info, input_tgz, output, fake_sign);
 
-	// Write the actual update
-	free(header);
-	return munger(input_tgz, output, 0, fake_sign);
+cleanup:
+	free(info.devices);
+	for (i = 0; i < info.num_meta; i++) {
+		free(info.metastrings[i]);
+	}
+	free(info.metastrings);
+	rsa_private_key_clear(&info.sign_pkey);
+	return ret;
 }
 
 int
     kindle_create_main(int argc, char* argv[])
 {
-	int                        opt;
-	int                        opt_index;
-	static const struct option opts[] = { { "device", required_argument, NULL, 'd' },
-					      { "key", required_argument, NULL, 'k' },
-					      { "bundle", required_argument, NULL, 'b' },
-					      { "srcrev", required_argument, NULL, 's' },
-					      { "tgtrev", required_argument, NULL, 't' },
-					      { "magic1", required_argument, NULL, '1' },
-					      { "magic2", required_argument, NULL, '2' },
-					      { "minor", required_argument, NULL, 'm' },
-					      { "platform", required_argument, NULL, 'p' },
-					      { "board", required_argument, NULL, 'B' },
-					      { "hdrrev", required_argument, NULL, 'h' },
-					      { "cert", required_argument, NULL, 'c' },
-					      { "opt", required_argument, NULL, 'o' },
-					      { "crit", required_argument, NULL, 'r' },
-					      { "meta", required_argument, NULL, 'x' },
-					      { "archive", no_argument, NULL, 'a' },
-					      { "unsigned", no_argument, NULL, 'u' },
-					      { "userdata", no_argument, NULL, 'U' },
-					      { "ota", no_argument, NULL, 'O' },
-					      { "legacy", no_argument, NULL, 'C' },
-					      { "packaging", no_argument, NULL, 'X' },
-					      { NULL, 0, NULL, 0 } };
-	UpdateInformation          info   = { "\0\0\0\0",
-                                   UnknownUpdate,
-                                   get_default_key(),
-                                   0,
-                                   UINT64_MAX,
-                                   0,
-                                   0,
-                                   0,
-                                   0,
-                                   NULL,
-                                   0,
-                                   0,
-                                   0,
-                                   CertificateDeveloper,
-                                   0,
-                                   0,
-                                   0,
-                                   NULL };
-	FILE*                      input  = NULL;
-	FILE*                      output = stdout;
-	int                        i;
-	unsigned int               ui;
-	char*                      output_filename           = NULL;
-	char**                     input_list                = NULL;
-	unsigned int               input_index               = 0;
-	char*                      tarball_filename          = NULL;
-	char*                      valid_update_file_pattern = NULL;
-	int                        tarball_fd                = -1;
-	const unsigned int         num_packaging_metastrings = 3;
-	bool                       keep_archive              = false;
-	bool                       skip_archive              = false;
-	bool                       fake_sign                 = false;
-	bool                       userdata_only             = false;
-	bool                       enforce_ota               = false;
-	bool                       enforce_source_rev        = false;
-	bool                       enforce_target_rev        = false;
-	bool                       legacy                    = false;
-	unsigned int               real_blocksize;
-	struct archive_entry*      entry;
-	struct archive*            match;
-	int                        r;
+	int                       opt;
+	int                       opt_index;
+	UpdateInformation         info   = { "\0\0\0\0",
+                                  UnknownUpdate,
+                                  get_default_key(),
+                                  0,
+                                  UINT64_MAX,
+                                  0,
+                                  0,
+                                  0,
+                                  0,
+                                  NULL,
+                                  0,
+                                  0,
+                                  0,
+                                  CertificateDeveloper,
+                                  0,
+                                  0,
+                                  0,
+                                  NULL,
+                                  NULL };
+	FILE*                     input  = NULL;
+	FILE*                     output = stdout;
+	int                       i;
+	int                       r;
+	unsigned int              ui;
+	char*                     output_filename           = NULL;
+	char**                    input_list                = NULL;
+	unsigned int              input_index               = 0;
+	char*                     tarball_filename          = NULL;
+	int                       tarball_fd                = -1;
+	FILE*                     tarball                   = NULL;
+	const unsigned int        num_packaging_metastrings = 3;
+	bool                      keep_archive              = false;
+	bool                      skip_archive              = false;
+	bool                      fake_sign                 = false;
+	bool                      userdata_only             = false;
+	bool                      enforce_ota               = false;
+	bool                      enforce_source_rev        = false;
+	bool                      enforce_target_rev        = false;
+	bool                      legacy                    = false;
+	bool                      stdin_input               = false;
+	unsigned int              jobs                      = 1U;
+	int                       compression_level         = -1;
+	long                      level;
+	char*                     endptr;
+	const char*               variants_filename         = NULL;
+	struct kt_create_variant* variants                  = NULL;
+	unsigned int              num_variants              = 0U;
+	unsigned int              num_written               = 0U;
+	char                      payload_md5[MD5_HASH_LENGTH];
+	const char*               sig_cache_dir             = NULL;
+	uint64_t                  sig_cache_size            = (uint64_t) KT_SIG_CACHE_DEFAULT_MAX_MIB * 1024U * 1024U;
+	struct kt_sig_cache       sig_cache;
+	const char*               previous_filename = NULL;
+	struct kt_prev_build      prev              = { 0 };
+	const char*               delta_filename    = NULL;
+	const char*               delta_root        = NULL;
+	struct kt_delta           delta             = { 0 };
+	unsigned int              real_blocksize;
 
 	// Skip command
 	argv++;
@@ -1387,1003 +4143,37 @@ int
 		fprintf(stderr, "Not enough arguments.\n");
 		return -1;
 	}
-	if (strncmp(argv[0], "ota2", 4) == 0) {
-		info.version = OTAUpdateV2;
-		memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-		real_blocksize = BLOCK_SIZE;
-	} else if (strncmp(argv[0], "ota", 3) == 0) {
-		info.version = OTAUpdate;
-		memcpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-		info.target_revision = UINT32_MAX;
-		real_blocksize       = BLOCK_SIZE;
-	} else if (strncmp(argv[0], "recovery2", 9) == 0) {
-		info.version = RecoveryUpdateV2;
-		memcpy(info.magic_number, "FB03", MAGIC_NUMBER_LENGTH);
-		real_blocksize = RECOVERY_BLOCK_SIZE;
-		// FB03 is at header_rev 0, don't force it to 2
-	} else if (strncmp(argv[0], "recovery", 8) == 0) {
-		info.version = RecoveryUpdate;
-		memcpy(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH);
-		info.target_revision = UINT32_MAX;
-		real_blocksize       = RECOVERY_BLOCK_SIZE;
-	} else if (strncmp(argv[0], "sig", 3) == 0) {
-		info.version = UpdateSignature;
-		// For reference only, since we only support converting an existing tarball, we don't really care about that...
-		//memcpy(info.magic_number, "SP01", MAGIC_NUMBER_LENGTH);
-		real_blocksize = BLOCK_SIZE;
-	} else {
-		fprintf(stderr, "'%s' is not a valid update type.\n", argv[0]);
+	if (kindle_create_set_type(&info, argv[0], &real_blocksize) != 0) {
 		goto do_error;
 	}
 
 	// Arguments
-	while ((opt = getopt_long(argc, argv, "d:k:b:s:t:1:2:m:p:B:h:c:o:r:x:auUOCX", opts, &opt_index)) != -1) {
+	while ((opt = getopt_long(
+		    argc, argv, "d:k:b:s:t:1:2:m:p:B:h:c:o:r:x:j:z:V:K:S:I:auUOCX", kindle_create_opts, &opt_index)) != -1) {
 		switch (opt) {
 			case 'd':
-				// The aliases handle their memory allocation on their own, in one shot.
-				if (strcasecmp(optarg, "kindle4") == 0) {
-					memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 2;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = Kindle4NonTouch;
-					info.devices[info.num_devices++]       = Kindle4NonTouchBlack;
-				} else if (strcasecmp(optarg, "touch") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 3 + kt_with_unknown_devcodes;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = Kindle5TouchWiFi;
-					info.devices[info.num_devices++]       = Kindle5TouchWiFi3G;
-					info.devices[info.num_devices++]       = Kindle5TouchWiFi3GEurope;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = Kindle5TouchUnknown;
-					}
-				} else if (strcasecmp(optarg, "paperwhite") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 6;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindlePaperWhiteWiFi;
-					info.devices[info.num_devices++]       = KindlePaperWhiteWiFi3G;
-					info.devices[info.num_devices++]       = KindlePaperWhiteWiFi3GCanada;
-					info.devices[info.num_devices++]       = KindlePaperWhiteWiFi3GEurope;
-					info.devices[info.num_devices++]       = KindlePaperWhiteWiFi3GJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhiteWiFi3GBrazil;
-				} else if (strcasecmp(optarg, "paperwhite2") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 12 + (kt_with_unknown_devcodes * 2);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFiJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3G;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3GCanada;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3GEurope;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3GRussia;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3GJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi4GBInternational;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3G4GBEurope;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3G4GB;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3G4GBCanada;
-					info.devices[info.num_devices++]       = KindlePaperWhite2WiFi3G4GBBrazil;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF4;
-						info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF9;
-					}
-				} else if (strcasecmp(optarg, "basic") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 2;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleBasic;
-					info.devices[info.num_devices++]       = KindleBasicKiwi;
-				} else if (strcasecmp(optarg, "voyage") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 5 + (kt_with_unknown_devcodes * 1);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleVoyageWiFi;
-					info.devices[info.num_devices++]       = KindleVoyageWiFi3G;
-					info.devices[info.num_devices++]       = KindleVoyageWiFi3GEurope;
-					info.devices[info.num_devices++]       = KindleVoyageWiFi3GJapan;
-					info.devices[info.num_devices++]       = KindleVoyageWiFi3GMexico;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleVoyageUnknown_0x4F;
-					}
-				} else if (strcasecmp(optarg, "paperwhite3") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 12 + (kt_with_unknown_devcodes * 2);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindlePaperWhite3WiFi;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WiFi3GJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WiFi3GCanada;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WiFi3G;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WiFi3GEurope;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WiFi3GMexico;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WhiteWiFi;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WhiteWiFi3GJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhite3BlackWiFi32GBJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhite3WhiteWiFi32GBJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GInternational;
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GInternationalBis;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KD;
-						info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KG;
-					}
-				} else if (strcasecmp(optarg, "oasis") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 5 + (kt_with_unknown_devcodes * 1);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleOasisWiFi;
-					info.devices[info.num_devices++]       = KindleOasisWiFi3G;
-					info.devices[info.num_devices++]       = KindleOasisWiFi3GEurope;
-					info.devices[info.num_devices++]       = KindleOasisWiFi3GInternational;
-					info.devices[info.num_devices++]       = KindleOasisWiFi3GChina;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleOasisUnknown_0GS;
-					}
-				} else if (strcasecmp(optarg, "basic2") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 2 + (kt_with_unknown_devcodes * 1);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleBasic2;
-					info.devices[info.num_devices++]       = KindleBasic2White;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleBasic2Unknown_0DU;
-					}
-				} else if (strcasecmp(optarg, "oasis2") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 6 + (kt_with_unknown_devcodes * 9);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleOasis2WiFi8GB;
-					info.devices[info.num_devices++]       = KindleOasis2WiFi3G32GB;
-					info.devices[info.num_devices++]       = KindleOasis2WiFi32GB;
-					info.devices[info.num_devices++]       = KindleOasis2WiFi3G32GBEurope;
-					info.devices[info.num_devices++]       = KindleOasis2WiFi32GBChampagne;
-					info.devices[info.num_devices++]       = KindleOasis2Unknown_0P6;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LM;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LN;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LP;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LQ;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0P2;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0P7;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0S3;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0S4;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0S7;
-					}
-				} else if (strcasecmp(optarg, "paperwhite4") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 13 + (kt_with_unknown_devcodes * 8);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi8GB;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi32GB;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi4G32GB;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi4G32GBEurope;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi8GBIndia;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi4G32GBJapan;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi8GBBlue;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi32GBBlue;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi8GBPlum;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi8GBSage;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi32GBIndia;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi32GBPlum;
-					info.devices[info.num_devices++]       = KindlePaperWhite4WiFi32GBSage;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0T4;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0T5;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0T7;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TJ;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TK;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TL;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TM;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TN;
-					}
-				} else if (strcasecmp(optarg, "basic3") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 4 + (kt_with_unknown_devcodes * 2);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleBasic3;
-					info.devices[info.num_devices++]       = KindleBasic3White;
-					info.devices[info.num_devices++]       = KindleBasic3KidsEdition;
-					info.devices[info.num_devices++]       = KindleBasic3White8GB;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleBasic3Unknown_0WG;
-						info.devices[info.num_devices++] = KindleBasic3Unknown_0WJ;
-					}
-				} else if (strcasecmp(optarg, "oasis3") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 6 + (kt_with_unknown_devcodes * 0);
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleOasis3WiFi32GBChampagne;
-					info.devices[info.num_devices++]       = KindleOasis3WiFi4G32GBJapan;
-					info.devices[info.num_devices++]       = KindleOasis3WiFi4G32GB;
-					info.devices[info.num_devices++]       = KindleOasis3WiFi32GB;
-					info.devices[info.num_devices++]       = KindleOasis3WiFi8GB;
-					info.devices[info.num_devices++]       = KindleOasis3WiFi4G32GBIndia;
-					/*
-					if (kt_with_unknown_devcodes) {
-					}
-					*/
-				} else if (strcasecmp(optarg, "kindle5") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices =
-					    3 + kt_with_unknown_devcodes +           // K5
-					    6 +                                      // PW1
-					    12 + (kt_with_unknown_devcodes * 2) +    // PW2
-					    2 +                                      // KT2
-					    5 + (kt_with_unknown_devcodes * 1) +     // KV
-					    12 + (kt_with_unknown_devcodes * 2) +    // PW3
-					    5 + (kt_with_unknown_devcodes * 1) +     // Oasis
-					    2 + (kt_with_unknown_devcodes * 1) +     // KT3
-					    6 + (kt_with_unknown_devcodes * 9) +     // Oasis 2
-					    13 + (kt_with_unknown_devcodes * 8) +    // PW4
-					    4 + (kt_with_unknown_devcodes * 2) +     // KT4
-					    6 + (kt_with_unknown_devcodes * 0);      // KOA3
-					info.devices = realloc(info.devices,
-							       (info.num_devices + num_aliased_devices) * sizeof(Device));
-					// K5
-					info.devices[info.num_devices++] = Kindle5TouchWiFi;
-					info.devices[info.num_devices++] = Kindle5TouchWiFi3G;
-					info.devices[info.num_devices++] = Kindle5TouchWiFi3GEurope;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = Kindle5TouchUnknown;
-					}
-					// PW1
-					info.devices[info.num_devices++] = KindlePaperWhiteWiFi;
-					info.devices[info.num_devices++] = KindlePaperWhiteWiFi3G;
-					info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GCanada;
-					info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GEurope;
-					info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GJapan;
-					info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GBrazil;
-					// PW2
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFiJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GCanada;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GEurope;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GRussia;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi4GBInternational;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBEurope;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GB;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBCanada;
-					info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBBrazil;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF4;
-						info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF9;
-					}
-					// KT2
-					info.devices[info.num_devices++] = KindleBasic;
-					info.devices[info.num_devices++] = KindleBasicKiwi;
-					// KV
-					info.devices[info.num_devices++] = KindleVoyageWiFi;
-					info.devices[info.num_devices++] = KindleVoyageWiFi3G;
-					info.devices[info.num_devices++] = KindleVoyageWiFi3GEurope;
-					info.devices[info.num_devices++] = KindleVoyageWiFi3GJapan;
-					info.devices[info.num_devices++] = KindleVoyageWiFi3GMexico;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleVoyageUnknown_0x4F;
-					}
-					// Black PW3
-					info.devices[info.num_devices++] = KindlePaperWhite3WiFi;
-					info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GCanada;
-					info.devices[info.num_devices++] = KindlePaperWhite3WiFi3G;
-					info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GEurope;
-					info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GMexico;
-					info.devices[info.num_devices++] = KindlePaperWhite3BlackWiFi32GBJapan;
-					// White PW3
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi;
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi32GBJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GInternational;
-					info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GInternationalBis;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KD;
-						info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KG;
-					}
-					// Oasis
-					info.devices[info.num_devices++] = KindleOasisWiFi;
-					info.devices[info.num_devices++] = KindleOasisWiFi3G;
-					info.devices[info.num_devices++] = KindleOasisWiFi3GEurope;
-					info.devices[info.num_devices++] = KindleOasisWiFi3GInternational;
-					info.devices[info.num_devices++] = KindleOasisWiFi3GChina;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleOasisUnknown_0GS;
-					}
-					// KT3
-					info.devices[info.num_devices++] = KindleBasic2;
-					info.devices[info.num_devices++] = KindleBasic2White;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleBasic2Unknown_0DU;
-					}
-					// Oasis 2
-					info.devices[info.num_devices++] = KindleOasis2WiFi8GB;
-					info.devices[info.num_devices++] = KindleOasis2WiFi3G32GB;
-					info.devices[info.num_devices++] = KindleOasis2WiFi32GB;
-					info.devices[info.num_devices++] = KindleOasis2WiFi3G32GBEurope;
-					info.devices[info.num_devices++] = KindleOasis2WiFi32GBChampagne;
-					info.devices[info.num_devices++] = KindleOasis2Unknown_0P6;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LM;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LN;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LP;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0LQ;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0P2;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0P7;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0S3;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0S4;
-						info.devices[info.num_devices++] = KindleOasis2Unknown_0S7;
-					}
-					// PW4
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi8GB;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi32GB;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi4G32GB;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi4G32GBEurope;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi8GBIndia;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi4G32GBJapan;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi8GBBlue;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi32GBBlue;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi8GBPlum;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi8GBSage;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi32GBIndia;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi32GBPlum;
-					info.devices[info.num_devices++] = KindlePaperWhite4WiFi32GBSage;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0T4;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0T5;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0T7;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TJ;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TK;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TL;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TM;
-						info.devices[info.num_devices++] = KindlePaperWhite4Unknown_0TN;
-					}
-					// KT4
-					info.devices[info.num_devices++] = KindleBasic3;
-					info.devices[info.num_devices++] = KindleBasic3White;
-					info.devices[info.num_devices++] = KindleBasic3KidsEdition;
-					info.devices[info.num_devices++] = KindleBasic3White8GB;
-					if (kt_with_unknown_devcodes) {
-						info.devices[info.num_devices++] = KindleBasic3Unknown_0WG;
-						info.devices[info.num_devices++] = KindleBasic3Unknown_0WJ;
-					}
-					// KOA3
-					info.devices[info.num_devices++] = KindleOasis3WiFi32GBChampagne;
-					info.devices[info.num_devices++] = KindleOasis3WiFi4G32GBJapan;
-					info.devices[info.num_devices++] = KindleOasis3WiFi4G32GB;
-					info.devices[info.num_devices++] = KindleOasis3WiFi32GB;
-					info.devices[info.num_devices++] = KindleOasis3WiFi8GB;
-					info.devices[info.num_devices++] = KindleOasis3WiFi4G32GBIndia;
-					/*
-					if (kt_with_unknown_devcodes) {
-					}
-					*/
-				} else if (kt_with_unknown_devcodes &&
-					   (strcasecmp(optarg, "unknown") == 0 || strcasecmp(optarg, "datamined") == 0)) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);    // Meh?
-					const unsigned int num_aliased_devices = 7;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x16;
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x21;
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x07;
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x0B;
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x0C;
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x0D;
-					info.devices[info.num_devices++]       = ValidKindleUnknown_0x99;
-				} else if (strcasecmp(optarg, "kindle2") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 2;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = Kindle2US;
-					info.devices[info.num_devices++]       = Kindle2International;
-				} else if (strcasecmp(optarg, "kindledx") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 3;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = KindleDXUS;
-					info.devices[info.num_devices++]       = KindleDXInternational;
-					info.devices[info.num_devices++]       = KindleDXGraphite;
-				} else if (strcasecmp(optarg, "kindle3") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 3;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = Kindle3WiFi;
-					info.devices[info.num_devices++]       = Kindle3WiFi3G;
-					info.devices[info.num_devices++]       = Kindle3WiFi3GEurope;
-				} else if (strcasecmp(optarg, "legacy") == 0) {
-					memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					const unsigned int num_aliased_devices = 2 + 3 + 3;
-					info.devices                           = realloc(info.devices,
-                                                               (info.num_devices + num_aliased_devices) * sizeof(Device));
-					info.devices[info.num_devices++]       = Kindle2US;
-					info.devices[info.num_devices++]       = Kindle2International;
-					info.devices[info.num_devices++]       = KindleDXUS;
-					info.devices[info.num_devices++]       = KindleDXInternational;
-					info.devices[info.num_devices++]       = KindleDXGraphite;
-					info.devices[info.num_devices++]       = Kindle3WiFi;
-					info.devices[info.num_devices++]       = Kindle3WiFi3G;
-					info.devices[info.num_devices++]       = Kindle3WiFi3GEurope;
-				} else {
-					info.devices = realloc(info.devices, ++info.num_devices * sizeof(Device));
-					// K1
-					if (strcasecmp(optarg, "k1") == 0) {
-						info.devices[info.num_devices - 1] = Kindle1;
-					}
-					// K2
-					else if (strcasecmp(optarg, "k2") == 0) {
-						info.devices[info.num_devices - 1] = Kindle2US;
-					} else if (strcasecmp(optarg, "k2i") == 0) {
-						info.devices[info.num_devices - 1] = Kindle2International;
-					}
-					// DX
-					else if (strcasecmp(optarg, "dx") == 0) {
-						info.devices[info.num_devices - 1] = KindleDXUS;
-					} else if (strcasecmp(optarg, "dxi") == 0) {
-						info.devices[info.num_devices - 1] = KindleDXInternational;
-					} else if (strcasecmp(optarg, "dxg") == 0) {
-						info.devices[info.num_devices - 1] = KindleDXGraphite;
-					}
-					// K3
-					else if (strcasecmp(optarg, "k3w") == 0) {
-						info.devices[info.num_devices - 1] = Kindle3WiFi;
-					} else if (strcasecmp(optarg, "k3g") == 0) {
-						info.devices[info.num_devices - 1] = Kindle3WiFi3G;
-					} else if (strcasecmp(optarg, "k3gb") == 0) {
-						info.devices[info.num_devices - 1] = Kindle3WiFi3GEurope;
-					}
-					// K4
-					else if (strcasecmp(optarg, "k4") == 0) {
-						info.devices[info.num_devices - 1] = Kindle4NonTouch;
-						memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "k4b") == 0) {
-						info.devices[info.num_devices - 1] = Kindle4NonTouchBlack;
-						memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-					}
-					// KT
-					// NOTE: Magic number switch to 'versionless' update types here...
-					//       FW >= 5.6.1 apparently dropped support for these in the UYK menu...
-					else if (strcasecmp(optarg, "k5w") == 0) {
-						info.devices[info.num_devices - 1] = Kindle5TouchWiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "k5g") == 0) {
-						info.devices[info.num_devices - 1] = Kindle5TouchWiFi3G;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "k5gb") == 0) {
-						info.devices[info.num_devices - 1] = Kindle5TouchWiFi3GEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "k5u") == 0) {
-						info.devices[info.num_devices - 1] = Kindle5TouchUnknown;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// PW1
-					else if (strcasecmp(optarg, "pw") == 0 || strcasecmp(optarg, "kpw") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pwg") == 0 || strcasecmp(optarg, "kpwg") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3G;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pwgc") == 0 || strcasecmp(optarg, "kpwgc") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GCanada;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pwgb") == 0 || strcasecmp(optarg, "kpwgb") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pwgj") == 0 || strcasecmp(optarg, "kpwgj") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pwgbr") == 0 ||
-						   strcasecmp(optarg, "kpwgbr") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GBrazil;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// PW2
-					else if (strcasecmp(optarg, "pw2") == 0 || strcasecmp(optarg, "kpw2") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2j") == 0 || strcasecmp(optarg, "kpw2j") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFiJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2g") == 0 || strcasecmp(optarg, "kpw2g") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gc") == 0 ||
-						   strcasecmp(optarg, "kpw2gc") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GCanada;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gb") == 0 ||
-						   strcasecmp(optarg, "kpw2gb") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gr") == 0 ||
-						   strcasecmp(optarg, "kpw2gr") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GRussia;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gj") == 0 ||
-						   strcasecmp(optarg, "kpw2gj") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2il") == 0 ||
-						   strcasecmp(optarg, "kpw2il") == 0) {
-						info.devices[info.num_devices - 1] =
-						    KindlePaperWhite2WiFi4GBInternational;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gbl") == 0 ||
-						   strcasecmp(optarg, "kpw2gbl") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GBEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gl") == 0 ||
-						   strcasecmp(optarg, "kpw2gl") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gcl") == 0 ||
-						   strcasecmp(optarg, "kpw2gcl") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GBCanada;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw2gbrl") == 0 ||
-						   strcasecmp(optarg, "kpw2gbrl") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GBBrazil;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// KT2
-					else if (strcasecmp(optarg, "kt2") == 0 || strcasecmp(optarg, "bk") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kt2a") == 0 || strcasecmp(optarg, "bka") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasicKiwi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// KV
-					else if (strcasecmp(optarg, "kv") == 0) {
-						info.devices[info.num_devices - 1] = KindleVoyageWiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kvg") == 0) {
-						info.devices[info.num_devices - 1] = KindleVoyageWiFi3G;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kvgb") == 0) {
-						info.devices[info.num_devices - 1] = KindleVoyageWiFi3GEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kvgj") == 0) {
-						info.devices[info.num_devices - 1] = KindleVoyageWiFi3GJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kvgm") == 0) {
-						info.devices[info.num_devices - 1] = KindleVoyageWiFi3GMexico;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// Black PW3
-					else if (strcasecmp(optarg, "pw3") == 0 || strcasecmp(optarg, "kpw3") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3g") == 0 || strcasecmp(optarg, "kpw3g") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3G;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3gj") == 0 ||
-						   strcasecmp(optarg, "kpw3gj") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3gc") == 0 ||
-						   strcasecmp(optarg, "kpw3gc") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GCanada;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3gb") == 0 ||
-						   strcasecmp(optarg, "kpw3gb") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3gm") == 0 ||
-						   strcasecmp(optarg, "kpw3gm") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GMexico;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3jl") == 0 ||
-						   strcasecmp(optarg, "kpw3jl") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3BlackWiFi32GBJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// White PW3
-					else if (strcasecmp(optarg, "pw3w") == 0 || strcasecmp(optarg, "kpw3w") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WhiteWiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3wgj") == 0 ||
-						   strcasecmp(optarg, "kpw3wgj") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WhiteWiFi3GJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3wjl") == 0 ||
-						   strcasecmp(optarg, "kpw3wjl") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite3WhiteWiFi32GBJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3wgi") == 0 ||
-						   strcasecmp(optarg, "kpw3wgi") == 0) {
-						info.devices[info.num_devices - 1] =
-						    KindlePaperWhite3WhiteWiFi3GInternational;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw3wgib") == 0 ||
-						   strcasecmp(optarg, "kpw3wgib") == 0) {
-						info.devices[info.num_devices - 1] =
-						    KindlePaperWhite3WhiteWiFi3GInternationalBis;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// Oasis
-					else if (strcasecmp(optarg, "koa") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasisWiFi;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koag") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasisWiFi3G;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koagb") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasisWiFi3GEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koagbi") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasisWiFi3GInternational;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koagcn") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasisWiFi3GChina;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// KT3
-					else if (strcasecmp(optarg, "kt3") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic2;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kt3w") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic2White;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// Oasis 2
-					else if (strcasecmp(optarg, "koa2w8") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis2WiFi8GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa2g32") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis2WiFi3G32GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa2w32") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis2WiFi32GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa2g32b") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis2WiFi3G32GBEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa2w32c") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis2WiFi32GBChampagne;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// PW4
-					else if (strcasecmp(optarg, "pw4") == 0 || strcasecmp(optarg, "kpw4") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi8GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4l") == 0 || strcasecmp(optarg, "kpw4l") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi32GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4lg") == 0 ||
-						   strcasecmp(optarg, "kpw4lg") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi4G32GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4lgb") == 0 ||
-						   strcasecmp(optarg, "kpw4lgb") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi4G32GBEurope;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4in") == 0 || strcasecmp(optarg, "kpwin") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi8GBIndia;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4lgjp") == 0 ||
-						   strcasecmp(optarg, "kpw4ljp") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi4G32GBJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4tb") == 0 ||
-						   strcasecmp(optarg, "kpw4tb") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi8GBBlue;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4ltb") == 0 ||
-						   strcasecmp(optarg, "kpw4ltb") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi32GBBlue;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4p") == 0 || strcasecmp(optarg, "kpw4p") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi8GBPlum;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4s") == 0 || strcasecmp(optarg, "kpw4s") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi8GBSage;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4lin") == 0 ||
-						   strcasecmp(optarg, "kpwlin") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi32GBIndia;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4lp") == 0 ||
-						   strcasecmp(optarg, "kpw4lp") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi32GBPlum;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "pw4ls") == 0 ||
-						   strcasecmp(optarg, "kpw4ls") == 0) {
-						info.devices[info.num_devices - 1] = KindlePaperWhite4WiFi32GBSage;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// KT4
-					else if (strcasecmp(optarg, "kt4") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic3;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kt4w") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic3White;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kt4ke") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic3KidsEdition;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "kt4w8") == 0) {
-						info.devices[info.num_devices - 1] = KindleBasic3White8GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// KOA3
-					else if (strcasecmp(optarg, "koa3w32c") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis3WiFi32GBChampagne;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa3g32jp") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis3WiFi4G32GBJapan;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa3g32") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis3WiFi4G32GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa3w32") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis3WiFi32GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa3w8") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis3WiFi8GB;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					} else if (strcasecmp(optarg, "koa3g32in") == 0) {
-						info.devices[info.num_devices - 1] = KindleOasis3WiFi4G32GBIndia;
-						memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-					}
-					// N/A
-					else if (strcasecmp(optarg, "none") == 0) {
-						info.devices[info.num_devices - 1] = KindleUnknown;
-						// We *really* mean no devices, so reset num_devices ;).
-						info.num_devices = 0;
-					} else if (strcasecmp(optarg, "auto") == 0 ||
-						   strcasecmp(optarg, "current") == 0) {
-						// Detect the current Kindle model
-						FILE* kindle_usid;
-						// NOTE: Newer devices also have /proc/serial?
-						if ((kindle_usid = fopen("/proc/usid", "rb")) == NULL) {
-							fprintf(
-							    stderr,
-							    "Cannot open /proc/usid (not running on a Kindle?): %s.\n",
-							    strerror(errno));
-							goto do_error;
-						}
-						unsigned char serial_no[SERIAL_NO_LENGTH];
-						if (fread(
-							serial_no, sizeof(unsigned char), SERIAL_NO_LENGTH, kindle_usid) <
-							SERIAL_NO_LENGTH ||
-						    ferror(kindle_usid) != 0) {
-							fprintf(
-							    stderr, "Error reading /proc/usid: %s.\n", strerror(errno));
-							fclose(kindle_usid);
-							goto do_error;
-						}
-						fclose(kindle_usid);
-						// Get the device code...
-						char   device_code[3 + 1] = { 0 };
-						Device dev_code           = KindleUnknown;
-						// NOTE: If the S/N starts with B or 9,
-						//       assume it's an older device with an hexadecimal device code
-						if (serial_no[0] == 'B' || serial_no[0] == '9') {
-							snprintf(device_code, 2 + 1, "%.*s", 2, serial_no + 2);
-							dev_code = (Device) strtoul(device_code, NULL, 16);
-							// ... And finally, unless we're feeling adventurous,
-							// check if it's really a valid device...
-							if (!kt_with_unknown_devcodes &&
-							    strcmp(convert_device_id(dev_code), "Unknown") == 0) {
-								fprintf(stderr,
-									"Unknown device %s (0x%02X) [%.6s].\n",
-									device_code,
-									dev_code,
-									serial_no);
-								goto do_error;
-							}
-						} else {
-							// ... try the new device ID scheme if it doesn't...
-							snprintf(device_code, 3 + 1, "%.*s", 3, serial_no + 3);
-							dev_code = (Device) from_base(device_code, 32);
-							// ... And finally, unless we're feeling adventurous,
-							// check if it's really a valid device...
-							if (!kt_with_unknown_devcodes &&
-							    strcmp(convert_device_id(dev_code), "Unknown") == 0) {
-								fprintf(stderr,
-									"Unknown device %s (0x%03X) [%.6s].\n",
-									device_code,
-									dev_code,
-									serial_no);
-								goto do_error;
-							}
-						}
-						// Yay, known valid device code :)
-						info.devices[info.num_devices - 1] = dev_code;
-						// Roughly guess a decent magic number...
-						if (dev_code < Kindle4NonTouch) {
-							memcpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-						} else if (dev_code == Kindle4NonTouch ||
-							   dev_code == Kindle4NonTouchBlack) {
-							memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-						} else {
-							memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-						}
-					} else {
-						// Check if we passed a device code, be it as a ready-to-use hex value,
-						// or a to-be-decoded serial fragment...
-						char*  endptr;
-						Device dev_code = (Device) strtoul(optarg, &endptr, 16);
-						// Check that it even remotely looks like a device code, old or new, first...
-						// NOTE: The range is 01 to 0VF for now, update as needed!
-						if (*endptr != '\0' || dev_code <= 0x00 || dev_code > 0x3AF) {
-							// That was either an out of range hexadecimal value,
-							// or not an hexadecimal value at all...
-							if (strcmp(convert_device_id(dev_code), "Unknown") == 0) {
-								// ... in which case, try to see if that was
-								// a serial fragment following the new device id scheme...
-								dev_code = (Device) from_base(optarg, 32);
-								// Unless we're feeling adventurous,
-								// check if it's a valid device...
-								if (!kt_with_unknown_devcodes &&
-								    strcmp(convert_device_id(dev_code), "Unknown") == 0) {
-									fprintf(stderr,
-										"Unknown device %s (0x%03X).\n",
-										optarg,
-										dev_code);
-									goto do_error;
-								}
-							}
-						} else {
-							// Okay, that looked like an in-range hex value,
-							// make sure it matches an hex-only device id if
-							// we're not bypassing device checks...
-							if (!kt_with_unknown_devcodes &&
-							    strcmp(convert_device_id(dev_code), "Unknown") == 0) {
-								fprintf(stderr,
-									"Unknown device %s (0x%02X).\n",
-									optarg,
-									dev_code);
-								goto do_error;
-							}
-						}
-						// Yay, known valid device code :)
-						info.devices[info.num_devices - 1] = dev_code;
-						// Roughly guess a decent magic number...
-						if (dev_code < Kindle4NonTouch) {
-							memcpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-						} else if (dev_code == Kindle4NonTouch ||
-							   dev_code == Kindle4NonTouchBlack) {
-							memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-						} else {
-							memcpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-						}
-					}
-				}
-				break;
 			case 'p':
-				if (strcasecmp(optarg, "unspecified") == 0) {
-					info.platform = Plat_Unspecified;
-				} else if (strcasecmp(optarg, "mario") == 0) {
-					info.platform = MarioDeprecated;
-				} else if (strcasecmp(optarg, "luigi") == 0) {
-					info.platform = Luigi;
-				} else if (strcasecmp(optarg, "banjo") == 0) {
-					info.platform = Banjo;
-				} else if (strcasecmp(optarg, "yoshi") == 0) {
-					info.platform = Yoshi;
-				} else if (strcasecmp(optarg, "yoshime-proto") == 0 ||
-					   strcasecmp(optarg, "yoshime-p") == 0) {
-					info.platform = YoshimeProto;
-				} else if (strcasecmp(optarg, "yoshime") == 0) {
-					info.platform = Yoshime;
-				} else if (strcasecmp(optarg, "wario") == 0) {
-					info.platform = Wario;
-				} else if (strcasecmp(optarg, "duet") == 0) {
-					info.platform = Duet;
-				} else if (strcasecmp(optarg, "heisenberg") == 0) {
-					info.platform = Heisenberg;
-				} else if (strcasecmp(optarg, "zelda") == 0) {
-					info.platform = Zelda;
-				} else if (strcasecmp(optarg, "rex") == 0) {
-					info.platform = Rex;
-				} else if (strcasecmp(optarg, "bellatrix") == 0) {
-					info.platform = Bellatrix;
-				} else {
-					fprintf(stderr, "Unknown platform %s.\n", optarg);
-					goto do_error;
-				}
-				break;
 			case 'B':
-				if (strcasecmp(optarg, "unspecified") == 0) {
-					info.board = Board_Unspecified;
-				} else if (strcasecmp(optarg, "tequila") == 0) {
-					info.board = Tequila;
-				} else if (strcasecmp(optarg, "whitney") == 0) {
-					info.board = Whitney;
-				} else {
-					fprintf(stderr, "Unknown board %s.\n", optarg);
-					goto do_error;
-				}
-				break;
 			case 'h':
-				info.header_rev = (uint32_t) atoi(optarg);
-				break;
-			case 'k':
-				if (nettle_rsa_privkey_from_pem(optarg, &info.sign_pkey) != 0) {
-					fprintf(stderr, "Key '%s' cannot be loaded.\n", optarg);
-					goto do_error;
-				}
-				break;
 			case 'b':
-				strncpy(info.magic_number, optarg, MAGIC_NUMBER_LENGTH);    // Flawfinder: ignore
-				if ((info.version = get_bundle_version(optarg)) == UnknownUpdate) {
-					fprintf(stderr, "Invalid bundle version %s.\n", optarg);
-					goto do_error;
-				}
-				break;
 			case 's':
-				// Handle "min" as a special value
-				if (strcasecmp(optarg, "min") == 0) {
-					info.source_revision = 0;
-				} else {
-					info.source_revision = strtoull(optarg, NULL, 0);
-				}
-				enforce_source_rev = true;
-				break;
 			case 't':
-				// And, arguably more useful, handle "max" as a special value
-				if (strcasecmp(optarg, "max") == 0) {
-					// NOTE: Given the way we handle commands vs. args, by now, info.version should be accurate.
-					if (info.version == OTAUpdateV2 || info.version == RecoveryUpdateV2 ||
-					    (info.version == RecoveryUpdate && info.header_rev == 2)) {
-						info.target_revision = UINT64_MAX;
-					} else {
-						info.target_revision = UINT32_MAX;
-					}
-				} else {
-					info.target_revision = strtoull(optarg, NULL, 0);
-				}
-				enforce_target_rev = true;
-				break;
 			case '1':
-				info.magic_1 = (uint32_t) atoi(optarg);
-				break;
 			case '2':
-				info.magic_2 = (uint32_t) atoi(optarg);
-				break;
 			case 'm':
-				info.minor = (uint32_t) atoi(optarg);
-				break;
 			case 'c':
-				info.certificate_number = (CertificateNumber) atoi(optarg);
-				break;
 			case 'o':
-				info.optional = (uint8_t) atoi(optarg);
-				break;
 			case 'r':
-				info.critical = (uint8_t) atoi(optarg);
-				break;
 			case 'x':
-				// A metastring must contain an '=' character (remember, it's a key=value pair ;))
-				if (strchr(optarg, '=') == NULL) {
-					fprintf(stderr, "Invalid metastring. Format: key=value, input: %s\n", optarg);
+				if (kindle_create_set_option(&info, opt, optarg, &enforce_source_rev, &enforce_target_rev) < 0) {
 					goto do_error;
 				}
-				// Flawfinder: ignore
-				if (strlen(optarg) > 0xFFFFu) {
-					fprintf(stderr,
-						"Metastring too long. Max length: %u, input length: %zu\n",
-						0xFFFFu,
-						strlen(optarg));    // Flawfinder: ignore
+				break;
+			case 'k':
+				if (nettle_rsa_privkey_from_pem(optarg, &info.sign_pkey) != 0) {
+					fprintf(stderr, "Key '%s' cannot be loaded.\n", optarg);
 					goto do_error;
 				}
-				info.metastrings = realloc(info.metastrings, ++info.num_meta * sizeof(char*));
-				info.metastrings[info.num_meta - 1] = strdup(optarg);
 				break;
 			case 'X':
 				info.metastrings = realloc(info.metastrings,
@@ -2453,11 +4243,61 @@ int
 			case 'U':
 				userdata_only = true;
 				break;
-			case 'O':
-				enforce_ota = true;
+			case 'O':
+				enforce_ota = true;
+				break;
+			case 'C':
+				legacy = true;
+				break;
+			case 'j':
+				// NOTE: 0 means one job per online CPU
+				if (kt_parse_jobs(optarg, &jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					goto do_error;
+				}
+				break;
+			case 'z':
+				level = strtol(optarg, &endptr, 10);
+				if (endptr == optarg || *endptr != '\0' || level < 0 || level > 9) {
+					fprintf(stderr, "Invalid compression level (0-9), input: %s\n", optarg);
+					goto do_error;
+				}
+				compression_level = (int) level;
+				break;
+			case 'V':
+				variants_filename = optarg;
+				break;
+			case 'K':
+				sig_cache_dir = optarg;
+				break;
+			case 'I':
+				previous_filename = optarg;
+				break;
+			case 'D':
+				// NOTE: Long-only (it's not in optstring)
+				delta_filename = optarg;
+				break;
+			case 'R':
+				// NOTE: Long-only (it's not in optstring)
+				delta_root = optarg;
+				break;
+			case 'T':
+				// NOTE: Long-only (it's not in optstring), since it takes an optional argument
+				kt_stats_enable(optarg);
 				break;
-			case 'C':
-				legacy = true;
+			case 'M':
+				// NOTE: In MiB (0 means we never keep temporaries in RAM)
+				if (kt_parse_mib(optarg, &kt_mem_budget) != 0) {
+					fprintf(stderr, "Invalid memory budget, input: %s\n", optarg);
+					goto do_error;
+				}
+				break;
+			case 'S':
+				// NOTE: In MiB
+				if (kt_parse_mib(optarg, &sig_cache_size) != 0 || sig_cache_size == 0U) {
+					fprintf(stderr, "Invalid signature cache size, input: %s\n", optarg);
+					goto do_error;
+				}
 				break;
 			case ':':
 				fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
@@ -2474,151 +4314,29 @@ int
 		}
 	}
 
-	// Signed userdata packages are very peculiar, handle them on their own...
-	if (userdata_only) {
-		// Needs to be a signed package
-		if (info.version != UpdateSignature) {
-			fprintf(stderr,
-				"Invalid update type (%s) for an userdata package.\n",
-				convert_bundle_version(info.version));
-			goto do_error;
-		}
-	} else {
-		// Did we want to enforce an OTA bundle type?
-		if (enforce_ota) {
-			// Only makes sense for ota2...
-			if (info.version != OTAUpdateV2) {
-				fprintf(
-				    stderr,
-				    "Invalid update type (%s). Enforcing the versioned OTA bundle type only makes sense for OTA V2.\n",
-				    convert_bundle_version(info.version));
-				goto do_error;
-			}
-			// We of course need the versioned ota bundle type...
-			memcpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-			// But also a source & target version!
-			if (!enforce_source_rev) {
-				info.source_revision = 2443670049U;    // FW 5.5.0
-			}
-			if (!enforce_target_rev) {
-				info.target_revision = 3732030038U + 1U;    // FW 5.13.6 (KT3)
-			}
-			// NOTE: Don't expect those to be entirely consistent when crossing devices
-			//       (f.g., the Touch's FW 5.3.7.3 has a higher OTA build number than the KV's FW 5.5.0)
-			// NOTE: The VoiceView packages may sometimes have a slightly higher Target OTA flag, f.g.,
-			//       while FW 5.10.1.2 was at 3360340004, the PW4 VoiceView packages targeted 3372830002,
-			//       which turned out to be FW 5.10.1.3
-			// NOTE: In a fun, new, twist, FW 5.12.2.1.1 appears to prevent same-to-same updates, hence the + 1...
-		}
-		// Musn't be *only* a sig envelope...
-		if (info.version == UpdateSignature) {
-			fprintf(stderr,
-				"Invalid update type (%s) for an update package.\n",
-				convert_bundle_version(info.version));
-			goto do_error;
-		}
-		// Validation (Allow 0 devices in Recovery V2 & FB02 h2, allow multiple devices in OTA V2 & Recovery V2)
-		if ((info.num_devices < 1 &&
-		     (info.version != RecoveryUpdateV2 && !(info.version == RecoveryUpdate && info.header_rev == 2))) ||
-		    ((info.version != OTAUpdateV2 && info.version != RecoveryUpdateV2) && info.num_devices > 1)) {
-			fprintf(stderr,
-				"Invalid number of supported devices (%hu) for this update type (%s).\n",
-				info.num_devices,
-				convert_bundle_version(info.version));
-			goto do_error;
-		}
-		if ((info.version != OTAUpdateV2 && info.version != RecoveryUpdateV2 &&
-		     !(info.version == RecoveryUpdate && info.header_rev == 2)) &&
-		    (info.source_revision > UINT32_MAX || info.target_revision > UINT32_MAX)) {
-			fprintf(stderr,
-				"Source/target revision for this update type (%s) cannot exceed %u.\n",
-				convert_bundle_version(info.version),
-				UINT32_MAX);
+	// Are we building a bunch of variants of the same package?
+	if (variants_filename != NULL) {
+		if (kindle_create_parse_variants(variants_filename,
+						 &info,
+						 enforce_source_rev,
+						 enforce_target_rev,
+						 &variants,
+						 &num_variants) != 0) {
 			goto do_error;
 		}
-		// When building an ota update with ota2 only devices, don't try to use non ota v1 bundle versions,
-		// reset it to FC02, or shit happens.
-		if (info.version == OTAUpdate) {
-			// OTA V1 only supports one device, we don't need to loop (fix anything newer than a K3GB)
-			if (info.devices[0] > Kindle3WiFi3GEurope &&
-			    (memcmp(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH) != 0 &&
-			     memcmp(info.magic_number, "FD03", MAGIC_NUMBER_LENGTH) != 0)) {
-				// FC04 is hardcoded when we set K4 as a device, and FD04 when we ask for a K5 and up, so fix it silently.
-				memcpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-			}
-		}
-		// Same thing with recovery updates
-		if (info.version == RecoveryUpdate) {
-			// It's called FB02.2 for a reason...
-			// Plus, we can have a null/none device with it, so we avoid the same blowup as the RecoveryV2 check ;).
-			if ((info.header_rev == 2 || info.devices[0] > Kindle3WiFi3GEurope) &&
-			    (memcmp(info.magic_number, "FB01", MAGIC_NUMBER_LENGTH) != 0 &&
-			     memcmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) != 0)) {
-				memcpy(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH);
-			}
-		}
-		// Same thing with recovery updates v2
-		if (info.version == RecoveryUpdateV2) {
-			// Make sure we have a sane magic number...
-			// We either don't yet have one set when not specifying any device,
-			// or what's set corresponds to OTA update types when specifying anything since the K4...
-			if (memcmp(info.magic_number, "FB03", MAGIC_NUMBER_LENGTH) != 0) {
-				// NOTE: This effectively prevents us from setting a custom magic number.
-				//       Which is not really something you'd want to do in this case anyway...
-				memcpy(info.magic_number, "FB03", MAGIC_NUMBER_LENGTH);
-			}
-		}
-		// We need a platform id, board id (& header rev?) for recovery2
-		if (info.version == RecoveryUpdateV2) {
-			if (strcmp(convert_platform_id(info.platform), "Unknown") == 0) {
-				fprintf(stderr,
-					"You need to set a platform for this update type (%s).\n",
-					convert_bundle_version(info.version));
-				goto do_error;
-			}
-			if (strcmp(convert_board_id(info.board), "Unknown") == 0) {
-				fprintf(stderr,
-					"You need to set a board for this update type (%s).\n",
-					convert_bundle_version(info.version));
-				goto do_error;
-			}
-			// Don't bother for header rev? We don't for other potentially optional flags in recovery, so...
-		}
-		// We need a platform id & board id for recovery FB02 V2
-		if (info.version == RecoveryUpdate) {
-			if (memcmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 &&
-			    strcmp(convert_platform_id(info.platform), "Unknown") == 0) {
-				fprintf(stderr,
-					"You need to set a platform for this update type (%s).\n",
-					convert_bundle_version(info.version));
-				goto do_error;
-			}
-			if (memcmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 &&
-			    strcmp(convert_board_id(info.board), "Unknown") == 0) {
-				fprintf(stderr,
-					"You need to set a board for this update type (%s).\n",
-					convert_bundle_version(info.version));
+		for (ui = 0; ui < num_variants; ui++) {
+			if (kindle_create_check_info(&variants[ui].info,
+						     userdata_only,
+						     enforce_ota,
+						     variants[ui].enforce_source_rev,
+						     variants[ui].enforce_target_rev) != 0) {
+				fprintf(stderr, "Invalid settings for variant '%s'.\n", variants[ui].output_filename);
 				goto do_error;
 			}
 		}
-		// Right now, we don't use device at all for FB02.2, so reset it to none to have a consistent recap... FIXME?
-		if (info.version == RecoveryUpdate) {
-			if (memcmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 &&
-			    info.num_devices > 0) {
-				info.num_devices               = 0;
-				info.devices[info.num_devices] = KindleUnknown;
-			}
-		}
-		// We of course need a full magic number...
-		// As magic_number is not NULL terminated, we cannot use strlen,
-		// so let one of our helper functions do the job...
-		if (get_bundle_version(info.magic_number) == UnknownUpdate) {
-			fprintf(stderr,
-				"You need to set a valid bundle version for this update type (%s), '%s' is invalid.\n",
-				convert_bundle_version(info.version),
-				info.magic_number);
-			goto do_error;
-		}
+	} else if (kindle_create_check_info(
+		       &info, userdata_only, enforce_ota, enforce_source_rev, enforce_target_rev) != 0) {
+		goto do_error;
 	}
 
 	// If we don't actually build an archive, legacy mode makes no sense
@@ -2627,23 +4345,21 @@ int
 	}
 
 	if (optind < argc) {
-		// Iterate over non-options (the file(s) we passed)
-		while (optind < argc) {
-			// The last one will always be our output (but only check if we have at least one input file,
-			// we might really want to output to stdout)
-			if (optind == argc - 1 && input_index > 0) {
-				output_filename = strdup(argv[optind++]);
-				// If it's a single dash, output to stdout (like tar cf -)
-				if (strcmp(output_filename, "-") == 0) {
-					free(output_filename);
-					output_filename = NULL;
-				}
-			} else {
-				// Build a list of all our input files/dirs,
-				// libarchive will do most of the heavy lifting for us
-				// (c.f., http://stackoverflow.com/questions/1182534/#1182649)
-				input_list                  = realloc(input_list, ++input_index * sizeof(char*));
-				input_list[input_index - 1] = strdup(argv[optind++]);
+		// The non-options (the file(s) we passed) are our input files/dirs,
+		// libarchive will do most of the heavy lifting for us
+		// (c.f., http://stackoverflow.com/questions/1182534/#1182649)
+		// NOTE: getopt left them all at the end of argv, so we just point there, no need to copy anything.
+		input_list  = argv + optind;
+		input_index = (unsigned int) (argc - optind);
+		// The last one will always be our output (but only check if we have at least one input file,
+		// we might really want to output to stdout), unless the variants manifest takes care of it.
+		if (input_index > 1 && variants == NULL) {
+			output_filename = strdup(argv[argc - 1]);
+			input_index--;
+			// If it's a single dash, output to stdout (like tar cf -)
+			if (strcmp(output_filename, "-") == 0) {
+				free(output_filename);
+				output_filename = NULL;
 			}
 		}
 	} else {
@@ -2652,54 +4368,23 @@ int
 	}
 
 	// While we're at it, check that our output name follows the proper naming scheme when creating a valid update package
-	if (output_filename != NULL) {
-		// Use libarchive's pattern matching, because it handles ./ in a smart way
-		match = archive_match_new();
-		entry = archive_entry_new();
-
-		// Handle signed & fake userdata packages...
-		if (fake_sign || userdata_only) {
-			valid_update_file_pattern = strdup("./data\\.stgz$");
-		} else {
-			// NOTE: Recovery updates must be lowercase!
-			if (info.version == RecoveryUpdate || info.version == RecoveryUpdateV2) {
-				valid_update_file_pattern = strdup("./update*\\.bin$");
-			} else {
-				valid_update_file_pattern = strdup("./[Uu]pdate*\\.bin$");
-			}
-		}
-		if (archive_match_exclude_pattern(match, valid_update_file_pattern) != ARCHIVE_OK) {
-			fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(match));
+	if (variants != NULL) {
+		if (input_index == 0) {
+			fprintf(stderr, "No input specified.\n");
+			goto do_error;
 		}
-		free(valid_update_file_pattern);
-
-		archive_entry_copy_pathname(entry, output_filename);
-
-		r = archive_match_path_excluded(match, entry);
-		if (r != 1) {
-			if (r < 0) {
-				fprintf(
-				    stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(match));
+		// We'll open them one at a time, when we get to them
+		for (ui = 0; ui < num_variants; ui++) {
+			if (kindle_create_check_output_name(
+				&variants[ui].info, variants[ui].output_filename, fake_sign, userdata_only) != 0) {
+				goto do_error;
 			}
-			fprintf(
-			    stderr,
-			    "Your output file '%s' needs to follow the proper naming scheme (%s) in order to be picked up by the Kindle.\n",
-			    output_filename,
-			    (fake_sign || userdata_only) ? "data.stgz" : "update*.bin");
-#if defined(_WIN32) && !defined(__CYGWIN__)
-			fprintf(
-			    stderr,
-			    "As an added quirk, on Windows, make sure you're using UNIX-style forward slashes ('/') in your output file path, instead of Windows-style backward slashes ('\\'), and do NOT leave any trailing slashes.\n");
-#endif
-			archive_entry_free(entry);
-			archive_match_free(match);
+		}
+	} else if (output_filename != NULL) {
+		if (kindle_create_check_output_name(&info, output_filename, fake_sign, userdata_only) != 0) {
 			goto do_error;
 		}
 
-		// Cleanup
-		archive_entry_free(entry);
-		archive_match_free(match);
-
 		// Check to see if we can write to our output file
 		// (do it now instead of earlier, this way the pattern matching has been done,
 		// and we potentially avoid fopen squishing a file we meant as input, not output)
@@ -2715,7 +4400,7 @@ int
 
 	// If we only provided a single input file, and it's a tarball, assume it's properly packaged,
 	// and just sign/munge it. (Restore backwards compatibilty with ixtab's tools, among other things)
-	if (input_index == 1) {
+	if (input_index == 1 && strcmp(input_list[0], "-") != 0) {
 		if (IS_TGZ(input_list[0]) || IS_TARBALL(input_list[0])) {
 			// NOTE: There's no real check besides the file extension...
 			skip_archive = true;
@@ -2736,209 +4421,195 @@ int
 		goto do_error;
 	}
 
-	// If we need to build a tarball, do it in a tempfile
-	if (!skip_archive) {
-		// We need a proper mkstemp template
-		char tartmpfile[PATH_MAX];
-		snprintf(tartmpfile, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_create_tarball_XXXXXX");
-		tarball_filename = strdup(tartmpfile);
-		tarball_fd       = mkstemp(tarball_filename);
-		if (tarball_fd == -1) {
-			fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
+	// We can't leave anything out of a tarball we're not building ourselves
+	if (delta_filename != NULL && skip_archive) {
+		fprintf(stderr, "A delta package can't be built out of a single tarball.\n");
+		goto do_error;
+	}
+
+	// Standard input can only be read once, and a delta needs to go back to the files themselves
+	for (ui = 0; ui < input_index; ui++) {
+		if (strcmp(input_list[ui], "-") != 0) {
+			continue;
+		}
+		if (stdin_input) {
+			fprintf(stderr, "Standard input can only be used once as an input.\n");
 			goto do_error;
 		}
+		stdin_input = true;
+	}
+	if (stdin_input && delta_filename != NULL) {
+		fprintf(stderr, "A delta package can't be built out of a tar stream on standard input.\n");
+		goto do_error;
 	}
 
-	// Recap (to stderr, in order not to mess stuff up if we output to stdout) what we're building
-	// Again, a signed userdata package is the ugly duckling...
-	if (userdata_only) {
-		fprintf(stderr,
-			"Building userdata package '%s' directly from '%s' (signed with cert %u).\n",
-			output_filename,
-			tarball_filename,
-			(uint32_t) info.certificate_number);
-	} else {
+	// The cleanup script needs to know where the payload ends up on the device, and we have no way to guess that
+	if (delta_filename != NULL && (delta_root == NULL || delta_root[0] != '/')) {
 		fprintf(stderr,
-			"Building %s%s%s (%.*s) update package '%s'%s%s%s%s for",
-			(legacy ? "(in legacy mode) " : ""),
-			(fake_sign ? "fake " : ""),
-			(convert_bundle_version(info.version)),
-			MAGIC_NUMBER_LENGTH,
-			info.magic_number,
-			output_filename,
-			(skip_archive ? " directly from " : ""),
-			(skip_archive ? "'" : ""),
-			(skip_archive ? tarball_filename : ""),
-			(skip_archive ? "'" : ""));
-		// If we have specific device IDs, list them
-		if (info.num_devices > 0) {
-			fprintf(stderr, " %hu device%s:\n", info.num_devices, (info.num_devices > 1 ? "s" : ""));
-			// Loop over devices
-			for (i = 0; i < info.num_devices; i++) {
-				fprintf(stderr, "\t%s", convert_device_id(info.devices[i]));
-				if (i != info.num_devices - 1) {
-					fprintf(stderr, "\n");
-				}
+			"A delta package needs to know where its payload ends up on the device (--delta-root, an absolute path).\n");
+		goto do_error;
+	}
+	if (delta_root != NULL && delta_filename == NULL) {
+		fprintf(stderr, "--delta-root only makes sense with --delta-from.\n");
+		goto do_error;
+	}
+
+	// If we need to build a tarball, do it in a tempfile
+	if (!skip_archive) {
+		if (keep_archive) {
+			// We were asked to keep it, so it needs a name: we need a proper mkstemp template
+			char tartmpfile[PATH_MAX];
+			snprintf(tartmpfile, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_create_tarball_XXXXXX");
+			tarball_filename = strdup(tartmpfile);
+			tarball_fd       = mkstemp(tarball_filename);
+			if (tarball_fd != -1) {
+				tarball = fdopen(tarball_fd, "w+b");
 			}
-			fprintf(stderr, "\n");
 		} else {
-			fprintf(stderr, " no specific device\n");
+			// Otherwise, it's just an anonymous temporary, which may very well never leave RAM
+			tarball = kt_tmpfile();
 		}
-		// Don't print settings not applicable to our update type...
-		switch (info.version) {
-			case OTAUpdateV2:
-				if (info.target_revision == UINT64_MAX) {
-					fprintf(
-					    stderr,
-					    "With the following flags: Min. OTA: %llu, Target OTA: MAX, Critical: %hhu, Cert: %u & %hu Metadata strings%s",
-					    (long long unsigned int) info.source_revision,
-					    info.critical,
-					    (uint32_t) info.certificate_number,
-					    info.num_meta,
-					    (info.num_meta ? " (" : ".\n"));
-				} else {
-					fprintf(
-					    stderr,
-					    "With the following flags: Min. OTA: %llu, Target OTA: %llu, Critical: %hhu, Cert: %u & %hu Metadata strings%s",
-					    (long long unsigned int) info.source_revision,
-					    (long long unsigned int) info.target_revision,
-					    info.critical,
-					    (uint32_t) info.certificate_number,
-					    info.num_meta,
-					    (info.num_meta ? " (" : ".\n"));
-				}
-				// Loop over meta
-				for (i = 0; i < info.num_meta; i++) {
-					fprintf(stderr, "%s", info.metastrings[i]);
-					if (i != info.num_meta - 1) {
-						fprintf(stderr, "; ");
-					} else {
-						fprintf(stderr, ").\n");
-					}
-				}
-				break;
-			case OTAUpdate:
-				if (info.target_revision == UINT32_MAX) {
-					fprintf(
-					    stderr,
-					    "With the following flags: Min. OTA: %llu, Target OTA: MAX, Optional: %hhu.\n",
-					    (long long unsigned int) info.source_revision,
-					    info.optional);
-				} else {
-					fprintf(
-					    stderr,
-					    "With the following flags: Min. OTA: %llu, Target OTA: %llu, Optional: %hhu.\n",
-					    (long long unsigned int) info.source_revision,
-					    (long long unsigned int) info.target_revision,
-					    info.optional);
-				}
-				break;
-			case RecoveryUpdate:
-				fprintf(stderr,
-					"With the following flags: Minor: %u, Magic 1: %u, Magic 2: %u",
-					info.minor,
-					info.magic_1,
-					info.magic_2);
-				if (memcmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2) {
-					if (info.target_revision == UINT64_MAX) {
-						fprintf(stderr,
-							", Header Rev: %u, Target OTA: MAX, Platform: %s, Board: %s.\n",
-							info.header_rev,
-							convert_platform_id(info.platform),
-							convert_board_id(info.board));
-					} else {
-						fprintf(stderr,
-							", Header Rev: %u, Target OTA: %llu, Platform: %s, Board: %s.\n",
-							info.header_rev,
-							(long long unsigned int) info.target_revision,
-							convert_platform_id(info.platform),
-							convert_board_id(info.board));
-					}
-				} else {
-					fprintf(stderr, ".\n");
-				}
-				break;
-			case RecoveryUpdateV2:
-				fprintf(stderr, "With the following flags:");
-				if (info.target_revision == UINT64_MAX) {
-					fprintf(stderr, " Target OTA: MAX");
-				} else {
-					fprintf(
-					    stderr, " Target OTA: %llu", (long long unsigned int) info.target_revision);
-				}
-				fprintf(
-				    stderr,
-				    ", Minor: %u, Magic 1: %u, Magic 2: %u, Header Rev: %u, Cert: %u, Platform: %s, Board: %s.\n",
-				    info.minor,
-				    info.magic_1,
-				    info.magic_2,
-				    info.header_rev,
-				    (uint32_t) info.certificate_number,
-				    convert_platform_id(info.platform),
-				    convert_board_id(info.board));
-				break;
-			case UnknownUpdate:
-			default:
-				fprintf(stderr, "\n\n!!!!\nUnknown update type, we shouldn't ever hit this!\n!!!!\n");
-				break;
+		if (tarball == NULL) {
+			fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
+			if (tarball_fd != -1) {
+				close(tarball_fd);
+				unlink(tarball_filename);
+			}
+			goto do_error;
+		}
+	}
+
+	// Recap (to stderr, in order not to mess stuff up if we output to stdout) what we're building
+	if (variants != NULL) {
+		for (ui = 0; ui < num_variants; ui++) {
+			kindle_create_print_recap(&variants[ui].info,
+						  variants[ui].output_filename,
+						  tarball_filename,
+						  legacy,
+						  fake_sign,
+						  skip_archive,
+						  userdata_only);
 		}
+	} else {
+		kindle_create_print_recap(
+		    &info, output_filename, tarball_filename, legacy, fake_sign, skip_archive, userdata_only);
 	}
 
 	// Create our package archive, sigfile & bundlefile included
 	if (!skip_archive) {
-		if (kindle_create_package_archive(
-			tarball_fd, input_list, input_index, &info.sign_pkey, legacy, real_blocksize) != 0) {
-			fprintf(stderr, "Failed to create intermediate archive '%s'.\n", tarball_filename);
-			// Delete the borked files
-			close(tarball_fd);
-			unlink(tarball_filename);
+		if (sig_cache_dir != NULL) {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+			if (sig_cache_init(&sig_cache, sig_cache_dir, sig_cache_size, &info.sign_pkey) != 0) {
+				goto do_error;
+			}
+#else
+			fprintf(stderr, "The signature cache is not supported on this platform, ignoring it.\n");
+			sig_cache_dir = NULL;
+#endif
+		}
+		if (previous_filename != NULL &&
+		    kindle_create_load_previous(previous_filename, &info.sign_pkey, fake_sign, &prev) != 0) {
+			goto do_error;
+		}
+		if (delta_filename != NULL &&
+		    kindle_create_load_delta(delta_filename, input_list, input_index, legacy, fake_sign, &delta) != 0) {
+			kindle_create_free_previous(&prev);
+			goto do_error;
+		}
+		delta.root = delta_root;
+		r = kindle_create_package_archive(tarball,
+						  input_list,
+						  input_index,
+						  &info.sign_pkey,
+						  legacy,
+						  real_blocksize,
+						  jobs,
+						  compression_level,
+						  sig_cache_dir != NULL ? &sig_cache : NULL,
+						  previous_filename != NULL ? &prev : NULL,
+						  delta_filename != NULL ? &delta : NULL);
+		kindle_create_free_previous(&prev);
+		kindle_create_free_delta(&delta);
+		if (r != 0) {
+			fprintf(stderr, "Failed to create intermediate archive.\n");
 			goto do_error;
 		}
-		// We opened it, we need to close it ;)
-		close(tarball_fd);
+		if (fflush(tarball) != 0) {
+			fprintf(stderr, "Failed to flush intermediate archive: %s.\n", strerror(errno));
+			goto do_error;
+		}
+		// Account for the intermediate tarball, since the archive writers don't go through us
+		off_t tarball_size = ftello(tarball);
+		if (tarball_size > 0) {
+			kt_stats_add(KT_STATS_BYTES_WRITTEN, (uint64_t) tarball_size);
+			kt_stats_add(KT_STATS_TEMP_BYTES, (uint64_t) tarball_size);
+		}
+		// And we just read it back from the top
+		rewind(tarball);
+		input   = tarball;
+		tarball = NULL;
 	}
 
 	// And finally, build our package :)
-	if ((input = fopen(tarball_filename, "rb")) == NULL) {
+	if (skip_archive && (input = fopen(tarball_filename, "rb")) == NULL) {
 		fprintf(stderr, "Cannot read input tarball '%s': %s.\n", tarball_filename, strerror(errno));
 		goto do_error;
 	}
-	if (kindle_create(&info, input, output, fake_sign) < 0) {
+	if (variants != NULL) {
+		// Every variant shares the same payload, so, only hash it once
+		// NOTE: Signed userdata packages don't embed it anywhere, so don't bother.
+		if (!userdata_only) {
+			if (munger_md5(input, NULL, fake_sign, payload_md5, NULL) < 0) {
+				fprintf(stderr, "Error calculating MD5 of package.\n");
+				goto do_error;
+			}
+		}
+		// And then only write the headers (and the signature envelope) of each variant around it
+		for (ui = 0; ui < num_variants; ui++) {
+			rewind(input);
+			if (!userdata_only) {
+				variants[ui].info.payload_md5 = payload_md5;
+			}
+			if ((output = fopen(variants[ui].output_filename, "wb")) == NULL) {
+				fprintf(stderr,
+					"Cannot create output package file '%s': %s.\n",
+					variants[ui].output_filename,
+					strerror(errno));
+				goto do_error;
+			}
+			num_written++;
+			if (kindle_create(&variants[ui].info, input, output, fake_sign) < 0) {
+				fprintf(stderr, "Cannot write update to output '%s'.\n", variants[ui].output_filename);
+				goto do_error;
+			}
+			fclose(output);
+			output = NULL;
+		}
+	} else if (kindle_create(&info, input, output, fake_sign) < 0) {
 		fprintf(stderr, "Cannot write update to output.\n");
 		goto do_error;
 	}
 
 	// Cleanup
-	for (ui = 0; ui < input_index; ui++) {
-		free(input_list[ui]);
-	}
-	free(input_list);
 	free(info.devices);
 	for (i = 0; i < info.num_meta; i++) {
 		free(info.metastrings[i]);
 	}
 	free(info.metastrings);
+	kindle_create_free_variants(variants, num_variants);
 	rsa_private_key_clear(&info.sign_pkey);
 	fclose(input);
-	if (output != stdout) {
+	if (output != NULL && output != stdout) {
 		fclose(output);
 	}
 	free(output_filename);
-	// Remove tarball, unless we asked to keep it, or we used an existing tarball as sole input
-	if (!keep_archive && !skip_archive) {
-		unlink(tarball_filename);
-	}
+	// NOTE: Unless we asked to keep it (or we used an existing tarball as sole input),
+	//       the intermediate tarball was anonymous, so it's already gone.
 	free(tarball_filename);
 
 	return 0;
 
 do_error:
-	if (input_index > 0) {
-		for (ui = 0; ui < input_index; ui++) {
-			free(input_list[ui]);
-		}
-		free(input_list);
-	}
 	free(output_filename);
 	free(info.devices);
 	for (i = 0; i < info.num_meta; i++) {
@@ -2952,6 +4623,18 @@ do_error:
 	if (output != NULL && output != stdout) {
 		fclose(output);
 	}
+	// A set of variants is all or nothing: don't leave the ones we managed to build lying around
+	for (ui = 0; ui < num_written; ui++) {
+		unlink(variants[ui].output_filename);
+	}
+	kindle_create_free_variants(variants, num_variants);
+	// Delete the borked intermediate tarball if we failed to build it (there's nothing to do on disk if it was anonymous)
+	if (tarball != NULL) {
+		fclose(tarball);
+		if (keep_archive) {
+			unlink(tarball_filename);
+		}
+	}
 	free(tarball_filename);
 	return -1;
 }
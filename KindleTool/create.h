@@ -49,47 +49,360 @@ typedef struct
 	unsigned char          critical;
 	uint16_t               num_meta;
 	char**                 metastrings;
+	// NOTE: If set, the MD5 of the demunged payload, so the header writers don't have to compute it again
+	const char*            payload_md5;
 } UpdateInformation;
 
+// The switches a variants manifest can override
+#define VARIANT_SWITCHES  "d:b:s:t:1:2:m:p:B:h:c:o:r:x:"
+#define VARIANT_LINE_MAX  4096
+#define VARIANT_ARGS_MAX  256
+
+// One of the packages built out of a single payload, as described by a line of a variants manifest
+struct kt_create_variant
+{
+	UpdateInformation info;
+	char*             output_filename;
+	bool              enforce_source_rev;
+	bool              enforce_target_rev;
+};
+
+// Persistent signature cache, keyed by the SHA-256 of a payload file, and the signing key.
+// An entry is our magic, the file's MD5 (as hex), and its raw signature.
+#define KT_SIG_CACHE_MAGIC        "KTSIGC01"
+#define KT_SIG_CACHE_MAGIC_LENGTH 8
+#define KT_SIG_CACHE_HEADER_SIZE  (KT_SIG_CACHE_MAGIC_LENGTH + MD5_HASH_LENGTH)
+// We only keep the first half of the key's fingerprint in the entries names
+#define KT_SIG_CACHE_KEY_ID_SIZE     (SHA256_DIGEST_SIZE / 2)
+#define KT_SIG_CACHE_DEFAULT_MAX_MIB 64U
+
+struct kt_sig_cache
+{
+	const char* dir;
+	uint64_t    max_size;
+	char        key_id[KT_SIG_CACHE_KEY_ID_SIZE * 2 + 1];
+};
+
+// Used when evicting entries, oldest first
+struct kt_sig_cache_entry
+{
+	char*  name;
+	time_t mtime;
+	off_t  size;
+};
+
+// A payload file of a previous build, for create --incremental.
+// It's reused as-is (data, MD5 & signature) if it still has the same size & mtime.
+struct kt_prev_entry
+{
+	char*         pathname;
+	int64_t       size;
+	time_t        mtime;
+	off_t         data_offset;    // Where its data lives in kt_prev_build's payload
+	char          md5[MD5_HASH_LENGTH + 1];
+	unsigned char raw_sig[CERTIFICATE_2K_SIZE];
+	bool          has_sig;
+};
+
+// Everything we know about a previous build, sorted by pathname
+struct kt_prev_build
+{
+	struct kt_prev_entry* entries;
+	size_t                num_entries;
+	FILE*                 payload;    // The data of its payload files, back to back
+};
+
+// The script we generate to remove whatever is gone since the delta base, for create --delta-from
+#define KT_DELTA_SCRIPT_NAME "kindletool_delta_cleanup.sh"
+#define KT_DELTA_SCRIPT_HEADER                                                                                           \
+	"#!/bin/sh\n"                                                                                                    \
+	"#\n"                                                                                                            \
+	"# Generated by KindleTool (create --delta-from): removes what's gone since the previous revision.\n"            \
+	"# Paths are relative to KT_DELTA_ROOT, where the payload ends up on the device (create --delta-root).\n"        \
+	"#\n"                                                                                                            \
+	"\n"                                                                                                             \
+	"KT_DELTA_ROOT="
+#define KT_DELTA_SCRIPT_RM "rm -f -- \"${KT_DELTA_ROOT}\"/"
+
+// A payload file of the delta base, pathname without any leading ./ or /.
+// relpath is the same thing, relative to the input directory it belongs to (NULL if it doesn't belong to any).
+// Its MD5 is only computed if the new tree has a file of the same size at the same path.
+struct kt_delta_entry
+{
+	char*       pathname;
+	const char* relpath;
+	char*       sourcepath;
+	int64_t     size;
+	char        md5[MD5_HASH_LENGTH + 1];
+	bool        seen;
+};
+
+// Everything we know about the delta base, sorted by pathname
+struct kt_delta
+{
+	struct kt_delta_entry* entries;
+	size_t                 num_entries;
+	unsigned int           unchanged;
+	const char*            root;
+};
+
+// A payload entry's signature, computed by our worker pool
+struct kttar_sig
+{
+	uint8_t                       digest[SHA256_DIGEST_SIZE];
+	// NOTE: We can't use keys > 2K anyway...
+	unsigned char                 raw_sig[CERTIFICATE_2K_SIZE];
+	const struct rsa_private_key* rsa_pkey;
+	// If set, look the signature up there first, and store it there otherwise.
+	const struct kt_sig_cache*    cache;
+	// The MD5 we computed for the index, a cached entry has to match it.
+	char                          md5[MD5_HASH_LENGTH + 1];
+	bool                          cached;
+	int                           status;
+};
+
+// pigz-style parallel gzip compression of our tarball
+#define KTGZ_BLOCK_SIZE (128 * 1024)
+#define KTGZ_DICT_SIZE  (32 * 1024)
+
+struct ktgz;
+
+// A block of the tarball, compressed by our worker pool
+struct ktgz_block
+{
+	struct ktgz*   ktgz;
+	unsigned char* in;
+	size_t         in_len;
+	// The tail of the previous block (copied over, since that one may very well be recycled before we're done)
+	unsigned char  dict[KTGZ_DICT_SIZE];
+	size_t         dict_len;
+	unsigned char* out;
+	size_t         out_size;
+	size_t         out_len;
+	uLong          crc;
+	int            level;
+	bool           last;
+	bool           done;
+	int            status;
+};
+
+// Our compressor state, sitting behind libarchive's client callbacks.
+// Blocks go around a ring: we fill them, our worker pool compresses them,
+// and our writer thread writes them out in order, so that reading, compressing & writing all overlap.
+struct ktgz
+{
+	FILE*              file;
+	int                level;
+	struct kt_pool*    pool;
+	struct ktgz_block* blocks;
+	unsigned int       num_blocks;
+	// Everything below is guarded by lock (except for what only the writer thread touches)
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;
+	uint64_t           filled;     // Blocks handed over to the pool so far (i.e., the one we're filling)
+	uint64_t           written;    // Blocks written out so far
+	bool               finished;
+	int                error;
+	pthread_t          writer;
+	bool               writer_running;
+	bool               header_written;
+	uLong              crc;
+	uint32_t           isize;
+};
+
+// How far ahead of the archiver our readahead stage is allowed to go
+#define KT_PREFETCH_WINDOW (64U * 1024U * 1024U)
+
+// Our readahead stage: it walks the input ahead of the archiver, and asks the kernel to start reading the upcoming files.
+// NOTE: It's only a hint, so it doesn't matter if both walks end up disagreeing somewhere.
+struct kt_prefetch
+{
+	char**             filename;
+	unsigned int       total_files;
+	pthread_mutex_t    lock;
+	pthread_cond_t     cond;
+	uint64_t           hinted;      // Bytes we've asked the kernel to read so far
+	uint64_t           consumed;    // Bytes the archiver went through so far
+	bool               stop;
+	pthread_t          thread;
+	bool               running;
+};
+
+// A payload file we archived, and still have to write a sigfile & an index entry for
+struct kttar_file
+{
+	const char*       pathname;            // As we found it
+	const char*       tweaked_pathname;    // As we archived it (they only differ in legacy mode)
+	int64_t           size;
+	struct kttar_sig* sig;    // Its hashes & its signature, filled in as we go (and by our worker pool)
+};
+
+// Small payload files get hashed in batches (c.f., kt_hash_batch), since the CPU may be able to hash a few at once.
+// NOTE: That means holding on to their content until the batch is full, hence the size limit.
+#define KTTAR_BATCH_FILES    32U
+#define KTTAR_BATCH_MAX_SIZE (64 * 1024)
+
+struct kttar_batch
+{
+	struct kttar_sig*  sigs[KTTAR_BATCH_FILES];
+	struct kt_hash_job jobs[KTTAR_BATCH_FILES];
+	size_t             offsets[KTTAR_BATCH_FILES];    // Into data, which may move as it grows
+	unsigned int       count;
+	unsigned char*     data;
+	size_t             used;
+	size_t             size;
+};
+
 // This is modeled after libarchive's bsdtar...
 struct kttar
 {
-	unsigned char* buff;
-	size_t         buff_size;
-	char**         to_sign_and_bundle_list;
-	char**         tweaked_to_sign_and_bundle_list;
-	unsigned int   sign_and_bundle_index;
-	bool           has_script;
-	size_t         tweak_pointer_index;
+	unsigned char*                buff;
+	size_t                        buff_size;
+	// Grown geometrically, while the strings & sigs it points to live in arena, so they never move
+	struct kttar_file*            files;
+	unsigned int                  num_files;
+	unsigned int                  files_capacity;
+	struct kt_arena               arena;
+	bool                          has_script;
+	size_t                        tweak_pointer_index;
+	// Running hashes of the entry being archived (if hash_entry is set), fed by copy_file_data_block
+	bool                          hash_entry;
+	struct md5_ctx                md5;
+	struct kt_sha256_ctx          sha256;
+	// Unless it's small enough to be batched, in which case its content goes to batch instead
+	bool                          batch_entry;
+	struct kttar_batch            batch;
+	const struct rsa_private_key* rsa_pkey;
+	const struct kt_sig_cache*    sig_cache;
+	const struct kt_prev_build*   prev;
+	unsigned int                  reused;
+	struct kt_delta*              delta;
+	struct kt_pool*               pool;
+	struct kt_prefetch*           prefetch;
 };
 
 static const char* convert_bundle_version(BundleVersion);
 
 static struct rsa_private_key get_default_key(void);
+static int                    sign_sha256_digest(const uint8_t*, const struct rsa_private_key*, unsigned char*);
 static int                    sign_file(FILE*, const struct rsa_private_key*, FILE*);
+static void                   sign_entry_job(void*);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static int  sig_cache_init(struct kt_sig_cache*, const char*, uint64_t, const struct rsa_private_key*);
+static void sig_cache_path(const struct kt_sig_cache*, const uint8_t*, char*);
+static bool sig_cache_lookup(const struct kt_sig_cache*, struct kttar_sig*);
+static void sig_cache_store(const struct kt_sig_cache*, const struct kttar_sig*);
+static int  sig_cache_entry_cmp(const void*, const void*);
+static void sig_cache_evict(const struct kt_sig_cache*);
+#endif
 
+static int kttar_path_excluded(struct archive_entry*);
 static int metadata_filter(struct archive*, void*, struct archive_entry*);
-static int write_file(const struct kttar*, struct archive*, struct archive*, struct archive_entry*);
-static int write_entry(const struct kttar*, struct archive*, struct archive*, struct archive_entry*);
-static int copy_file_data_block(const struct kttar*, struct archive*, struct archive*, struct archive_entry*);
-static int create_from_archive_read_disk(struct kttar*,
-					 struct archive*,
-					 const char*,
-					 bool,
-					 const char*,
-					 const unsigned int);
-
-static int kindle_create_package_archive(const int,
+static int write_file(struct kttar*, struct archive*, struct archive*, struct archive_entry*);
+static int write_entry(struct kttar*, struct archive*, struct archive*, struct archive_entry*);
+static int copy_file_data_block(struct kttar*, struct archive*, struct archive*, struct archive_entry*);
+static int write_memory_entry(struct archive*, const char*, const void*, size_t, mode_t);
+static int write_previous_entry(struct kttar*, struct archive*, const struct kt_prev_entry*, struct archive_entry*);
+static void       ktgz_deflate_block(struct ktgz_block*);
+static void       ktgz_compress_block(void*);
+static int        ktgz_write_file(FILE*, const unsigned char*, size_t);
+static void*      ktgz_writer(void*);
+static int        ktgz_submit(struct ktgz*, bool);
+static int        ktgz_finish(struct ktgz*);
+static la_ssize_t ktgz_write(struct archive*, void*, const void*, size_t);
+static int        ktgz_close(struct archive*, void*);
+static int        ktgz_init(struct ktgz*, FILE*, int, struct kt_pool*, unsigned int);
+static void       ktgz_free(struct ktgz*);
+
+#if defined(POSIX_FADV_WILLNEED) || defined(F_RDADVISE)
+static void  kt_prefetch_hint(const char*, int64_t);
+static bool  kt_prefetch_walk(struct kt_prefetch*, const char*);
+static void* kt_prefetch_thread(void*);
+#endif
+static void kt_prefetch_start(struct kt_prefetch*, char**, const unsigned int);
+static void kt_prefetch_consume(struct kt_prefetch*, int64_t);
+static void kt_prefetch_stop(struct kt_prefetch*);
+
+static int                   kt_prev_entry_cmp(const void*, const void*);
+static int                   kt_prev_entry_key_cmp(const void*, const void*);
+static struct kt_prev_entry* kindle_create_find_previous(const struct kt_prev_build*, struct archive_entry*);
+static unsigned char*        kindle_create_read_member(struct archive*, struct archive_entry*, size_t*);
+static int                   kindle_create_stash_member(struct archive*, FILE*, unsigned char*, off_t*);
+static int  kindle_create_load_previous(const char*, const struct rsa_private_key*, const bool, struct kt_prev_build*);
+static void kindle_create_free_previous(struct kt_prev_build*);
+
+static const char* kt_delta_path(const char*);
+static bool        kt_delta_input_prefix(const char*, char*, size_t*);
+static int         kt_delta_entry_cmp(const void*, const void*);
+static int         kt_delta_entry_key_cmp(const void*, const void*);
+static int         kt_delta_md5_file(const char*, unsigned char*, size_t, char*);
+static int         kt_delta_md5_member(struct archive*, unsigned char*, size_t, char*);
+static int         kindle_create_load_delta(
+    const char*, char**, const unsigned int, const bool, const bool, struct kt_delta*);
+static void        kindle_create_free_delta(struct kt_delta*);
+static bool        kindle_create_delta_unchanged(struct kttar*, struct archive_entry*);
+static bool        kt_delta_write_quoted(struct nettle_buffer*, const char*);
+static int         kindle_create_delta_script(struct kttar*, struct archive*, const unsigned int);
+
+static int                kttar_scratch(char**, size_t*, size_t);
+static struct kttar_file* kttar_track_file(struct kttar*, const char*, const char*, int64_t);
+static int                kttar_hash_data(struct kttar*, const void*, size_t);
+static int                kttar_batch_flush(struct kttar*);
+
+static int kttar_add_entry(struct kttar*,
+			   struct archive*,
+			   struct archive*,
+			   struct archive_entry*,
+			   const char*,
+			   const unsigned int);
+static int create_from_archive_read_disk(struct kttar*, struct archive*, const char*, const unsigned int);
+static int create_from_archive_read_stream(struct kttar*, struct archive*, const unsigned int);
+
+static int kindle_create_package_archive(FILE*,
 					 char**,
 					 const unsigned int,
 					 const struct rsa_private_key*,
 					 const unsigned int,
-					 const unsigned int);
+					 const unsigned int,
+					 const unsigned int,
+					 const int,
+					 const struct kt_sig_cache*,
+					 const struct kt_prev_build*,
+					 struct kt_delta*);
 static int kindle_create(const UpdateInformation*, FILE*, FILE*, const bool);
-static int kindle_create_ota_update_v2(const UpdateInformation*, FILE*, FILE*, const bool);
+static int kindle_create_wrapped(const UpdateInformation*,
+				 FILE*,
+				 FILE*,
+				 const bool,
+				 int (*)(const UpdateInformation*, FILE*, FILE*, const bool, struct kt_sha256_ctx*));
+static int kindle_write_update(unsigned char*,
+			       size_t,
+			       size_t,
+			       FILE*,
+			       FILE*,
+			       const bool,
+			       const char*,
+			       struct kt_sha256_ctx*);
+static int kindle_create_ota_update_v2(const UpdateInformation*, FILE*, FILE*, const bool, struct kt_sha256_ctx*);
+static int kindle_write_signature_header(const UpdateInformation*, FILE*);
 static int kindle_create_signature(const UpdateInformation*, FILE*, FILE*);
-static int kindle_create_ota_update(const UpdateInformation*, FILE*, FILE*, const bool);
-static int kindle_create_recovery(const UpdateInformation*, FILE*, FILE*, const bool);
-static int kindle_create_recovery_v2(const UpdateInformation*, FILE*, FILE*, const bool);
+static int kindle_create_ota_update(const UpdateInformation*, FILE*, FILE*, const bool, struct kt_sha256_ctx*);
+static int kindle_create_recovery(const UpdateInformation*, FILE*, FILE*, const bool, struct kt_sha256_ctx*);
+static int kindle_create_recovery_v2(const UpdateInformation*, FILE*, FILE*, const bool, struct kt_sha256_ctx*);
+
+static int  parse_device(UpdateInformation*, const char*);
+static int  parse_platform(UpdateInformation*, const char*);
+static int  parse_board(UpdateInformation*, const char*);
+static int  kindle_create_set_type(UpdateInformation*, const char*, unsigned int*);
+static int  kindle_create_set_option(UpdateInformation*, int, const char*, bool*, bool*);
+static int  kindle_create_apply_switches(UpdateInformation*, const char* const*, int, bool*, bool*);
+static int  kindle_create_check_info(UpdateInformation*, const bool, const bool, const bool, const bool);
+static int  kindle_create_check_output_name(const UpdateInformation*, const char*, const bool, const bool);
+static void kindle_create_print_recap(
+    const UpdateInformation*, const char*, const char*, const bool, const bool, const bool, const bool);
+static int kindle_create_parse_variants(
+    const char*, const UpdateInformation*, const bool, const bool, struct kt_create_variant**, unsigned int*);
+static void kindle_create_free_variants(struct kt_create_variant*, unsigned int);
 
 #endif
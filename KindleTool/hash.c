@@ -0,0 +1,557 @@
+/*
+**  KindleTool, hash.c
+**
+**  Copyright (C) 2011-2012  Yifan Lu
+**  Copyright (C) 2012-2020  NiLuJe
+**  Concept based on an original Python implementation by Igor Skochinsky & Jean-Yves Avenard,
+**    cf., http://www.mobileread.com/forums/showthread.php?t=63225
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "kindle_tool.h"
+
+// The hashes we compute for every single payload file (MD5 for the bundle index, SHA-256 for its signature).
+// Everything goes through nettle, unless the CPU gives us a faster way to do it:
+// SHA-256 can use the SHA extensions (x86) or the ARMv8 crypto extensions,
+// and MD5, which no CPU accelerates, can at least hash a batch of small files in parallel, in the AVX2 lanes.
+// NOTE: The intrinsics headers are only pulled in here, they're not something the rest of us need to see.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#	define KT_HASH_X86
+#	include <cpuid.h>
+#	include <immintrin.h>
+#endif
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+// NOTE: We only go there when the compiler was told the target has them, so there's no runtime check to speak of.
+#	define KT_HASH_ARMV8
+#	include <arm_neon.h>
+#endif
+
+#define KT_SHA256_STATE_WORDS (SHA256_DIGEST_SIZE / 4U)
+#define KT_MD5_LANES          8U
+
+static const uint32_t kt_sha256_iv[KT_SHA256_STATE_WORDS] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+							      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+#if defined(KT_HASH_X86) || defined(KT_HASH_ARMV8)
+static const uint32_t kt_sha256_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+// What we picked, once and for all (NULL means nettle)
+static pthread_once_t kt_hash_once = PTHREAD_ONCE_INIT;
+static void (*kt_sha256_compress)(uint32_t*, const uint8_t*, size_t) = NULL;
+static void (*kt_md5_batch)(struct kt_hash_job*, size_t)               = NULL;
+static const char* kt_sha256_backend                                   = "nettle";
+static const char* kt_md5_backend                                      = "nettle";
+
+#if defined(KT_HASH_X86)
+// Straight out of Intel's SHA extensions whitepaper, four rounds at a time.
+// state is in the usual ABCDEFGH order, the instructions want it as ABEF & CDGH.
+#	define KT_SHANI_ROUNDS(i, w)                                                                                     \
+		do {                                                                                                     \
+			msg    = _mm_add_epi32(w, _mm_load_si128((const __m128i*) (const void*) &kt_sha256_k[4 * (i)])); \
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                                             \
+			msg    = _mm_shuffle_epi32(msg, 0x0E);                                                           \
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                                             \
+		} while (0)
+// Expand the next four words of the message schedule into w0, now that we're done with it
+#	define KT_SHANI_SCHEDULE(w0, w1, w2, w3)                                                                         \
+		w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3)
+
+__attribute__((target("sha,sse4.1"))) static void
+    kt_sha256_compress_shani(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	const __m128i shuf_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+	__m128i       state0, state1, msg, tmp, abef_save, cdgh_save;
+	__m128i       w0, w1, w2, w3;
+
+	tmp    = _mm_loadu_si128((const __m128i*) (const void*) &state[0]);
+	state1 = _mm_loadu_si128((const __m128i*) (const void*) &state[4]);
+	tmp    = _mm_shuffle_epi32(tmp, 0xB1);          // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+	while (blocks-- > 0U) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (const void*) (data + 0)), shuf_mask);
+		w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (const void*) (data + 16)), shuf_mask);
+		w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (const void*) (data + 32)), shuf_mask);
+		w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (const void*) (data + 48)), shuf_mask);
+		for (unsigned int i = 0U; i < 12U; i += 4U) {
+			KT_SHANI_ROUNDS(i, w0);
+			KT_SHANI_SCHEDULE(w0, w1, w2, w3);
+			KT_SHANI_ROUNDS(i + 1U, w1);
+			KT_SHANI_SCHEDULE(w1, w2, w3, w0);
+			KT_SHANI_ROUNDS(i + 2U, w2);
+			KT_SHANI_SCHEDULE(w2, w3, w0, w1);
+			KT_SHANI_ROUNDS(i + 3U, w3);
+			KT_SHANI_SCHEDULE(w3, w0, w1, w2);
+		}
+		KT_SHANI_ROUNDS(12, w0);
+		KT_SHANI_ROUNDS(13, w1);
+		KT_SHANI_ROUNDS(14, w2);
+		KT_SHANI_ROUNDS(15, w3);
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	tmp    = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+	_mm_storeu_si128((__m128i*) (void*) &state[0], state0);
+	_mm_storeu_si128((__m128i*) (void*) &state[4], state1);
+}
+
+// Eight independent MD5 blocks at once, one per 32-bit lane.
+#	define KT_MD5_ROTL(x, s)        _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+#	define KT_MD5_F1(x, y, z)       _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#	define KT_MD5_F2(x, y, z)       KT_MD5_F1(z, x, y)
+#	define KT_MD5_F3(x, y, z)       _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#	define KT_MD5_F4(x, y, z)       _mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, ones)))
+#	define KT_MD5_STEP(f, a, b, c, d, m, k, s)                                                                       \
+		do {                                                                                                     \
+			a = _mm256_add_epi32(                                                                            \
+			    a, _mm256_add_epi32(f(b, c, d), _mm256_add_epi32(m, _mm256_set1_epi32((int) (k)))));         \
+			a = _mm256_add_epi32(KT_MD5_ROTL(a, s), b);                                                      \
+		} while (0)
+
+__attribute__((target("avx2"))) static void
+    kt_md5_compress_avx2(uint32_t state[4][KT_MD5_LANES], const uint8_t* const block[KT_MD5_LANES])
+{
+	const __m256i ones = _mm256_set1_epi32(-1);
+	__m256i       m[16];
+	__m256i       a, b, c, d;
+	uint32_t      word[KT_MD5_LANES];
+
+	for (unsigned int i = 0U; i < 16U; i++) {
+		// NOTE: x86 is little-endian, just like MD5
+		for (unsigned int l = 0U; l < KT_MD5_LANES; l++) {
+			memcpy(&word[l], block[l] + 4U * i, sizeof(word[l]));
+		}
+		m[i] = _mm256_loadu_si256((const __m256i*) (const void*) word);
+	}
+	a = _mm256_load_si256((const __m256i*) (const void*) state[0]);
+	b = _mm256_load_si256((const __m256i*) (const void*) state[1]);
+	c = _mm256_load_si256((const __m256i*) (const void*) state[2]);
+	d = _mm256_load_si256((const __m256i*) (const void*) state[3]);
+
+	KT_MD5_STEP(KT_MD5_F1, a, b, c, d, m[0], 0xd76aa478, 7);
+	KT_MD5_STEP(KT_MD5_F1, d, a, b, c, m[1], 0xe8c7b756, 12);
+	KT_MD5_STEP(KT_MD5_F1, c, d, a, b, m[2], 0x242070db, 17);
+	KT_MD5_STEP(KT_MD5_F1, b, c, d, a, m[3], 0xc1bdceee, 22);
+	KT_MD5_STEP(KT_MD5_F1, a, b, c, d, m[4], 0xf57c0faf, 7);
+	KT_MD5_STEP(KT_MD5_F1, d, a, b, c, m[5], 0x4787c62a, 12);
+	KT_MD5_STEP(KT_MD5_F1, c, d, a, b, m[6], 0xa8304613, 17);
+	KT_MD5_STEP(KT_MD5_F1, b, c, d, a, m[7], 0xfd469501, 22);
+	KT_MD5_STEP(KT_MD5_F1, a, b, c, d, m[8], 0x698098d8, 7);
+	KT_MD5_STEP(KT_MD5_F1, d, a, b, c, m[9], 0x8b44f7af, 12);
+	KT_MD5_STEP(KT_MD5_F1, c, d, a, b, m[10], 0xffff5bb1, 17);
+	KT_MD5_STEP(KT_MD5_F1, b, c, d, a, m[11], 0x895cd7be, 22);
+	KT_MD5_STEP(KT_MD5_F1, a, b, c, d, m[12], 0x6b901122, 7);
+	KT_MD5_STEP(KT_MD5_F1, d, a, b, c, m[13], 0xfd987193, 12);
+	KT_MD5_STEP(KT_MD5_F1, c, d, a, b, m[14], 0xa679438e, 17);
+	KT_MD5_STEP(KT_MD5_F1, b, c, d, a, m[15], 0x49b40821, 22);
+
+	KT_MD5_STEP(KT_MD5_F2, a, b, c, d, m[1], 0xf61e2562, 5);
+	KT_MD5_STEP(KT_MD5_F2, d, a, b, c, m[6], 0xc040b340, 9);
+	KT_MD5_STEP(KT_MD5_F2, c, d, a, b, m[11], 0x265e5a51, 14);
+	KT_MD5_STEP(KT_MD5_F2, b, c, d, a, m[0], 0xe9b6c7aa, 20);
+	KT_MD5_STEP(KT_MD5_F2, a, b, c, d, m[5], 0xd62f105d, 5);
+	KT_MD5_STEP(KT_MD5_F2, d, a, b, c, m[10], 0x02441453, 9);
+	KT_MD5_STEP(KT_MD5_F2, c, d, a, b, m[15], 0xd8a1e681, 14);
+	KT_MD5_STEP(KT_MD5_F2, b, c, d, a, m[4], 0xe7d3fbc8, 20);
+	KT_MD5_STEP(KT_MD5_F2, a, b, c, d, m[9], 0x21e1cde6, 5);
+	KT_MD5_STEP(KT_MD5_F2, d, a, b, c, m[14], 0xc33707d6, 9);
+	KT_MD5_STEP(KT_MD5_F2, c, d, a, b, m[3], 0xf4d50d87, 14);
+	KT_MD5_STEP(KT_MD5_F2, b, c, d, a, m[8], 0x455a14ed, 20);
+	KT_MD5_STEP(KT_MD5_F2, a, b, c, d, m[13], 0xa9e3e905, 5);
+	KT_MD5_STEP(KT_MD5_F2, d, a, b, c, m[2], 0xfcefa3f8, 9);
+	KT_MD5_STEP(KT_MD5_F2, c, d, a, b, m[7], 0x676f02d9, 14);
+	KT_MD5_STEP(KT_MD5_F2, b, c, d, a, m[12], 0x8d2a4c8a, 20);
+
+	KT_MD5_STEP(KT_MD5_F3, a, b, c, d, m[5], 0xfffa3942, 4);
+	KT_MD5_STEP(KT_MD5_F3, d, a, b, c, m[8], 0x8771f681, 11);
+	KT_MD5_STEP(KT_MD5_F3, c, d, a, b, m[11], 0x6d9d6122, 16);
+	KT_MD5_STEP(KT_MD5_F3, b, c, d, a, m[14], 0xfde5380c, 23);
+	KT_MD5_STEP(KT_MD5_F3, a, b, c, d, m[1], 0xa4beea44, 4);
+	KT_MD5_STEP(KT_MD5_F3, d, a, b, c, m[4], 0x4bdecfa9, 11);
+	KT_MD5_STEP(KT_MD5_F3, c, d, a, b, m[7], 0xf6bb4b60, 16);
+	KT_MD5_STEP(KT_MD5_F3, b, c, d, a, m[10], 0xbebfbc70, 23);
+	KT_MD5_STEP(KT_MD5_F3, a, b, c, d, m[13], 0x289b7ec6, 4);
+	KT_MD5_STEP(KT_MD5_F3, d, a, b, c, m[0], 0xeaa127fa, 11);
+	KT_MD5_STEP(KT_MD5_F3, c, d, a, b, m[3], 0xd4ef3085, 16);
+	KT_MD5_STEP(KT_MD5_F3, b, c, d, a, m[6], 0x04881d05, 23);
+	KT_MD5_STEP(KT_MD5_F3, a, b, c, d, m[9], 0xd9d4d039, 4);
+	KT_MD5_STEP(KT_MD5_F3, d, a, b, c, m[12], 0xe6db99e5, 11);
+	KT_MD5_STEP(KT_MD5_F3, c, d, a, b, m[15], 0x1fa27cf8, 16);
+	KT_MD5_STEP(KT_MD5_F3, b, c, d, a, m[2], 0xc4ac5665, 23);
+
+	KT_MD5_STEP(KT_MD5_F4, a, b, c, d, m[0], 0xf4292244, 6);
+	KT_MD5_STEP(KT_MD5_F4, d, a, b, c, m[7], 0x432aff97, 10);
+	KT_MD5_STEP(KT_MD5_F4, c, d, a, b, m[14], 0xab9423a7, 15);
+	KT_MD5_STEP(KT_MD5_F4, b, c, d, a, m[5], 0xfc93a039, 21);
+	KT_MD5_STEP(KT_MD5_F4, a, b, c, d, m[12], 0x655b59c3, 6);
+	KT_MD5_STEP(KT_MD5_F4, d, a, b, c, m[3], 0x8f0ccc92, 10);
+	KT_MD5_STEP(KT_MD5_F4, c, d, a, b, m[10], 0xffeff47d, 15);
+	KT_MD5_STEP(KT_MD5_F4, b, c, d, a, m[1], 0x85845dd1, 21);
+	KT_MD5_STEP(KT_MD5_F4, a, b, c, d, m[8], 0x6fa87e4f, 6);
+	KT_MD5_STEP(KT_MD5_F4, d, a, b, c, m[15], 0xfe2ce6e0, 10);
+	KT_MD5_STEP(KT_MD5_F4, c, d, a, b, m[6], 0xa3014314, 15);
+	KT_MD5_STEP(KT_MD5_F4, b, c, d, a, m[13], 0x4e0811a1, 21);
+	KT_MD5_STEP(KT_MD5_F4, a, b, c, d, m[4], 0xf7537e82, 6);
+	KT_MD5_STEP(KT_MD5_F4, d, a, b, c, m[11], 0xbd3af235, 10);
+	KT_MD5_STEP(KT_MD5_F4, c, d, a, b, m[2], 0x2ad7d2bb, 15);
+	KT_MD5_STEP(KT_MD5_F4, b, c, d, a, m[9], 0xeb86d391, 21);
+
+	a = _mm256_add_epi32(a, _mm256_load_si256((const __m256i*) (const void*) state[0]));
+	b = _mm256_add_epi32(b, _mm256_load_si256((const __m256i*) (const void*) state[1]));
+	c = _mm256_add_epi32(c, _mm256_load_si256((const __m256i*) (const void*) state[2]));
+	d = _mm256_add_epi32(d, _mm256_load_si256((const __m256i*) (const void*) state[3]));
+	_mm256_store_si256((__m256i*) (void*) state[0], a);
+	_mm256_store_si256((__m256i*) (void*) state[1], b);
+	_mm256_store_si256((__m256i*) (void*) state[2], c);
+	_mm256_store_si256((__m256i*) (void*) state[3], d);
+}
+#endif
+
+#if defined(KT_HASH_ARMV8)
+static void
+    kt_sha256_compress_armv8(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+	uint32x4_t state0 = vld1q_u32(&state[0]);
+	uint32x4_t state1 = vld1q_u32(&state[4]);
+	uint32x4_t abcd_save, efgh_save, wk, abcd;
+	uint32x4_t w[4];
+
+	while (blocks-- > 0U) {
+		abcd_save = state0;
+		efgh_save = state1;
+
+		for (unsigned int i = 0U; i < 4U; i++) {
+			w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16U * i)));
+		}
+		for (unsigned int i = 0U; i < 16U; i++) {
+			wk   = vaddq_u32(w[i % 4U], vld1q_u32(&kt_sha256_k[4U * i]));
+			abcd = state0;
+			// Expand the next four words of the message schedule, now that we're done with these
+			if (i < 12U) {
+				w[i % 4U] = vsha256su1q_u32(
+				    vsha256su0q_u32(w[i % 4U], w[(i + 1U) % 4U]), w[(i + 2U) % 4U], w[(i + 3U) % 4U]);
+			}
+			state0 = vsha256hq_u32(state0, state1, wk);
+			state1 = vsha256h2q_u32(state1, abcd, wk);
+		}
+
+		state0 = vaddq_u32(state0, abcd_save);
+		state1 = vaddq_u32(state1, efgh_save);
+		data += SHA256_BLOCK_SIZE;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+#endif
+
+// One job per lane, the lanes that are done get the next job in line, until we run out.
+#if defined(KT_HASH_X86)
+struct kt_md5_lane
+{
+	struct kt_hash_job* job;
+	size_t              block;     // The one we're at
+	size_t              full;      // How many full blocks of job->data there are
+	size_t              blocks;    // Including the padding, which lives in tail
+	uint8_t             tail[2U * MD5_BLOCK_SIZE];
+};
+
+static void
+    kt_md5_lane_start(struct kt_md5_lane* lane, struct kt_hash_job* job, uint32_t state[4][KT_MD5_LANES], unsigned int l)
+{
+	size_t   rest;
+	uint64_t bits;
+
+	lane->job = job;
+	if (job == NULL) {
+		return;
+	}
+	lane->block = 0U;
+	lane->full  = job->size / MD5_BLOCK_SIZE;
+	rest        = job->size % MD5_BLOCK_SIZE;
+	// The usual MD5 padding: a single set bit, zeroes, and the message length in bits (little-endian)
+	memset(lane->tail, 0, sizeof(lane->tail));
+	if (rest > 0U) {
+		memcpy(lane->tail, job->data + lane->full * MD5_BLOCK_SIZE, rest);
+	}
+	lane->tail[rest] = 0x80;
+	lane->blocks     = lane->full + (rest < MD5_BLOCK_SIZE - 8U ? 1U : 2U);
+	bits             = (uint64_t) job->size * 8U;
+	for (unsigned int i = 0U; i < 8U; i++) {
+		lane->tail[(lane->blocks - lane->full) * MD5_BLOCK_SIZE - 8U + i] = (uint8_t) (bits >> (8U * i));
+	}
+
+	state[0][l] = 0x67452301;
+	state[1][l] = 0xefcdab89;
+	state[2][l] = 0x98badcfe;
+	state[3][l] = 0x10325476;
+}
+
+static const uint8_t*
+    kt_md5_lane_block(const struct kt_md5_lane* lane, size_t block)
+{
+	if (block < lane->full) {
+		return lane->job->data + block * MD5_BLOCK_SIZE;
+	}
+	return lane->tail + (block - lane->full) * MD5_BLOCK_SIZE;
+}
+
+static void
+    kt_md5_lane_finish(struct kt_md5_lane* lane, uint32_t state[4][KT_MD5_LANES], unsigned int l)
+{
+	for (unsigned int i = 0U; i < 4U; i++) {
+		for (unsigned int j = 0U; j < 4U; j++) {
+			lane->job->md5[4U * i + j] = (uint8_t) (state[i][l] >> (8U * j));
+		}
+	}
+}
+
+static void
+    kt_md5_batch_avx2(struct kt_hash_job* jobs, size_t num_jobs)
+{
+	static const uint8_t zero_block[MD5_BLOCK_SIZE] = { 0 };
+	uint32_t             state[4][KT_MD5_LANES] __attribute__((aligned(32)));
+	struct kt_md5_lane   lanes[KT_MD5_LANES];
+	const uint8_t*       block[KT_MD5_LANES];
+	size_t               next = 0U;
+	unsigned int         active;
+
+	for (unsigned int l = 0U; l < KT_MD5_LANES; l++) {
+		kt_md5_lane_start(&lanes[l], next < num_jobs ? &jobs[next++] : NULL, state, l);
+	}
+	for (;;) {
+		active = 0U;
+		for (unsigned int l = 0U; l < KT_MD5_LANES; l++) {
+			if (lanes[l].job != NULL) {
+				block[l] = kt_md5_lane_block(&lanes[l], lanes[l].block);
+				active++;
+			} else {
+				// Idle lanes just churn through zeroes, nobody's looking at their state
+				block[l] = zero_block;
+			}
+		}
+		// Once we're down to the last straggler, it's cheaper to finish it on its own
+		if (active <= 1U) {
+			break;
+		}
+
+		kt_md5_compress_avx2(state, block);
+		for (unsigned int l = 0U; l < KT_MD5_LANES; l++) {
+			if (lanes[l].job != NULL && ++lanes[l].block == lanes[l].blocks) {
+				kt_md5_lane_finish(&lanes[l], state, l);
+				kt_md5_lane_start(&lanes[l], next < num_jobs ? &jobs[next++] : NULL, state, l);
+			}
+		}
+	}
+	for (unsigned int l = 0U; l < KT_MD5_LANES; l++) {
+		uint32_t lane_state[4];
+
+		if (lanes[l].job == NULL) {
+			continue;
+		}
+		for (unsigned int i = 0U; i < 4U; i++) {
+			lane_state[i] = state[i][l];
+		}
+		// NOTE: The compression function is in nettle's public md5.h (renamed in 3.x, with a compat define)
+		for (; lanes[l].block < lanes[l].blocks; lanes[l].block++) {
+			_nettle_md5_compress(lane_state, kt_md5_lane_block(&lanes[l], lanes[l].block));
+		}
+		for (unsigned int i = 0U; i < 4U; i++) {
+			state[i][l] = lane_state[i];
+		}
+		kt_md5_lane_finish(&lanes[l], state, l);
+	}
+}
+#endif
+
+static void
+    kt_hash_detect(void)
+{
+	// Let the user stick to nettle, no matter what (i.e., to rule us out when something looks fishy).
+	if (getenv("KT_NO_HASH_ACCEL") != NULL) {
+		return;
+	}
+#if defined(KT_HASH_X86)
+	unsigned int eax, ebx, ecx, edx;
+	bool         has_ssse3_sse41 = false;
+	bool         has_avx_os      = false;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		has_ssse3_sse41 = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+		// AVX2 is only usable if the OS saves the YMM registers for us (OSXSAVE, and SSE & AVX state in XCR0)
+		if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+			unsigned int xcr0_lo, xcr0_hi;
+			__asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+			(void) xcr0_hi;
+			has_avx_os = (xcr0_lo & 0x6U) == 0x6U;
+		}
+	}
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if ((ebx & bit_SHA) && has_ssse3_sse41) {
+			kt_sha256_compress = kt_sha256_compress_shani;
+			kt_sha256_backend  = "SHA-NI";
+		}
+		if ((ebx & bit_AVX2) && has_avx_os) {
+			kt_md5_batch   = kt_md5_batch_avx2;
+			kt_md5_backend = "AVX2 (8 lanes)";
+		}
+	}
+#elif defined(KT_HASH_ARMV8)
+	kt_sha256_compress = kt_sha256_compress_armv8;
+	kt_sha256_backend  = "ARMv8 crypto extensions";
+#endif
+}
+
+void
+    kt_sha256_init(struct kt_sha256_ctx* ctx)
+{
+	pthread_once(&kt_hash_once, kt_hash_detect);
+	if (kt_sha256_compress == NULL) {
+		sha256_init(&ctx->nettle);
+		return;
+	}
+	memcpy(ctx->state, kt_sha256_iv, sizeof(ctx->state));
+	ctx->count = 0U;
+	ctx->index = 0U;
+}
+
+void
+    kt_sha256_update(struct kt_sha256_ctx* ctx, size_t length, const uint8_t* data)
+{
+	size_t blocks;
+
+	if (kt_sha256_compress == NULL) {
+		sha256_update(&ctx->nettle, length, data);
+		return;
+	}
+	if (length == 0U) {
+		return;
+	}
+	// Top off what's left of the previous update first
+	if (ctx->index > 0U) {
+		size_t left = SHA256_BLOCK_SIZE - ctx->index;
+		if (length < left) {
+			memcpy(ctx->block + ctx->index, data, length);
+			ctx->index += (unsigned int) length;
+			return;
+		}
+		memcpy(ctx->block + ctx->index, data, left);
+		kt_sha256_compress(ctx->state, ctx->block, 1U);
+		ctx->count++;
+		ctx->index = 0U;
+		data += left;
+		length -= left;
+	}
+	// Then as many full blocks as possible, straight from the input
+	blocks = length / SHA256_BLOCK_SIZE;
+	if (blocks > 0U) {
+		kt_sha256_compress(ctx->state, data, blocks);
+		ctx->count += blocks;
+		data += blocks * SHA256_BLOCK_SIZE;
+		length -= blocks * SHA256_BLOCK_SIZE;
+	}
+	memcpy(ctx->block, data, length);
+	ctx->index = (unsigned int) length;
+}
+
+// Always outputs a full SHA256_DIGEST_SIZE digest
+void
+    kt_sha256_digest(struct kt_sha256_ctx* ctx, uint8_t* digest)
+{
+	uint64_t bits;
+
+	if (kt_sha256_compress == NULL) {
+		sha256_digest(&ctx->nettle, SHA256_DIGEST_SIZE, digest);
+		return;
+	}
+	bits = (ctx->count * SHA256_BLOCK_SIZE + ctx->index) * 8U;
+	// The usual padding: a single set bit, zeroes, and the message length in bits (big-endian)
+	ctx->block[ctx->index++] = 0x80;
+	if (ctx->index > SHA256_BLOCK_SIZE - 8U) {
+		memset(ctx->block + ctx->index, 0, SHA256_BLOCK_SIZE - ctx->index);
+		kt_sha256_compress(ctx->state, ctx->block, 1U);
+		ctx->index = 0U;
+	}
+	memset(ctx->block + ctx->index, 0, SHA256_BLOCK_SIZE - 8U - ctx->index);
+	for (unsigned int i = 0U; i < 8U; i++) {
+		ctx->block[SHA256_BLOCK_SIZE - 1U - i] = (uint8_t) (bits >> (8U * i));
+	}
+	kt_sha256_compress(ctx->state, ctx->block, 1U);
+	for (unsigned int i = 0U; i < KT_SHA256_STATE_WORDS; i++) {
+		digest[4U * i]      = (uint8_t) (ctx->state[i] >> 24U);
+		digest[4U * i + 1U] = (uint8_t) (ctx->state[i] >> 16U);
+		digest[4U * i + 2U] = (uint8_t) (ctx->state[i] >> 8U);
+		digest[4U * i + 3U] = (uint8_t) ctx->state[i];
+	}
+	// Leave it ready for another round, like nettle does
+	kt_sha256_init(ctx);
+}
+
+// Compute both the MD5 & the SHA-256 of a batch of in-memory buffers (typically, a bunch of small payload files).
+void
+    kt_hash_batch(struct kt_hash_job* jobs, size_t num_jobs)
+{
+	struct kt_sha256_ctx sha256;
+	uint64_t             stats_start = kt_stats_start();
+
+	pthread_once(&kt_hash_once, kt_hash_detect);
+	if (kt_md5_batch != NULL && num_jobs > 1U) {
+		kt_md5_batch(jobs, num_jobs);
+	} else {
+		struct md5_ctx md5;
+
+		for (size_t i = 0U; i < num_jobs; i++) {
+			md5_init(&md5);
+			md5_update(&md5, jobs[i].size, jobs[i].data);
+			md5_digest(&md5, MD5_DIGEST_SIZE, jobs[i].md5);
+		}
+	}
+	// NOTE: With the SHA extensions, one message at a time is already faster than what we could do in the AVX2 lanes
+	for (size_t i = 0U; i < num_jobs; i++) {
+		kt_sha256_init(&sha256);
+		kt_sha256_update(&sha256, jobs[i].size, jobs[i].data);
+		kt_sha256_digest(&sha256, jobs[i].sha256);
+	}
+	kt_stats_stop(KT_STATS_HASH, stats_start);
+}
+
+// What we're actually using, for the version command
+void
+    kt_hash_describe(char* buf, size_t size)
+{
+	pthread_once(&kt_hash_once, kt_hash_detect);
+	snprintf(buf, size, "SHA-256 via %s, batched MD5 via %s", kt_sha256_backend, kt_md5_backend);
+}
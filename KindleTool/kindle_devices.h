@@ -0,0 +1,756 @@
+/*
+**  KindleTool, kindle_devices.h
+**
+**  Copyright (C) 2011-2012  Yifan Lu
+**  Copyright (C) 2012-2020  NiLuJe
+**  Concept based on an original Python implementation by Igor Skochinsky & Jean-Yves Avenard,
+**    cf., http://www.mobileread.com/forums/showthread.php?t=63225
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Device look-up tables, generated by tools/kindle_device_table.py (don't edit by hand!).
+   To add a device, add it to kindle_model_sort.py & kindle_device_table.py, and regenerate this.
+*/
+
+#ifndef __KINDLETOOL_DEVICES_H
+#define __KINDLETOOL_DEVICES_H
+
+#include "kindle_tool.h"
+
+// Every known device, sorted by device code
+static const struct kt_device kt_devices[] = {
+	{ 0x001, Plat_Unspecified, "Kindle 1" },    // Kindle1
+	{ 0x002, MarioDeprecated, "Kindle 2 US" },    // Kindle2US
+	{ 0x003, MarioDeprecated, "Kindle 2 International" },    // Kindle2International
+	{ 0x004, MarioDeprecated, "Kindle DX US" },    // KindleDXUS
+	{ 0x005, MarioDeprecated, "Kindle DX International" },    // KindleDXInternational
+	{ 0x006, Luigi, "Kindle 3 WiFi+3G" },    // Kindle3WiFi3G
+	{ 0x007, Plat_Unspecified, "Unknown Kindle (0x07)" },    // ValidKindleUnknown_0x07
+	{ 0x008, Luigi, "Kindle 3 WiFi" },    // Kindle3WiFi
+	{ 0x009, MarioDeprecated, "Kindle DX Graphite" },    // KindleDXGraphite
+	{ 0x00A, Luigi, "Kindle 3 WiFi+3G Europe" },    // Kindle3WiFi3GEurope
+	{ 0x00B, Plat_Unspecified, "Unknown Kindle (0x0B)" },    // ValidKindleUnknown_0x0B
+	{ 0x00C, Plat_Unspecified, "Unknown Kindle (0x0C)" },    // ValidKindleUnknown_0x0C
+	{ 0x00D, Plat_Unspecified, "Unknown Kindle (0x0D)" },    // ValidKindleUnknown_0x0D
+	{ 0x00E, Yoshi, "Silver Kindle 4 Non-Touch (2011)" },    // Kindle4NonTouch
+	{ 0x00F, Yoshi, "Kindle 5 Touch WiFi+3G" },    // Kindle5TouchWiFi3G
+	{ 0x010, Yoshi, "Kindle 5 Touch WiFi+3G Europe" },    // Kindle5TouchWiFi3GEurope
+	{ 0x011, Yoshi, "Kindle 5 Touch WiFi" },    // Kindle5TouchWiFi
+	{ 0x012, Yoshi, "Kindle 5 Touch (Unknown Variant)" },    // Kindle5TouchUnknown
+	{ 0x013, Wario, "Kindle Voyage WiFi" },    // KindleVoyageWiFi
+	{ 0x016, Plat_Unspecified, "Unknown Kindle (0x16)" },    // ValidKindleUnknown_0x16
+	{ 0x017, Wario, "Kindle PaperWhite 2 (2013) WiFi (4GB) International" },    // KindlePaperWhite2WiFi4GBInternational
+	{ 0x01B, Yoshime, "Kindle PaperWhite WiFi+3G" },    // KindlePaperWhiteWiFi3G
+	{ 0x01C, Yoshime, "Kindle PaperWhite WiFi+3G Canada" },    // KindlePaperWhiteWiFi3GCanada
+	{ 0x01D, Yoshime, "Kindle PaperWhite WiFi+3G Europe" },    // KindlePaperWhiteWiFi3GEurope
+	{ 0x01F, Yoshime, "Kindle PaperWhite WiFi+3G Japan" },    // KindlePaperWhiteWiFi3GJapan
+	{ 0x020, Yoshime, "Kindle PaperWhite WiFi+3G Brazil" },    // KindlePaperWhiteWiFi3GBrazil
+	{ 0x021, Plat_Unspecified, "Unknown Kindle (0x21)" },    // ValidKindleUnknown_0x21
+	{ 0x023, Yoshi, "Black Kindle 4 Non-Touch (2012)" },    // Kindle4NonTouchBlack
+	{ 0x024, Yoshime, "Kindle PaperWhite WiFi" },    // KindlePaperWhiteWiFi
+	{ 0x02A, Wario, "Kindle Voyage WiFi+3G Japan" },    // KindleVoyageWiFi3GJapan
+	{ 0x04F, Wario, "Kindle Voyage (Unknown Variant 0x4F)" },    // KindleVoyageUnknown_0x4F
+	{ 0x052, Wario, "Kindle Voyage WiFi+3G Mexico" },    // KindleVoyageWiFi3GMexico
+	{ 0x053, Wario, "Kindle Voyage WiFi+3G Europe" },    // KindleVoyageWiFi3GEurope
+	{ 0x054, Wario, "Kindle Voyage WiFi+3G" },    // KindleVoyageWiFi3G
+	{ 0x05A, Wario, "Kindle PaperWhite 2 (2013) WiFi Japan" },    // KindlePaperWhite2WiFiJapan
+	{ 0x05F, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Canada" },    // KindlePaperWhite2WiFi3G4GBCanada
+	{ 0x060, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Europe" },    // KindlePaperWhite2WiFi3G4GBEurope
+	{ 0x061, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Brazil" },    // KindlePaperWhite2WiFi3G4GBBrazil
+	{ 0x062, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G (4GB)" },    // KindlePaperWhite2WiFi3G4GB
+	{ 0x099, Wario, "Unknown Kindle (0x99)" },    // ValidKindleUnknown_0x99
+	{ 0x0C6, Wario, "Kindle Basic (2014)" },    // KindleBasic
+	{ 0x0D4, Wario, "Kindle PaperWhite 2 (2013) WiFi" },    // KindlePaperWhite2WiFi
+	{ 0x0D5, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G" },    // KindlePaperWhite2WiFi3G
+	{ 0x0D6, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G Canada" },    // KindlePaperWhite2WiFi3GCanada
+	{ 0x0D7, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G Europe" },    // KindlePaperWhite2WiFi3GEurope
+	{ 0x0D8, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G Russia" },    // KindlePaperWhite2WiFi3GRussia
+	{ 0x0DD, Wario, "Kindle Basic (2014) Australia" },    // KindleBasicKiwi
+	{ 0x0F2, Wario, "Kindle PaperWhite 2 (2013) WiFi+3G Japan" },    // KindlePaperWhite2WiFi3GJapan
+	{ 0x0F4, Wario, "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF4)" },    // KindlePaperWhite2Unknown_0xF4
+	{ 0x0F9, Wario, "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF9)" },    // KindlePaperWhite2Unknown_0xF9
+	{ 0x1BC, Heisenberg, "Kindle Basic 2 (2016) (Unknown Variant 0DU)" },    // KindleBasic2Unknown_0DU
+	{ 0x201, Wario, "Kindle PaperWhite 3 (2015) WiFi" },    // KindlePaperWhite3WiFi
+	{ 0x202, Wario, "Kindle PaperWhite 3 (2015) WiFi+3G" },    // KindlePaperWhite3WiFi3G
+	{ 0x204, Wario, "Kindle PaperWhite 3 (2015) WiFi+3G Mexico" },    // KindlePaperWhite3WiFi3GMexico
+	{ 0x205, Wario, "Kindle PaperWhite 3 (2015) WiFi+3G Europe" },    // KindlePaperWhite3WiFi3GEurope
+	{ 0x206, Wario, "Kindle PaperWhite 3 (2015) WiFi+3G Canada" },    // KindlePaperWhite3WiFi3GCanada
+	{ 0x207, Wario, "Kindle PaperWhite 3 (2015) WiFi+3G Japan" },    // KindlePaperWhite3WiFi3GJapan
+	{ 0x20C, Duet, "Kindle Oasis WiFi" },    // KindleOasisWiFi
+	{ 0x20D, Duet, "Kindle Oasis WiFi+3G" },    // KindleOasisWiFi3G
+	{ 0x219, Duet, "Kindle Oasis WiFi+3G International" },    // KindleOasisWiFi3GInternational
+	{ 0x21A, Duet, "Kindle Oasis (Unknown Variant 0GS)" },    // KindleOasisUnknown_0GS
+	{ 0x21B, Duet, "Kindle Oasis WiFi+3G China" },    // KindleOasisWiFi3GChina
+	{ 0x21C, Duet, "Kindle Oasis WiFi+3G Europe" },    // KindleOasisWiFi3GEurope
+	{ 0x269, Heisenberg, "Kindle Basic 2 (2016)" },    // KindleBasic2
+	{ 0x26A, Heisenberg, "White Kindle Basic 2 (2016)" },    // KindleBasic2White
+	{ 0x26B, Wario, "White Kindle PaperWhite 3 (2016) WiFi" },    // KindlePaperWhite3WhiteWiFi
+	{ 0x26C, Wario, "White Kindle PaperWhite 3 (2016) WiFi+3G Japan" },    // KindlePaperWhite3WhiteWiFi3GJapan
+	{ 0x26D, Wario, "White Kindle PaperWhite 3 (Unknown Variant 0KD)" },    // KindlePW3WhiteUnknown_0KD
+	{ 0x26E, Wario, "White Kindle PaperWhite 3 (2016) WiFi+3G International" },    // KindlePaperWhite3WhiteWiFi3GInternational
+	{ 0x26F, Wario, "White Kindle PaperWhite 3 (2016) WiFi+3G International (Bis)" },    // KindlePaperWhite3WhiteWiFi3GInternationalBis
+	{ 0x270, Wario, "White Kindle PaperWhite 3 (Unknown Variant 0KG)" },    // KindlePW3WhiteUnknown_0KG
+	{ 0x293, Wario, "Kindle PaperWhite 3 (2016) WiFi (32GB) Japan" },    // KindlePaperWhite3WiFi32GBJapanBlack
+	{ 0x294, Wario, "White Kindle PaperWhite 3 (2016) WiFi (32GB) Japan" },    // KindlePaperWhite3WiFi32GBJapanWhite
+	{ 0x295, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0LM)" },    // KindleOasis2Unknown_0LM
+	{ 0x296, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0LN)" },    // KindleOasis2Unknown_0LN
+	{ 0x297, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0LP)" },    // KindleOasis2Unknown_0LP
+	{ 0x298, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0LQ)" },    // KindleOasis2Unknown_0LQ
+	{ 0x2E1, Zelda, "Champagne Kindle Oasis 2 (2017) WiFi (32GB)" },    // KindleOasis2WiFi32GBChampagne
+	{ 0x2E2, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0P2)" },    // KindleOasis2Unknown_0P2
+	{ 0x2E6, Zelda, "Kindle Oasis 2 (2017) WiFi+3G (32GB) (Variant 0P6)" },    // KindleOasis2Unknown_0P6
+	{ 0x2E7, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0P7)" },    // KindleOasis2Unknown_0P7
+	{ 0x2E8, Zelda, "Kindle Oasis 2 (2017) WiFi (8GB)" },    // KindleOasis2WiFi8GB
+	{ 0x2F7, Rex, "Kindle PaperWhite 4 (2018) WiFi (8GB)" },    // KindlePaperWhite4WiFi8GB
+	{ 0x341, Zelda, "Kindle Oasis 2 (2017) WiFi+3G (32GB)" },    // KindleOasis2WiFi3G32GB
+	{ 0x342, Zelda, "Kindle Oasis 2 (2017) WiFi+3G (32GB) Europe" },    // KindleOasis2WiFi3G32GBEurope
+	{ 0x343, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0S3)" },    // KindleOasis2Unknown_0S3
+	{ 0x344, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0S4)" },    // KindleOasis2Unknown_0S4
+	{ 0x347, Zelda, "Kindle Oasis 2 (2017) (Unknown Variant 0S7)" },    // KindleOasis2Unknown_0S7
+	{ 0x34A, Zelda, "Kindle Oasis 2 (2017) WiFi (32GB)" },    // KindleOasis2WiFi32GB
+	{ 0x361, Rex, "Kindle PaperWhite 4 (2018) WiFi+4G (32GB)" },    // KindlePaperWhite4WiFi4G32GB
+	{ 0x362, Rex, "Kindle PaperWhite 4 (2018) WiFi+4G (32GB) Europe" },    // KindlePaperWhite4WiFi4G32GBEurope
+	{ 0x363, Rex, "Kindle PaperWhite 4 (2018) WiFi+4G (32GB) Japan" },    // KindlePaperWhite4WiFi4G32GBJapan
+	{ 0x364, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0T4)" },    // KindlePaperWhite4Unknown_0T4
+	{ 0x365, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0T5)" },    // KindlePaperWhite4Unknown_0T5
+	{ 0x366, Rex, "Kindle PaperWhite 4 (2018) WiFi (32GB)" },    // KindlePaperWhite4WiFi32GB
+	{ 0x367, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0T7)" },    // KindlePaperWhite4Unknown_0T7
+	{ 0x372, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0TJ)" },    // KindlePaperWhite4Unknown_0TJ
+	{ 0x373, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0TK)" },    // KindlePaperWhite4Unknown_0TK
+	{ 0x374, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0TL)" },    // KindlePaperWhite4Unknown_0TL
+	{ 0x375, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0TM)" },    // KindlePaperWhite4Unknown_0TM
+	{ 0x376, Rex, "Kindle PaperWhite 4 (2018) (Unknown Variant 0TN)" },    // KindlePaperWhite4Unknown_0TN
+	{ 0x3AB, Rex, "Kindle Basic 3 (2019) Kids Edition" },    // KindleBasic3KidsEdition
+	{ 0x3CF, Rex, "White Kindle Basic 3 (2019) (8GB)" },    // KindleBasic3White8GB
+	{ 0x3D0, Rex, "Kindle Basic 3 (2019) (Unknown Variant 0WG)" },    // KindleBasic3Unknown_0WG
+	{ 0x3D1, Rex, "White Kindle Basic 3 (2019)" },    // KindleBasic3White
+	{ 0x3D2, Rex, "Kindle Basic 3 (2019) (Unknown Variant 0WJ)" },    // KindleBasic3Unknown_0WJ
+	{ 0x3D4, Zelda, "Kindle Oasis 3 (2019) WiFi (8GB)" },    // KindleOasis3WiFi8GB
+	{ 0x3D5, Zelda, "Kindle Oasis 3 (2019) WiFi (32GB)" },    // KindleOasis3WiFi32GB
+	{ 0x3D6, Zelda, "Kindle Oasis 3 (2019) WiFi+4G (32GB)" },    // KindleOasis3WiFi4G32GB
+	{ 0x3D7, Zelda, "Kindle Oasis 3 (2019) WiFi+4G (32GB) India" },    // KindleOasis3WiFi4G32GBIndia
+	{ 0x3D8, Zelda, "Kindle Oasis 3 (2019) WiFi+4G (32GB) Japan" },    // KindleOasis3WiFi4G32GBJapan
+	{ 0x402, Rex, "Kindle PaperWhite 4 (2018) WiFi (8GB) India" },    // KindlePaperWhite4WiFi8GBIndia
+	{ 0x403, Rex, "Kindle PaperWhite 4 (2018) WiFi (32GB) India" },    // KindlePaperWhite4WiFi32GBIndia
+	{ 0x414, Rex, "Kindle Basic 3 (2019)" },    // KindleBasic3
+	{ 0x434, Zelda, "Champagne Kindle Oasis 3 (2019) WiFi (32GB)" },    // KindleOasis3WiFi32GBChampagne
+	{ 0x4D8, Rex, "Twilight Blue Kindle PaperWhite 4 (2018) WiFi (32GB)" },    // KindlePaperWhite4WiFi32GBBlue
+	{ 0x4D9, Rex, "Plum Kindle PaperWhite 4 (2018) WiFi (32GB)" },    // KindlePaperWhite4WiFi32GBPlum
+	{ 0x4DA, Rex, "Sage Kindle PaperWhite 4 (2018) WiFi (32GB)" },    // KindlePaperWhite4WiFi32GBSage
+	{ 0x4DB, Rex, "Twilight Blue Kindle PaperWhite 4 (2018) WiFi (8GB)" },    // KindlePaperWhite4WiFi8GBBlue
+	{ 0x4DC, Rex, "Plum Kindle PaperWhite 4 (2018) WiFi (8GB)" },    // KindlePaperWhite4WiFi8GBPlum
+	{ 0x4DD, Rex, "Sage Kindle PaperWhite 4 (2018) WiFi (8GB)" },    // KindlePaperWhite4WiFi8GBSage
+};
+
+// Device code -> index in kt_devices + 1 (0 means unknown)
+#define KT_DEVICE_MAX_CODE 0x4DDU
+static const uint8_t kt_device_index[KT_DEVICE_MAX_CODE + 1U] = {
+	  0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,
+	 16,  17,  18,  19,   0,   0,  20,  21,   0,   0,   0,  22,  23,  24,   0,  25,
+	 26,  27,   0,  28,  29,   0,   0,   0,   0,   0,  30,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  31,
+	  0,   0,  32,  33,  34,   0,   0,   0,   0,   0,  35,   0,   0,   0,   0,  36,
+	 37,  38,  39,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,  40,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,  41,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,  42,  43,  44,  45,  46,   0,   0,   0,   0,  47,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,  48,   0,  49,   0,   0,   0,   0,  50,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  51,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,  52,  53,   0,  54,  55,  56,  57,   0,   0,   0,   0,  58,  59,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,  60,  61,  62,  63,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,  64,  65,  66,  67,  68,  69,  70,
+	 71,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,  72,  73,  74,  75,  76,  77,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,  78,  79,   0,   0,   0,  80,  81,  82,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,  83,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,  84,  85,  86,  87,   0,   0,  88,   0,   0,  89,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,  90,  91,  92,  93,  94,  95,  96,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,  97,  98,  99, 100, 101,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 102,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 103,
+	104, 105, 106,   0, 107, 108, 109, 110, 111,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0, 112, 113,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0, 114,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0, 115,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0, 116, 117, 118, 119, 120, 121,
+};
+
+// The devices behind each -d value, in header order
+static const struct kt_device_set kt_device_sets[] = {
+	{ 0x001, false },    // Kindle1
+	{ 0x002, false },    // Kindle2US
+	{ 0x003, false },    // Kindle2International
+	{ 0x004, false },    // KindleDXUS
+	{ 0x005, false },    // KindleDXInternational
+	{ 0x006, false },    // Kindle3WiFi3G
+	{ 0x008, false },    // Kindle3WiFi
+	{ 0x009, false },    // KindleDXGraphite
+	{ 0x00A, false },    // Kindle3WiFi3GEurope
+	{ 0x00E, false },    // Kindle4NonTouch
+	{ 0x00F, false },    // Kindle5TouchWiFi3G
+	{ 0x010, false },    // Kindle5TouchWiFi3GEurope
+	{ 0x011, false },    // Kindle5TouchWiFi
+	{ 0x012, false },    // Kindle5TouchUnknown
+	{ 0x013, false },    // KindleVoyageWiFi
+	{ 0x017, false },    // KindlePaperWhite2WiFi4GBInternational
+	{ 0x01B, false },    // KindlePaperWhiteWiFi3G
+	{ 0x01C, false },    // KindlePaperWhiteWiFi3GCanada
+	{ 0x01D, false },    // KindlePaperWhiteWiFi3GEurope
+	{ 0x01F, false },    // KindlePaperWhiteWiFi3GJapan
+	{ 0x020, false },    // KindlePaperWhiteWiFi3GBrazil
+	{ 0x023, false },    // Kindle4NonTouchBlack
+	{ 0x024, false },    // KindlePaperWhiteWiFi
+	{ 0x02A, false },    // KindleVoyageWiFi3GJapan
+	{ 0x052, false },    // KindleVoyageWiFi3GMexico
+	{ 0x053, false },    // KindleVoyageWiFi3GEurope
+	{ 0x054, false },    // KindleVoyageWiFi3G
+	{ 0x05A, false },    // KindlePaperWhite2WiFiJapan
+	{ 0x05F, false },    // KindlePaperWhite2WiFi3G4GBCanada
+	{ 0x060, false },    // KindlePaperWhite2WiFi3G4GBEurope
+	{ 0x061, false },    // KindlePaperWhite2WiFi3G4GBBrazil
+	{ 0x062, false },    // KindlePaperWhite2WiFi3G4GB
+	{ 0x0C6, false },    // KindleBasic
+	{ 0x0D4, false },    // KindlePaperWhite2WiFi
+	{ 0x0D5, false },    // KindlePaperWhite2WiFi3G
+	{ 0x0D6, false },    // KindlePaperWhite2WiFi3GCanada
+	{ 0x0D7, false },    // KindlePaperWhite2WiFi3GEurope
+	{ 0x0D8, false },    // KindlePaperWhite2WiFi3GRussia
+	{ 0x0DD, false },    // KindleBasicKiwi
+	{ 0x0F2, false },    // KindlePaperWhite2WiFi3GJapan
+	{ 0x201, false },    // KindlePaperWhite3WiFi
+	{ 0x202, false },    // KindlePaperWhite3WiFi3G
+	{ 0x204, false },    // KindlePaperWhite3WiFi3GMexico
+	{ 0x205, false },    // KindlePaperWhite3WiFi3GEurope
+	{ 0x206, false },    // KindlePaperWhite3WiFi3GCanada
+	{ 0x207, false },    // KindlePaperWhite3WiFi3GJapan
+	{ 0x20C, false },    // KindleOasisWiFi
+	{ 0x20D, false },    // KindleOasisWiFi3G
+	{ 0x219, false },    // KindleOasisWiFi3GInternational
+	{ 0x21B, false },    // KindleOasisWiFi3GChina
+	{ 0x21C, false },    // KindleOasisWiFi3GEurope
+	{ 0x269, false },    // KindleBasic2
+	{ 0x26A, false },    // KindleBasic2White
+	{ 0x26B, false },    // KindlePaperWhite3WhiteWiFi
+	{ 0x26C, false },    // KindlePaperWhite3WhiteWiFi3GJapan
+	{ 0x26E, false },    // KindlePaperWhite3WhiteWiFi3GInternational
+	{ 0x26F, false },    // KindlePaperWhite3WhiteWiFi3GInternationalBis
+	{ 0x293, false },    // KindlePaperWhite3WiFi32GBJapanBlack
+	{ 0x294, false },    // KindlePaperWhite3WiFi32GBJapanWhite
+	{ 0x2E1, false },    // KindleOasis2WiFi32GBChampagne
+	{ 0x2E8, false },    // KindleOasis2WiFi8GB
+	{ 0x2F7, false },    // KindlePaperWhite4WiFi8GB
+	{ 0x341, false },    // KindleOasis2WiFi3G32GB
+	{ 0x342, false },    // KindleOasis2WiFi3G32GBEurope
+	{ 0x34A, false },    // KindleOasis2WiFi32GB
+	{ 0x361, false },    // KindlePaperWhite4WiFi4G32GB
+	{ 0x362, false },    // KindlePaperWhite4WiFi4G32GBEurope
+	{ 0x363, false },    // KindlePaperWhite4WiFi4G32GBJapan
+	{ 0x366, false },    // KindlePaperWhite4WiFi32GB
+	{ 0x3AB, false },    // KindleBasic3KidsEdition
+	{ 0x3CF, false },    // KindleBasic3White8GB
+	{ 0x3D1, false },    // KindleBasic3White
+	{ 0x3D4, false },    // KindleOasis3WiFi8GB
+	{ 0x3D5, false },    // KindleOasis3WiFi32GB
+	{ 0x3D6, false },    // KindleOasis3WiFi4G32GB
+	{ 0x3D7, false },    // KindleOasis3WiFi4G32GBIndia
+	{ 0x3D8, false },    // KindleOasis3WiFi4G32GBJapan
+	{ 0x402, false },    // KindlePaperWhite4WiFi8GBIndia
+	{ 0x403, false },    // KindlePaperWhite4WiFi32GBIndia
+	{ 0x414, false },    // KindleBasic3
+	{ 0x434, false },    // KindleOasis3WiFi32GBChampagne
+	{ 0x4D8, false },    // KindlePaperWhite4WiFi32GBBlue
+	{ 0x4D9, false },    // KindlePaperWhite4WiFi32GBPlum
+	{ 0x4DA, false },    // KindlePaperWhite4WiFi32GBSage
+	{ 0x4DB, false },    // KindlePaperWhite4WiFi8GBBlue
+	{ 0x4DC, false },    // KindlePaperWhite4WiFi8GBPlum
+	{ 0x4DD, false },    // KindlePaperWhite4WiFi8GBSage
+	{ 0x00E, false },    // Kindle4NonTouch
+	{ 0x023, false },    // Kindle4NonTouchBlack
+	{ 0x011, false },    // Kindle5TouchWiFi
+	{ 0x00F, false },    // Kindle5TouchWiFi3G
+	{ 0x010, false },    // Kindle5TouchWiFi3GEurope
+	{ 0x012, true },    // Kindle5TouchUnknown
+	{ 0x024, false },    // KindlePaperWhiteWiFi
+	{ 0x01B, false },    // KindlePaperWhiteWiFi3G
+	{ 0x01C, false },    // KindlePaperWhiteWiFi3GCanada
+	{ 0x01D, false },    // KindlePaperWhiteWiFi3GEurope
+	{ 0x01F, false },    // KindlePaperWhiteWiFi3GJapan
+	{ 0x020, false },    // KindlePaperWhiteWiFi3GBrazil
+	{ 0x0D4, false },    // KindlePaperWhite2WiFi
+	{ 0x05A, false },    // KindlePaperWhite2WiFiJapan
+	{ 0x0D5, false },    // KindlePaperWhite2WiFi3G
+	{ 0x0D6, false },    // KindlePaperWhite2WiFi3GCanada
+	{ 0x0D7, false },    // KindlePaperWhite2WiFi3GEurope
+	{ 0x0D8, false },    // KindlePaperWhite2WiFi3GRussia
+	{ 0x0F2, false },    // KindlePaperWhite2WiFi3GJapan
+	{ 0x017, false },    // KindlePaperWhite2WiFi4GBInternational
+	{ 0x060, false },    // KindlePaperWhite2WiFi3G4GBEurope
+	{ 0x062, false },    // KindlePaperWhite2WiFi3G4GB
+	{ 0x05F, false },    // KindlePaperWhite2WiFi3G4GBCanada
+	{ 0x061, false },    // KindlePaperWhite2WiFi3G4GBBrazil
+	{ 0x0F4, true },    // KindlePaperWhite2Unknown_0xF4
+	{ 0x0F9, true },    // KindlePaperWhite2Unknown_0xF9
+	{ 0x0C6, false },    // KindleBasic
+	{ 0x0DD, false },    // KindleBasicKiwi
+	{ 0x013, false },    // KindleVoyageWiFi
+	{ 0x054, false },    // KindleVoyageWiFi3G
+	{ 0x053, false },    // KindleVoyageWiFi3GEurope
+	{ 0x02A, false },    // KindleVoyageWiFi3GJapan
+	{ 0x052, false },    // KindleVoyageWiFi3GMexico
+	{ 0x04F, true },    // KindleVoyageUnknown_0x4F
+	{ 0x201, false },    // KindlePaperWhite3WiFi
+	{ 0x207, false },    // KindlePaperWhite3WiFi3GJapan
+	{ 0x206, false },    // KindlePaperWhite3WiFi3GCanada
+	{ 0x202, false },    // KindlePaperWhite3WiFi3G
+	{ 0x205, false },    // KindlePaperWhite3WiFi3GEurope
+	{ 0x204, false },    // KindlePaperWhite3WiFi3GMexico
+	{ 0x26B, false },    // KindlePaperWhite3WhiteWiFi
+	{ 0x26C, false },    // KindlePaperWhite3WhiteWiFi3GJapan
+	{ 0x293, false },    // KindlePaperWhite3WiFi32GBJapanBlack
+	{ 0x294, false },    // KindlePaperWhite3WiFi32GBJapanWhite
+	{ 0x26E, false },    // KindlePaperWhite3WhiteWiFi3GInternational
+	{ 0x26F, false },    // KindlePaperWhite3WhiteWiFi3GInternationalBis
+	{ 0x26D, true },    // KindlePW3WhiteUnknown_0KD
+	{ 0x270, true },    // KindlePW3WhiteUnknown_0KG
+	{ 0x20C, false },    // KindleOasisWiFi
+	{ 0x20D, false },    // KindleOasisWiFi3G
+	{ 0x21C, false },    // KindleOasisWiFi3GEurope
+	{ 0x219, false },    // KindleOasisWiFi3GInternational
+	{ 0x21B, false },    // KindleOasisWiFi3GChina
+	{ 0x21A, true },    // KindleOasisUnknown_0GS
+	{ 0x269, false },    // KindleBasic2
+	{ 0x26A, false },    // KindleBasic2White
+	{ 0x1BC, true },    // KindleBasic2Unknown_0DU
+	{ 0x2E8, false },    // KindleOasis2WiFi8GB
+	{ 0x341, false },    // KindleOasis2WiFi3G32GB
+	{ 0x34A, false },    // KindleOasis2WiFi32GB
+	{ 0x342, false },    // KindleOasis2WiFi3G32GBEurope
+	{ 0x2E1, false },    // KindleOasis2WiFi32GBChampagne
+	{ 0x2E6, false },    // KindleOasis2Unknown_0P6
+	{ 0x295, true },    // KindleOasis2Unknown_0LM
+	{ 0x296, true },    // KindleOasis2Unknown_0LN
+	{ 0x297, true },    // KindleOasis2Unknown_0LP
+	{ 0x298, true },    // KindleOasis2Unknown_0LQ
+	{ 0x2E2, true },    // KindleOasis2Unknown_0P2
+	{ 0x2E7, true },    // KindleOasis2Unknown_0P7
+	{ 0x343, true },    // KindleOasis2Unknown_0S3
+	{ 0x344, true },    // KindleOasis2Unknown_0S4
+	{ 0x347, true },    // KindleOasis2Unknown_0S7
+	{ 0x2F7, false },    // KindlePaperWhite4WiFi8GB
+	{ 0x366, false },    // KindlePaperWhite4WiFi32GB
+	{ 0x361, false },    // KindlePaperWhite4WiFi4G32GB
+	{ 0x362, false },    // KindlePaperWhite4WiFi4G32GBEurope
+	{ 0x402, false },    // KindlePaperWhite4WiFi8GBIndia
+	{ 0x363, false },    // KindlePaperWhite4WiFi4G32GBJapan
+	{ 0x4DB, false },    // KindlePaperWhite4WiFi8GBBlue
+	{ 0x4D8, false },    // KindlePaperWhite4WiFi32GBBlue
+	{ 0x4DC, false },    // KindlePaperWhite4WiFi8GBPlum
+	{ 0x4DD, false },    // KindlePaperWhite4WiFi8GBSage
+	{ 0x403, false },    // KindlePaperWhite4WiFi32GBIndia
+	{ 0x4D9, false },    // KindlePaperWhite4WiFi32GBPlum
+	{ 0x4DA, false },    // KindlePaperWhite4WiFi32GBSage
+	{ 0x364, true },    // KindlePaperWhite4Unknown_0T4
+	{ 0x365, true },    // KindlePaperWhite4Unknown_0T5
+	{ 0x367, true },    // KindlePaperWhite4Unknown_0T7
+	{ 0x372, true },    // KindlePaperWhite4Unknown_0TJ
+	{ 0x373, true },    // KindlePaperWhite4Unknown_0TK
+	{ 0x374, true },    // KindlePaperWhite4Unknown_0TL
+	{ 0x375, true },    // KindlePaperWhite4Unknown_0TM
+	{ 0x376, true },    // KindlePaperWhite4Unknown_0TN
+	{ 0x414, false },    // KindleBasic3
+	{ 0x3D1, false },    // KindleBasic3White
+	{ 0x3AB, false },    // KindleBasic3KidsEdition
+	{ 0x3CF, false },    // KindleBasic3White8GB
+	{ 0x3D0, true },    // KindleBasic3Unknown_0WG
+	{ 0x3D2, true },    // KindleBasic3Unknown_0WJ
+	{ 0x434, false },    // KindleOasis3WiFi32GBChampagne
+	{ 0x3D8, false },    // KindleOasis3WiFi4G32GBJapan
+	{ 0x3D6, false },    // KindleOasis3WiFi4G32GB
+	{ 0x3D5, false },    // KindleOasis3WiFi32GB
+	{ 0x3D4, false },    // KindleOasis3WiFi8GB
+	{ 0x3D7, false },    // KindleOasis3WiFi4G32GBIndia
+	{ 0x011, false },    // Kindle5TouchWiFi
+	{ 0x00F, false },    // Kindle5TouchWiFi3G
+	{ 0x010, false },    // Kindle5TouchWiFi3GEurope
+	{ 0x012, true },    // Kindle5TouchUnknown
+	{ 0x024, false },    // KindlePaperWhiteWiFi
+	{ 0x01B, false },    // KindlePaperWhiteWiFi3G
+	{ 0x01C, false },    // KindlePaperWhiteWiFi3GCanada
+	{ 0x01D, false },    // KindlePaperWhiteWiFi3GEurope
+	{ 0x01F, false },    // KindlePaperWhiteWiFi3GJapan
+	{ 0x020, false },    // KindlePaperWhiteWiFi3GBrazil
+	{ 0x0D4, false },    // KindlePaperWhite2WiFi
+	{ 0x05A, false },    // KindlePaperWhite2WiFiJapan
+	{ 0x0D5, false },    // KindlePaperWhite2WiFi3G
+	{ 0x0D6, false },    // KindlePaperWhite2WiFi3GCanada
+	{ 0x0D7, false },    // KindlePaperWhite2WiFi3GEurope
+	{ 0x0D8, false },    // KindlePaperWhite2WiFi3GRussia
+	{ 0x0F2, false },    // KindlePaperWhite2WiFi3GJapan
+	{ 0x017, false },    // KindlePaperWhite2WiFi4GBInternational
+	{ 0x060, false },    // KindlePaperWhite2WiFi3G4GBEurope
+	{ 0x062, false },    // KindlePaperWhite2WiFi3G4GB
+	{ 0x05F, false },    // KindlePaperWhite2WiFi3G4GBCanada
+	{ 0x061, false },    // KindlePaperWhite2WiFi3G4GBBrazil
+	{ 0x0F4, true },    // KindlePaperWhite2Unknown_0xF4
+	{ 0x0F9, true },    // KindlePaperWhite2Unknown_0xF9
+	{ 0x0C6, false },    // KindleBasic
+	{ 0x0DD, false },    // KindleBasicKiwi
+	{ 0x013, false },    // KindleVoyageWiFi
+	{ 0x054, false },    // KindleVoyageWiFi3G
+	{ 0x053, false },    // KindleVoyageWiFi3GEurope
+	{ 0x02A, false },    // KindleVoyageWiFi3GJapan
+	{ 0x052, false },    // KindleVoyageWiFi3GMexico
+	{ 0x04F, true },    // KindleVoyageUnknown_0x4F
+	{ 0x201, false },    // KindlePaperWhite3WiFi
+	{ 0x207, false },    // KindlePaperWhite3WiFi3GJapan
+	{ 0x206, false },    // KindlePaperWhite3WiFi3GCanada
+	{ 0x202, false },    // KindlePaperWhite3WiFi3G
+	{ 0x205, false },    // KindlePaperWhite3WiFi3GEurope
+	{ 0x204, false },    // KindlePaperWhite3WiFi3GMexico
+	{ 0x293, false },    // KindlePaperWhite3WiFi32GBJapanBlack
+	{ 0x26B, false },    // KindlePaperWhite3WhiteWiFi
+	{ 0x26C, false },    // KindlePaperWhite3WhiteWiFi3GJapan
+	{ 0x294, false },    // KindlePaperWhite3WiFi32GBJapanWhite
+	{ 0x26E, false },    // KindlePaperWhite3WhiteWiFi3GInternational
+	{ 0x26F, false },    // KindlePaperWhite3WhiteWiFi3GInternationalBis
+	{ 0x26D, true },    // KindlePW3WhiteUnknown_0KD
+	{ 0x270, true },    // KindlePW3WhiteUnknown_0KG
+	{ 0x20C, false },    // KindleOasisWiFi
+	{ 0x20D, false },    // KindleOasisWiFi3G
+	{ 0x21C, false },    // KindleOasisWiFi3GEurope
+	{ 0x219, false },    // KindleOasisWiFi3GInternational
+	{ 0x21B, false },    // KindleOasisWiFi3GChina
+	{ 0x21A, true },    // KindleOasisUnknown_0GS
+	{ 0x269, false },    // KindleBasic2
+	{ 0x26A, false },    // KindleBasic2White
+	{ 0x1BC, true },    // KindleBasic2Unknown_0DU
+	{ 0x2E8, false },    // KindleOasis2WiFi8GB
+	{ 0x341, false },    // KindleOasis2WiFi3G32GB
+	{ 0x34A, false },    // KindleOasis2WiFi32GB
+	{ 0x342, false },    // KindleOasis2WiFi3G32GBEurope
+	{ 0x2E1, false },    // KindleOasis2WiFi32GBChampagne
+	{ 0x2E6, false },    // KindleOasis2Unknown_0P6
+	{ 0x295, true },    // KindleOasis2Unknown_0LM
+	{ 0x296, true },    // KindleOasis2Unknown_0LN
+	{ 0x297, true },    // KindleOasis2Unknown_0LP
+	{ 0x298, true },    // KindleOasis2Unknown_0LQ
+	{ 0x2E2, true },    // KindleOasis2Unknown_0P2
+	{ 0x2E7, true },    // KindleOasis2Unknown_0P7
+	{ 0x343, true },    // KindleOasis2Unknown_0S3
+	{ 0x344, true },    // KindleOasis2Unknown_0S4
+	{ 0x347, true },    // KindleOasis2Unknown_0S7
+	{ 0x2F7, false },    // KindlePaperWhite4WiFi8GB
+	{ 0x366, false },    // KindlePaperWhite4WiFi32GB
+	{ 0x361, false },    // KindlePaperWhite4WiFi4G32GB
+	{ 0x362, false },    // KindlePaperWhite4WiFi4G32GBEurope
+	{ 0x402, false },    // KindlePaperWhite4WiFi8GBIndia
+	{ 0x363, false },    // KindlePaperWhite4WiFi4G32GBJapan
+	{ 0x4DB, false },    // KindlePaperWhite4WiFi8GBBlue
+	{ 0x4D8, false },    // KindlePaperWhite4WiFi32GBBlue
+	{ 0x4DC, false },    // KindlePaperWhite4WiFi8GBPlum
+	{ 0x4DD, false },    // KindlePaperWhite4WiFi8GBSage
+	{ 0x403, false },    // KindlePaperWhite4WiFi32GBIndia
+	{ 0x4D9, false },    // KindlePaperWhite4WiFi32GBPlum
+	{ 0x4DA, false },    // KindlePaperWhite4WiFi32GBSage
+	{ 0x364, true },    // KindlePaperWhite4Unknown_0T4
+	{ 0x365, true },    // KindlePaperWhite4Unknown_0T5
+	{ 0x367, true },    // KindlePaperWhite4Unknown_0T7
+	{ 0x372, true },    // KindlePaperWhite4Unknown_0TJ
+	{ 0x373, true },    // KindlePaperWhite4Unknown_0TK
+	{ 0x374, true },    // KindlePaperWhite4Unknown_0TL
+	{ 0x375, true },    // KindlePaperWhite4Unknown_0TM
+	{ 0x376, true },    // KindlePaperWhite4Unknown_0TN
+	{ 0x414, false },    // KindleBasic3
+	{ 0x3D1, false },    // KindleBasic3White
+	{ 0x3AB, false },    // KindleBasic3KidsEdition
+	{ 0x3CF, false },    // KindleBasic3White8GB
+	{ 0x3D0, true },    // KindleBasic3Unknown_0WG
+	{ 0x3D2, true },    // KindleBasic3Unknown_0WJ
+	{ 0x434, false },    // KindleOasis3WiFi32GBChampagne
+	{ 0x3D8, false },    // KindleOasis3WiFi4G32GBJapan
+	{ 0x3D6, false },    // KindleOasis3WiFi4G32GB
+	{ 0x3D5, false },    // KindleOasis3WiFi32GB
+	{ 0x3D4, false },    // KindleOasis3WiFi8GB
+	{ 0x3D7, false },    // KindleOasis3WiFi4G32GBIndia
+	{ 0x016, false },    // ValidKindleUnknown_0x16
+	{ 0x021, false },    // ValidKindleUnknown_0x21
+	{ 0x007, false },    // ValidKindleUnknown_0x07
+	{ 0x00B, false },    // ValidKindleUnknown_0x0B
+	{ 0x00C, false },    // ValidKindleUnknown_0x0C
+	{ 0x00D, false },    // ValidKindleUnknown_0x0D
+	{ 0x099, false },    // ValidKindleUnknown_0x99
+	{ 0x002, false },    // Kindle2US
+	{ 0x003, false },    // Kindle2International
+	{ 0x004, false },    // KindleDXUS
+	{ 0x005, false },    // KindleDXInternational
+	{ 0x009, false },    // KindleDXGraphite
+	{ 0x008, false },    // Kindle3WiFi
+	{ 0x006, false },    // Kindle3WiFi3G
+	{ 0x00A, false },    // Kindle3WiFi3GEurope
+	{ 0x002, false },    // Kindle2US
+	{ 0x003, false },    // Kindle2International
+	{ 0x004, false },    // KindleDXUS
+	{ 0x005, false },    // KindleDXInternational
+	{ 0x009, false },    // KindleDXGraphite
+	{ 0x008, false },    // Kindle3WiFi
+	{ 0x006, false },    // Kindle3WiFi3G
+	{ 0x00A, false },    // Kindle3WiFi3GEurope
+};
+
+// Every -d value (devices & aliases), sorted by name
+static const struct kt_device_alias kt_device_aliases[] = {
+	{ "basic", "FD04", false, 113, 2 },
+	{ "basic2", "FD04", false, 141, 3 },
+	{ "basic3", "FD04", false, 180, 6 },
+	{ "bk", "FD04", false, 32, 1 },
+	{ "bka", "FD04", false, 38, 1 },
+	{ "datamined", "FD04", true, 295, 7 },
+	{ "dx", "", false, 3, 1 },
+	{ "dxg", "", false, 7, 1 },
+	{ "dxi", "", false, 4, 1 },
+	{ "k1", "", false, 0, 1 },
+	{ "k2", "", false, 1, 1 },
+	{ "k2i", "", false, 2, 1 },
+	{ "k3g", "", false, 5, 1 },
+	{ "k3gb", "", false, 8, 1 },
+	{ "k3w", "", false, 6, 1 },
+	{ "k4", "FC04", false, 9, 1 },
+	{ "k4b", "FC04", false, 21, 1 },
+	{ "k5g", "FD04", false, 10, 1 },
+	{ "k5gb", "FD04", false, 11, 1 },
+	{ "k5u", "FD04", false, 13, 1 },
+	{ "k5w", "FD04", false, 12, 1 },
+	{ "kindle2", "FD04", false, 302, 2 },
+	{ "kindle3", "FD04", false, 307, 3 },
+	{ "kindle4", "FC04", false, 87, 2 },
+	{ "kindle5", "FD04", false, 192, 103 },
+	{ "kindledx", "FD04", false, 304, 3 },
+	{ "koa", "FD04", false, 46, 1 },
+	{ "koa2g32", "FD04", false, 62, 1 },
+	{ "koa2g32b", "FD04", false, 63, 1 },
+	{ "koa2w32", "FD04", false, 64, 1 },
+	{ "koa2w32c", "FD04", false, 59, 1 },
+	{ "koa2w8", "FD04", false, 60, 1 },
+	{ "koa3g32", "FD04", false, 74, 1 },
+	{ "koa3g32in", "FD04", false, 75, 1 },
+	{ "koa3g32jp", "FD04", false, 76, 1 },
+	{ "koa3w32", "FD04", false, 73, 1 },
+	{ "koa3w32c", "FD04", false, 80, 1 },
+	{ "koa3w8", "FD04", false, 72, 1 },
+	{ "koag", "FD04", false, 47, 1 },
+	{ "koagb", "FD04", false, 50, 1 },
+	{ "koagbi", "FD04", false, 48, 1 },
+	{ "koagcn", "FD04", false, 49, 1 },
+	{ "kpw", "FD04", false, 22, 1 },
+	{ "kpw2", "FD04", false, 33, 1 },
+	{ "kpw2g", "FD04", false, 34, 1 },
+	{ "kpw2gb", "FD04", false, 36, 1 },
+	{ "kpw2gbl", "FD04", false, 29, 1 },
+	{ "kpw2gbrl", "FD04", false, 30, 1 },
+	{ "kpw2gc", "FD04", false, 35, 1 },
+	{ "kpw2gcl", "FD04", false, 28, 1 },
+	{ "kpw2gj", "FD04", false, 39, 1 },
+	{ "kpw2gl", "FD04", false, 31, 1 },
+	{ "kpw2gr", "FD04", false, 37, 1 },
+	{ "kpw2il", "FD04", false, 15, 1 },
+	{ "kpw2j", "FD04", false, 27, 1 },
+	{ "kpw3", "FD04", false, 40, 1 },
+	{ "kpw3g", "FD04", false, 41, 1 },
+	{ "kpw3gb", "FD04", false, 43, 1 },
+	{ "kpw3gc", "FD04", false, 44, 1 },
+	{ "kpw3gj", "FD04", false, 45, 1 },
+	{ "kpw3gm", "FD04", false, 42, 1 },
+	{ "kpw3jl", "FD04", false, 57, 1 },
+	{ "kpw3w", "FD04", false, 53, 1 },
+	{ "kpw3wgi", "FD04", false, 55, 1 },
+	{ "kpw3wgib", "FD04", false, 56, 1 },
+	{ "kpw3wgj", "FD04", false, 54, 1 },
+	{ "kpw3wjl", "FD04", false, 58, 1 },
+	{ "kpw4", "FD04", false, 61, 1 },
+	{ "kpw4l", "FD04", false, 68, 1 },
+	{ "kpw4lg", "FD04", false, 65, 1 },
+	{ "kpw4lgb", "FD04", false, 66, 1 },
+	{ "kpw4ljp", "FD04", false, 67, 1 },
+	{ "kpw4lp", "FD04", false, 82, 1 },
+	{ "kpw4ls", "FD04", false, 83, 1 },
+	{ "kpw4ltb", "FD04", false, 81, 1 },
+	{ "kpw4p", "FD04", false, 85, 1 },
+	{ "kpw4s", "FD04", false, 86, 1 },
+	{ "kpw4tb", "FD04", false, 84, 1 },
+	{ "kpwg", "FD04", false, 16, 1 },
+	{ "kpwgb", "FD04", false, 18, 1 },
+	{ "kpwgbr", "FD04", false, 20, 1 },
+	{ "kpwgc", "FD04", false, 17, 1 },
+	{ "kpwgj", "FD04", false, 19, 1 },
+	{ "kpwin", "FD04", false, 77, 1 },
+	{ "kpwlin", "FD04", false, 78, 1 },
+	{ "kt2", "FD04", false, 32, 1 },
+	{ "kt2a", "FD04", false, 38, 1 },
+	{ "kt3", "FD04", false, 51, 1 },
+	{ "kt3w", "FD04", false, 52, 1 },
+	{ "kt4", "FD04", false, 79, 1 },
+	{ "kt4ke", "FD04", false, 69, 1 },
+	{ "kt4w", "FD04", false, 71, 1 },
+	{ "kt4w8", "FD04", false, 70, 1 },
+	{ "kv", "FD04", false, 14, 1 },
+	{ "kvg", "FD04", false, 26, 1 },
+	{ "kvgb", "FD04", false, 25, 1 },
+	{ "kvgj", "FD04", false, 23, 1 },
+	{ "kvgm", "FD04", false, 24, 1 },
+	{ "legacy", "FD04", false, 310, 8 },
+	{ "oasis", "FD04", false, 135, 6 },
+	{ "oasis2", "FD04", false, 144, 15 },
+	{ "oasis3", "FD04", false, 186, 6 },
+	{ "paperwhite", "FD04", false, 93, 6 },
+	{ "paperwhite2", "FD04", false, 99, 14 },
+	{ "paperwhite3", "FD04", false, 121, 14 },
+	{ "paperwhite4", "FD04", false, 159, 21 },
+	{ "pw", "FD04", false, 22, 1 },
+	{ "pw2", "FD04", false, 33, 1 },
+	{ "pw2g", "FD04", false, 34, 1 },
+	{ "pw2gb", "FD04", false, 36, 1 },
+	{ "pw2gbl", "FD04", false, 29, 1 },
+	{ "pw2gbrl", "FD04", false, 30, 1 },
+	{ "pw2gc", "FD04", false, 35, 1 },
+	{ "pw2gcl", "FD04", false, 28, 1 },
+	{ "pw2gj", "FD04", false, 39, 1 },
+	{ "pw2gl", "FD04", false, 31, 1 },
+	{ "pw2gr", "FD04", false, 37, 1 },
+	{ "pw2il", "FD04", false, 15, 1 },
+	{ "pw2j", "FD04", false, 27, 1 },
+	{ "pw3", "FD04", false, 40, 1 },
+	{ "pw3g", "FD04", false, 41, 1 },
+	{ "pw3gb", "FD04", false, 43, 1 },
+	{ "pw3gc", "FD04", false, 44, 1 },
+	{ "pw3gj", "FD04", false, 45, 1 },
+	{ "pw3gm", "FD04", false, 42, 1 },
+	{ "pw3jl", "FD04", false, 57, 1 },
+	{ "pw3w", "FD04", false, 53, 1 },
+	{ "pw3wgi", "FD04", false, 55, 1 },
+	{ "pw3wgib", "FD04", false, 56, 1 },
+	{ "pw3wgj", "FD04", false, 54, 1 },
+	{ "pw3wjl", "FD04", false, 58, 1 },
+	{ "pw4", "FD04", false, 61, 1 },
+	{ "pw4in", "FD04", false, 77, 1 },
+	{ "pw4l", "FD04", false, 68, 1 },
+	{ "pw4lg", "FD04", false, 65, 1 },
+	{ "pw4lgb", "FD04", false, 66, 1 },
+	{ "pw4lgjp", "FD04", false, 67, 1 },
+	{ "pw4lin", "FD04", false, 78, 1 },
+	{ "pw4lp", "FD04", false, 82, 1 },
+	{ "pw4ls", "FD04", false, 83, 1 },
+	{ "pw4ltb", "FD04", false, 81, 1 },
+	{ "pw4p", "FD04", false, 85, 1 },
+	{ "pw4s", "FD04", false, 86, 1 },
+	{ "pw4tb", "FD04", false, 84, 1 },
+	{ "pwg", "FD04", false, 16, 1 },
+	{ "pwgb", "FD04", false, 18, 1 },
+	{ "pwgbr", "FD04", false, 20, 1 },
+	{ "pwgc", "FD04", false, 17, 1 },
+	{ "pwgj", "FD04", false, 19, 1 },
+	{ "touch", "FD04", false, 89, 4 },
+	{ "unknown", "FD04", true, 295, 7 },
+	{ "voyage", "FD04", false, 115, 6 },
+};
+
+// Open addressing (linear probing) hash table of the -d values, as indices in kt_device_aliases + 1
+#define KT_DEVICE_HASH_SIZE 512U
+static const uint16_t kt_device_hash[KT_DEVICE_HASH_SIZE] = {
+	  0,   0,   8,  53,  69,   0, 144,   0,  11,  30,   3, 124, 142,   0,  22, 108,
+	  0,   0,   0,   0,   0,   0,   0,   0,  86,   0,   0,   0,   0,   0,   0,   0,
+	 61, 129, 140,   0,   0,   0,   0,   0,   0,   0,  59,  50,   0, 147,  85,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0,  28,   0,  83,   0,   0,   1,   0,  40,
+	  0,   0,   0,   0,   0,   0,   0,  39, 107, 126,   0,  44,   0,   0,   0,   0,
+	 74,   0,   0,   0,   0,   0,   0,   0,   0,  97,   0,   0,   0,   0,   0, 137,
+	  0,   0,  91,   0,   0,  49, 116,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	 81,  31,   0,   0,   0,   0,   0,   0,   0,   0,   0,  87,   0,   0,   0,   0,
+	  0,   0,   0,   0,  15,   0,   0,   0,   0,   0,   4,   0,   0, 136,   0,   0,
+	  0,   0,   0,   0,   0,  36,   0,  35,   0,   0,  27, 106,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0, 111,   0, 102,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0, 121,  12,   0, 149,   0,   0,  56,   0,   0, 105, 117,   0,   0,  32,
+	  0,  10,   0,   0,   0, 143,   0,  25,  17,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,  46,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,  33,   0,   0,   0,   0,   0, 118,   0,  93,   0,   0,
+	152,  96,   0, 115,  19,   0,   6,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0, 128, 123,   0,   0,   0,   0,  84,  73,  71, 103,   0,  57,  21, 125,
+	  0,   0,   0,   0, 101,   0,   0,   0,   0,   0,  47,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,  60,   0,   0,   9, 104,   0,  78,  66, 133, 100,   0,
+	  0,   0,   0,   0,  24,  82, 132,   0,   0,   0,   0,   0,   0, 135,   0,   0,
+	  0,   0,  37,   0,  45,   0,   0,  92,   0,   0,  77, 109,   0, 146,   0,   0,
+	  0,   7,   0,   0,  89,   0,   0,   0,   0,   0,   0,  43,   0,   0,  54,  99,
+	  0,   0,  41,   0,  48,   0,  42, 138, 139,   0,  51,   0,  70, 119,   0, 130,
+	122,   0,   0,   0,  26,  79,   0,   0,   0,   0,  16,  67,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,  65,   0,   0, 134,  95,  90, 110,   0,   0,  62,   0,
+	  0,   0,   0,   0,  94,  75,   0,   0,   0,   0,   0,   0, 131,   2,   0,   0,
+	  0,  23,  80, 120,   0,   0,   0,   0,   0,   0,   0,  88,   0,   0,  29,   0,
+	  0,   0,   0,   0,  13, 112,   0,  76,   0, 151, 148,   0,   0,  58,  34,  68,
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   0,   0,   0,   0,   0, 150,   0,   0,   0,   0,  63,  18,   0,
+	  0,  72,  14, 127,  38,  64, 141,   0,  20,   0,   0,   0,  98,   0,   0,   0,
+	  0,   5,   0,  55,   0,   0,   0,   0,  52, 113,   0,   0, 114, 145,   0,   0,
+};
+
+#endif
@@ -26,13 +26,18 @@
 #include "kindle_tool.h"
 
 // Ugly globals.
-unsigned int kt_with_unknown_devcodes;
-char         kt_tempdir[PATH_MAX] = { 0 };
+__thread unsigned int kt_with_unknown_devcodes;
+char                  kt_tempdir[PATH_MAX] = { 0 };
+struct kt_stats       kt_stats             = { 0 };
+uint64_t              kt_mem_budget        = (uint64_t) KT_MEM_BUDGET_DEFAULT_MIB * 1024U * 1024U;
 
+// NOTE: The commandline frontend isn't part of libkindletool
+#ifndef KT_LIBRARY
 static int kindle_print_help(const char*);
 static int kindle_print_version(const char*);
 static int kindle_deobfuscate_main(int, char**);
 static int kindle_obfuscate_main(int, char**);
 static int kindle_info_main(int, char**);
+#endif
 
 #endif
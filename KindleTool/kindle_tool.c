@@ -20,9 +20,23 @@
 **  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// For fopencookie
+#if defined(__linux__) || defined(__CYGWIN__)
+#	ifndef _GNU_SOURCE
+#		define _GNU_SOURCE
+#	endif
+#endif
+
 #include "kindle_main.h"
+#include "kindle_devices.h"
 #include "kindle_table.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#elif defined(__ARM_NEON)
+#	include <arm_neon.h>
+#endif
+
 #if defined(_WIN32) && !defined(__CYGWIN__)
 // NOTE: Handle the rest of the Win32 tempfiles mess in a quick'n dirty way...
 // Namely: - We couldn't use MinGW's mkstemp until 5.0 came out
@@ -98,10 +112,500 @@ FILE*
 }
 #endif
 
+// write(), but for real.
+int
+    kt_write_fd(int fd, const void* buff, size_t len)
+{
+	const unsigned char* p = buff;
+	ssize_t              bytes_written;
+
+	while (len > 0) {
+		bytes_written = write(fd, p, len);
+		if (bytes_written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += bytes_written;
+		len -= (size_t) bytes_written;
+	}
+	return 0;
+}
+
+// Return the length of the valid UTF-8 sequence at the start of str (out of len bytes), or 0 if there isn't one.
+// NOTE: Overlong encodings, UTF-16 surrogates, and anything past U+10FFFF don't count (c.f., RFC 3629).
+size_t
+    kt_utf8_sequence_length(const unsigned char* str, size_t len)
+{
+	size_t   need;
+	uint32_t cp;
+
+	if (len == 0U) {
+		return 0U;
+	}
+	if (str[0] < 0x80U) {
+		return 1U;
+	} else if (str[0] >= 0xC2U && str[0] <= 0xDFU) {
+		need = 2U;
+		cp   = str[0] & 0x1FU;
+	} else if ((str[0] & 0xF0U) == 0xE0U) {
+		need = 3U;
+		cp   = str[0] & 0x0FU;
+	} else if (str[0] >= 0xF0U && str[0] <= 0xF4U) {
+		need = 4U;
+		cp   = str[0] & 0x07U;
+	} else {
+		return 0U;
+	}
+	if (len < need) {
+		return 0U;
+	}
+	for (size_t i = 1U; i < need; i++) {
+		if ((str[i] & 0xC0U) != 0x80U) {
+			return 0U;
+		}
+		cp = (cp << 6U) | (str[i] & 0x3FU);
+	}
+	if ((need == 3U && cp < 0x800U) || (need == 4U && cp < 0x10000U) || (cp >= 0xD800U && cp <= 0xDFFFU) ||
+	    cp > 0x10FFFFU) {
+		return 0U;
+	}
+	return need;
+}
+
+// Print a quoted, escaped, JSON string. UTF-8 goes through as-is, only control characters, quotes & backslashes
+// get escaped. Whatever isn't valid UTF-8 is escaped byte by byte (as if it were Latin-1), to keep the JSON valid.
+void
+    kt_json_write_string(FILE* output, const char* str, size_t len)
+{
+	const unsigned char* p = (const unsigned char*) str;
+	size_t               n;
+
+	fputc('"', output);
+	for (size_t i = 0U; i < len; i += n) {
+		n = 1U;
+		if (p[i] == '"' || p[i] == '\\') {
+			fprintf(output, "\\%c", p[i]);
+		} else if (p[i] == '\n') {
+			fputs("\\n", output);
+		} else if (p[i] == '\t') {
+			fputs("\\t", output);
+		} else if (p[i] < 0x20U || p[i] == 0x7FU) {
+			fprintf(output, "\\u%04X", p[i]);
+		} else if ((n = kt_utf8_sequence_length(p + i, len - i)) > 0U) {
+			fwrite(p + i, sizeof(unsigned char), n, output);
+		} else {
+			n = 1U;
+			fprintf(output, "\\u%04X", p[i]);
+		}
+	}
+	fputc('"', output);
+}
+
+#if defined(KT_HAS_FOPENCOOKIE) || defined(KT_HAS_FUNOPEN)
+// Our temporary files live in memory, as long as they fit in what's left of kt_mem_budget (which they all share),
+// and are transparently moved to kt_tempdir once they don't.
+// NOTE: They're stdio streams without an fd, so, no fileno for them (which also means no mmap in kt_input_open).
+#	define KT_MEMTMP_MIN_SIZE (64U * 1024U)
+
+struct kt_memtmp
+{
+	unsigned char* data;
+	size_t         size;        // How much of data is valid
+	size_t         capacity;    // How much of the budget we've reserved (i.e., how much data can hold)
+	size_t         pos;
+	int            fd;    // Once we've spilled to disk, -1 until then
+};
+
+// How much of kt_mem_budget is currently in use
+static uint64_t kt_mem_used = 0U;
+
+static bool
+    kt_mem_reserve(size_t len)
+{
+	uint64_t used = __atomic_load_n(&kt_mem_used, __ATOMIC_RELAXED);
+
+	do {
+		if (len > kt_mem_budget || used > kt_mem_budget - len) {
+			return false;
+		}
+	} while (
+	    !__atomic_compare_exchange_n(&kt_mem_used, &used, used + len, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+static void
+    kt_mem_release(size_t len)
+{
+	__atomic_fetch_sub(&kt_mem_used, len, __ATOMIC_RELAXED);
+}
+
+// Make room for at least needed bytes, if the budget allows it
+static int
+    kt_memtmp_grow(struct kt_memtmp* tmp, size_t needed)
+{
+	size_t         capacity = (tmp->capacity > 0U) ? tmp->capacity : KT_MEMTMP_MIN_SIZE;
+	unsigned char* data;
+
+	if (needed > SIZE_MAX / 2U) {
+		return -1;
+	}
+	while (capacity < needed) {
+		capacity *= 2U;
+	}
+	// If we can't afford to double it, try for just what we need
+	if (!kt_mem_reserve(capacity - tmp->capacity)) {
+		capacity = needed;
+		if (!kt_mem_reserve(capacity - tmp->capacity)) {
+			return -1;
+		}
+	}
+	if ((data = realloc(tmp->data, capacity)) == NULL) {
+		kt_mem_release(capacity - tmp->capacity);
+		return -1;
+	}
+	tmp->data     = data;
+	tmp->capacity = capacity;
+	return 0;
+}
+
+// Move everything to a file in kt_tempdir, which we'll use from then on
+static int
+    kt_memtmp_spill(struct kt_memtmp* tmp)
+{
+	int fd = -1;
+	int saved_errno;
+
+#	if defined(O_TMPFILE)
+	// If we can, don't even give it a name
+	fd = open(kt_tempdir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+#	endif
+	if (fd == -1) {
+		char template[PATH_MAX];
+		snprintf(template, PATH_MAX, "%s/%s", kt_tempdir, "kindletool_tmpfile_XXXXXX");
+		if ((fd = mkstemp(template)) == -1) {
+			fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+			return -1;
+		}
+		unlink(template);
+	}
+	if (kt_write_fd(fd, tmp->data, tmp->size) != 0 || lseek(fd, (off_t) tmp->pos, SEEK_SET) == -1) {
+		saved_errno = errno;
+		fprintf(stderr, "Couldn't write to temporary file: %s.\n", strerror(errno));
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	kt_stats_add(KT_STATS_TEMP_SPILLED, tmp->size);
+
+	free(tmp->data);
+	kt_mem_release(tmp->capacity);
+	tmp->data     = NULL;
+	tmp->size     = 0U;
+	tmp->capacity = 0U;
+	tmp->fd       = fd;
+	return 0;
+}
+
+static ssize_t
+    kt_memtmp_read(struct kt_memtmp* tmp, char* buff, size_t len)
+{
+	ssize_t bytes_read;
+
+	if (tmp->fd != -1) {
+		while ((bytes_read = read(tmp->fd, buff, len)) == -1 && errno == EINTR) {
+			;
+		}
+		return bytes_read;
+	}
+
+	if (tmp->pos >= tmp->size) {
+		return 0;
+	}
+	if (len > tmp->size - tmp->pos) {
+		len = tmp->size - tmp->pos;
+	}
+	memcpy(buff, tmp->data + tmp->pos, len);
+	tmp->pos += len;
+	return (ssize_t) len;
+}
+
+static ssize_t
+    kt_memtmp_write(struct kt_memtmp* tmp, const char* buff, size_t len)
+{
+	// If it doesn't fit anymore, spill
+	if (tmp->fd == -1 && tmp->pos + len > tmp->capacity &&
+	    (tmp->pos > SIZE_MAX - len || kt_memtmp_grow(tmp, tmp->pos + len) != 0) && kt_memtmp_spill(tmp) != 0) {
+		return -1;
+	}
+
+	if (tmp->fd != -1) {
+		if (kt_write_fd(tmp->fd, buff, len) != 0) {
+			return -1;
+		}
+		kt_stats_add(KT_STATS_TEMP_SPILLED, len);
+		return (ssize_t) len;
+	}
+
+	// Fill the gap if we seeked past the end
+	if (tmp->pos > tmp->size) {
+		memset(tmp->data + tmp->size, 0, tmp->pos - tmp->size);
+	}
+	memcpy(tmp->data + tmp->pos, buff, len);
+	tmp->pos += len;
+	if (tmp->pos > tmp->size) {
+		tmp->size = tmp->pos;
+	}
+	return (ssize_t) len;
+}
+
+static int
+    kt_memtmp_seek(struct kt_memtmp* tmp, int64_t* offset, int whence)
+{
+	int64_t base;
+	off_t   pos;
+
+	if (tmp->fd != -1) {
+		if ((pos = lseek(tmp->fd, (off_t) *offset, whence)) == -1) {
+			return -1;
+		}
+		*offset = (int64_t) pos;
+		return 0;
+	}
+
+	switch (whence) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = (int64_t) tmp->pos;
+			break;
+		case SEEK_END:
+			base = (int64_t) tmp->size;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	if ((*offset < 0 && -*offset > base) || (*offset > 0 && (uint64_t) *offset > SIZE_MAX - (uint64_t) base)) {
+		errno = EINVAL;
+		return -1;
+	}
+	tmp->pos = (size_t) (base + *offset);
+	*offset  = (int64_t) tmp->pos;
+	return 0;
+}
+
+static int
+    kt_memtmp_close(void* cookie)
+{
+	struct kt_memtmp* tmp = cookie;
+
+	if (tmp->fd != -1) {
+		close(tmp->fd);
+	}
+	free(tmp->data);
+	kt_mem_release(tmp->capacity);
+	free(tmp);
+	return 0;
+}
+
+#	if defined(KT_HAS_FOPENCOOKIE)
+static ssize_t
+    kt_memtmp_cookie_read(void* cookie, char* buff, size_t len)
+{
+	return kt_memtmp_read(cookie, buff, len);
+}
+
+static ssize_t
+    kt_memtmp_cookie_write(void* cookie, const char* buff, size_t len)
+{
+	ssize_t ret = kt_memtmp_write(cookie, buff, len);
+
+	// NOTE: glibc expects 0 on error
+	return (ret < 0) ? 0 : ret;
+}
+
+static int
+    kt_memtmp_cookie_seek(void* cookie, off64_t* offset, int whence)
+{
+	int64_t pos = *offset;
+
+	if (kt_memtmp_seek(cookie, &pos, whence) != 0) {
+		return -1;
+	}
+	*offset = pos;
+	return 0;
+}
+#	else
+static int
+    kt_memtmp_cookie_read(void* cookie, char* buff, int len)
+{
+	return (int) kt_memtmp_read(cookie, buff, (size_t) len);
+}
+
+static int
+    kt_memtmp_cookie_write(void* cookie, const char* buff, int len)
+{
+	return (int) kt_memtmp_write(cookie, buff, (size_t) len);
+}
+
+static fpos_t
+    kt_memtmp_cookie_seek(void* cookie, fpos_t offset, int whence)
+{
+	int64_t pos = (int64_t) offset;
+
+	if (kt_memtmp_seek(cookie, &pos, whence) != 0) {
+		return -1;
+	}
+	return (fpos_t) pos;
+}
+#	endif
+#endif
+
+// A read/write temporary file, that's gone once closed. Kept in memory while it fits in kt_mem_budget, when we can.
+FILE*
+    kt_tmpfile(void)
+{
+#if defined(KT_HAS_FOPENCOOKIE) || defined(KT_HAS_FUNOPEN)
+	struct kt_memtmp* tmp;
+	FILE*             file;
+
+	// No budget, no point
+	if (kt_mem_budget == 0U) {
+		return tmpfile();
+	}
+	if ((tmp = calloc(1, sizeof(*tmp))) == NULL) {
+		return NULL;
+	}
+	tmp->fd = -1;
+#	if defined(KT_HAS_FOPENCOOKIE)
+	cookie_io_functions_t funcs = { kt_memtmp_cookie_read, kt_memtmp_cookie_write, kt_memtmp_cookie_seek, kt_memtmp_close };
+
+	file = fopencookie(tmp, "w+b", funcs);
+#	else
+	file = funopen(tmp, kt_memtmp_cookie_read, kt_memtmp_cookie_write, kt_memtmp_cookie_seek, kt_memtmp_close);
+#	endif
+	if (file == NULL) {
+		free(tmp);
+	}
+	return file;
+#else
+	return tmpfile();
+#endif
+}
+
+// NOTE: Both of Amazon's tables boil down to a nibble swap followed by an XOR with a constant,
+//       which maps nicely onto a couple of SIMD shuffles (or shifts).
+//       The tables in kindle_table.h stay the reference implementation, and the fallback on everything else.
+#define MD_XOR_KEY 0x7A
+#define DM_XOR_KEY 0xA7
+
+#if defined(__x86_64__) || defined(__i386__)
+// NOTE: Split the job in two 16 entries LUTs, one per nibble, so that each of them fits in a single pshufb.
+static void
+    build_nibble_luts(uint8_t key, uint8_t lo_lut[16], uint8_t hi_lut[16])
+{
+	for (uint8_t n = 0U; n < 16U; n++) {
+		// The low nibble becomes the high nibble, and vice-versa
+		lo_lut[n] = (uint8_t)((n << 4U) ^ (key & 0xF0U));
+		hi_lut[n] = (uint8_t)(n ^ (key & 0x0FU));
+	}
+}
+
+__attribute__((target("ssse3"))) static size_t
+    swap_xor_ssse3(unsigned char* bytes, size_t length, uint8_t key)
+{
+	uint8_t lo[16];
+	uint8_t hi[16];
+	build_nibble_luts(key, lo, hi);
+	const __m128i lo_lut = _mm_loadu_si128((const void*) lo);
+	const __m128i hi_lut = _mm_loadu_si128((const void*) hi);
+	const __m128i mask   = _mm_set1_epi8(0x0F);
+
+	size_t i = 0U;
+	for (; i + 16U <= length; i += 16U) {
+		__m128i v = _mm_loadu_si128((const void*) (bytes + i));
+		// NOTE: There's no 8-bit shift, so shift 16-bit lanes, and mask the bits that leaked from the neighbor out.
+		__m128i l = _mm_and_si128(v, mask);
+		__m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		v         = _mm_or_si128(_mm_shuffle_epi8(lo_lut, l), _mm_shuffle_epi8(hi_lut, h));
+		_mm_storeu_si128((void*) (bytes + i), v);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+    swap_xor_avx2(unsigned char* bytes, size_t length, uint8_t key)
+{
+	uint8_t lo[16];
+	uint8_t hi[16];
+	build_nibble_luts(key, lo, hi);
+	// NOTE: vpshufb only shuffles within 128-bit lanes, so we just need the same LUT in both of them.
+	const __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const void*) lo));
+	const __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const void*) hi));
+	const __m256i mask   = _mm256_set1_epi8(0x0F);
+
+	size_t i = 0U;
+	for (; i + 32U <= length; i += 32U) {
+		__m256i v = _mm256_loadu_si256((const void*) (bytes + i));
+		__m256i l = _mm256_and_si256(v, mask);
+		__m256i h = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		v         = _mm256_or_si256(_mm256_shuffle_epi8(lo_lut, l), _mm256_shuffle_epi8(hi_lut, h));
+		_mm256_storeu_si256((void*) (bytes + i), v);
+	}
+
+	return i;
+}
+#elif defined(__ARM_NEON)
+// NOTE: NEON is mandatory on AArch64, and we only get here on ARMv7 if the toolchain was told the target has it,
+//       so there's nothing to check at runtime.
+static size_t
+    swap_xor_neon(unsigned char* bytes, size_t length, uint8_t key)
+{
+	const uint8x16_t k = vdupq_n_u8(key);
+
+	size_t i = 0U;
+	for (; i + 16U <= length; i += 16U) {
+		uint8x16_t v = vld1q_u8(bytes + i);
+		// NEON has proper 8-bit shifts, so this one is a straight rotate
+		v = veorq_u8(vorrq_u8(vshlq_n_u8(v, 4), vshrq_n_u8(v, 4)), k);
+		vst1q_u8(bytes + i, v);
+	}
+
+	return i;
+}
+#endif
+
+// Run the best vector kernel this CPU supports over as much of the buffer as possible,
+// and return how many bytes were processed (the tail is left to the table).
+static size_t
+    swap_xor_vector(unsigned char* bytes, size_t length, uint8_t key)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2")) {
+		return swap_xor_avx2(bytes, length, key);
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return swap_xor_ssse3(bytes, length, key);
+	}
+	return 0U;
+#elif defined(__ARM_NEON)
+	return swap_xor_neon(bytes, length, key);
+#else
+	(void) bytes;
+	(void) length;
+	(void) key;
+	return 0U;
+#endif
+}
+
 void
     md(unsigned char* bytes, size_t length)
 {
-	for (size_t i = 0; i < length; ++i) {
+	for (size_t i = swap_xor_vector(bytes, length, MD_XOR_KEY); i < length; ++i) {
 		bytes[i] = (unsigned char) ptog[bytes[i]];
 	}
 }
@@ -109,21 +613,56 @@ void
 void
     dm(unsigned char* bytes, size_t length)
 {
-	for (size_t i = 0; i < length; ++i) {
+	for (size_t i = swap_xor_vector(bytes, length, DM_XOR_KEY); i < length; ++i) {
 		bytes[i] = (unsigned char) gtop[bytes[i]];
 	}
 }
 
+// NOTE: Big aligned chunks, to keep the vector kernels fed, and the number of stdio calls down.
+static unsigned char*
+    alloc_munge_buffer(void)
+{
+	void* buf = NULL;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	buf = _aligned_malloc(MUNGE_BUFFER_SIZE, MUNGE_BUFFER_ALIGN);
+#else
+	if (posix_memalign(&buf, MUNGE_BUFFER_ALIGN, MUNGE_BUFFER_SIZE) != 0) {
+		buf = NULL;
+	}
+#endif
+	if (buf == NULL) {
+		fprintf(stderr, "Error allocating munging buffer.\n");
+	}
+	return buf;
+}
+
+static void
+    free_munge_buffer(unsigned char* buf)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	_aligned_free(buf);
+#else
+	free(buf);
+#endif
+}
+
 int
     munger(FILE* input, FILE* output, size_t length, const bool fake_sign)
 {
-	unsigned char bytes[BUFFER_SIZE];
-	size_t        bytes_read;
-	size_t        bytes_written;
+	unsigned char* bytes;
+	size_t         bytes_read;
+	size_t         bytes_written;
+	uint64_t       total       = 0U;
+	uint64_t       stats_start = kt_stats_start();
+
+	if ((bytes = alloc_munge_buffer()) == NULL) {
+		return -1;
+	}
 
-	while ((bytes_read = fread(
-		    bytes, sizeof(unsigned char), (length < BUFFER_SIZE && length > 0 ? length : BUFFER_SIZE), input)) >
-	       0) {
+	while ((bytes_read = fread(bytes,
+				   sizeof(unsigned char),
+				   (length < MUNGE_BUFFER_SIZE && length > 0 ? length : MUNGE_BUFFER_SIZE),
+				   input)) > 0) {
 		// Don't munge if we asked for a fake package
 		if (!fake_sign) {
 			md(bytes, bytes_read);
@@ -131,16 +670,23 @@ int
 		bytes_written = fwrite(bytes, sizeof(unsigned char), bytes_read, output);
 		if (ferror(output) != 0) {
 			fprintf(stderr, "Error munging, cannot write to output: %s.\n", strerror(errno));
+			free_munge_buffer(bytes);
 			return -1;
 		} else if (bytes_written < bytes_read) {
 			fprintf(stderr,
 				"Error munging, read %zu bytes but only wrote %zu bytes.\n",
 				bytes_read,
 				bytes_written);
+			free_munge_buffer(bytes);
 			return -1;
 		}
 		length -= bytes_read;
+		total += bytes_read;
 	}
+	free_munge_buffer(bytes);
+	kt_stats_add(KT_STATS_BYTES_READ, total);
+	kt_stats_add(KT_STATS_BYTES_WRITTEN, total);
+	kt_stats_stop(KT_STATS_MUNGE, stats_start);
 	if (ferror(input) != 0) {
 		fprintf(stderr, "Error munging, cannot read input: %s.\n", strerror(errno));
 		return -1;
@@ -152,13 +698,20 @@ int
 int
     demunger(FILE* input, FILE* output, size_t length, const bool fake_sign)
 {
-	unsigned char bytes[BUFFER_SIZE];
-	size_t        bytes_read;
-	size_t        bytes_written;
+	unsigned char* bytes;
+	size_t         bytes_read;
+	size_t         bytes_written;
+	uint64_t       total       = 0U;
+	uint64_t       stats_start = kt_stats_start();
+
+	if ((bytes = alloc_munge_buffer()) == NULL) {
+		return -1;
+	}
 
-	while ((bytes_read = fread(
-		    bytes, sizeof(unsigned char), (length < BUFFER_SIZE && length > 0 ? length : BUFFER_SIZE), input)) >
-	       0) {
+	while ((bytes_read = fread(bytes,
+				   sizeof(unsigned char),
+				   (length < MUNGE_BUFFER_SIZE && length > 0 ? length : MUNGE_BUFFER_SIZE),
+				   input)) > 0) {
 		// Don't demunge if we supplied a fake package
 		if (!fake_sign) {
 			dm(bytes, bytes_read);
@@ -166,16 +719,23 @@ int
 		bytes_written = fwrite(bytes, sizeof(unsigned char), bytes_read, output);
 		if (ferror(output) != 0) {
 			fprintf(stderr, "Error demunging, cannot write to output: %s.\n", strerror(errno));
+			free_munge_buffer(bytes);
 			return -1;
 		} else if (bytes_written < bytes_read) {
 			fprintf(stderr,
 				"Error demunging, read %zu bytes but only wrote %zu bytes.\n",
 				bytes_read,
 				bytes_written);
+			free_munge_buffer(bytes);
 			return -1;
 		}
 		length -= bytes_read;
+		total += bytes_read;
 	}
+	free_munge_buffer(bytes);
+	kt_stats_add(KT_STATS_BYTES_READ, total);
+	kt_stats_add(KT_STATS_BYTES_WRITTEN, total);
+	kt_stats_stop(KT_STATS_MUNGE, stats_start);
 	if (ferror(input) != 0) {
 		fprintf(stderr, "Error demunging, cannot read input: %s.\n", strerror(errno));
 		return -1;
@@ -184,356 +744,912 @@ int
 	return 0;
 }
 
-const char*
-    convert_device_id(Device dev)
+// Grab the input's mapping if it's a regular file. We map it whole, but start at the current file position.
+void
+    kt_input_open(struct kt_input* input, FILE* file)
 {
-	switch (dev) {
-		case Kindle1:
-			return "Kindle 1";
-		case Kindle2US:
-			return "Kindle 2 US";
-		case Kindle2International:
-			return "Kindle 2 International";
-		case KindleDXUS:
-			return "Kindle DX US";
-		case KindleDXInternational:
-			return "Kindle DX International";
-		case KindleDXGraphite:
-			return "Kindle DX Graphite";
-		case Kindle3WiFi:
-			return "Kindle 3 WiFi";
-		case Kindle3WiFi3G:
-			return "Kindle 3 WiFi+3G";
-		case Kindle3WiFi3GEurope:
-			return "Kindle 3 WiFi+3G Europe";
-		case Kindle4NonTouch:
-			return "Silver Kindle 4 Non-Touch (2011)";
-		case Kindle5TouchWiFi:
-			return "Kindle 5 Touch WiFi";
-		case Kindle5TouchWiFi3G:
-			return "Kindle 5 Touch WiFi+3G";
-		case Kindle5TouchWiFi3GEurope:
-			return "Kindle 5 Touch WiFi+3G Europe";
-		case Kindle5TouchUnknown:
-			return "Kindle 5 Touch (Unknown Variant)";
-		case Kindle4NonTouchBlack:
-			return "Black Kindle 4 Non-Touch (2012)";
-		case KindlePaperWhiteWiFi:
-			return "Kindle PaperWhite WiFi";
-		case KindlePaperWhiteWiFi3G:
-			return "Kindle PaperWhite WiFi+3G";
-		case KindlePaperWhiteWiFi3GCanada:
-			return "Kindle PaperWhite WiFi+3G Canada";
-		case KindlePaperWhiteWiFi3GEurope:
-			return "Kindle PaperWhite WiFi+3G Europe";
-		case KindlePaperWhiteWiFi3GJapan:
-			return "Kindle PaperWhite WiFi+3G Japan";
-		case KindlePaperWhiteWiFi3GBrazil:
-			return "Kindle PaperWhite WiFi+3G Brazil";
-		case KindlePaperWhite2WiFi:
-			return "Kindle PaperWhite 2 (2013) WiFi";
-		case KindlePaperWhite2WiFiJapan:
-			return "Kindle PaperWhite 2 (2013) WiFi Japan";
-		case KindlePaperWhite2WiFi3G:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G";
-		case KindlePaperWhite2WiFi3GCanada:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G Canada";
-		case KindlePaperWhite2WiFi3GEurope:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G Europe";
-		case KindlePaperWhite2WiFi3GRussia:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G Russia";
-		case KindlePaperWhite2WiFi3GJapan:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G Japan";
-		case KindlePaperWhite2WiFi4GBInternational:
-			return "Kindle PaperWhite 2 (2013) WiFi (4GB) International";
-		case KindlePaperWhite2WiFi3G4GBEurope:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Europe";
-		case KindlePaperWhite2Unknown_0xF4:
-			return "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF4)";
-		case KindlePaperWhite2Unknown_0xF9:
-			return "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF9)";
-		case KindlePaperWhite2WiFi3G4GB:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G (4GB)";
-		case KindlePaperWhite2WiFi3G4GBBrazil:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Brazil";
-		case KindlePaperWhite2WiFi3G4GBCanada:
-			return "Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Canada";
-		case KindleBasic:
-			return "Kindle Basic (2014)";
-		case KindleVoyageWiFi:
-			return "Kindle Voyage WiFi";
-		case ValidKindleUnknown_0x16:
-			return "Unknown Kindle (0x16)";
-		case ValidKindleUnknown_0x21:
-			return "Unknown Kindle (0x21)";
-		case KindleVoyageWiFi3G:
-			return "Kindle Voyage WiFi+3G";
-		case KindleVoyageWiFi3GJapan:
-			return "Kindle Voyage WiFi+3G Japan";
-		case KindleVoyageUnknown_0x4F:
-			return "Kindle Voyage (Unknown Variant 0x4F)";
-		case KindleVoyageWiFi3GMexico:
-			return "Kindle Voyage WiFi+3G Mexico";
-		case KindleVoyageWiFi3GEurope:
-			return "Kindle Voyage WiFi+3G Europe";
-		case ValidKindleUnknown_0x07:
-			return "Unknown Kindle (0x07)";
-		case ValidKindleUnknown_0x0B:
-			return "Unknown Kindle (0x0B)";
-		case ValidKindleUnknown_0x0C:
-			return "Unknown Kindle (0x0C)";
-		case ValidKindleUnknown_0x0D:
-			return "Unknown Kindle (0x0D)";
-		case ValidKindleUnknown_0x99:
-			return "Unknown Kindle (0x99)";
-		case KindleBasicKiwi:
-			return "Kindle Basic (2014) Australia";
-		case KindlePaperWhite3WiFi:
-			return "Kindle PaperWhite 3 (2015) WiFi";
-		case KindlePaperWhite3WiFi3G:
-			return "Kindle PaperWhite 3 (2015) WiFi+3G";
-		case KindlePaperWhite3WiFi3GMexico:
-			return "Kindle PaperWhite 3 (2015) WiFi+3G Mexico";
-		case KindlePaperWhite3WiFi3GEurope:
-			return "Kindle PaperWhite 3 (2015) WiFi+3G Europe";
-		case KindlePaperWhite3WiFi3GCanada:
-			return "Kindle PaperWhite 3 (2015) WiFi+3G Canada";
-		case KindlePaperWhite3WiFi3GJapan:
-			return "Kindle PaperWhite 3 (2015) WiFi+3G Japan";
-		case KindlePaperWhite3WhiteWiFi:
-			return "White Kindle PaperWhite 3 (2016) WiFi";
-		case KindlePaperWhite3WhiteWiFi3GJapan:
-			return "White Kindle PaperWhite 3 (2016) WiFi+3G Japan";
-		case KindlePW3WhiteUnknown_0KD:
-			return "White Kindle PaperWhite 3 (Unknown Variant 0KD)";
-		case KindlePaperWhite3WhiteWiFi3GInternational:
-			return "White Kindle PaperWhite 3 (2016) WiFi+3G International";
-		case KindlePaperWhite3WhiteWiFi3GInternationalBis:
-			return "White Kindle PaperWhite 3 (2016) WiFi+3G International (Bis)";
-		case KindlePW3WhiteUnknown_0KG:
-			return "White Kindle PaperWhite 3 (Unknown Variant 0KG)";
-		case KindlePaperWhite3BlackWiFi32GBJapan:
-			return "Kindle PaperWhite 3 (2016) WiFi (32GB) Japan";
-		case KindlePaperWhite3WhiteWiFi32GBJapan:
-			return "White Kindle PaperWhite 3 (2016) WiFi (32GB) Japan";
-		case KindleOasisWiFi:
-			return "Kindle Oasis WiFi";
-		case KindleOasisWiFi3G:
-			return "Kindle Oasis WiFi+3G";
-		case KindleOasisWiFi3GInternational:
-			return "Kindle Oasis WiFi+3G International";
-		case KindleOasisUnknown_0GS:
-			return "Kindle Oasis (Unknown Variant 0GS)";
-		case KindleOasisWiFi3GChina:
-			return "Kindle Oasis WiFi+3G China";
-		case KindleOasisWiFi3GEurope:
-			return "Kindle Oasis WiFi+3G Europe";
-		case KindleBasic2White:
-			return "White Kindle Basic 2 (2016)";
-		case KindleBasic2:
-			return "Kindle Basic 2 (2016)";
-		case KindleBasic2Unknown_0DU:
-			return "Kindle Basic 2 (2016) (Unknown Variant 0DU)";
-		case KindleOasis2Unknown_0LM:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0LM)";
-		case KindleOasis2Unknown_0LN:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0LN)";
-		case KindleOasis2Unknown_0LP:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0LP)";
-		case KindleOasis2Unknown_0LQ:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0LQ)";
-		case KindleOasis2WiFi32GBChampagne:
-			return "Champagne Kindle Oasis 2 (2017) WiFi (32GB)";
-		case KindleOasis2Unknown_0P2:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0P2)";
-		case KindleOasis2Unknown_0P6:
-			return "Kindle Oasis 2 (2017) WiFi+3G (32GB) (Variant 0P6)";
-		case KindleOasis2Unknown_0P7:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0P7)";
-		case KindleOasis2WiFi8GB:
-			return "Kindle Oasis 2 (2017) WiFi (8GB)";
-		case KindleOasis2WiFi3G32GB:
-			return "Kindle Oasis 2 (2017) WiFi+3G (32GB)";
-		case KindleOasis2WiFi3G32GBEurope:
-			return "Kindle Oasis 2 (2017) WiFi+3G (32GB) Europe";
-		case KindleOasis2Unknown_0S3:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0S3)";
-		case KindleOasis2Unknown_0S4:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0S4)";
-		case KindleOasis2Unknown_0S7:
-			return "Kindle Oasis 2 (2017) (Unknown Variant 0S7)";
-		case KindleOasis2WiFi32GB:
-			return "Kindle Oasis 2 (2017) WiFi (32GB)";
-		case KindlePaperWhite4WiFi8GB:
-			return "Kindle PaperWhite 4 (2018) WiFi (8GB)";
-		case KindlePaperWhite4WiFi4G32GB:
-			return "Kindle PaperWhite 4 (2018) WiFi+4G (32GB)";
-		case KindlePaperWhite4WiFi4G32GBEurope:
-			return "Kindle PaperWhite 4 (2018) WiFi+4G (32GB) Europe";
-		case KindlePaperWhite4WiFi4G32GBJapan:
-			return "Kindle PaperWhite 4 (2018) WiFi+4G (32GB) Japan";
-		case KindlePaperWhite4Unknown_0T4:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0T4)";
-		case KindlePaperWhite4Unknown_0T5:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0T5)";
-		case KindlePaperWhite4WiFi32GB:
-			return "Kindle PaperWhite 4 (2018) WiFi (32GB)";
-		case KindlePaperWhite4Unknown_0T7:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0T7)";
-		case KindlePaperWhite4Unknown_0TJ:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0TJ)";
-		case KindlePaperWhite4Unknown_0TK:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0TK)";
-		case KindlePaperWhite4Unknown_0TL:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0TL)";
-		case KindlePaperWhite4Unknown_0TM:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0TM)";
-		case KindlePaperWhite4Unknown_0TN:
-			return "Kindle PaperWhite 4 (2018) (Unknown Variant 0TN)";
-		case KindlePaperWhite4WiFi8GBIndia:
-			return "Kindle PaperWhite 4 (2018) WiFi (8GB) India";
-		case KindlePaperWhite4WiFi32GBIndia:
-			return "Kindle PaperWhite 4 (2018) WiFi (32GB) India";
-		case KindlePaperWhite4WiFi32GBBlue:
-			return "Twilight Blue Kindle PaperWhite 4 (2018) WiFi (32GB)";
-		case KindlePaperWhite4WiFi32GBPlum:
-			return "Plum Kindle PaperWhite 4 (2018) WiFi (32GB)";
-		case KindlePaperWhite4WiFi32GBSage:
-			return "Sage Kindle PaperWhite 4 (2018) WiFi (32GB)";
-		case KindlePaperWhite4WiFi8GBBlue:
-			return "Twilight Blue Kindle PaperWhite 4 (2018) WiFi (8GB)";
-		case KindlePaperWhite4WiFi8GBPlum:
-			return "Plum Kindle PaperWhite 4 (2018) WiFi (8GB)";
-		case KindlePaperWhite4WiFi8GBSage:
-			return "Sage Kindle PaperWhite 4 (2018) WiFi (8GB)";
-		case KindleBasic3:
-			return "Kindle Basic 3 (2019)";
-		case KindleBasic3White8GB:
-			return "White Kindle Basic 3 (2019) (8GB)";
-		case KindleBasic3Unknown_0WG:
-			return "Kindle Basic 3 (2019) (Unknown Variant 0WG)";
-		case KindleBasic3White:
-			return "White Kindle Basic 3 (2019)";
-		case KindleBasic3Unknown_0WJ:
-			return "Kindle Basic 3 (2019) (Unknown Variant 0WJ)";
-		case KindleBasic3KidsEdition:
-			return "Kindle Basic 3 (2019) Kids Edition";
-		case KindleOasis3WiFi32GBChampagne:
-			return "Champagne Kindle Oasis 3 (2019) WiFi (32GB)";
-		case KindleOasis3WiFi4G32GBJapan:
-			return "Kindle Oasis 3 (2019) WiFi+4G (32GB) Japan";
-		case KindleOasis3WiFi4G32GBIndia:
-			return "Kindle Oasis 3 (2019) WiFi+4G (32GB) India";
-		case KindleOasis3WiFi4G32GB:
-			return "Kindle Oasis 3 (2019) WiFi+4G (32GB)";
-		case KindleOasis3WiFi32GB:
-			return "Kindle Oasis 3 (2019) WiFi (32GB)";
-		case KindleOasis3WiFi8GB:
-			return "Kindle Oasis 3 (2019) WiFi (8GB)";
-		case KindleUnknown:
-		default:
-			return "Unknown";
+	memset(input, 0, sizeof(*input));
+	input->file = file;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	struct stat st;
+	off_t       pos;
+	void*       map;
+
+	if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	    (uintmax_t) st.st_size > SIZE_MAX || (pos = ftello(file)) == -1 || pos > st.st_size) {
+		return;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (map == MAP_FAILED) {
+		return;
 	}
+	// We'll only ever walk it front to back
+	madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+	input->map  = map;
+	input->size = (size_t) st.st_size;
+	input->pos  = (size_t) pos;
+#endif
 }
 
-const char*
-    convert_platform_id(Platform plat)
+// Release the mapping, and leave the file position where we stopped
+void
+    kt_input_close(struct kt_input* input)
 {
-	switch (plat) {
-		case Plat_Unspecified:
-			return "Unspecified";
-		case MarioDeprecated:
-			return "Mario (Deprecated)";
-		case Luigi:
-			return "Luigi";
-		case Banjo:
-			return "Banjo";
-		case Yoshi:
-			return "Yoshi";
-		case YoshimeProto:
-			return "Yoshime (Prototype)";
-		case Yoshime:
-			return "Yoshime (Yoshime3)";
-		case Wario:
-			return "Wario";
-		case Duet:
-			return "Duet";
-		case Heisenberg:
-			return "Heisenberg";
-		case Zelda:
-			return "Zelda";
-		case Rex:
-			return "Rex";
-		case Bellatrix:
-			return "Bellatrix";
-		default:
-			return "Unknown";
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	if (input->map != NULL) {
+		munmap(input->map, input->size);
+		fseeko(input->file, (off_t) input->pos, SEEK_SET);
+		input->map = NULL;
+	}
+#endif
+	free(input->scratch);
+	input->scratch      = NULL;
+	input->scratch_size = 0;
+}
+
+// Account for the len bytes at data we just consumed, and hash whatever we hadn't already hashed.
+// NOTE: We may have skipped back before that, in which case the front of data was already hashed.
+static void
+    kt_input_consumed(struct kt_input* input, const void* data, size_t len)
+{
+	input->consumed += len;
+	if (input->sha256 != NULL && input->consumed > input->hashed) {
+		size_t fresh = (size_t) (input->consumed - input->hashed);
+
+		if (fresh > len) {
+			fresh = len;
+		}
+		kt_sha256_update(input->sha256, fresh, (const uint8_t*) data + (len - fresh));
+		input->hashed = input->consumed;
 	}
 }
 
-const char*
-    convert_board_id(Board board)
+// fread, basically
+size_t
+    kt_input_read(struct kt_input* input, void* buff, size_t len)
 {
-	switch (board) {
-		case Board_Unspecified:
-			return "Unspecified";
-		case Tequila:
-			return "Tequila";
-		case Whitney:
-			return "Whitney";
-		default:
-			return "Unknown";
+	if (input->map == NULL) {
+		len = fread(buff, sizeof(unsigned char), len, input->file);
+		kt_input_consumed(input, buff, len);
+		return len;
+	}
+
+	if (len > input->size - input->pos) {
+		len = input->size - input->pos;
 	}
+	memcpy(buff, input->map + input->pos, len);
+	input->pos += len;
+	kt_input_consumed(input, buff, len);
+	return len;
 }
 
-BundleVersion
-    get_bundle_version(const char magic_number[MAGIC_NUMBER_LENGTH])
+// Returns a pointer to the next len bytes of input, or NULL if there aren't that many left.
+// That's read-only, and only valid until the next call.
+const unsigned char*
+    kt_input_get(struct kt_input* input, size_t len)
 {
-	if (!memcmp(magic_number, "FB02", MAGIC_NUMBER_LENGTH) || !memcmp(magic_number, "FB01", MAGIC_NUMBER_LENGTH)) {
-		return RecoveryUpdate;
-	} else if (!memcmp(magic_number, "FB03", MAGIC_NUMBER_LENGTH)) {
-		return RecoveryUpdateV2;
-	} else if (!memcmp(magic_number, "FC02", MAGIC_NUMBER_LENGTH) ||
-		   !memcmp(magic_number, "FD03", MAGIC_NUMBER_LENGTH)) {
-		return OTAUpdate;
-	} else if (!memcmp(magic_number, "FC04", MAGIC_NUMBER_LENGTH) ||
-		   !memcmp(magic_number, "FD04", MAGIC_NUMBER_LENGTH) ||
-		   !memcmp(magic_number, "FL01", MAGIC_NUMBER_LENGTH)) {
-		return OTAUpdateV2;
-	} else if (!memcmp(magic_number, "SP01", MAGIC_NUMBER_LENGTH)) {
-		return UpdateSignature;
-	} else if (!memcmp(magic_number, "\x1F\x8B\x08\x00", MAGIC_NUMBER_LENGTH)) {    // GZIP magic number
-		return UserDataPackage;
-	} else if (!memcmp(magic_number, "\x50\x4B\x03\x04", MAGIC_NUMBER_LENGTH)) {    // ZIP magic number
-		return AndroidUpdate;
-	} else {
-		return UnknownUpdate;
+	const unsigned char* p;
+
+	if (input->map != NULL) {
+		if (len > input->size - input->pos) {
+			return NULL;
+		}
+		p = input->map + input->pos;
+		input->pos += len;
+		kt_input_consumed(input, p, len);
+		return p;
+	}
+
+	if (len > input->scratch_size) {
+		unsigned char* scratch = realloc(input->scratch, len);
+		if (scratch == NULL) {
+			return NULL;
+		}
+		input->scratch      = scratch;
+		input->scratch_size = len;
+	}
+	if (fread(input->scratch, sizeof(unsigned char), len, input->file) < len) {
+		return NULL;
+	}
+	kt_input_consumed(input, input->scratch, len);
+	return input->scratch;
+}
+
+// fseeko(SEEK_CUR), basically
+int
+    kt_input_skip(struct kt_input* input, off_t offset)
+{
+	// If we're hashing, we can't just jump over stuff
+	if (input->sha256 != NULL && offset > 0) {
+		while (offset > 0) {
+			size_t chunk = (offset > MUNGE_BUFFER_SIZE) ? MUNGE_BUFFER_SIZE : (size_t) offset;
+
+			if (kt_input_get(input, chunk) == NULL) {
+				errno = EINVAL;
+				return -1;
+			}
+			offset -= (off_t) chunk;
+		}
+		return 0;
+	}
+
+	if (input->map == NULL) {
+		if (fseeko(input->file, offset, SEEK_CUR) != 0) {
+			return -1;
+		}
+		input->consumed = (uint64_t) ((int64_t) input->consumed + offset);
+		return 0;
+	}
+
+	if ((offset < 0 && (size_t) -offset > input->pos) || (offset > 0 && (size_t) offset > input->size - input->pos)) {
+		errno = EINVAL;
+		return -1;
+	}
+	input->pos      = (size_t) ((off_t) input->pos + offset);
+	input->consumed = (uint64_t) ((int64_t) input->consumed + offset);
+	return 0;
+}
+
+bool
+    kt_input_error(const struct kt_input* input)
+{
+	if (input->map == NULL) {
+		return ferror(input->file) != 0;
+	}
+	return false;
+}
+
+#if defined(KT_HAS_SENDFILE)
+// Have the kernel copy as much as it can of the rest of a mapped (and as such, regular) input to output,
+// without the data ever going through us (copy_file_range between regular files, sendfile to a pipe).
+// Whatever it won't do for this pair of files is left to the caller. Returns -1 on error, 0 otherwise.
+static int
+    kt_input_copy_kernel(struct kt_input* input, FILE* output)
+{
+	struct stat st;
+	int         in_fd  = fileno(input->file);
+	int         out_fd = fileno(output);
+	off_t       off;
+	ssize_t     copied;
+#	if defined(KT_HAS_COPY_FILE_RANGE)
+	bool copy_range;
+#	endif
+
+	if (out_fd == -1 || fstat(out_fd, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode))) {
+		return 0;
+	}
+	// What's already buffered has to go first
+	if (fflush(output) != 0) {
+		return -1;
+	}
+
+#	if defined(KT_HAS_COPY_FILE_RANGE)
+	copy_range = S_ISREG(st.st_mode);
+#	endif
+	off = (off_t) input->pos;
+	while (input->pos < input->size) {
+#	if defined(KT_HAS_COPY_FILE_RANGE)
+		if (copy_range) {
+			copied = syscall(SYS_copy_file_range, in_fd, &off, out_fd, NULL, input->size - input->pos, 0U);
+			// NOTE: Older kernels won't do it across filesystems (or at all), but sendfile can pick up the slack.
+			if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+					     errno == EBADF)) {
+				copy_range = false;
+				continue;
+			}
+		} else
+#	endif
+		{
+			copied = sendfile(out_fd, in_fd, &off, input->size - input->pos);
+			if (copied == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				break;
+			}
+		}
+		if (copied == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (copied == 0) {
+			break;
+		}
+		input->pos += (size_t) copied;
+	}
+
+	// Make sure stdio picks up where the kernel left off
+	if (S_ISREG(st.st_mode) && fseeko(output, 0, SEEK_CUR) != 0) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+// Copy the rest of the input to output, demunging it along the way if asked to.
+// When we're not demunging, and both ends are real files (or output is a pipe), we let the kernel do the work.
+// The caller is in charge of the error reporting (errno is left as-is).
+int
+    kt_input_copy(struct kt_input* input, FILE* output, const bool demunge)
+{
+	unsigned char* bytes;
+	size_t         len;
+	size_t         start       = input->pos;
+	uint64_t       total       = 0U;
+	uint64_t       stats_start = kt_stats_start();
+
+	// Straight copy from a mapping, no need to go through a buffer
+	if (input->map != NULL && !demunge && input->sha256 == NULL) {
+#if defined(KT_HAS_SENDFILE)
+		if (kt_input_copy_kernel(input, output) != 0) {
+			return -1;
+		}
+#endif
+		len = input->size - input->pos;
+		if (fwrite(input->map + input->pos, sizeof(unsigned char), len, output) < len) {
+			return -1;
+		}
+		input->pos += len;
+		input->consumed += input->pos - start;
+		kt_stats_add(KT_STATS_BYTES_READ, input->pos - start);
+		kt_stats_add(KT_STATS_BYTES_WRITTEN, input->pos - start);
+		kt_stats_stop(KT_STATS_COPY, stats_start);
+		return 0;
+	}
+
+	if ((bytes = alloc_munge_buffer()) == NULL) {
+		return -1;
+	}
+	while ((len = kt_input_read(input, bytes, MUNGE_BUFFER_SIZE)) > 0) {
+		if (demunge) {
+			dm(bytes, len);
+		}
+		if (fwrite(bytes, sizeof(unsigned char), len, output) < len) {
+			free_munge_buffer(bytes);
+			return -1;
+		}
+		total += len;
+	}
+	free_munge_buffer(bytes);
+	kt_stats_add(KT_STATS_BYTES_READ, total);
+	kt_stats_add(KT_STATS_BYTES_WRITTEN, total);
+	kt_stats_stop(demunge ? KT_STATS_MUNGE : KT_STATS_COPY, stats_start);
+	if (kt_input_error(input)) {
+		return -1;
+	}
+	return 0;
+}
+
+// Munge input to output (unless fake_sign, where input is already mangled), while computing the MD5 of the demunged form
+// as it streams through, which is what the update headers expect. Pass a NULL output to only compute the MD5,
+// or a NULL output_md5 to skip it. If output_sha256 is set, it's fed what we write to output.
+int
+    munger_md5(FILE* input, FILE* output, const bool fake_sign, char* output_md5, struct kt_sha256_ctx* output_sha256)
+{
+	unsigned char* bytes;
+	unsigned char* plain = NULL;
+	size_t         bytes_read;
+	struct md5_ctx md5;
+	uint8_t        digest[MD5_DIGEST_SIZE];
+	uint64_t       total       = 0U;
+	uint64_t       stats_start = kt_stats_start();
+
+	if ((bytes = alloc_munge_buffer()) == NULL) {
+		return -1;
+	}
+	// We need a scratch copy to hash the demunged data when we're not supposed to touch what we write
+	if (fake_sign && output_md5 != NULL && (plain = alloc_munge_buffer()) == NULL) {
+		free_munge_buffer(bytes);
+		return -1;
+	}
+
+	md5_init(&md5);
+	while ((bytes_read = fread(bytes, sizeof(unsigned char), MUNGE_BUFFER_SIZE, input)) > 0) {
+		if (fake_sign) {
+			if (output_md5 != NULL) {
+				memcpy(plain, bytes, bytes_read);
+				dm(plain, bytes_read);
+				md5_update(&md5, bytes_read, plain);
+			}
+		} else {
+			if (output_md5 != NULL) {
+				md5_update(&md5, bytes_read, bytes);
+			}
+			if (output != NULL) {
+				md(bytes, bytes_read);
+			}
+		}
+		if (output != NULL) {
+			if (fwrite(bytes, sizeof(unsigned char), bytes_read, output) < bytes_read) {
+				fprintf(stderr, "Error munging, cannot write to output: %s.\n", strerror(errno));
+				free_munge_buffer(plain);
+				free_munge_buffer(bytes);
+				return -1;
+			}
+			// Hash what we just wrote, if we were asked to
+			if (output_sha256 != NULL) {
+				kt_sha256_update(output_sha256, bytes_read, bytes);
+			}
+		}
+		total += bytes_read;
+	}
+	free_munge_buffer(plain);
+	free_munge_buffer(bytes);
+	kt_stats_add(KT_STATS_BYTES_READ, total);
+	if (output != NULL) {
+		kt_stats_add(KT_STATS_BYTES_WRITTEN, total);
+	}
+	// NOTE: Without an output, we're just hashing
+	kt_stats_stop(output != NULL ? KT_STATS_MUNGE : KT_STATS_HASH, stats_start);
+	if (ferror(input) != 0) {
+		fprintf(stderr, "Error munging, cannot read input: %s.\n", strerror(errno));
+		return -1;
+	}
+	if (output_md5 != NULL) {
+		md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+		base16_encode_update(output_md5, MD5_DIGEST_SIZE, digest);
+	}
+
+	return 0;
+}
+
+// NOTE: Needs to match fnv1a() in tools/kindle_device_table.py
+static uint32_t
+    kt_device_name_hash(const char* name)
+{
+	uint32_t hash = 0x811C9DC5U;
+
+	for (const unsigned char* p = (const unsigned char*) name; *p != '\0'; p++) {
+		hash = (hash ^ (uint32_t) tolower(*p)) * 0x01000193U;
+	}
+	return hash;
+}
+
+// O(1) device code lookup in the generated device table. Returns NULL for unknown devices.
+const struct kt_device*
+    kt_device_lookup(Device dev)
+{
+	if ((unsigned int) dev > KT_DEVICE_MAX_CODE || kt_device_index[dev] == 0U) {
+		return NULL;
+	}
+	return &kt_devices[kt_device_index[dev] - 1U];
+}
+
+// Hashed (case-insensitive) lookup of a -d value in the generated device table. Returns NULL if there's no such name.
+// NOTE: This doesn't check unknown_only, that's up to the caller.
+const struct kt_device_alias*
+    kt_device_alias_lookup(const char* name)
+{
+	uint32_t slot = kt_device_name_hash(name) & (KT_DEVICE_HASH_SIZE - 1U);
+
+	while (kt_device_hash[slot] != 0U) {
+		const struct kt_device_alias* alias = &kt_device_aliases[kt_device_hash[slot] - 1U];
+		if (strcasecmp(alias->name, name) == 0) {
+			return alias;
+		}
+		slot = (slot + 1U) & (KT_DEVICE_HASH_SIZE - 1U);
+	}
+	return NULL;
+}
+
+// Store the devices behind alias in devices (which needs room for alias->count devices), in header order.
+// Returns the amount of devices stored, which depends on KT_WITH_UNKNOWN_DEVCODES.
+unsigned int
+    kt_device_alias_expand(const struct kt_device_alias* alias, Device* devices)
+{
+	unsigned int num_devices = 0U;
+
+	for (unsigned int i = alias->first; i < alias->first + alias->count; i++) {
+		if (!kt_device_sets[i].unknown || kt_with_unknown_devcodes) {
+			devices[num_devices++] = (Device) kt_device_sets[i].device;
+		}
+	}
+	return num_devices;
+}
+
+const char*
+    convert_device_id(Device dev)
+{
+	const struct kt_device* device = kt_device_lookup(dev);
+
+	return device ? device->name : "Unknown";
+}
+
+static const char* const kt_platform_names[] = {
+	[Plat_Unspecified] = "Unspecified",
+	[MarioDeprecated]  = "Mario (Deprecated)",
+	[Luigi]            = "Luigi",
+	[Banjo]            = "Banjo",
+	[Yoshi]            = "Yoshi",
+	[YoshimeProto]     = "Yoshime (Prototype)",
+	[Yoshime]          = "Yoshime (Yoshime3)",
+	[Wario]            = "Wario",
+	[Duet]             = "Duet",
+	[Heisenberg]       = "Heisenberg",
+	[Zelda]            = "Zelda",
+	[Rex]              = "Rex",
+	[Bellatrix]        = "Bellatrix",
+};
+
+bool
+    kt_platform_known(Platform plat)
+{
+	return (unsigned int) plat < sizeof(kt_platform_names) / sizeof(*kt_platform_names);
+}
+
+const char*
+    convert_platform_id(Platform plat)
+{
+	return kt_platform_known(plat) ? kt_platform_names[plat] : "Unknown";
+}
+
+static const char* const kt_board_names[] = {
+	[Board_Unspecified] = "Unspecified",
+	[Tequila]           = "Tequila",
+	[Whitney]           = "Whitney",
+};
+
+bool
+    kt_board_known(Board board)
+{
+	return (unsigned int) board < sizeof(kt_board_names) / sizeof(*kt_board_names) && kt_board_names[board] != NULL;
+}
+
+const char*
+    convert_board_id(Board board)
+{
+	return kt_board_known(board) ? kt_board_names[board] : "Unknown";
+}
+
+BundleVersion
+    get_bundle_version(const char magic_number[MAGIC_NUMBER_LENGTH])
+{
+	if (!memcmp(magic_number, "FB02", MAGIC_NUMBER_LENGTH) || !memcmp(magic_number, "FB01", MAGIC_NUMBER_LENGTH)) {
+		return RecoveryUpdate;
+	} else if (!memcmp(magic_number, "FB03", MAGIC_NUMBER_LENGTH)) {
+		return RecoveryUpdateV2;
+	} else if (!memcmp(magic_number, "FC02", MAGIC_NUMBER_LENGTH) ||
+		   !memcmp(magic_number, "FD03", MAGIC_NUMBER_LENGTH)) {
+		return OTAUpdate;
+	} else if (!memcmp(magic_number, "FC04", MAGIC_NUMBER_LENGTH) ||
+		   !memcmp(magic_number, "FD04", MAGIC_NUMBER_LENGTH) ||
+		   !memcmp(magic_number, "FL01", MAGIC_NUMBER_LENGTH)) {
+		return OTAUpdateV2;
+	} else if (!memcmp(magic_number, "SP01", MAGIC_NUMBER_LENGTH)) {
+		return UpdateSignature;
+	} else if (!memcmp(magic_number, "\x1F\x8B\x08\x00", MAGIC_NUMBER_LENGTH)) {    // GZIP magic number
+		return UserDataPackage;
+	} else if (!memcmp(magic_number, "\x50\x4B\x03\x04", MAGIC_NUMBER_LENGTH)) {    // ZIP magic number
+		return AndroidUpdate;
+	} else {
+		return UnknownUpdate;
+	}
+}
+
+int
+    md5_sum(FILE* input, char output_string[BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE)])
+{
+	unsigned char  bytes[BUFFER_SIZE];
+	size_t         bytes_read;
+	struct md5_ctx md5;
+	uint8_t        digest[MD5_DIGEST_SIZE];
+	uint64_t       total       = 0U;
+	uint64_t       stats_start = kt_stats_start();
+
+	md5_init(&md5);
+	while ((bytes_read = fread(bytes, sizeof(unsigned char), BUFFER_SIZE, input)) > 0) {
+		md5_update(&md5, bytes_read, bytes);
+		total += bytes_read;
+	}
+	kt_stats_add(KT_STATS_BYTES_READ, total);
+	kt_stats_stop(KT_STATS_HASH, stats_start);
+	if (ferror(input) != 0) {
+		fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
+		return -1;
+	}
+	md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+	// And build the hex checksum the nettle way ;)
+	base16_encode_update(output_string, MD5_DIGEST_SIZE, digest);
+
+	return 0;
+}
+
+static const char* const kt_stats_phase_names[KT_STATS_NUM_PHASES] = {
+	[KT_STATS_WALK] = "walk",   [KT_STATS_COMPRESS] = "compress", [KT_STATS_HASH] = "hash",
+	[KT_STATS_SIGN] = "sign",   [KT_STATS_MUNGE] = "munge",       [KT_STATS_COPY] = "copy",
+	[KT_STATS_EXTRACT] = "extract",
+};
+
+static const char* const kt_stats_counter_names[KT_STATS_NUM_COUNTERS] = {
+	[KT_STATS_BYTES_READ] = "bytes_read", [KT_STATS_BYTES_WRITTEN] = "bytes_written",
+	[KT_STATS_TEMP_BYTES] = "temp_bytes", [KT_STATS_TEMP_SPILLED] = "temp_spilled",
+	[KT_STATS_FILES] = "files",           [KT_STATS_RSA_OPS] = "rsa_ops",
+};
+
+static uint64_t
+    kt_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+// Start collecting statistics (if json_filename is NULL, we'll print a summary to stderr).
+// The clock starts now, so this should be called before doing any actual work.
+void
+    kt_stats_enable(const char* json_filename)
+{
+	kt_stats.enabled       = true;
+	kt_stats.json_filename = json_filename;
+	kt_stats.start_ns      = kt_stats_now();
+}
+
+// Returns a timestamp to pass to kt_stats_stop, or 0 if we're not collecting anything.
+// NOTE: That's all it costs when disabled, so these can be sprinkled around liberally (just not in tight loops).
+uint64_t
+    kt_stats_start(void)
+{
+	if (!kt_stats.enabled) {
+		return 0U;
+	}
+	return kt_stats_now();
+}
+
+// Account the time elapsed since start to phase. Thread-safe.
+void
+    kt_stats_stop(enum kt_stats_phase phase, uint64_t start)
+{
+	if (!kt_stats.enabled || start == 0U) {
+		return;
+	}
+	__atomic_fetch_add(&kt_stats.phase_ns[phase], kt_stats_now() - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&kt_stats.phase_calls[phase], 1U, __ATOMIC_RELAXED);
+}
+
+// Thread-safe, too.
+void
+    kt_stats_add(enum kt_stats_counter counter, uint64_t value)
+{
+	if (!kt_stats.enabled) {
+		return;
+	}
+	__atomic_fetch_add(&kt_stats.counters[counter], value, __ATOMIC_RELAXED);
+}
+
+// Print a summary of what we collected to stderr, or dump it as JSON to kt_stats.json_filename.
+// Returns 0 on success (including when there's nothing to report), or -1 if we couldn't write the JSON file.
+int
+    kt_stats_report(void)
+{
+	FILE*    output;
+	uint64_t total_ns;
+	size_t   i;
+
+	if (!kt_stats.enabled) {
+		return 0;
+	}
+	total_ns = kt_stats_now() - kt_stats.start_ns;
+
+	if (kt_stats.json_filename == NULL) {
+		fprintf(stderr, "\nStatistics:\n");
+		fprintf(stderr, "  %-14s %10.3fs\n", "total", (double) total_ns / 1e9);
+		for (i = 0U; i < KT_STATS_NUM_PHASES; i++) {
+			if (kt_stats.phase_calls[i] == 0U) {
+				continue;
+			}
+			fprintf(stderr,
+				"  %-14s %10.3fs (%ju calls)\n",
+				kt_stats_phase_names[i],
+				(double) kt_stats.phase_ns[i] / 1e9,
+				(uintmax_t) kt_stats.phase_calls[i]);
+		}
+		for (i = 0U; i < KT_STATS_NUM_COUNTERS; i++) {
+			fprintf(stderr, "  %-14s %11ju\n", kt_stats_counter_names[i], (uintmax_t) kt_stats.counters[i]);
+		}
+		return 0;
+	}
+
+	if ((output = fopen(kt_stats.json_filename, "wb")) == NULL) {
+		fprintf(stderr, "Cannot open statistics file '%s': %s.\n", kt_stats.json_filename, strerror(errno));
+		return -1;
+	}
+	fprintf(output, "{\"total_seconds\":%.6f,\"phases\":{", (double) total_ns / 1e9);
+	for (i = 0U; i < KT_STATS_NUM_PHASES; i++) {
+		fprintf(output,
+			"%s\"%s\":{\"seconds\":%.6f,\"calls\":%ju}",
+			(i > 0U ? "," : ""),
+			kt_stats_phase_names[i],
+			(double) kt_stats.phase_ns[i] / 1e9,
+			(uintmax_t) kt_stats.phase_calls[i]);
+	}
+	fputs("}", output);
+	for (i = 0U; i < KT_STATS_NUM_COUNTERS; i++) {
+		fprintf(output, ",\"%s\":%ju", kt_stats_counter_names[i], (uintmax_t) kt_stats.counters[i]);
+	}
+	fputs("}\n", output);
+	if (fclose(output) != 0) {
+		fprintf(stderr, "Cannot write statistics file '%s': %s.\n", kt_stats.json_filename, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// How many CPUs we can throw work at
+unsigned int
+    kt_online_cpus(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	return (unsigned int) sysinfo.dwNumberOfProcessors;
+#else
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (ncpus > 0) ? (unsigned int) ncpus : 1U;
+#endif
+}
+
+// Parse a base 10 unsigned number for a switch: it has to be all there is to str, and no larger than max
+int
+    kt_parse_number(const char* str, uint64_t max, uint64_t* value)
+{
+	unsigned long long number;
+	char*              endptr;
+
+	// NOTE: strtoull skips leading whitespace, and happily negates whatever follows a minus sign, so, digits only.
+	if (!isdigit((unsigned char) str[0])) {
+		return -1;
+	}
+	errno  = 0;
+	number = strtoull(str, &endptr, 10);
+	if (errno != 0 || *endptr != '\0' || number > max) {
+		return -1;
+	}
+	*value = (uint64_t) number;
+	return 0;
+}
+
+// Parse a -j, --jobs switch (0 means one per online CPU)
+int
+    kt_parse_jobs(const char* str, unsigned int* jobs)
+{
+	uint64_t number;
+
+	if (kt_parse_number(str, KT_MAX_JOBS, &number) != 0) {
+		return -1;
+	}
+	*jobs = (number == 0U) ? kt_online_cpus() : (unsigned int) number;
+	return 0;
+}
+
+// Parse a size in MiB for a switch, and convert it to bytes
+int
+    kt_parse_mib(const char* str, uint64_t* bytes)
+{
+	uint64_t mib;
+
+	if (kt_parse_number(str, UINT64_MAX / (1024U * 1024U), &mib) != 0) {
+		return -1;
+	}
+	*bytes = mib * 1024U * 1024U;
+	return 0;
+}
+
+// Every allocation is aligned for any of our structs, and so is the data following a chunk's header
+#define KT_ARENA_ALIGN       (2U * sizeof(void*))
+#define KT_ARENA_HEADER_SIZE ((sizeof(struct kt_arena_chunk) + KT_ARENA_ALIGN - 1U) & ~(KT_ARENA_ALIGN - 1U))
+
+void*
+    kt_arena_alloc(struct kt_arena* arena, size_t size)
+{
+	struct kt_arena_chunk* chunk = arena->head;
+	unsigned char*         p;
+
+	size = (size + KT_ARENA_ALIGN - 1U) & ~(KT_ARENA_ALIGN - 1U);
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > KT_ARENA_CHUNK_SIZE ? size : KT_ARENA_CHUNK_SIZE;
+
+		if ((chunk = malloc(KT_ARENA_HEADER_SIZE + chunk_size)) == NULL) {
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0U;
+		// Oversized allocations get a chunk of their own, don't waste what's left of the current one
+		if (size > KT_ARENA_CHUNK_SIZE && arena->head != NULL) {
+			chunk->next       = arena->head->next;
+			arena->head->next = chunk;
+		} else {
+			chunk->next = arena->head;
+			arena->head = chunk;
+		}
+	}
+	p = (unsigned char*) chunk + KT_ARENA_HEADER_SIZE + chunk->used;
+	chunk->used += size;
+	memset(p, 0, size);
+
+	return p;
+}
+
+char*
+    kt_arena_strdup(struct kt_arena* arena, const char* str)
+{
+	size_t len = strlen(str) + 1U;    // Flawfinder: ignore
+	char*  dup;
+
+	if ((dup = kt_arena_alloc(arena, len)) == NULL) {
+		return NULL;
+	}
+	memcpy(dup, str, len);
+	return dup;
+}
+
+void
+    kt_arena_free(struct kt_arena* arena)
+{
+	struct kt_arena_chunk* chunk;
+
+	while ((chunk = arena->head) != NULL) {
+		arena->head = chunk->next;
+		free(chunk);
+	}
+}
+
+// A very basic worker pool: jobs are run in submission order by the first available thread.
+// NOTE: With less than two threads, we don't spawn anything, and jobs are simply run inline in kt_pool_submit.
+struct kt_pool_job
+{
+	void (*fn)(void*);
+	void*               arg;
+	struct kt_pool_job* next;
+};
+
+struct kt_pool
+{
+	pthread_mutex_t     lock;
+	pthread_cond_t      work;    // Signaled when a job is queued, or when we're tearing down
+	pthread_cond_t      idle;    // Signaled when the last pending job is done
+	struct kt_pool_job* head;
+	struct kt_pool_job* tail;
+	unsigned int        pending;    // Queued + running
+	bool                stop;
+	unsigned int        num_threads;
+	pthread_t*          threads;
+};
+
+static void*
+    kt_pool_worker(void* data)
+{
+	struct kt_pool*     pool = data;
+	struct kt_pool_job* job;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->head == NULL && !pool->stop) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->head == NULL) {
+			// We've been asked to stop, and there's nothing left to do
+			break;
+		}
+		job        = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0) {
+			pthread_cond_broadcast(&pool->idle);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct kt_pool*
+    kt_pool_new(unsigned int num_threads)
+{
+	struct kt_pool* pool;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for worker pool.\n");
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	if (num_threads < 2U) {
+		return pool;
+	}
+	if ((pool->threads = calloc(num_threads, sizeof(*pool->threads))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for worker pool.\n");
+		kt_pool_free(pool);
+		return NULL;
+	}
+	for (unsigned int i = 0U; i < num_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, kt_pool_worker, pool) != 0) {
+			// Make do with what we've got (possibly nothing, in which case we'll just run things inline)
+			fprintf(stderr, "Cannot spawn worker thread: %s.\n", strerror(errno));
+			break;
+		}
+		pool->num_threads++;
 	}
+
+	return pool;
 }
 
 int
-    md5_sum(FILE* input, char output_string[BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE)])
+    kt_pool_submit(struct kt_pool* pool, void (*fn)(void*), void* arg)
 {
-	unsigned char  bytes[BUFFER_SIZE];
-	size_t         bytes_read;
-	struct md5_ctx md5;
-	uint8_t        digest[MD5_DIGEST_SIZE];
+	struct kt_pool_job* job;
 
-	md5_init(&md5);
-	while ((bytes_read = fread(bytes, sizeof(unsigned char), BUFFER_SIZE, input)) > 0) {
-		md5_update(&md5, bytes_read, bytes);
+	if (pool->num_threads == 0U) {
+		fn(arg);
+		return 0;
 	}
-	if (ferror(input) != 0) {
-		fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
+
+	if ((job = malloc(sizeof(*job))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for worker job.\n");
 		return -1;
 	}
-	md5_digest(&md5, MD5_DIGEST_SIZE, digest);
-	// And build the hex checksum the nettle way ;)
-	base16_encode_update(output_string, MD5_DIGEST_SIZE, digest);
+	job->fn   = fn;
+	job->arg  = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail == NULL) {
+		pool->head = job;
+	} else {
+		pool->tail->next = job;
+	}
+	pool->tail = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
 
 	return 0;
 }
 
+// Wait until every job submitted so far is done
+void
+    kt_pool_wait(struct kt_pool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0U) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+    kt_pool_free(struct kt_pool* pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	// Let the workers drain the queue, then join them
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned int i = 0U; i < pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	free(pool->threads);
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+#ifndef KT_LIBRARY
 static int
     kindle_print_help(const char* prog_name)
 {
@@ -555,22 +1671,53 @@ static int
 	    "    Options:\n"
 	    "      -c, --stdout                Write to standard output, keeping original files unchanged.\n"
 	    "      -i, --info                  Just print the package information, no conversion done.\n"
+	    "      -l, --list                  Just list the members of the package to stdout, like tar -t, without writing anything to disk (implies --info, the payload's integrity is still checked).\n"
+	    "                                    With several packages, each member is prefixed with the name of its package.\n"
 	    "      -s, --sig                   OTA V2, Recovery V2 & Recovery FB02 with header rev 2 updates only. Extract the payload signature.\n"
 	    "      -k, --keep                  Don't delete the input package.\n"
 	    "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
 	    "      -w, --unwrap                Just unwrap the package, if it's wrapped in an UpdateSignature header (especially useful for userdata packages).\n"
+	    "      -j, --jobs <num>            Convert up to <num> packages at once (0 means one per CPU, defaults to 1).\n"
+	    "                                    Each package's information is only printed once it's done. Ignored with --stdout.\n"
+	    "          --stats[=<file>]        Print how long each phase took, and how much I/O it did, once we're done (as JSON to <file>, if set).\n"
+	    "          --mem-budget <MiB>      Keep temporary files in RAM until they grow past that size, then spill them to disk (0 means always on disk, defaults to 64).\n"
 	    "      \n"
 	    "  %s extract [options] <input> <output>\n"
 	    "    Extracts a Kindle update package to a directory.\n"
+	    "    If output is a single dash, the content of the files is written to stdout instead (in which case a failed integrity check can only be reported after the fact).\n"
 	    "    \n"
 	    "    Options:\n"
 	    "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+	    "      -j, --jobs <num>            Write files with up to <num> threads, while a single one keeps decompressing (0 means one per CPU, defaults to 1).\n"
+	    "          --fsync                 Make sure everything made it to the disk before we're done (in a single sync, once everything's written).\n"
+	    "          --only <pattern>        Only extract the members matching that pattern (can be repeated, a directory matches everything below it).\n"
+	    "          --no-check              Don't check the payload's integrity. If every --only pattern is a plain path, we then stop reading as soon as they've all been found.\n"
+	    "          --stats[=<file>]        Print how long each phase took, and how much I/O it did, once we're done (as JSON to <file>, if set).\n"
+	    "          --mem-budget <MiB>      Keep temporary files in RAM until they grow past that size, then spill them to disk (0 means always on disk, defaults to 64).\n"
+	    "      \n"
+	    "  %s scan [options] <file|dir>...\n"
+	    "    Prints the header information of every package as a single line of JSON, reading only the headers.\n"
+	    "    Directories are walked recursively, looking for .bin & .stgz files. Records are printed in the input order.\n"
+	    "    \n"
+	    "    Options:\n"
+	    "      -j, --jobs <num>            Scan up to <num> packages at once (0 means one per CPU, the default).\n"
+	    "      \n"
+	    "  %s verify [options] <file|dir>...\n"
+	    "    Checks the signature & integrity of every package in a single pass over it, without writing anything to disk:\n"
+	    "    the UpdateSignature envelope, the payload's MD5, every sigfile, and every line of the bundle index.\n"
+	    "    Directories are walked recursively, looking for .bin & .stgz files. Prints a line per package, in the input order: OK, or FAILED followed by what didn't check out.\n"
+	    "    \n"
+	    "    Options:\n"
+	    "      -k, --key <file>            Check the signatures against that PEM key (a private key, or just its public half). Defaults to our own key.\n"
+	    "      -j, --jobs <num>            Verify up to <num> packages at once (0 means one per CPU, the default).\n"
+	    "          --stats[=<file>]        Print how long each phase took, and how much I/O it did, once we're done (as JSON to <file>, if set).\n"
 	    "      \n"
-	    "  %s create <type> <devices> [options] <dir|file>... [ <output> ]\n"
+	    "  %s create <type> <devices> [options] <dir|file|->... [ <output> ]\n"
 	    "    Creates a Kindle update package.\n"
 	    "    You should be able to throw a mix of files & directories as input without trouble.\n"
 	    "    Just keep in mind that by default, if you feed it absolute paths, it will archive absolute paths, which usually isn't what you want!\n"
 	    "    If input is a single gzipped tarball (\".tgz\" or \".tar.gz\") file, we assume it is properly packaged (bundlefile & sigfile), and will only convert it to an update.\n"
+	    "    If an input is a single dash, we read a tar (or tar.gz) stream from standard input, and package its contents like we would a directory.\n"
 	    "    Output should be a file with the extension \".bin\", if it is not provided, or if it's a single dash, outputs to standard output.\n"
 	    "    In case of OTA updates, all files with the extension \".ffs\" or \".sh\" will be treated as update scripts.\n"
 	    "    \n"
@@ -745,13 +1892,52 @@ static int
 	    "      -C, --legacy                Emulate the behaviour of yifanlu's KindleTool regarding directories. By default, we behave like tar:\n"
 	    "                                    every path passed on the commandline is stored as-is in the archive. This switch changes that, and store paths\n"
 	    "                                    relative to the path passed on the commandline, like if we had chdir'ed into it.\n"
+	    "      -j, --jobs <num>            Sign the payload files & compress the intermediate archive with <num> threads\n"
+	    "                                    (0 means one per CPU, defaults to 1). With more than one, reading the input ahead of time,\n"
+	    "                                    compressing & writing the archive all happen at the same time.\n"
+	    "      -z, --compression-level <level>\n"
+	    "                                  Compress the intermediate archive at that gzip level (0-9, defaults to 6).\n"
+	    "      -V, --variants <file>       Build one package per line of <file> out of the same payload. Each line is an output filename, followed by\n"
+	    "                                    the header switches (-d, -b, -s, -t, -1, -2, -m, -p, -B, -h, -c, -o, -r, -x) that differ from the commandline.\n"
+	    "                                    The first -d on a line replaces the commandline's devices. No output is expected on the commandline.\n"
+	    "                                    If any of them fails, none of them are kept.\n"
+	    "      -K, --sig-cache <dir>       Keep the payload files signatures in <dir>, and reuse them in later builds if the files and key didn't change.\n"
+	    "                                    <dir> can safely be shared by concurrent builds.\n"
+	    "      -S, --sig-cache-size <MiB>  Evict the least recently used signatures once the cache grows past that size (defaults to 64).\n"
+	    "      -I, --incremental <file>    Copy the files that didn't change since the previous build <file> (either the package itself,\n"
+	    "                                    or its intermediate archive) straight from it, along with their signatures, without reading\n"
+	    "                                    or signing them again. It has to be signed with the same key. NOTE: Like make, this trusts\n"
+	    "                                    the size & mtime: a file edited in place without changing either ships its old contents.\n"
+	    "          --delta-from <old>      Only package what was added or changed (by content) since <old>, an older copy of the input directory,\n"
+	    "                                    a package, or its intermediate archive. Scripts always make it in, and a generated\n"
+	    "                                    kindletool_delta_cleanup.sh removes what's gone from <root> (see --delta-root).\n"
+	    "                                    Use -s & -t to make the package apply to <old>'s revision only.\n"
+	    "          --delta-root <root>     Where the input directory ends up on the device (an absolute path), mandatory with --delta-from.\n"
+	    "          --stats[=<file>]        Print how long each phase took, and how much I/O it did, once we're done (as JSON to <file>, if set).\n"
+	    "          --mem-budget <MiB>      Keep temporary files in RAM until they grow past that size, then spill them to disk (0 means always on disk, defaults to 64).\n"
+	    "      \n"
+	    "  %s serve [options] <socket>\n"
+	    "    Listen on a Unix socket, and run create, convert, extract, scan, verify, md & dm jobs on demand, each in its own process.\n"
+	    "    A job is sent as a list of NUL-terminated strings: the working directory, the command & its arguments, then an empty string.\n"
+	    "    Each job gets a single line of JSON back: {\"status\":<exit status>,\"stdout\":\"<base64>\",\"stderr\":\"<text>\"}.\n"
+	    "    \n"
+	    "    Options:\n"
+	    "      -j, --jobs <num>            Run up to <num> jobs at once (0 means one per CPU, the default).\n"
+	    "      -k, --key <file>            Parse that PEM key right away, and keep it around for the jobs that use it via -k.\n"
 	    "      \n"
-	    "  %s info <serialno>\n"
+	    "  %s info [options] <serialno>\n"
 	    "    Get the default root password.\n"
 	    "    Unless you changed your password manually, the first password shown will be the right one.\n"
 	    "    (The Kindle defaults to DES hashed passwords, which are truncated to 8 characters).\n"
 	    "    If you're looking for the recovery MMC export password, that's the second one.\n"
 	    "    \n"
+	    "    Options:\n"
+	    "      -b, --batch <file|->        Instead of a single serial number, read one per line from <file> (or stdin, for -), blank lines & lines starting with a # are skipped.\n"
+	    "                                    Prints a record per serial number to stdout, in the input order: its device, platform & passwords, or what was wrong with it.\n"
+	    "                                    Records are CSV, with a header line, unless --json is set.\n"
+	    "          --json                  With --batch, print a line of JSON per serial number instead.\n"
+	    "      -j, --jobs <num>            With --batch, process up to <num> chunks of serial numbers at once (0 means one per CPU, the default).\n"
+	    "      \n"
 	    "  %s version\n"
 	    "    Show some info about this KindleTool build.\n"
 	    "    \n"
@@ -761,7 +1947,12 @@ static int
 	    "Notices:\n"
 	    "  1.  If the variable KT_WITH_UNKNOWN_DEVCODES is set in your environment (no matter the value), some device checks will be relaxed with the create command.\n"
 	    "  2.  Updates with meta-strings will probably fail to run when passed to 'Update Your Kindle'.\n"
-	    "  3.  Currently, even though OTA V2 supports updates that run on multiple devices, it is not possible to create an update package that will run on both FW 4.x (Kindle 4) and FW 5.x (Basically everything since the Kindle Touch).\n",
+	    "  3.  Currently, even though OTA V2 supports updates that run on multiple devices, it is not possible to create an update package that will run on both FW 4.x (Kindle 4) and FW 5.x (Basically everything since the Kindle Touch).\n"
+	    "  4.  If the variable KT_STATS is set in your environment, every command behaves as if it had been passed --stats (or --stats=<value>, if its value isn't empty).\n"
+	    "  5.  If the variable KT_NO_HASH_ACCEL is set in your environment (no matter the value), hashing sticks to nettle's generic code, instead of using the fastest SHA-256 & MD5 implementations your CPU supports (the version command tells you which ones those are).\n",
+	    prog_name,
+	    prog_name,
+	    prog_name,
 	    prog_name,
 	    prog_name,
 	    prog_name,
@@ -776,6 +1967,8 @@ static int
 static int
     kindle_print_version(const char* prog_name)
 {
+	char hash_backend[128];
+
 	printf("%s (KindleTool) %s built by %s with ", prog_name, KT_VERSION, KT_USERATHOST);
 #ifdef __clang__
 	printf("Clang %s ", __clang_version__);
@@ -786,6 +1979,8 @@ static int
 	printf(
 	    "& nettle %s\n",
 	    NETTLE_VERSION);    // NOTE: This is completely custom, I couldn't find a way to get this info at buildtime in a saner way...
+	kt_hash_describe(hash_backend, sizeof(hash_backend));
+	printf("Hashing: %s\n", hash_backend);
 	return 0;
 }
 
@@ -859,104 +2054,705 @@ static int
 	return 0;
 }
 
+// Everything we know about a single S/N (c.f., kindle_serial_info)
+struct kt_serial_info
+{
+	char     input[4U * SERIAL_NO_LENGTH + 1U];    // What we were given, possibly truncated
+	char     serial_no[SERIAL_NO_LENGTH + 1U];     // Uppercased, and LF terminated, since that's what gets hashed
+	Device   device;
+	Platform platform;
+	char     root_pw[5U + 3U + 1U];
+	char     recovery_pw[5U + 4U + 1U];
+	char     error[BUFFER_SIZE];
+	bool     fail;
+};
+
+// How many S/Ns info --batch reads in one go, and how many of those each of our worker threads handles at a time
+#define KT_INFO_BATCH_SIZE  4096U
+#define KT_INFO_BATCH_SLICE 256U
+
+struct kt_serial_slice
+{
+	struct kt_serial_info* infos;
+	unsigned int           count;
+};
+
+// Compute the device & default passwords for the S/N in info->input.
+// Returns 0 on success, or -1 (with info->error set) if it doesn't make sense.
 static int
-    kindle_info_main(int argc, char* argv[])
+    kindle_serial_info(struct kt_serial_info* info)
 {
-	char           serial_no[SERIAL_NO_LENGTH + 1] = { 0 };    // Leave an extra space for the LF...
 	struct md5_ctx md5;
 	uint8_t        digest[MD5_DIGEST_SIZE];
 	char           hash[BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE)];
-	char           device_code[3 + 1] = { 0 };
-	Device         device;
-	unsigned int   i;
+	char                    device_code[3 + 1] = { 0 };
+	const struct kt_device* device;
+	const char*             pw_base;
+	unsigned int            i;
 
-	// Skip command
-	argv++;
-	argc--;
-	if (argc < 1) {
-		fprintf(stderr, "Missing argument. You must pass a serial number.\n");
-		return -1;
-	}
-	// Don't manipulate argv directly, make a copy of it first...
-	strncpy(serial_no, argv[0], SERIAL_NO_LENGTH);    // Flawfinder: ignore
+	info->fail = true;
 	// Flawfinder: ignore
-	if (strlen(serial_no) < SERIAL_NO_LENGTH || strlen(argv[0]) > SERIAL_NO_LENGTH) {
-		fprintf(stderr,
-			"Serial number must be composed of exactly 16 characters (without spaces). For example: %s\n",
-			"B0NNXXXXXXXXXXXX");
+	if (strlen(info->input) != SERIAL_NO_LENGTH) {
+		snprintf(info->error,
+			 sizeof(info->error),
+			 "Serial number must be composed of exactly 16 characters (without spaces). For example: %s",
+			 "B0NNXXXXXXXXXXXX");
 		return -1;
 	}
 	// Make it fully uppercase
 	for (i = 0; i < SERIAL_NO_LENGTH; i++) {
-		if (islower((int) serial_no[i])) {
-			serial_no[i] = (char) toupper((int) serial_no[i]);
-		}
+		info->serial_no[i] = (char) toupper((int) (unsigned char) info->input[i]);
 	}
 	// We need to terminate the string with a LF, no matter the system (probably to match the procfs usid format)...
-	serial_no[SERIAL_NO_LENGTH] = '\xA';
+	info->serial_no[SERIAL_NO_LENGTH] = '\xA';
 	// The root password is based on the MD5 hash of the S/N, so, hash it first.
 	md5_init(&md5);
-	md5_update(&md5, SERIAL_NO_LENGTH + 1, (uint8_t*) serial_no);
+	md5_update(&md5, SERIAL_NO_LENGTH + 1, (uint8_t*) info->serial_no);
 	md5_digest(&md5, MD5_DIGEST_SIZE, digest);
 	base16_encode_update(hash, MD5_DIGEST_SIZE, digest);
 
 	// And finally, do the device dance...
 	// NOTE: If the S/N starts with B or 9, assume it's an older device with an hexadecimal device code
-	if (serial_no[0] == 'B' || serial_no[0] == '9') {
+	if (info->serial_no[0] == 'B' || info->serial_no[0] == '9') {
 		// NOTE: Slice the bracketed section out of the S/N: B0[17]NNNNNNNNNNNN
-		snprintf(device_code, 2 + 1, "%.*s", 2, serial_no + 2);
+		snprintf(device_code, 2 + 1, "%.*s", 2, info->serial_no + 2);
 		// It's in hex, easy peasy.
-		device = (Device) strtoul(device_code, NULL, 16);
-		if (strcmp(convert_device_id(device), "Unknown") == 0) {
-			fprintf(stderr, "Unknown device %s (0x%02X).\n", device_code, device);
+		info->device = (Device) strtoul(device_code, NULL, 16);
+		if ((device = kt_device_lookup(info->device)) == NULL) {
+			snprintf(info->error, sizeof(info->error), "Unknown device %s (0x%02X).", device_code, info->device);
 			return -1;
 		}
 	} else {
 		// Otherwise, assume it's the new base32-ish format (so far, all of those S/N start with a 'G').
 		// In use since the PW3.
 		// NOTE: Slice the bracketed section out of the S/N: (G09[0G1]NNNNNNNNNN)
-		snprintf(device_code, 3 + 1, "%.*s", 3, serial_no + 3);
+		snprintf(device_code, 3 + 1, "%.*s", 3, info->serial_no + 3);
 		// (these ones are encoded in a slightly custom base 32)
-		device = (Device) from_base(device_code, 32);
-		if (strcmp(convert_device_id(device), "Unknown") == 0) {
-			fprintf(stderr, "Unknown device %s (0x%03X).\n", device_code, device);
+		info->device = (Device) from_base(device_code, 32);
+		if ((device = kt_device_lookup(info->device)) == NULL) {
+			snprintf(info->error, sizeof(info->error), "Unknown device %s (0x%03X).", device_code, info->device);
 			return -1;
 		}
 	}
+	info->platform = device->platform;
 	// Handle the Wario (>= PW2) passwords while we're at it... Thanks to npoland for this one ;).
-	// NOTE: Remember to check if this is still sane w/ kindle_model_sort.py when new stuff comes out!
-	if (device == KindleVoyageWiFi || device == KindlePaperWhite2WiFi4GBInternational ||
-	    device >= KindleVoyageWiFi3GJapan) {
-		fprintf(stderr, "Platform is Wario or newer [%s]\n", convert_device_id(device));
-		fprintf(stderr,
-			"Root PW            %s%.*s\nRecovery PW        %s%.*s\n",
-			"fiona",
-			3,
-			&hash[13],
-			"fiona",
-			4,
-			&hash[13]);
+	if (info->platform >= Wario) {
+		pw_base = &hash[13];
 	} else {
-		fprintf(stderr, "Platform is pre Wario [%s]\n", convert_device_id(device));
-		fprintf(stderr,
-			"Root PW            %s%.*s\nRecovery PW        %s%.*s\n",
-			"fiona",
-			3,
-			&hash[7],
-			"fiona",
-			4,
-			&hash[7]);
+		pw_base = &hash[7];
 	}
 	// Default root passwords are DES hashed, so we only care about the first 8 chars. On the other hand,
 	// the recovery MMC export option expects a 9 chars password, so, provide both...
+	snprintf(info->root_pw, sizeof(info->root_pw), "%s%.*s", "fiona", 3, pw_base);
+	snprintf(info->recovery_pw, sizeof(info->recovery_pw), "%s%.*s", "fiona", 4, pw_base);
+	info->fail = false;
+	return 0;
+}
+
+// Run kindle_serial_info over a slice of a batch. This runs on a worker thread.
+static void
+    kindle_serial_info_job(void* data)
+{
+	struct kt_serial_slice* slice = data;
+
+	for (unsigned int i = 0U; i < slice->count; i++) {
+		kindle_serial_info(&slice->infos[i]);
+	}
+}
+
+// Print a field of an info --batch record, either as a quoted, escaped, JSON string, or as a CSV field,
+// which only gets quoted (RFC 4180 style) when it has to be.
+static void
+    kt_info_write_field(FILE* output, const char* str, bool json)
+{
+	if (!json) {
+		if (strpbrk(str, ",\"\r\n") == NULL) {
+			fputs(str, output);
+			return;
+		}
+		fputc('"', output);
+		for (; *str != '\0'; str++) {
+			if (*str == '"') {
+				fputc('"', output);
+			}
+			fputc(*str, output);
+		}
+		fputc('"', output);
+		return;
+	}
+	kt_json_write_string(output, str, strlen(str));    // Flawfinder: ignore
+}
+
+static void
+    kt_info_write_record(FILE* output, const struct kt_serial_info* info, bool json)
+{
+	char serial_no[SERIAL_NO_LENGTH + 1U];
+	char device_id[16];
+
+	if (info->fail) {
+		if (json) {
+			fputs("{\"serial\":", output);
+			kt_info_write_field(output, info->input, true);
+			fputs(",\"error\":", output);
+			kt_info_write_field(output, info->error, true);
+			fputs("}\n", output);
+		} else {
+			kt_info_write_field(output, info->input, false);
+			fputs(",,,,,,", output);
+			kt_info_write_field(output, info->error, false);
+			fputc('\n', output);
+		}
+		return;
+	}
+	// NOTE: Print the S/N as we hashed it, minus the LF
+	snprintf(serial_no, sizeof(serial_no), "%.*s", SERIAL_NO_LENGTH, info->serial_no);
+	snprintf(device_id, sizeof(device_id), "0x%02X", info->device);
+	if (json) {
+		fputs("{\"serial\":", output);
+		kt_info_write_field(output, serial_no, true);
+		fputs(",\"device_id\":", output);
+		kt_info_write_field(output, device_id, true);
+		fputs(",\"device\":", output);
+		kt_info_write_field(output, convert_device_id(info->device), true);
+		fputs(",\"platform\":", output);
+		kt_info_write_field(output, convert_platform_id(info->platform), true);
+		fputs(",\"root_pw\":", output);
+		kt_info_write_field(output, info->root_pw, true);
+		fputs(",\"recovery_pw\":", output);
+		kt_info_write_field(output, info->recovery_pw, true);
+		fputs("}\n", output);
+	} else {
+		kt_info_write_field(output, serial_no, false);
+		fputc(',', output);
+		kt_info_write_field(output, device_id, false);
+		fputc(',', output);
+		kt_info_write_field(output, convert_device_id(info->device), false);
+		fputc(',', output);
+		kt_info_write_field(output, convert_platform_id(info->platform), false);
+		fprintf(output, ",%s,%s,\n", info->root_pw, info->recovery_pw);
+	}
+}
+
+// Read a S/N per line from input (blank lines & lines starting with a # are skipped),
+// and print a record for each of them to stdout, in the input order. Returns -1 if any of them failed.
+static int
+    kindle_info_batch(FILE* input, bool json, unsigned int jobs)
+{
+	struct kt_serial_info* infos;
+	struct kt_serial_slice slices[KT_INFO_BATCH_SIZE / KT_INFO_BATCH_SLICE];
+	struct kt_pool*        pool;
+	char                   line[BUFFER_SIZE];
+	unsigned int           count;
+	unsigned int           num_slices;
+	bool                   eof  = false;
+	bool                   fail = false;
+
+	if ((infos = calloc(KT_INFO_BATCH_SIZE, sizeof(*infos))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory for serial numbers.\n");
+		return -1;
+	}
+	if ((pool = kt_pool_new(jobs)) == NULL) {
+		free(infos);
+		return -1;
+	}
+	if (!json) {
+		fprintf(stdout, "serial,device_id,device,platform,root_pw,recovery_pw,error\n");
+	}
+	while (!eof) {
+		// Read a batch worth of S/Ns...
+		count = 0U;
+		while (count < KT_INFO_BATCH_SIZE) {
+			char*  start;
+			size_t len;
+
+			if (fgets(line, sizeof(line), input) == NULL) {
+				eof = true;
+				break;
+			}
+			len = strlen(line);    // Flawfinder: ignore
+			// NOTE: Drop the rest of an overlong line, it won't be a valid S/N anyway
+			if (len > 0U && line[len - 1U] != '\n') {
+				int c;
+
+				while ((c = fgetc(input)) != EOF && c != '\n') {
+					;
+				}
+			}
+			// Trim it
+			while (len > 0U && isspace((int) (unsigned char) line[len - 1U])) {
+				line[--len] = '\0';
+			}
+			for (start = line; isspace((int) (unsigned char) *start); start++) {
+				;
+			}
+			if (*start == '\0' || *start == '#') {
+				continue;
+			}
+			snprintf(infos[count].input, sizeof(infos[count].input), "%s", start);
+			count++;
+		}
+		if (count == 0U) {
+			break;
+		}
+		// ...crunch it...
+		num_slices = 0U;
+		for (unsigned int i = 0U; i < count; i += KT_INFO_BATCH_SLICE) {
+			slices[num_slices].infos = &infos[i];
+			slices[num_slices].count = (count - i < KT_INFO_BATCH_SLICE) ? count - i : KT_INFO_BATCH_SLICE;
+			if (kt_pool_submit(pool, kindle_serial_info_job, &slices[num_slices]) != 0) {
+				kindle_serial_info_job(&slices[num_slices]);
+			}
+			num_slices++;
+		}
+		kt_pool_wait(pool);
+		// ...and print it, in order
+		for (unsigned int i = 0U; i < count; i++) {
+			kt_info_write_record(stdout, &infos[i], json);
+			if (infos[i].fail) {
+				fail = true;
+			}
+		}
+	}
+	if (ferror(input)) {
+		fprintf(stderr, "Cannot read serial numbers: %s.\n", strerror(errno));
+		fail = true;
+	}
+	kt_pool_free(pool);
+	free(infos);
+	fflush(stdout);
+
+	if (fail) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+static int
+    kindle_info_main(int argc, char* argv[])
+{
+	int                        opt;
+	int                        opt_index;
+	static const struct option opts[] = { { "batch", required_argument, NULL, 'b' },
+					      { "json", no_argument, NULL, 'J' },
+					      { "jobs", required_argument, NULL, 'j' },
+					      { NULL, 0, NULL, 0 } };
+	const char*                batch_filename = NULL;
+	bool                       json           = false;
+	unsigned int               jobs           = kt_online_cpus();
+	FILE*                      input;
+	struct kt_serial_info      info = { 0 };
+	int                        ret;
+
+	while ((opt = getopt_long(argc, argv, "b:j:", opts, &opt_index)) != -1) {
+		switch (opt) {
+			case 'b':
+				batch_filename = optarg;
+				break;
+			case 'J':
+				json = true;
+				break;
+			case 'j':
+				if (kt_parse_jobs(optarg, &jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					return -1;
+				}
+				break;
+			case ':':
+				fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+				return -1;
+				break;
+			case '?':
+				fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+				return -1;
+				break;
+			default:
+				fprintf(stderr, "?? Unknown option code 0%o ??\n", (unsigned int) opt);
+				return -1;
+				break;
+		}
+	}
+
+	if (batch_filename != NULL) {
+		if (optind < argc) {
+			fprintf(stderr, "You cannot pass a serial number along with --batch.\n");
+			return -1;
+		}
+		if (strcmp(batch_filename, "-") == 0) {
+			return kindle_info_batch(stdin, json, jobs);
+		}
+		if ((input = fopen(batch_filename, "rb")) == NULL) {
+			fprintf(stderr, "Cannot open serial numbers list '%s': %s.\n", batch_filename, strerror(errno));
+			return -1;
+		}
+		ret = kindle_info_batch(input, json, jobs);
+		fclose(input);
+		return ret;
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing argument. You must pass a serial number.\n");
+		return -1;
+	}
+	// Don't manipulate argv directly, make a copy of it first...
+	snprintf(info.input, sizeof(info.input), "%s", argv[optind]);
+	if (kindle_serial_info(&info) != 0) {
+		fprintf(stderr, "%s\n", info.error);
+		return -1;
+	}
+	if (info.platform >= Wario) {
+		fprintf(stderr, "Platform is Wario or newer [%s]\n", convert_device_id(info.device));
+	} else {
+		fprintf(stderr, "Platform is pre Wario [%s]\n", convert_device_id(info.device));
+	}
+	fprintf(stderr, "Root PW            %s\nRecovery PW        %s\n", info.root_pw, info.recovery_pw);
 	return 0;
 }
 
+static int kindle_run_command(const char*, int, char**);
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// Requests are tiny, don't let a client make us eat all the RAM
+#	define KT_SERVE_REQUEST_MAX (1024U * 1024U)
+
+static volatile sig_atomic_t kt_serve_stop = 0;
+
+static void
+    kt_serve_stop_handler(int signum __attribute__((unused)))
+{
+	kt_serve_stop = 1;
+}
+
+// Dump the content of a file as a JSON string
+static void
+    kt_serve_write_json_string(FILE* output, FILE* input)
+{
+	char*  data  = NULL;
+	char*  grown;
+	size_t size  = 0U;
+	size_t alloc = 0U;
+	size_t len;
+
+	// NOTE: Slurp it whole, so that we don't split any UTF-8 sequence. It's only what a single job printed, anyway.
+	//       If we run out of memory, just send what we've got.
+	do {
+		if (size == alloc) {
+			if ((grown = realloc(data, alloc > 0U ? alloc * 2U : BUFFER_SIZE)) == NULL) {
+				break;
+			}
+			data  = grown;
+			alloc = alloc > 0U ? alloc * 2U : BUFFER_SIZE;
+		}
+		len = fread(data + size, sizeof(char), alloc - size, input);
+		size += len;
+	} while (len > 0U);
+	kt_json_write_string(output, data, size);
+	free(data);
+}
+
+// Dump the content of a file as a base64-encoded JSON string
+static void
+    kt_serve_write_json_base64(FILE* output, FILE* input)
+{
+	// NOTE: Every chunk but the last one is a multiple of 3 bytes, so they end up properly concatenated, without padding
+	uint8_t buff[3 * 1024];
+	char    encoded[BASE64_ENCODE_RAW_LENGTH(sizeof(buff))];
+	size_t  len;
+
+	fputc('"', output);
+	while ((len = fread(buff, sizeof(uint8_t), sizeof(buff), input)) > 0) {
+		base64_encode_raw(encoded, len, buff);
+		fwrite(encoded, sizeof(char), BASE64_ENCODE_RAW_LENGTH(len), output);
+	}
+	fputc('"', output);
+}
+
+// Run a single job, in a forked worker, with fd being the client's connection.
+// A request is a list of NUL-terminated strings: the working directory, followed by the command & its arguments,
+// ended by an empty string (or EOF). We reply with a single line of JSON, holding the exit status,
+// and what the command printed (stdout is base64-encoded, since it may very well be a package).
+static void
+    kt_serve_job(int fd, const char* prog_name)
+{
+	char*   request     = NULL;
+	size_t  request_len = 0U;
+	size_t  request_size;
+	ssize_t bytes_read;
+	char*   start;
+	char*   end;
+	size_t  len;
+	char**  job_argv = NULL;
+	int     job_argc = 0;
+	FILE*   job_stdout;
+	FILE*   job_stderr;
+	FILE*   reply;
+	int     null_fd;
+	int     status = -1;
+
+	// Read the whole request first
+	request_size = 64U * 1024U;
+	request      = malloc(request_size);
+	while (request != NULL && (request_len < 2U || request[request_len - 1U] != '\0' ||
+				   request[request_len - 2U] != '\0')) {
+		if (request_len == request_size) {
+			if (request_size >= KT_SERVE_REQUEST_MAX) {
+				break;
+			}
+			request_size *= 2U;
+			request = realloc(request, request_size);
+			continue;
+		}
+		bytes_read = read(fd, request + request_len, request_size - request_len);
+		if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			break;
+		}
+		request_len += (size_t) bytes_read;
+	}
+	// Split it
+	if (request != NULL) {
+		start = request;
+		end   = request + request_len;
+		while (start < end && (len = strnlen(start, (size_t) (end - start))) > 0U && start + len < end) {
+			job_argv             = realloc(job_argv, (size_t) (job_argc + 2) * sizeof(char*));
+			job_argv[job_argc++] = start;
+			start += len + 1U;
+		}
+	}
+
+	// Capture whatever the command prints
+	if ((job_stdout = tmpfile()) == NULL || (job_stderr = tmpfile()) == NULL) {
+		fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+		free(job_argv);
+		free(request);
+		return;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	dup2(fileno(job_stdout), STDOUT_FILENO);
+	dup2(fileno(job_stderr), STDERR_FILENO);
+	if ((null_fd = open("/dev/null", O_RDONLY)) != -1) {
+		dup2(null_fd, STDIN_FILENO);
+		close(null_fd);
+	}
+
+	if (job_argc > 1 && strncmp(job_argv[1], "--", 2) == 0) {
+		// Allow our commands to be passed in longform, like on the commandline
+		job_argv[1] += 2;
+	}
+	if (job_argc < 2) {
+		fprintf(stderr, "Invalid request: we need a working directory, and a command.\n");
+	} else if (strncmp(job_argv[1], "serve", 5) == 0) {
+		fprintf(stderr, "We're already serving!\n");
+	} else if (chdir(job_argv[0]) != 0) {
+		fprintf(stderr, "Cannot change working directory to '%s': %s.\n", job_argv[0], strerror(errno));
+	} else {
+		job_argv[job_argc] = NULL;
+		// Our commands expect a fresh getopt state
+		optind = 1;
+		// If KT_STATS was set, restart the clock for this job
+		if (kt_stats.enabled) {
+			kt_stats_enable(kt_stats.json_filename);
+		}
+		status = kindle_run_command(prog_name, job_argc - 1, job_argv + 1);
+		kt_stats_report();
+	}
+	fflush(stdout);
+	fflush(stderr);
+
+	// And send the results back
+	if ((reply = fdopen(fd, "wb")) != NULL) {
+		rewind(job_stdout);
+		rewind(job_stderr);
+		fprintf(reply, "{\"status\":%d,\"stdout\":", status);
+		kt_serve_write_json_base64(reply, job_stdout);
+		fputs(",\"stderr\":", reply);
+		kt_serve_write_json_string(reply, job_stderr);
+		fputs("}\n", reply);
+		fclose(reply);
+	}
+	fclose(job_stdout);
+	fclose(job_stderr);
+	free(job_argv);
+	free(request);
+}
+
+// Listen for jobs on a Unix socket, and run them in forked workers.
+// Since the workers are forked, they inherit everything we've already set up (tempdir, keys...).
+static int
+    kindle_serve_main(const char* prog_name, int argc, char* argv[])
+{
+	int                        opt;
+	int                        opt_index;
+	static const struct option opts[] = { { "jobs", required_argument, NULL, 'j' },
+					      { "key", required_argument, NULL, 'k' },
+					      { NULL, 0, NULL, 0 } };
+	unsigned int               jobs    = kt_online_cpus();
+	unsigned int               running = 0U;
+	const char*                socket_path;
+	struct sockaddr_un         addr;
+	struct sigaction           sa;
+	struct stat                st;
+	int                        fd;
+	int                        conn_fd;
+	pid_t                      pid;
+
+	while ((opt = getopt_long(argc, argv, "j:k:", opts, &opt_index)) != -1) {
+		switch (opt) {
+			case 'j':
+				// NOTE: 0 means one job per online CPU
+				if (kt_parse_jobs(optarg, &jobs) != 0) {
+					fprintf(stderr, "Invalid number of jobs (0-%u), input: %s\n", KT_MAX_JOBS, optarg);
+					return -1;
+				}
+				break;
+			case 'k':
+				if (nettle_rsa_privkey_preload(optarg) != EXIT_SUCCESS) {
+					fprintf(stderr, "Key '%s' cannot be loaded.\n", optarg);
+					return -1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Unknown option code 0%o\n", (unsigned int) opt);
+				return -1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "No socket specified! Pass a path to a Unix socket.\n");
+		return -1;
+	}
+	socket_path = argv[optind];
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	// Flawfinder: ignore
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long.\n", socket_path);
+		return -1;
+	}
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+	// Do the expensive stuff once and for all
+	kindle_create_preload();
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		fprintf(stderr, "Cannot create socket: %s.\n", strerror(errno));
+		return -1;
+	}
+	// Replace a stale socket, but nothing else
+	if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(socket_path);
+	}
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		fprintf(stderr, "Cannot listen on '%s': %s.\n", socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// Stop cleanly on SIGINT & SIGTERM, and don't die when a client goes away early
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = kt_serve_stop_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "Serving on '%s', running up to %u jobs at once.\n", socket_path, jobs);
+	while (!kt_serve_stop) {
+		// Reap finished jobs, and wait for one of them if we're running as many as we can
+		while (running > 0U && waitpid(-1, NULL, (running >= jobs) ? 0 : WNOHANG) > 0) {
+			running--;
+		}
+		if (kt_serve_stop || running >= jobs) {
+			continue;
+		}
+		if ((conn_fd = accept(fd, NULL, NULL)) == -1) {
+			if (errno != EINTR) {
+				fprintf(stderr, "Cannot accept connection: %s.\n", strerror(errno));
+			}
+			continue;
+		}
+		fflush(stdout);
+		fflush(stderr);
+		if ((pid = fork()) == 0) {
+			close(fd);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			kt_serve_job(conn_fd, prog_name);
+			_exit(0);
+		} else if (pid == -1) {
+			fprintf(stderr, "Cannot fork: %s.\n", strerror(errno));
+		} else {
+			running++;
+		}
+		close(conn_fd);
+	}
+
+	fprintf(stderr, "Waiting for %u pending jobs.\n", running);
+	close(fd);
+	unlink(socket_path);
+	while (running > 0U) {
+		if (waitpid(-1, NULL, 0) > 0) {
+			running--;
+		} else if (errno != EINTR) {
+			break;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+// Run a single command (argv[0]), either straight from main, or as a serve job
+static int
+    kindle_run_command(const char* prog_name, int argc, char* argv[])
+{
+	const char* cmd = argv[0];
+
+	if (strncmp(cmd, "md", 2) == 0) {
+		return kindle_obfuscate_main(argc, argv);
+	} else if (strncmp(cmd, "dm", 2) == 0) {
+		return kindle_deobfuscate_main(argc, argv);
+	} else if (strncmp(cmd, "convert", 7) == 0) {
+		return kindle_convert_main(argc, argv);
+	} else if (strncmp(cmd, "extract", 7) == 0) {
+		return kindle_extract_main(argc, argv);
+	} else if (strncmp(cmd, "scan", 4) == 0) {
+		return kindle_scan_main(argc, argv);
+	} else if (strncmp(cmd, "verify", 6) == 0) {
+		return kindle_verify_main(argc, argv);
+	} else if (strncmp(cmd, "create", 6) == 0) {
+		return kindle_create_main(argc, argv);
+	} else if (strncmp(cmd, "serve", 5) == 0) {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+		return kindle_serve_main(prog_name, argc, argv);
+#else
+		fprintf(stderr, "The serve command is not supported on this platform.\n");
+		return -1;
+#endif
+	} else if (strncmp(cmd, "info", 4) == 0) {
+		return kindle_info_main(argc, argv);
+	} else if (strncmp(cmd, "version", 7) == 0) {
+		return kindle_print_version(prog_name);
+	} else if (strncmp(cmd, "help", 4) == 0 || strncmp(cmd, "-help", 5) == 0 || strncmp(cmd, "-h", 2) == 0 ||
+		   strncmp(cmd, "-?", 2) == 0 || strncmp(cmd, "/?", 2) == 0 || strncmp(cmd, "/h", 2) == 0 ||
+		   strncmp(cmd, "/help", 2) == 0) {
+		return kindle_print_help(prog_name);
+	} else {
+		fprintf(stderr, "Unknown command '%s'!\n\n", cmd);
+		kindle_print_help(prog_name);
+		return 1;
+	}
+
+}
+
 int
     main(int argc, char* argv[])
 {
 	const char* prog_name;
-	const char* cmd;
+	const char* stats_filename;
+	int         ret;
 
 	// Do we want to use unknown devcodes?
 	// Very lame test, we only check if the var actually exists, we don't check the value...
@@ -966,6 +2762,11 @@ int
 		kt_with_unknown_devcodes = 1;
 	}
 
+	// Do we want some statistics? Same deal, but a non-empty value is where we dump them as JSON.
+	if ((stats_filename = getenv("KT_STATS")) != NULL) {
+		kt_stats_enable(*stats_filename != '\0' ? stats_filename : NULL);
+	}
+
 	// Try to use a sane temp directory, and remember it
 #if defined(_WIN32) && !defined(__CYGWIN__)
 	// Seed rand() so it isn't so utterly awful
@@ -1026,7 +2827,6 @@ int
 		kindle_print_help(prog_name);
 		exit(1);
 	}
-	cmd = argv[0];
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 	// Set binary mode properly on MingW, MSVCRT craps out when freopen'ing NULL ;)
@@ -1043,29 +2843,10 @@ int
 	}
 #endif
 
-	if (strncmp(cmd, "md", 2) == 0) {
-		return kindle_obfuscate_main(argc, argv);
-	} else if (strncmp(cmd, "dm", 2) == 0) {
-		return kindle_deobfuscate_main(argc, argv);
-	} else if (strncmp(cmd, "convert", 7) == 0) {
-		return kindle_convert_main(argc, argv);
-	} else if (strncmp(cmd, "extract", 7) == 0) {
-		return kindle_extract_main(argc, argv);
-	} else if (strncmp(cmd, "create", 6) == 0) {
-		return kindle_create_main(argc, argv);
-	} else if (strncmp(cmd, "info", 4) == 0) {
-		return kindle_info_main(argc, argv);
-	} else if (strncmp(cmd, "version", 7) == 0) {
-		return kindle_print_version(prog_name);
-	} else if (strncmp(cmd, "help", 4) == 0 || strncmp(cmd, "-help", 5) == 0 || strncmp(cmd, "-h", 2) == 0 ||
-		   strncmp(cmd, "-?", 2) == 0 || strncmp(cmd, "/?", 2) == 0 || strncmp(cmd, "/h", 2) == 0 ||
-		   strncmp(cmd, "/help", 2) == 0) {
-		return kindle_print_help(prog_name);
-	} else {
-		fprintf(stderr, "Unknown command '%s'!\n\n", cmd);
-		kindle_print_help(prog_name);
-		exit(1);
+	ret = kindle_run_command(prog_name, argc, argv);
+	if (kt_stats_report() != 0 && ret == 0) {
+		ret = -1;
 	}
-
-	return 1;
+	return ret;
 }
+#endif
@@ -36,7 +36,10 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,9 +49,20 @@
 #if !defined(_WIN32) && !defined(__CYGWIN__)
 #	include <pwd.h>
 #endif
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#	include <dirent.h>
+#	include <signal.h>
+#	include <sys/mman.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#	include <sys/wait.h>
+#	include <utime.h>
+#endif
 #include <time.h>
 #if defined(__linux__)
 #	include <linux/limits.h>
+#	include <sys/sendfile.h>
+#	include <sys/syscall.h>
 #endif
 #include <libgen.h>
 
@@ -62,8 +76,10 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <zlib.h>
 
 #include <gmp.h>
+#include <nettle/asn1.h>
 #include <nettle/base16.h>
 #include <nettle/base64.h>
 #include <nettle/buffer.h>
@@ -78,6 +94,9 @@
 #endif
 
 #define BUFFER_SIZE         1024
+// Chunk size (and alignment) of the munger/demunger buffers
+#define MUNGE_BUFFER_SIZE   (256 * 1024)
+#define MUNGE_BUFFER_ALIGN  64
 #define BLOCK_SIZE          64
 #define RECOVERY_BLOCK_SIZE 131072
 
@@ -133,15 +152,34 @@ FILE* kt_win_tmpfile(void);
 #	define KT_TMPDIR P_tmpdir
 #endif
 
+// Can we wrap our own callbacks in a stdio stream? (c.f., kt_tmpfile & libkindletool)
+// NOTE: The BSDs (and macOS) have funopen instead
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#	define KT_HAS_FUNOPEN
+#elif defined(__linux__) || defined(__CYGWIN__)
+#	define KT_HAS_FOPENCOOKIE
+#endif
+
+// Let the kernel do the copying when we're just passing bytes through (c.f., kt_input_copy).
+// NOTE: We go through syscall for copy_file_range, since it's only wrapped by fairly recent libcs.
+#if defined(__linux__)
+#	define KT_HAS_SENDFILE
+#	if defined(SYS_copy_file_range)
+#		define KT_HAS_COPY_FILE_RANGE
+#	endif
+#endif
+
+// How much memory our temporary files can use before spilling to kt_tempdir (c.f., kt_tmpfile & --mem-budget)
+#define KT_MEM_BUDGET_DEFAULT_MIB 64U
+
+// How many jobs a -j, --jobs switch can ask for (0 means one per online CPU)
+#define KT_MAX_JOBS 1024U
+
 // HOST_NAME_MAX is undefined on macOS, it instead kindly asks you to query _SC_HOST_NAME_MAX via sysconf()...
 #ifndef HOST_NAME_MAX
 #	define HOST_NAME_MAX 256
 #endif
 
-// Bundlefile status bitmasks
-#define BUNDLE_OPEN    1    // 1 << 0       (bit 0)
-#define BUNDLE_CREATED 2    // 1 << 1       (bit 1)
-
 // Version tag fallback
 #ifndef KT_VERSION
 #	define KT_VERSION "v1.6.5-GIT"
@@ -443,33 +481,209 @@ typedef struct
 	} data;
 } UpdateHeader;
 
+// Device look-up tables, generated by tools/kindle_device_table.py (cf. kindle_devices.h)
+struct kt_device
+{
+	uint16_t    device;
+	Platform    platform;
+	const char* name;
+};
+
+struct kt_device_set
+{
+	uint16_t device;
+	bool     unknown;    // Only included when KT_WITH_UNKNOWN_DEVCODES is set
+};
+
+// A -d value, be it a single device or an alias
+struct kt_device_alias
+{
+	const char* name;
+	char        magic_number[MAGIC_NUMBER_LENGTH + 1];    // Empty if it doesn't imply a specific bundle version
+	bool        unknown_only;                             // Only valid when KT_WITH_UNKNOWN_DEVCODES is set
+	uint16_t    first;                                    // Its devices, in kt_device_sets
+	uint16_t    count;
+};
+
+// A SHA-256 context that may go through something faster than nettle (c.f., hash.c).
+// Don't touch it directly, we only ever use one of the two halves, depending on what the CPU can do.
+struct kt_sha256_ctx
+{
+	struct sha256_ctx nettle;
+	uint32_t          state[SHA256_DIGEST_SIZE / 4U];
+	uint64_t          count;    // Blocks
+	unsigned int      index;    // Into block
+	uint8_t           block[SHA256_BLOCK_SIZE];
+};
+
+// Input abstraction for the package readers.
+// Regular files are mmap'ed (when we can), so that headers can be parsed in place,
+// and the payload can be read without going through stdio. Everything else (pipes, Windows) goes through stdio.
+struct kt_input
+{
+	FILE*                 file;
+	unsigned char*        map;    // NULL if we're going through stdio
+	size_t                size;
+	size_t                pos;
+	unsigned char*        scratch;    // Backing storage for kt_input_get when we're going through stdio
+	size_t                scratch_size;
+	uint64_t              consumed;    // How much we went through so far
+	struct kt_sha256_ctx* sha256;      // If set, fed everything we consume past hashed (c.f., verify)
+	uint64_t              hashed;
+};
+
+// Per-phase timing & I/O statistics (c.f., --stats & KT_STATS).
+// NOTE: Phases can nest, and they're summed over every thread, so they won't necessarily add up to the total.
+enum kt_stats_phase
+{
+	KT_STATS_WALK = 0U,    // Walking the input tree, and feeding it to the archive (create)
+	KT_STATS_COMPRESS,     // gzip compression, when we're the ones doing it (create -j)
+	KT_STATS_HASH,         // Standalone hashing passes
+	KT_STATS_SIGN,         // RSA signatures (and the hashing that goes with them)
+	KT_STATS_MUNGE,        // (De)munging the payload (and hashing it along the way)
+	KT_STATS_COPY,         // Plain copies (temp files, userdata tarballs, unmunged payloads)
+	KT_STATS_EXTRACT,      // Unpacking tarballs to disk (extract)
+	KT_STATS_NUM_PHASES
+};
+
+enum kt_stats_counter
+{
+	KT_STATS_BYTES_READ = 0U,
+	KT_STATS_BYTES_WRITTEN,
+	KT_STATS_TEMP_BYTES,    // Subset of the above that went to temporary files
+	KT_STATS_TEMP_SPILLED,  // Subset of the above that didn't fit in our memory budget, and went to kt_tempdir
+	KT_STATS_FILES,         // Files archived or extracted, and packages converted
+	KT_STATS_RSA_OPS,
+	KT_STATS_NUM_COUNTERS
+};
+
+struct kt_stats
+{
+	bool        enabled;
+	const char* json_filename;    // If set, we dump JSON there, instead of printing a summary to stderr
+	uint64_t    start_ns;
+	uint64_t    phase_ns[KT_STATS_NUM_PHASES];
+	uint64_t    phase_calls[KT_STATS_NUM_PHASES];
+	uint64_t    counters[KT_STATS_NUM_COUNTERS];
+};
+
+// A bump allocator, for piles of small allocations that all go away at the same time (f.g., per-file bookkeeping).
+// Allocations are zeroed, and never move. There's no way to free them one by one, kt_arena_free releases everything.
+// NOTE: Not thread-safe, but what it hands out can of course be shared.
+#define KT_ARENA_CHUNK_SIZE (256U * 1024U)
+struct kt_arena_chunk
+{
+	struct kt_arena_chunk* next;
+	size_t                 size;
+	size_t                 used;
+};
+
+struct kt_arena
+{
+	struct kt_arena_chunk* head;
+};
+
+// A single buffer to hash with kt_hash_batch
+struct kt_hash_job
+{
+	const uint8_t* data;
+	size_t         size;
+	uint8_t        md5[MD5_DIGEST_SIZE];
+	uint8_t        sha256[SHA256_DIGEST_SIZE];
+};
+
 // Ugly global. Used to cache the state of the KT_WITH_UNKNOWN_DEVCODES env var...
 // NOTE: While this looks like the ideal candidate to be a bool,
 //       we can't do that because we use its value in unsigned operations,
 //       and I can't be arsed to add a bunch of casts there (because for some mystical reason, bool is signed :?)
-extern unsigned int kt_with_unknown_devcodes;
+// NOTE: It's thread-local, so that libkindletool callers can each pick their own.
+extern __thread unsigned int kt_with_unknown_devcodes;
 
 // And another to store the tmpdir...
 extern char kt_tempdir[PATH_MAX];
 
+// And our statistics, which are only ever collected by the commandline frontend.
+extern struct kt_stats kt_stats;
+
+// And the memory budget of our temporary files, in bytes.
+extern uint64_t kt_mem_budget;
+
 uint32_t from_base(const char*, uint8_t);
 
 void          md(unsigned char*, size_t);
 void          dm(unsigned char*, size_t);
 int           munger(FILE*, FILE*, size_t, const bool);
 int           demunger(FILE*, FILE*, size_t, const bool);
+int           munger_md5(FILE*, FILE*, const bool, char*, struct kt_sha256_ctx*);
 const char*   convert_device_id(Device) __attribute__((const));
 const char*   convert_platform_id(Platform) __attribute__((const));
 const char*   convert_board_id(Board) __attribute__((const));
+bool          kt_platform_known(Platform) __attribute__((const));
+bool          kt_board_known(Board) __attribute__((const));
 BundleVersion get_bundle_version(const char*) __attribute__((pure));
 int           md5_sum(FILE*, char*);
 
+const struct kt_device*       kt_device_lookup(Device) __attribute__((const));
+const struct kt_device_alias* kt_device_alias_lookup(const char*) __attribute__((pure));
+unsigned int                  kt_device_alias_expand(const struct kt_device_alias*, Device*);
+
+void                 kt_input_open(struct kt_input*, FILE*);
+void                 kt_input_close(struct kt_input*);
+size_t               kt_input_read(struct kt_input*, void*, size_t);
+const unsigned char* kt_input_get(struct kt_input*, size_t);
+int                  kt_input_skip(struct kt_input*, off_t);
+bool                 kt_input_error(const struct kt_input*);
+int                  kt_input_copy(struct kt_input*, FILE*, const bool);
+
+int    kt_write_fd(int, const void*, size_t);
+size_t kt_utf8_sequence_length(const unsigned char*, size_t);
+void   kt_json_write_string(FILE*, const char*, size_t);
+FILE*  kt_tmpfile(void);
+
+void     kt_stats_enable(const char*);
+uint64_t kt_stats_start(void);
+void     kt_stats_stop(enum kt_stats_phase, uint64_t);
+void     kt_stats_add(enum kt_stats_counter, uint64_t);
+int      kt_stats_report(void);
+
+void* kt_arena_alloc(struct kt_arena*, size_t);
+char* kt_arena_strdup(struct kt_arena*, const char*);
+void  kt_arena_free(struct kt_arena*);
+
+void kt_sha256_init(struct kt_sha256_ctx*);
+void kt_sha256_update(struct kt_sha256_ctx*, size_t, const uint8_t*);
+void kt_sha256_digest(struct kt_sha256_ctx*, uint8_t*);
+void kt_hash_batch(struct kt_hash_job*, size_t);
+void kt_hash_describe(char*, size_t);
+
+unsigned int    kt_online_cpus(void);
+int             kt_parse_number(const char*, uint64_t, uint64_t*);
+int             kt_parse_jobs(const char*, unsigned int*);
+int             kt_parse_mib(const char*, uint64_t*);
+struct kt_pool* kt_pool_new(unsigned int);
+int             kt_pool_submit(struct kt_pool*, void (*)(void*), void*);
+void            kt_pool_wait(struct kt_pool*);
+void            kt_pool_free(struct kt_pool*);
+
+int kindle_convert_payload(FILE*, FILE*, FILE*, const bool);
 int kindle_convert_main(int, char**);
 
 int kindle_extract_main(int, char**);
 
-int kindle_create_main(int, char**);
+int kindle_scan_main(int, char**);
 
+int kindle_verify_main(int, char**);
+
+void kindle_create_preload(void);
+void kindle_create_default_pubkey(struct rsa_public_key*);
+int  kindle_create_payload(const char*, const char* const*, FILE*, FILE*, const bool);
+int  kindle_create_main(int, char**);
+
+void kt_rsa_private_key_copy(struct rsa_private_key*, const struct rsa_private_key*);
+#if !defined(_WIN32) || defined(__CYGWIN__)
+int nettle_rsa_privkey_preload(const char*);
+#endif
 int nettle_rsa_privkey_from_pem(const char*, struct rsa_private_key*);
+int nettle_rsa_pubkey_from_pem(const char*, struct rsa_public_key*);
 
 #endif
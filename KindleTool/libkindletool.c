@@ -0,0 +1,433 @@
+/*
+**  KindleTool, libkindletool.c
+**
+**  Copyright (C) 2011-2012  Yifan Lu
+**  Copyright (C) 2012-2020  NiLuJe
+**  Concept based on an original Python implementation by Igor Skochinsky & Jean-Yves Avenard,
+**    cf., http://www.mobileread.com/forums/showthread.php?t=63225
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// For fopencookie
+#if defined(__linux__) || defined(__CYGWIN__)
+#	ifndef _GNU_SOURCE
+#		define _GNU_SOURCE
+#	endif
+#endif
+
+#include "kindle_tool.h"
+#include "libkindletool.h"
+
+static ssize_t
+    kt_lib_buffer_read(void* opaque, void* buf, size_t len)
+{
+	struct kindletool_buffer* buffer = opaque;
+
+	if (buffer->pos >= buffer->size) {
+		return 0;
+	}
+	if (len > buffer->size - buffer->pos) {
+		len = buffer->size - buffer->pos;
+	}
+	memcpy(buf, buffer->data + buffer->pos, len);
+	buffer->pos += len;
+	return (ssize_t) len;
+}
+
+static ssize_t
+    kt_lib_buffer_write(void* opaque, const void* buf, size_t len)
+{
+	struct kindletool_buffer* buffer = opaque;
+	size_t                    end;
+
+	if (len > SIZE_MAX - buffer->pos || buffer->pos + len > SSIZE_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	end = buffer->pos + len;
+	if (end > buffer->capacity) {
+		size_t         capacity = (buffer->capacity > 0U) ? buffer->capacity : MUNGE_BUFFER_SIZE;
+		unsigned char* data;
+
+		while (capacity < end) {
+			capacity = (capacity > SIZE_MAX / 2U) ? end : capacity * 2U;
+		}
+		if ((data = realloc(buffer->data, capacity)) == NULL) {
+			return -1;
+		}
+		buffer->data     = data;
+		buffer->capacity = capacity;
+	}
+	// Don't leave garbage behind if we seeked past the end
+	if (buffer->pos > buffer->size) {
+		memset(buffer->data + buffer->size, 0, buffer->pos - buffer->size);
+	}
+	memcpy(buffer->data + buffer->pos, buf, len);
+	buffer->pos = end;
+	if (end > buffer->size) {
+		buffer->size = end;
+	}
+	return (ssize_t) len;
+}
+
+static int
+    kt_lib_buffer_seek(void* opaque, int64_t* offset, int whence)
+{
+	struct kindletool_buffer* buffer = opaque;
+	int64_t                   base;
+
+	switch (whence) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = (int64_t) buffer->pos;
+			break;
+		case SEEK_END:
+			base = (int64_t) buffer->size;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+			break;
+	}
+	if (*offset < -base || *offset > INT64_MAX - base || (uint64_t)(base + *offset) > SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	buffer->pos = (size_t)(base + *offset);
+	*offset     = base + *offset;
+	return 0;
+}
+
+void
+    kindletool_buffer_stream(struct kindletool_buffer* buffer, struct kindletool_stream* stream)
+{
+	stream->opaque = buffer;
+	stream->read   = kt_lib_buffer_read;
+	stream->write  = kt_lib_buffer_write;
+	stream->seek   = kt_lib_buffer_seek;
+}
+
+void
+    kindletool_buffer_free(struct kindletool_buffer* buffer)
+{
+	free(buffer->data);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+// Where the report goes when nobody's listening
+static ssize_t
+    kt_lib_discard_write(void* opaque __attribute__((unused)), const void* buf __attribute__((unused)), size_t len)
+{
+	return (ssize_t) len;
+}
+
+// Wrap a stream in a stdio one, so that the rest of the code doesn't have to know about it
+#if defined(KT_HAS_FOPENCOOKIE)
+static ssize_t
+    kt_lib_cookie_read(void* cookie, char* buf, size_t len)
+{
+	const struct kindletool_stream* stream = cookie;
+
+	return stream->read(stream->opaque, buf, len);
+}
+
+static ssize_t
+    kt_lib_cookie_write(void* cookie, const char* buf, size_t len)
+{
+	const struct kindletool_stream* stream = cookie;
+	ssize_t                         ret    = stream->write(stream->opaque, buf, len);
+
+	// NOTE: glibc expects 0 on error
+	return (ret < 0) ? 0 : ret;
+}
+
+static int
+    kt_lib_cookie_seek(void* cookie, off64_t* offset, int whence)
+{
+	const struct kindletool_stream* stream = cookie;
+	int64_t                         pos    = *offset;
+
+	if (stream->seek(stream->opaque, &pos, whence) != 0) {
+		return -1;
+	}
+	*offset = pos;
+	return 0;
+}
+#elif defined(KT_HAS_FUNOPEN)
+static int
+    kt_lib_cookie_read(void* cookie, char* buf, int len)
+{
+	const struct kindletool_stream* stream = cookie;
+
+	return (int) stream->read(stream->opaque, buf, (size_t) len);
+}
+
+static int
+    kt_lib_cookie_write(void* cookie, const char* buf, int len)
+{
+	const struct kindletool_stream* stream = cookie;
+
+	return (int) stream->write(stream->opaque, buf, (size_t) len);
+}
+
+static fpos_t
+    kt_lib_cookie_seek(void* cookie, fpos_t offset, int whence)
+{
+	const struct kindletool_stream* stream = cookie;
+	int64_t                         pos    = (int64_t) offset;
+
+	if (stream->seek(stream->opaque, &pos, whence) != 0) {
+		return -1;
+	}
+	return (fpos_t) pos;
+}
+#endif
+
+#if defined(KT_HAS_FOPENCOOKIE) || defined(KT_HAS_FUNOPEN)
+static int
+    kt_lib_cookie_close(void* cookie)
+{
+	free(cookie);
+	return 0;
+}
+#endif
+
+static FILE*
+    kt_lib_fopen(const struct kindletool_stream* stream, const char* mode)
+{
+#if defined(KT_HAS_FOPENCOOKIE) || defined(KT_HAS_FUNOPEN)
+	struct kindletool_stream* cookie;
+	FILE*                     file;
+
+	// Keep our own copy, the caller's may not outlive us
+	if ((cookie = malloc(sizeof(*cookie))) == NULL) {
+		fprintf(stderr, "Error allocating stream: %s.\n", strerror(errno));
+		return NULL;
+	}
+	*cookie = *stream;
+#	if defined(KT_HAS_FOPENCOOKIE)
+	cookie_io_functions_t funcs = { stream->read != NULL ? kt_lib_cookie_read : NULL,
+					stream->write != NULL ? kt_lib_cookie_write : NULL,
+					stream->seek != NULL ? kt_lib_cookie_seek : NULL,
+					kt_lib_cookie_close };
+
+	file = fopencookie(cookie, mode, funcs);
+#	else
+	file = funopen(cookie,
+		       stream->read != NULL ? kt_lib_cookie_read : NULL,
+		       stream->write != NULL ? kt_lib_cookie_write : NULL,
+		       stream->seek != NULL ? kt_lib_cookie_seek : NULL,
+		       kt_lib_cookie_close);
+	(void) mode;
+#	endif
+	if (file == NULL) {
+		fprintf(stderr, "Error opening stream: %s.\n", strerror(errno));
+		free(cookie);
+	}
+	return file;
+#else
+	(void) stream;
+	(void) mode;
+	fprintf(stderr, "libkindletool streams are not supported on this platform.\n");
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+// If the input can't seek, we slurp it into spool first
+static FILE*
+    kt_lib_open_input(const struct kindletool_stream* input, struct kindletool_buffer* spool)
+{
+	struct kindletool_stream stream;
+	unsigned char            buffer[BUFSIZ];
+	ssize_t                  count;
+
+	if (input->read == NULL) {
+		fprintf(stderr, "Input stream is not readable.\n");
+		return NULL;
+	}
+	if (input->seek != NULL) {
+		return kt_lib_fopen(input, "rb");
+	}
+
+	while ((count = input->read(input->opaque, buffer, sizeof(buffer))) > 0) {
+		if (kt_lib_buffer_write(spool, buffer, (size_t) count) < 0) {
+			fprintf(stderr, "Error buffering input stream: %s.\n", strerror(errno));
+			return NULL;
+		}
+	}
+	if (count < 0) {
+		fprintf(stderr, "Error reading input stream: %s.\n", strerror(errno));
+		return NULL;
+	}
+	spool->pos = 0U;
+	kindletool_buffer_stream(spool, &stream);
+	return kt_lib_fopen(&stream, "rb");
+}
+
+// Write what we spooled to output, once we know it's good
+static int
+    kt_lib_flush_spool(const struct kindletool_buffer* spool, const struct kindletool_stream* output)
+{
+	size_t  pos = 0U;
+	ssize_t count;
+
+	while (pos < spool->size) {
+		if ((count = output->write(output->opaque, spool->data + pos, spool->size - pos)) <= 0) {
+			fprintf(stderr, "Error writing to output stream: %s.\n", strerror(errno));
+			return -1;
+		}
+		pos += (size_t) count;
+	}
+	return 0;
+}
+
+static FILE*
+    kt_lib_open_report(const struct kindletool_ctx* ctx)
+{
+	static const struct kindletool_stream discard = { NULL, NULL, kt_lib_discard_write, NULL };
+
+	if (ctx->report != NULL && ctx->report->write != NULL) {
+		return kt_lib_fopen(ctx->report, "w");
+	}
+	return kt_lib_fopen(&discard, "w");
+}
+
+// NOTE: The tarball is always buffered in memory: we need to read it back to check its integrity,
+//       and that way, a package that fails the check never leaves half a tarball in output.
+static int
+    kt_lib_convert(const struct kindletool_ctx*    ctx,
+		   const struct kindletool_stream* input,
+		   const struct kindletool_stream* output)
+{
+	const unsigned int       with_unknown_devcodes = kt_with_unknown_devcodes;
+	struct kindletool_buffer in_spool              = { 0 };
+	struct kindletool_buffer out_spool             = { 0 };
+	struct kindletool_stream spool_stream;
+	FILE*                    in_file  = NULL;
+	FILE*                    out_file = NULL;
+	FILE*                    report   = NULL;
+	int                      ret      = -1;
+
+	kt_with_unknown_devcodes = ctx->with_unknown_devcodes;
+	if ((report = kt_lib_open_report(ctx)) == NULL) {
+		goto cleanup;
+	}
+	if ((in_file = kt_lib_open_input(input, &in_spool)) == NULL) {
+		goto cleanup;
+	}
+	if (output != NULL) {
+		if (output->write == NULL) {
+			fprintf(stderr, "Output stream is not writable.\n");
+			goto cleanup;
+		}
+		kindletool_buffer_stream(&out_spool, &spool_stream);
+		if ((out_file = kt_lib_fopen(&spool_stream, "w+b")) == NULL) {
+			goto cleanup;
+		}
+	}
+	ret = kindle_convert_payload(in_file, out_file, report, ctx->fake_sign);
+
+cleanup:
+	if (out_file != NULL) {
+		if (fclose(out_file) != 0) {
+			ret = -1;
+		}
+		if (ret == 0) {
+			ret = kt_lib_flush_spool(&out_spool, output);
+		}
+	}
+	if (in_file != NULL) {
+		fclose(in_file);
+	}
+	if (report != NULL && fclose(report) != 0) {
+		ret = -1;
+	}
+	kindletool_buffer_free(&in_spool);
+	kindletool_buffer_free(&out_spool);
+	kt_with_unknown_devcodes = with_unknown_devcodes;
+	return ret;
+}
+
+int
+    kindletool_info(const struct kindletool_ctx* ctx, const struct kindletool_stream* input)
+{
+	return kt_lib_convert(ctx, input, NULL);
+}
+
+int
+    kindletool_convert(const struct kindletool_ctx*    ctx,
+		       const struct kindletool_stream* input,
+		       const struct kindletool_stream* output)
+{
+	return kt_lib_convert(ctx, input, output);
+}
+
+// NOTE: Signed packages need to back-patch their signature, so if output can't seek, they're buffered in memory.
+int
+    kindletool_create(const struct kindletool_ctx*    ctx,
+		      const char*                     type,
+		      const char* const*              switches,
+		      const struct kindletool_stream* input,
+		      const struct kindletool_stream* output)
+{
+	const unsigned int       with_unknown_devcodes = kt_with_unknown_devcodes;
+	struct kindletool_buffer in_spool              = { 0 };
+	struct kindletool_buffer out_spool             = { 0 };
+	struct kindletool_stream spool_stream;
+	FILE*                    in_file  = NULL;
+	FILE*                    out_file = NULL;
+	bool                     spooled  = false;
+	int                      ret      = -1;
+
+	kt_with_unknown_devcodes = ctx->with_unknown_devcodes;
+	if ((in_file = kt_lib_open_input(input, &in_spool)) == NULL) {
+		goto cleanup;
+	}
+	if (output->write == NULL) {
+		fprintf(stderr, "Output stream is not writable.\n");
+		goto cleanup;
+	}
+	if (output->seek != NULL || ctx->fake_sign) {
+		out_file = kt_lib_fopen(output, "wb");
+	} else {
+		kindletool_buffer_stream(&out_spool, &spool_stream);
+		out_file = kt_lib_fopen(&spool_stream, "w+b");
+		spooled  = true;
+	}
+	if (out_file == NULL) {
+		goto cleanup;
+	}
+	ret = kindle_create_payload(type, switches, in_file, out_file, ctx->fake_sign);
+
+cleanup:
+	if (out_file != NULL) {
+		if (fclose(out_file) != 0) {
+			ret = -1;
+		}
+		if (ret == 0 && spooled) {
+			ret = kt_lib_flush_spool(&out_spool, output);
+		}
+	}
+	if (in_file != NULL) {
+		fclose(in_file);
+	}
+	kindletool_buffer_free(&in_spool);
+	kindletool_buffer_free(&out_spool);
+	kt_with_unknown_devcodes = with_unknown_devcodes;
+	return ret;
+}
@@ -0,0 +1,84 @@
+/*
+**  KindleTool, libkindletool.h
+**
+**  Copyright (C) 2011-2012  Yifan Lu
+**  Copyright (C) 2012-2020  NiLuJe
+**  Concept based on an original Python implementation by Igor Skochinsky & Jean-Yves Avenard,
+**    cf., http://www.mobileread.com/forums/showthread.php?t=63225
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LIBKINDLETOOL_H
+#define __LIBKINDLETOOL_H
+
+// Public API of libkindletool.a, so that packages can be converted & built in-process, without going through files.
+// Every function is reentrant: the whole state of a call lives in its ctx & streams,
+// so different threads can work on different packages at the same time.
+// NOTE: Only available where we can wrap callbacks in a stdio stream (i.e., glibc, musl, the BSDs, macOS & Cygwin).
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A byte stream, as a set of callbacks, which all get opaque as their first argument.
+// read & write return the amount of bytes they processed, 0 on EOF, or -1 on error (only the relevant one is needed).
+// seek is optional: it moves to *offset relative to whence (like fseek), and stores the resulting absolute position in *offset.
+// Returns 0 on success, or -1 on error. If a stream can't seek, we buffer in memory whatever we need to revisit.
+// NOTE: A seekable input stream may get rewound to offset 0, so the package needs to start there.
+struct kindletool_stream
+{
+	void* opaque;
+	ssize_t (*read)(void*, void*, size_t);
+	ssize_t (*write)(void*, const void*, size_t);
+	int (*seek)(void*, int64_t*, int);
+};
+
+// A growable in-memory buffer. Zero-init it, and use kindletool_buffer_stream to read from it or write to it.
+// To read an existing buffer, just point data & size at it (it's only ever realloc'ed when written to, though).
+struct kindletool_buffer
+{
+	unsigned char* data;
+	size_t         size;
+	size_t         capacity;
+	size_t         pos;
+};
+
+struct kindletool_ctx
+{
+	bool                            with_unknown_devcodes;    // Like setting KT_WITH_UNKNOWN_DEVCODES
+	bool                            fake_sign;                // Like convert/create -u
+	const struct kindletool_stream* report;                   // Where the package information goes (may be NULL)
+};
+
+void kindletool_buffer_stream(struct kindletool_buffer*, struct kindletool_stream*);
+void kindletool_buffer_free(struct kindletool_buffer*);
+
+// Print the information about the package in input to ctx->report, like convert -i.
+int kindletool_info(const struct kindletool_ctx*, const struct kindletool_stream*);
+// Convert the package in input to its plain tarball in output, like convert, integrity check included.
+int kindletool_convert(const struct kindletool_ctx*, const struct kindletool_stream*, const struct kindletool_stream*);
+// Build a package of the given type (ota2, ota, recovery2, recovery or sig) out of the tarball in input, like create does
+// when fed a single tarball. switches is a NULL terminated list of header switches, in the same format as a line of
+// a create --variants manifest (f.g., { "-d", "pw2", "--tgtrev=max", NULL }), and may be NULL.
+// NOTE: The sig type builds a signed userdata package (i.e., create sig -U).
+// NOTE: Unlike the package information, create's diagnostics still go to stderr.
+int kindletool_create(const struct kindletool_ctx*,
+		      const char*,
+		      const char* const*,
+		      const struct kindletool_stream*,
+		      const struct kindletool_stream*);
+
+#endif
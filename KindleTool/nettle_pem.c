@@ -218,16 +218,20 @@ static int
     convert_rsa_private_key(struct nettle_buffer*   buffer,
 			    size_t                  length,
 			    const uint8_t*          data,
+			    struct rsa_public_key*  rsa_pub,
 			    struct rsa_private_key* rsa_pkey)
 {
-	struct rsa_public_key pub;
-	int                   res;
+	struct rsa_public_key  pub;
+	struct rsa_private_key pkey;
+	int                    res;
 
 	// NOTE: Unlike rsa_keypair_from_sexp, we *HAVE* to init the pubkey too, or everything blows up,
 	//       the from_der codepath expects it to be setup...
+	//       Same thing for the private part when we're only after the public one, or it'd be parsed as a public key.
 	rsa_public_key_init(&pub);
+	rsa_private_key_init(&pkey);
 
-	if (rsa_keypair_from_der(&pub, rsa_pkey, 0, length, data)) {
+	if (rsa_keypair_from_der(rsa_pub ? rsa_pub : &pub, rsa_pkey ? rsa_pkey : &pkey, 0, length, data)) {
 		nettle_buffer_reset(buffer);
 		res = 1;
 	} else {
@@ -235,18 +239,84 @@ static int
 		res = 0;
 	}
 
+	rsa_private_key_clear(&pkey);
 	rsa_public_key_clear(&pub);
 
 	return res;
 }
 
+static int
+    convert_rsa_public_key(struct nettle_buffer*  buffer,
+			   size_t                 length,
+			   const uint8_t*         data,
+			   struct rsa_public_key* rsa_pub)
+{
+	int res;
+
+	if (rsa_keypair_from_der(rsa_pub, NULL, 0, length, data)) {
+		nettle_buffer_reset(buffer);
+		res = 1;
+	} else {
+		fprintf(stderr, "Invalid PKCS#1 public key.\n");
+		res = 0;
+	}
+
+	return res;
+}
+
+// A X.509 SubjectPublicKeyInfo, which is what openssl rsa -pubout gives us. We only handle RSA keys.
+static int
+    convert_public_key(struct nettle_buffer*  buffer,
+		       size_t                 length,
+		       const uint8_t*         data,
+		       struct rsa_public_key* rsa_pub)
+{
+	// pkcs-1 {iso(1) member-body(2) us(840) rsadsi(113549) pkcs(1) 1 } rsaEncryption(1)
+	static const uint8_t     id_rsa_encryption[9] = { 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01 };
+	struct asn1_der_iterator i;
+	struct asn1_der_iterator j;
+
+	/* SubjectPublicKeyInfo ::= SEQUENCE {
+	       algorithm               AlgorithmIdentifier,
+	       subjectPublicKey        BIT STRING
+	   }
+	   AlgorithmIdentifier ::= SEQUENCE {
+	       algorithm               OBJECT IDENTIFIER,
+	       parameters              OPTIONAL
+	   } */
+	if (asn1_der_iterator_first(&i, length, data) == ASN1_ITERATOR_CONSTRUCTED && i.type == ASN1_SEQUENCE &&
+	    asn1_der_decode_constructed_last(&i) == ASN1_ITERATOR_CONSTRUCTED && i.type == ASN1_SEQUENCE &&
+	    /* Use the j iterator to parse the algorithm identifier */
+	    asn1_der_decode_constructed(&i, &j) == ASN1_ITERATOR_PRIMITIVE && j.type == ASN1_IDENTIFIER &&
+	    asn1_der_iterator_next(&i) == ASN1_ITERATOR_PRIMITIVE && i.type == ASN1_BITSTRING &&
+	    /* Use i to parse the object wrapped in the bit string */
+	    asn1_der_decode_bitstring_last(&i)) {
+		if (j.length != sizeof(id_rsa_encryption) ||
+		    memcmp(j.data, id_rsa_encryption, sizeof(id_rsa_encryption)) != 0) {
+			fprintf(stderr, "Unsupported public key algorithm (only RSA keys are supported).\n");
+			return 0;
+		}
+		// Parameters must be NULL
+		if (asn1_der_iterator_next(&j) == ASN1_ITERATOR_PRIMITIVE && j.type == ASN1_NULL && j.length == 0 &&
+		    asn1_der_iterator_next(&j) == ASN1_ITERATOR_END && rsa_public_key_from_der_iterator(rsa_pub, 0, &i)) {
+			nettle_buffer_reset(buffer);
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "Invalid SubjectPublicKeyInfo.\n");
+	return 0;
+}
+
 // NOTE: Destroys contents of buffer
 //       Returns 1 on success, 0 on error, and -1 for unsupported algorithms.
+//       We're after either a private key (rsa_pkey), or a public one (rsa_pub, which a private key also provides).
 static int
     convert_type(struct nettle_buffer*   buffer,
 		 enum object_type        type,
 		 size_t                  length,
 		 const uint8_t*          data,
+		 struct rsa_public_key*  rsa_pub,
 		 struct rsa_private_key* rsa_pkey)
 {
 	int res;
@@ -257,7 +327,23 @@ static int
 			return -1;
 
 		case RSA_PRIVATE_KEY:
-			res = convert_rsa_private_key(buffer, length, data, rsa_pkey);
+			res = convert_rsa_private_key(buffer, length, data, rsa_pub, rsa_pkey);
+			break;
+
+		case RSA_PUBLIC_KEY:
+			if (rsa_pub == NULL) {
+				fprintf(stderr, "Unsupported key type!\n");
+				return -1;
+			}
+			res = convert_rsa_public_key(buffer, length, data, rsa_pub);
+			break;
+
+		case GENERAL_PUBLIC_KEY:
+			if (rsa_pub == NULL) {
+				fprintf(stderr, "Unsupported key type!\n");
+				return -1;
+			}
+			res = convert_public_key(buffer, length, data, rsa_pub);
 			break;
 	}
 
@@ -265,7 +351,12 @@ static int
 }
 
 static int
-    load_pem(struct nettle_buffer* buffer, FILE* f, struct rsa_private_key* rsa_pkey, enum object_type type, int base64)
+    load_pem(struct nettle_buffer*   buffer,
+	     FILE*                   f,
+	     struct rsa_public_key*  rsa_pub,
+	     struct rsa_private_key* rsa_pkey,
+	     enum object_type        type,
+	     int                     base64)
 {
 	if (type) {
 		read_file(buffer, f);
@@ -273,7 +364,7 @@ static int
 			return 0;
 		}
 
-		if (convert_type(buffer, type, buffer->size, buffer->contents, rsa_pkey) != 1) {
+		if (convert_type(buffer, type, buffer->size, buffer->contents, rsa_pub, rsa_pkey) != 1) {
 			return 0;
 		}
 
@@ -325,9 +416,12 @@ static int
 
 			if (!type) {
 				fprintf(stderr, "Ignoring unsupported object type `%s'.\n", marker);
-			} else if (convert_type(
-				       buffer, type, info.data_length, buffer->contents + info.data_start, rsa_pkey) !=
-				   1) {
+			} else if (convert_type(buffer,
+						type,
+						info.data_length,
+						buffer->contents + info.data_start,
+						rsa_pub,
+						rsa_pkey) != 1) {
 				fprintf(stderr, "convert_type failed!\n");
 				return 0;
 			}
@@ -335,6 +429,76 @@ static int
 	}
 }
 
+// Copy a key into an already initialized one
+void
+    kt_rsa_private_key_copy(struct rsa_private_key* dst, const struct rsa_private_key* src)
+{
+	dst->size = src->size;
+	mpz_set(dst->d, src->d);
+	mpz_set(dst->p, src->p);
+	mpz_set(dst->q, src->q);
+	mpz_set(dst->a, src->a);
+	mpz_set(dst->b, src->b);
+	mpz_set(dst->c, src->c);
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// Keys we were asked to keep around by serve, so that its workers don't have to parse them for every single job
+struct kt_preloaded_key
+{
+	char*                  path;
+	struct rsa_private_key rsa_pkey;
+};
+
+static struct kt_preloaded_key* kt_preloaded_keys     = NULL;
+static size_t                   kt_num_preloaded_keys = 0U;
+
+static const struct kt_preloaded_key*
+    find_preloaded_key(const char* pem_filename)
+{
+	char   path[PATH_MAX];
+	size_t i;
+
+	// NOTE: Jobs may run from another directory, so, compare canonical paths
+	if (kt_num_preloaded_keys == 0U || realpath(pem_filename, path) == NULL) {
+		return NULL;
+	}
+	for (i = 0U; i < kt_num_preloaded_keys; i++) {
+		if (strcmp(kt_preloaded_keys[i].path, path) == 0) {
+			return &kt_preloaded_keys[i];
+		}
+	}
+	return NULL;
+}
+
+int
+    nettle_rsa_privkey_preload(const char* pem_filename)
+{
+	char                     path[PATH_MAX];
+	struct kt_preloaded_key* key;
+
+	if (find_preloaded_key(pem_filename) != NULL) {
+		return EXIT_SUCCESS;
+	}
+	if (realpath(pem_filename, path) == NULL) {
+		fprintf(stderr, "Failed to open `%s': %s.\n", pem_filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	kt_preloaded_keys = realloc(kt_preloaded_keys, (kt_num_preloaded_keys + 1U) * sizeof(*kt_preloaded_keys));
+	key               = &kt_preloaded_keys[kt_num_preloaded_keys];
+	rsa_private_key_init(&key->rsa_pkey);
+	if (nettle_rsa_privkey_from_pem(pem_filename, &key->rsa_pkey) != EXIT_SUCCESS) {
+		rsa_private_key_clear(&key->rsa_pkey);
+		return EXIT_FAILURE;
+	}
+	key->path = strdup(path);
+	kt_num_preloaded_keys++;
+
+	return EXIT_SUCCESS;
+}
+#endif
+
 int
     nettle_rsa_privkey_from_pem(const char* pem_filename, struct rsa_private_key* rsa_pkey)
 {
@@ -342,6 +506,15 @@ int
 	enum object_type     type   = 0;
 	int                  base64 = 0;
 
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	// If it was preloaded, just hand out a copy
+	const struct kt_preloaded_key* preloaded = find_preloaded_key(pem_filename);
+	if (preloaded != NULL) {
+		kt_rsa_private_key_copy(rsa_pkey, &preloaded->rsa_pkey);
+		return EXIT_SUCCESS;
+	}
+#endif
+
 	nettle_buffer_init_realloc(&buffer, NULL, nettle_xrealloc);
 
 	const char* mode = (type || base64) ? "r" : "rb";
@@ -352,13 +525,47 @@ int
 		return EXIT_FAILURE;
 	}
 
-	if (!load_pem(&buffer, f, rsa_pkey, type, base64)) {
+	if (!load_pem(&buffer, f, NULL, rsa_pkey, type, base64)) {
+		fprintf(stderr, "load_pem failed!\n");
+		return EXIT_FAILURE;
+	}
+
+	fclose(f);
+	nettle_buffer_clear(&buffer);
+
+	return EXIT_SUCCESS;
+}
+
+// Same thing, but for a public key, to check signatures against.
+// That may come from a private key, a PKCS#1 public key, or a X.509 SubjectPublicKeyInfo.
+int
+    nettle_rsa_pubkey_from_pem(const char* pem_filename, struct rsa_public_key* rsa_pub)
+{
+	struct nettle_buffer buffer;
+
+	nettle_buffer_init_realloc(&buffer, NULL, nettle_xrealloc);
+
+	FILE* f = fopen(pem_filename, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open `%s': %s.\n", pem_filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (!load_pem(&buffer, f, rsa_pub, NULL, 0, 0)) {
 		fprintf(stderr, "load_pem failed!\n");
+		fclose(f);
+		nettle_buffer_clear(&buffer);
 		return EXIT_FAILURE;
 	}
 
 	fclose(f);
 	nettle_buffer_clear(&buffer);
 
+	// We might not have found anything we could use
+	if (rsa_pub->size == 0U) {
+		fprintf(stderr, "No RSA key found in `%s'.\n", pem_filename);
+		return EXIT_FAILURE;
+	}
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,552 @@
+#!/usr/bin/env python3
+#
+# Device table generator for KindleTool.
+# Output is to stdout, the result is KindleTool/kindle_devices.h
+#
+# Device codes come from the model list in kindle_model_sort.py,
+# what we add here is everything KindleTool needs to know about each model:
+# its name, its platform, and the -d names & aliases it answers to.
+
+import sys
+
+from kindle_model_sort import model_tuples
+
+# Model -> (name, platform, -d names)
+# NOTE: Devices without a -d name can still be picked by device code, or through an alias.
+#       The platform is only used to tell pre-Wario devices apart from the newer ones, so unknown models are parked
+#       on whichever side of that fence their device code puts them.
+DEVICES = {
+	'Kindle1':                                       ('Kindle 1', 'Plat_Unspecified', ('k1',)),
+	'Kindle2US':                                     ('Kindle 2 US', 'MarioDeprecated', ('k2',)),
+	'Kindle2International':                          ('Kindle 2 International', 'MarioDeprecated', ('k2i',)),
+	'KindleDXUS':                                    ('Kindle DX US', 'MarioDeprecated', ('dx',)),
+	'KindleDXInternational':                         ('Kindle DX International', 'MarioDeprecated', ('dxi',)),
+	'ValidKindleUnknown_0x07':                       ('Unknown Kindle (0x07)', 'Plat_Unspecified', ()),
+	'Kindle3WiFi3G':                                 ('Kindle 3 WiFi+3G', 'Luigi', ('k3g',)),
+	'Kindle3WiFi':                                   ('Kindle 3 WiFi', 'Luigi', ('k3w',)),
+	'KindleDXGraphite':                              ('Kindle DX Graphite', 'MarioDeprecated', ('dxg',)),
+	'Kindle3WiFi3GEurope':                           ('Kindle 3 WiFi+3G Europe', 'Luigi', ('k3gb',)),
+	'ValidKindleUnknown_0x0B':                       ('Unknown Kindle (0x0B)', 'Plat_Unspecified', ()),
+	'ValidKindleUnknown_0x0C':                       ('Unknown Kindle (0x0C)', 'Plat_Unspecified', ()),
+	'ValidKindleUnknown_0x0D':                       ('Unknown Kindle (0x0D)', 'Plat_Unspecified', ()),
+	'Kindle4NonTouch':                               ('Silver Kindle 4 Non-Touch (2011)', 'Yoshi', ('k4',)),
+	'Kindle5TouchWiFi3G':                            ('Kindle 5 Touch WiFi+3G', 'Yoshi', ('k5g',)),
+	'Kindle5TouchWiFi3GEurope':                      ('Kindle 5 Touch WiFi+3G Europe', 'Yoshi', ('k5gb',)),
+	'Kindle5TouchWiFi':                              ('Kindle 5 Touch WiFi', 'Yoshi', ('k5w',)),
+	'Kindle5TouchUnknown':                           ('Kindle 5 Touch (Unknown Variant)', 'Yoshi', ('k5u',)),
+	'KindlePaperWhiteWiFi3G':                        ('Kindle PaperWhite WiFi+3G', 'Yoshime', ('pwg', 'kpwg')),
+	'KindlePaperWhiteWiFi3GCanada':                  ('Kindle PaperWhite WiFi+3G Canada', 'Yoshime', ('pwgc', 'kpwgc')),
+	'KindlePaperWhiteWiFi3GEurope':                  ('Kindle PaperWhite WiFi+3G Europe', 'Yoshime', ('pwgb', 'kpwgb')),
+	'KindlePaperWhiteWiFi3GJapan':                   ('Kindle PaperWhite WiFi+3G Japan', 'Yoshime', ('pwgj', 'kpwgj')),
+	'KindlePaperWhiteWiFi3GBrazil':                  ('Kindle PaperWhite WiFi+3G Brazil', 'Yoshime', ('pwgbr', 'kpwgbr')),
+	'Kindle4NonTouchBlack':                          ('Black Kindle 4 Non-Touch (2012)', 'Yoshi', ('k4b',)),
+	'KindlePaperWhiteWiFi':                          ('Kindle PaperWhite WiFi', 'Yoshime', ('pw', 'kpw')),
+	'KindlePaperWhite2WiFiJapan':                    ('Kindle PaperWhite 2 (2013) WiFi Japan', 'Wario', ('pw2j', 'kpw2j')),
+	'KindlePaperWhite2WiFi':                         ('Kindle PaperWhite 2 (2013) WiFi', 'Wario', ('pw2', 'kpw2')),
+	'KindlePaperWhite2WiFi3G':                       ('Kindle PaperWhite 2 (2013) WiFi+3G', 'Wario', ('pw2g', 'kpw2g')),
+	'KindlePaperWhite2WiFi3GCanada':                 ('Kindle PaperWhite 2 (2013) WiFi+3G Canada', 'Wario', ('pw2gc', 'kpw2gc')),
+	'KindlePaperWhite2WiFi3GEurope':                 ('Kindle PaperWhite 2 (2013) WiFi+3G Europe', 'Wario', ('pw2gb', 'kpw2gb')),
+	'KindlePaperWhite2WiFi3GRussia':                 ('Kindle PaperWhite 2 (2013) WiFi+3G Russia', 'Wario', ('pw2gr', 'kpw2gr')),
+	'KindlePaperWhite2WiFi3GJapan':                  ('Kindle PaperWhite 2 (2013) WiFi+3G Japan', 'Wario', ('pw2gj', 'kpw2gj')),
+	'KindlePaperWhite2WiFi4GBInternational':         ('Kindle PaperWhite 2 (2013) WiFi (4GB) International', 'Wario', ('pw2il', 'kpw2il')),
+	'KindlePaperWhite2WiFi3G4GBCanada':              ('Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Canada', 'Wario', ('pw2gcl', 'kpw2gcl')),
+	'KindlePaperWhite2WiFi3G4GBEurope':              ('Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Europe', 'Wario', ('pw2gbl', 'kpw2gbl')),
+	'KindlePaperWhite2WiFi3G4GBBrazil':              ('Kindle PaperWhite 2 (2013) WiFi+3G (4GB) Brazil', 'Wario', ('pw2gbrl', 'kpw2gbrl')),
+	'KindlePaperWhite2WiFi3G4GB':                    ('Kindle PaperWhite 2 (2013) WiFi+3G (4GB)', 'Wario', ('pw2gl', 'kpw2gl')),
+	'KindlePaperWhite2Unknown_0xF4':                 ('Kindle PaperWhite 2 (2013) (Unknown Variant 0xF4)', 'Wario', ()),
+	'KindlePaperWhite2Unknown_0xF9':                 ('Kindle PaperWhite 2 (2013) (Unknown Variant 0xF9)', 'Wario', ()),
+	'KindleVoyageWiFi':                              ('Kindle Voyage WiFi', 'Wario', ('kv',)),
+	'KindleVoyageWiFi3G':                            ('Kindle Voyage WiFi+3G', 'Wario', ('kvg',)),
+	'KindleVoyageWiFi3GJapan':                       ('Kindle Voyage WiFi+3G Japan', 'Wario', ('kvgj',)),
+	'KindleVoyageUnknown_0x4F':                      ('Kindle Voyage (Unknown Variant 0x4F)', 'Wario', ()),
+	'KindleVoyageWiFi3GMexico':                      ('Kindle Voyage WiFi+3G Mexico', 'Wario', ('kvgm',)),
+	'KindleVoyageWiFi3GEurope':                      ('Kindle Voyage WiFi+3G Europe', 'Wario', ('kvgb',)),
+	'KindleBasic':                                   ('Kindle Basic (2014)', 'Wario', ('kt2', 'bk')),
+	'ValidKindleUnknown_0x99':                       ('Unknown Kindle (0x99)', 'Wario', ()),
+	'KindleBasicKiwi':                               ('Kindle Basic (2014) Australia', 'Wario', ('kt2a', 'bka')),
+	'ValidKindleUnknown_0x16':                       ('Unknown Kindle (0x16)', 'Plat_Unspecified', ()),
+	'ValidKindleUnknown_0x21':                       ('Unknown Kindle (0x21)', 'Plat_Unspecified', ()),
+	'KindlePaperWhite3WiFi':                         ('Kindle PaperWhite 3 (2015) WiFi', 'Wario', ('pw3', 'kpw3')),
+	'KindlePaperWhite3WiFi3G':                       ('Kindle PaperWhite 3 (2015) WiFi+3G', 'Wario', ('pw3g', 'kpw3g')),
+	'KindlePaperWhite3WiFi3GMexico':                 ('Kindle PaperWhite 3 (2015) WiFi+3G Mexico', 'Wario', ('pw3gm', 'kpw3gm')),
+	'KindlePaperWhite3WiFi3GEurope':                 ('Kindle PaperWhite 3 (2015) WiFi+3G Europe', 'Wario', ('pw3gb', 'kpw3gb')),
+	'KindlePaperWhite3WiFi3GCanada':                 ('Kindle PaperWhite 3 (2015) WiFi+3G Canada', 'Wario', ('pw3gc', 'kpw3gc')),
+	'KindlePaperWhite3WiFi3GJapan':                  ('Kindle PaperWhite 3 (2015) WiFi+3G Japan', 'Wario', ('pw3gj', 'kpw3gj')),
+	'KindlePaperWhite3WhiteWiFi':                    ('White Kindle PaperWhite 3 (2016) WiFi', 'Wario', ('pw3w', 'kpw3w')),
+	'KindlePaperWhite3WhiteWiFi3GJapan':             ('White Kindle PaperWhite 3 (2016) WiFi+3G Japan', 'Wario', ('pw3wgj', 'kpw3wgj')),
+	'KindlePW3WhiteUnknown_0KD':                     ('White Kindle PaperWhite 3 (Unknown Variant 0KD)', 'Wario', ()),
+	'KindlePaperWhite3WhiteWiFi3GInternational':     ('White Kindle PaperWhite 3 (2016) WiFi+3G International', 'Wario', ('pw3wgi', 'kpw3wgi')),
+	'KindlePaperWhite3WhiteWiFi3GInternationalBis':  ('White Kindle PaperWhite 3 (2016) WiFi+3G International (Bis)', 'Wario', ('pw3wgib', 'kpw3wgib')),
+	'KindlePW3WhiteUnknown_0KG':                     ('White Kindle PaperWhite 3 (Unknown Variant 0KG)', 'Wario', ()),
+	'KindlePaperWhite3WiFi32GBJapanBlack':           ('Kindle PaperWhite 3 (2016) WiFi (32GB) Japan', 'Wario', ('pw3jl', 'kpw3jl')),
+	'KindlePaperWhite3WiFi32GBJapanWhite':           ('White Kindle PaperWhite 3 (2016) WiFi (32GB) Japan', 'Wario', ('pw3wjl', 'kpw3wjl')),
+	'KindleOasisWiFi':                               ('Kindle Oasis WiFi', 'Duet', ('koa',)),
+	'KindleOasisWiFi3G':                             ('Kindle Oasis WiFi+3G', 'Duet', ('koag',)),
+	'KindleOasisWiFi3GInternational':                ('Kindle Oasis WiFi+3G International', 'Duet', ('koagbi',)),
+	'KindleOasisUnknown_0GS':                        ('Kindle Oasis (Unknown Variant 0GS)', 'Duet', ()),
+	'KindleOasisWiFi3GChina':                        ('Kindle Oasis WiFi+3G China', 'Duet', ('koagcn',)),
+	'KindleOasisWiFi3GEurope':                       ('Kindle Oasis WiFi+3G Europe', 'Duet', ('koagb',)),
+	'KindleBasic2Unknown_0DU':                       ('Kindle Basic 2 (2016) (Unknown Variant 0DU)', 'Heisenberg', ()),
+	'KindleBasic2':                                  ('Kindle Basic 2 (2016)', 'Heisenberg', ('kt3',)),
+	'KindleBasic2White':                             ('White Kindle Basic 2 (2016)', 'Heisenberg', ('kt3w',)),
+	'KindleOasis2Unknown_0LM':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0LM)', 'Zelda', ()),
+	'KindleOasis2Unknown_0LN':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0LN)', 'Zelda', ()),
+	'KindleOasis2Unknown_0LP':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0LP)', 'Zelda', ()),
+	'KindleOasis2Unknown_0LQ':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0LQ)', 'Zelda', ()),
+	'KindleOasis2WiFi32GBChampagne':                 ('Champagne Kindle Oasis 2 (2017) WiFi (32GB)', 'Zelda', ('koa2w32c',)),
+	'KindleOasis2Unknown_0P2':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0P2)', 'Zelda', ()),
+	'KindleOasis2Unknown_0P6':                       ('Kindle Oasis 2 (2017) WiFi+3G (32GB) (Variant 0P6)', 'Zelda', ()),
+	'KindleOasis2Unknown_0P7':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0P7)', 'Zelda', ()),
+	'KindleOasis2WiFi8GB':                           ('Kindle Oasis 2 (2017) WiFi (8GB)', 'Zelda', ('koa2w8',)),
+	'KindleOasis2WiFi3G32GB':                        ('Kindle Oasis 2 (2017) WiFi+3G (32GB)', 'Zelda', ('koa2g32',)),
+	'KindleOasis2WiFi3G32GBEurope':                  ('Kindle Oasis 2 (2017) WiFi+3G (32GB) Europe', 'Zelda', ('koa2g32b',)),
+	'KindleOasis2Unknown_0S3':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0S3)', 'Zelda', ()),
+	'KindleOasis2Unknown_0S4':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0S4)', 'Zelda', ()),
+	'KindleOasis2Unknown_0S7':                       ('Kindle Oasis 2 (2017) (Unknown Variant 0S7)', 'Zelda', ()),
+	'KindleOasis2WiFi32GB':                          ('Kindle Oasis 2 (2017) WiFi (32GB)', 'Zelda', ('koa2w32',)),
+	'KindlePaperWhite4WiFi8GB':                      ('Kindle PaperWhite 4 (2018) WiFi (8GB)', 'Rex', ('pw4', 'kpw4')),
+	'KindlePaperWhite4WiFi4G32GB':                   ('Kindle PaperWhite 4 (2018) WiFi+4G (32GB)', 'Rex', ('pw4lg', 'kpw4lg')),
+	'KindlePaperWhite4WiFi4G32GBEurope':             ('Kindle PaperWhite 4 (2018) WiFi+4G (32GB) Europe', 'Rex', ('pw4lgb', 'kpw4lgb')),
+	'KindlePaperWhite4WiFi4G32GBJapan':              ('Kindle PaperWhite 4 (2018) WiFi+4G (32GB) Japan', 'Rex', ('pw4lgjp', 'kpw4ljp')),
+	'KindlePaperWhite4Unknown_0T4':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0T4)', 'Rex', ()),
+	'KindlePaperWhite4Unknown_0T5':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0T5)', 'Rex', ()),
+	'KindlePaperWhite4WiFi32GB':                     ('Kindle PaperWhite 4 (2018) WiFi (32GB)', 'Rex', ('pw4l', 'kpw4l')),
+	'KindlePaperWhite4Unknown_0T7':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0T7)', 'Rex', ()),
+	'KindlePaperWhite4Unknown_0TJ':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0TJ)', 'Rex', ()),
+	'KindlePaperWhite4Unknown_0TK':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0TK)', 'Rex', ()),
+	'KindlePaperWhite4Unknown_0TL':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0TL)', 'Rex', ()),
+	'KindlePaperWhite4Unknown_0TM':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0TM)', 'Rex', ()),
+	'KindlePaperWhite4Unknown_0TN':                  ('Kindle PaperWhite 4 (2018) (Unknown Variant 0TN)', 'Rex', ()),
+	'KindlePaperWhite4WiFi8GBIndia':                 ('Kindle PaperWhite 4 (2018) WiFi (8GB) India', 'Rex', ('pw4in', 'kpwin')),
+	'KindlePaperWhite4WiFi32GBIndia':                ('Kindle PaperWhite 4 (2018) WiFi (32GB) India', 'Rex', ('pw4lin', 'kpwlin')),
+	'KindlePaperWhite4WiFi32GBBlue':                 ('Twilight Blue Kindle PaperWhite 4 (2018) WiFi (32GB)', 'Rex', ('pw4ltb', 'kpw4ltb')),
+	'KindlePaperWhite4WiFi32GBPlum':                 ('Plum Kindle PaperWhite 4 (2018) WiFi (32GB)', 'Rex', ('pw4lp', 'kpw4lp')),
+	'KindlePaperWhite4WiFi32GBSage':                 ('Sage Kindle PaperWhite 4 (2018) WiFi (32GB)', 'Rex', ('pw4ls', 'kpw4ls')),
+	'KindlePaperWhite4WiFi8GBBlue':                  ('Twilight Blue Kindle PaperWhite 4 (2018) WiFi (8GB)', 'Rex', ('pw4tb', 'kpw4tb')),
+	'KindlePaperWhite4WiFi8GBPlum':                  ('Plum Kindle PaperWhite 4 (2018) WiFi (8GB)', 'Rex', ('pw4p', 'kpw4p')),
+	'KindlePaperWhite4WiFi8GBSage':                  ('Sage Kindle PaperWhite 4 (2018) WiFi (8GB)', 'Rex', ('pw4s', 'kpw4s')),
+	'KindleBasic3':                                  ('Kindle Basic 3 (2019)', 'Rex', ('kt4',)),
+	'KindleBasic3White8GB':                          ('White Kindle Basic 3 (2019) (8GB)', 'Rex', ('kt4w8',)),
+	'KindleBasic3Unknown_0WG':                       ('Kindle Basic 3 (2019) (Unknown Variant 0WG)', 'Rex', ()),
+	'KindleBasic3White':                             ('White Kindle Basic 3 (2019)', 'Rex', ('kt4w',)),
+	'KindleBasic3Unknown_0WJ':                       ('Kindle Basic 3 (2019) (Unknown Variant 0WJ)', 'Rex', ()),
+	'KindleBasic3KidsEdition':                       ('Kindle Basic 3 (2019) Kids Edition', 'Rex', ('kt4ke',)),
+	'KindleOasis3WiFi32GBChampagne':                 ('Champagne Kindle Oasis 3 (2019) WiFi (32GB)', 'Zelda', ('koa3w32c',)),
+	'KindleOasis3WiFi4G32GBJapan':                   ('Kindle Oasis 3 (2019) WiFi+4G (32GB) Japan', 'Zelda', ('koa3g32jp',)),
+	'KindleOasis3WiFi4G32GBIndia':                   ('Kindle Oasis 3 (2019) WiFi+4G (32GB) India', 'Zelda', ('koa3g32in',)),
+	'KindleOasis3WiFi4G32GB':                        ('Kindle Oasis 3 (2019) WiFi+4G (32GB)', 'Zelda', ('koa3g32',)),
+	'KindleOasis3WiFi32GB':                          ('Kindle Oasis 3 (2019) WiFi (32GB)', 'Zelda', ('koa3w32',)),
+	'KindleOasis3WiFi8GB':                           ('Kindle Oasis 3 (2019) WiFi (8GB)', 'Zelda', ('koa3w8',)),
+}
+
+# -d aliases: (names, needs KT_WITH_UNKNOWN_DEVCODES, implied magic number, models)
+# NOTE: Models are listed in the order they end up in the header, and the ones prefixed with a ? are only included
+#       when KT_WITH_UNKNOWN_DEVCODES is set.
+ALIASES = [
+	(('kindle4',), False, 'FC04', [
+		'Kindle4NonTouch',
+		'Kindle4NonTouchBlack',
+	]),
+	(('touch',), False, 'FD04', [
+		'Kindle5TouchWiFi',
+		'Kindle5TouchWiFi3G',
+		'Kindle5TouchWiFi3GEurope',
+		'?Kindle5TouchUnknown',
+	]),
+	(('paperwhite',), False, 'FD04', [
+		'KindlePaperWhiteWiFi',
+		'KindlePaperWhiteWiFi3G',
+		'KindlePaperWhiteWiFi3GCanada',
+		'KindlePaperWhiteWiFi3GEurope',
+		'KindlePaperWhiteWiFi3GJapan',
+		'KindlePaperWhiteWiFi3GBrazil',
+	]),
+	(('paperwhite2',), False, 'FD04', [
+		'KindlePaperWhite2WiFi',
+		'KindlePaperWhite2WiFiJapan',
+		'KindlePaperWhite2WiFi3G',
+		'KindlePaperWhite2WiFi3GCanada',
+		'KindlePaperWhite2WiFi3GEurope',
+		'KindlePaperWhite2WiFi3GRussia',
+		'KindlePaperWhite2WiFi3GJapan',
+		'KindlePaperWhite2WiFi4GBInternational',
+		'KindlePaperWhite2WiFi3G4GBEurope',
+		'KindlePaperWhite2WiFi3G4GB',
+		'KindlePaperWhite2WiFi3G4GBCanada',
+		'KindlePaperWhite2WiFi3G4GBBrazil',
+		'?KindlePaperWhite2Unknown_0xF4',
+		'?KindlePaperWhite2Unknown_0xF9',
+	]),
+	(('basic',), False, 'FD04', [
+		'KindleBasic',
+		'KindleBasicKiwi',
+	]),
+	(('voyage',), False, 'FD04', [
+		'KindleVoyageWiFi',
+		'KindleVoyageWiFi3G',
+		'KindleVoyageWiFi3GEurope',
+		'KindleVoyageWiFi3GJapan',
+		'KindleVoyageWiFi3GMexico',
+		'?KindleVoyageUnknown_0x4F',
+	]),
+	(('paperwhite3',), False, 'FD04', [
+		'KindlePaperWhite3WiFi',
+		'KindlePaperWhite3WiFi3GJapan',
+		'KindlePaperWhite3WiFi3GCanada',
+		'KindlePaperWhite3WiFi3G',
+		'KindlePaperWhite3WiFi3GEurope',
+		'KindlePaperWhite3WiFi3GMexico',
+		'KindlePaperWhite3WhiteWiFi',
+		'KindlePaperWhite3WhiteWiFi3GJapan',
+		'KindlePaperWhite3WiFi32GBJapanBlack',
+		'KindlePaperWhite3WiFi32GBJapanWhite',
+		'KindlePaperWhite3WhiteWiFi3GInternational',
+		'KindlePaperWhite3WhiteWiFi3GInternationalBis',
+		'?KindlePW3WhiteUnknown_0KD',
+		'?KindlePW3WhiteUnknown_0KG',
+	]),
+	(('oasis',), False, 'FD04', [
+		'KindleOasisWiFi',
+		'KindleOasisWiFi3G',
+		'KindleOasisWiFi3GEurope',
+		'KindleOasisWiFi3GInternational',
+		'KindleOasisWiFi3GChina',
+		'?KindleOasisUnknown_0GS',
+	]),
+	(('basic2',), False, 'FD04', [
+		'KindleBasic2',
+		'KindleBasic2White',
+		'?KindleBasic2Unknown_0DU',
+	]),
+	(('oasis2',), False, 'FD04', [
+		'KindleOasis2WiFi8GB',
+		'KindleOasis2WiFi3G32GB',
+		'KindleOasis2WiFi32GB',
+		'KindleOasis2WiFi3G32GBEurope',
+		'KindleOasis2WiFi32GBChampagne',
+		'KindleOasis2Unknown_0P6',
+		'?KindleOasis2Unknown_0LM',
+		'?KindleOasis2Unknown_0LN',
+		'?KindleOasis2Unknown_0LP',
+		'?KindleOasis2Unknown_0LQ',
+		'?KindleOasis2Unknown_0P2',
+		'?KindleOasis2Unknown_0P7',
+		'?KindleOasis2Unknown_0S3',
+		'?KindleOasis2Unknown_0S4',
+		'?KindleOasis2Unknown_0S7',
+	]),
+	(('paperwhite4',), False, 'FD04', [
+		'KindlePaperWhite4WiFi8GB',
+		'KindlePaperWhite4WiFi32GB',
+		'KindlePaperWhite4WiFi4G32GB',
+		'KindlePaperWhite4WiFi4G32GBEurope',
+		'KindlePaperWhite4WiFi8GBIndia',
+		'KindlePaperWhite4WiFi4G32GBJapan',
+		'KindlePaperWhite4WiFi8GBBlue',
+		'KindlePaperWhite4WiFi32GBBlue',
+		'KindlePaperWhite4WiFi8GBPlum',
+		'KindlePaperWhite4WiFi8GBSage',
+		'KindlePaperWhite4WiFi32GBIndia',
+		'KindlePaperWhite4WiFi32GBPlum',
+		'KindlePaperWhite4WiFi32GBSage',
+		'?KindlePaperWhite4Unknown_0T4',
+		'?KindlePaperWhite4Unknown_0T5',
+		'?KindlePaperWhite4Unknown_0T7',
+		'?KindlePaperWhite4Unknown_0TJ',
+		'?KindlePaperWhite4Unknown_0TK',
+		'?KindlePaperWhite4Unknown_0TL',
+		'?KindlePaperWhite4Unknown_0TM',
+		'?KindlePaperWhite4Unknown_0TN',
+	]),
+	(('basic3',), False, 'FD04', [
+		'KindleBasic3',
+		'KindleBasic3White',
+		'KindleBasic3KidsEdition',
+		'KindleBasic3White8GB',
+		'?KindleBasic3Unknown_0WG',
+		'?KindleBasic3Unknown_0WJ',
+	]),
+	(('oasis3',), False, 'FD04', [
+		'KindleOasis3WiFi32GBChampagne',
+		'KindleOasis3WiFi4G32GBJapan',
+		'KindleOasis3WiFi4G32GB',
+		'KindleOasis3WiFi32GB',
+		'KindleOasis3WiFi8GB',
+		'KindleOasis3WiFi4G32GBIndia',
+	]),
+	(('kindle5',), False, 'FD04', [
+		'Kindle5TouchWiFi',
+		'Kindle5TouchWiFi3G',
+		'Kindle5TouchWiFi3GEurope',
+		'?Kindle5TouchUnknown',
+		'KindlePaperWhiteWiFi',
+		'KindlePaperWhiteWiFi3G',
+		'KindlePaperWhiteWiFi3GCanada',
+		'KindlePaperWhiteWiFi3GEurope',
+		'KindlePaperWhiteWiFi3GJapan',
+		'KindlePaperWhiteWiFi3GBrazil',
+		'KindlePaperWhite2WiFi',
+		'KindlePaperWhite2WiFiJapan',
+		'KindlePaperWhite2WiFi3G',
+		'KindlePaperWhite2WiFi3GCanada',
+		'KindlePaperWhite2WiFi3GEurope',
+		'KindlePaperWhite2WiFi3GRussia',
+		'KindlePaperWhite2WiFi3GJapan',
+		'KindlePaperWhite2WiFi4GBInternational',
+		'KindlePaperWhite2WiFi3G4GBEurope',
+		'KindlePaperWhite2WiFi3G4GB',
+		'KindlePaperWhite2WiFi3G4GBCanada',
+		'KindlePaperWhite2WiFi3G4GBBrazil',
+		'?KindlePaperWhite2Unknown_0xF4',
+		'?KindlePaperWhite2Unknown_0xF9',
+		'KindleBasic',
+		'KindleBasicKiwi',
+		'KindleVoyageWiFi',
+		'KindleVoyageWiFi3G',
+		'KindleVoyageWiFi3GEurope',
+		'KindleVoyageWiFi3GJapan',
+		'KindleVoyageWiFi3GMexico',
+		'?KindleVoyageUnknown_0x4F',
+		'KindlePaperWhite3WiFi',
+		'KindlePaperWhite3WiFi3GJapan',
+		'KindlePaperWhite3WiFi3GCanada',
+		'KindlePaperWhite3WiFi3G',
+		'KindlePaperWhite3WiFi3GEurope',
+		'KindlePaperWhite3WiFi3GMexico',
+		'KindlePaperWhite3WiFi32GBJapanBlack',
+		'KindlePaperWhite3WhiteWiFi',
+		'KindlePaperWhite3WhiteWiFi3GJapan',
+		'KindlePaperWhite3WiFi32GBJapanWhite',
+		'KindlePaperWhite3WhiteWiFi3GInternational',
+		'KindlePaperWhite3WhiteWiFi3GInternationalBis',
+		'?KindlePW3WhiteUnknown_0KD',
+		'?KindlePW3WhiteUnknown_0KG',
+		'KindleOasisWiFi',
+		'KindleOasisWiFi3G',
+		'KindleOasisWiFi3GEurope',
+		'KindleOasisWiFi3GInternational',
+		'KindleOasisWiFi3GChina',
+		'?KindleOasisUnknown_0GS',
+		'KindleBasic2',
+		'KindleBasic2White',
+		'?KindleBasic2Unknown_0DU',
+		'KindleOasis2WiFi8GB',
+		'KindleOasis2WiFi3G32GB',
+		'KindleOasis2WiFi32GB',
+		'KindleOasis2WiFi3G32GBEurope',
+		'KindleOasis2WiFi32GBChampagne',
+		'KindleOasis2Unknown_0P6',
+		'?KindleOasis2Unknown_0LM',
+		'?KindleOasis2Unknown_0LN',
+		'?KindleOasis2Unknown_0LP',
+		'?KindleOasis2Unknown_0LQ',
+		'?KindleOasis2Unknown_0P2',
+		'?KindleOasis2Unknown_0P7',
+		'?KindleOasis2Unknown_0S3',
+		'?KindleOasis2Unknown_0S4',
+		'?KindleOasis2Unknown_0S7',
+		'KindlePaperWhite4WiFi8GB',
+		'KindlePaperWhite4WiFi32GB',
+		'KindlePaperWhite4WiFi4G32GB',
+		'KindlePaperWhite4WiFi4G32GBEurope',
+		'KindlePaperWhite4WiFi8GBIndia',
+		'KindlePaperWhite4WiFi4G32GBJapan',
+		'KindlePaperWhite4WiFi8GBBlue',
+		'KindlePaperWhite4WiFi32GBBlue',
+		'KindlePaperWhite4WiFi8GBPlum',
+		'KindlePaperWhite4WiFi8GBSage',
+		'KindlePaperWhite4WiFi32GBIndia',
+		'KindlePaperWhite4WiFi32GBPlum',
+		'KindlePaperWhite4WiFi32GBSage',
+		'?KindlePaperWhite4Unknown_0T4',
+		'?KindlePaperWhite4Unknown_0T5',
+		'?KindlePaperWhite4Unknown_0T7',
+		'?KindlePaperWhite4Unknown_0TJ',
+		'?KindlePaperWhite4Unknown_0TK',
+		'?KindlePaperWhite4Unknown_0TL',
+		'?KindlePaperWhite4Unknown_0TM',
+		'?KindlePaperWhite4Unknown_0TN',
+		'KindleBasic3',
+		'KindleBasic3White',
+		'KindleBasic3KidsEdition',
+		'KindleBasic3White8GB',
+		'?KindleBasic3Unknown_0WG',
+		'?KindleBasic3Unknown_0WJ',
+		'KindleOasis3WiFi32GBChampagne',
+		'KindleOasis3WiFi4G32GBJapan',
+		'KindleOasis3WiFi4G32GB',
+		'KindleOasis3WiFi32GB',
+		'KindleOasis3WiFi8GB',
+		'KindleOasis3WiFi4G32GBIndia',
+	]),
+	(('unknown', 'datamined'), True, 'FD04', [
+		'ValidKindleUnknown_0x16',
+		'ValidKindleUnknown_0x21',
+		'ValidKindleUnknown_0x07',
+		'ValidKindleUnknown_0x0B',
+		'ValidKindleUnknown_0x0C',
+		'ValidKindleUnknown_0x0D',
+		'ValidKindleUnknown_0x99',
+	]),
+	(('kindle2',), False, 'FD04', [
+		'Kindle2US',
+		'Kindle2International',
+	]),
+	(('kindledx',), False, 'FD04', [
+		'KindleDXUS',
+		'KindleDXInternational',
+		'KindleDXGraphite',
+	]),
+	(('kindle3',), False, 'FD04', [
+		'Kindle3WiFi',
+		'Kindle3WiFi3G',
+		'Kindle3WiFi3GEurope',
+	]),
+	(('legacy',), False, 'FD04', [
+		'Kindle2US',
+		'Kindle2International',
+		'KindleDXUS',
+		'KindleDXInternational',
+		'KindleDXGraphite',
+		'Kindle3WiFi',
+		'Kindle3WiFi3G',
+		'Kindle3WiFi3GEurope',
+	]),
+]
+
+# Size of the name hash table, keep it a power of two, and at least twice the amount of names.
+HASH_SIZE = 512
+
+
+# NOTE: Needs to match kt_device_name_hash() in kindle_tool.c
+def fnv1a(name):
+	h = 0x811C9DC5
+	for c in name.lower().encode('ascii'):
+		h = ((h ^ c) * 0x01000193) & 0xFFFFFFFF
+	return h
+
+
+def magic_for(model, platform):
+	# Same as what the hand-written parser used to do: the legacy devices don't imply anything,
+	# the K4 gets a versioned OTA V2 bundle, and everything since the Touch a versionless one.
+	if model.startswith('Kindle4'):
+		return 'FC04'
+	if platform in ('Plat_Unspecified', 'MarioDeprecated', 'Luigi'):
+		return ''
+	return 'FD04'
+
+
+def main():
+	codes = {t[0]: t[1] for t in model_tuples if t[1] != 0x00}
+	if set(codes) != set(DEVICES):
+		sys.exit('Model list mismatch: {}'.format(sorted(set(codes) ^ set(DEVICES))))
+
+	devices = sorted(codes.items(), key=lambda t: t[1])
+	index = {model: i for i, (model, code) in enumerate(devices)}
+	if len(devices) >= 0xFF:
+		sys.exit('Too many devices for an uint8_t index')
+
+	# One set per -d value. Plain devices get a single entry set, aliases their whole list.
+	sets = []
+	names = []
+	for model, code in devices:
+		if DEVICES[model][2]:
+			first = len(sets)
+			sets.append((code, False, model))
+			for name in DEVICES[model][2]:
+				names.append((name, magic_for(model, DEVICES[model][1]), False, first, 1))
+	for alias_names, unknown_only, magic, models in ALIASES:
+		first = len(sets)
+		for model in models:
+			sets.append((codes[model.lstrip('?')], model.startswith('?'), model.lstrip('?')))
+		for name in alias_names:
+			names.append((name, magic, unknown_only, first, len(models)))
+	names.sort(key=lambda t: t[0])
+	if len(set(n[0] for n in names)) != len(names):
+		sys.exit('Duplicate -d names')
+	if len(names) * 2 > HASH_SIZE:
+		sys.exit('Hash table too small')
+
+	table = [0] * HASH_SIZE
+	for i, n in enumerate(names):
+		slot = fnv1a(n[0]) & (HASH_SIZE - 1)
+		while table[slot] != 0:
+			slot = (slot + 1) & (HASH_SIZE - 1)
+		table[slot] = i + 1
+
+	out = sys.stdout
+	out.write(HEADER)
+	out.write('// Every known device, sorted by device code\n')
+	out.write('static const struct kt_device kt_devices[] = {\n')
+	for model, code in devices:
+		out.write('\t{{ 0x{:03X}, {}, "{}" }},    // {}\n'.format(code, DEVICES[model][1], DEVICES[model][0], model))
+	out.write('};\n\n')
+
+	max_code = devices[-1][1]
+	out.write('// Device code -> index in kt_devices + 1 (0 means unknown)\n')
+	out.write('#define KT_DEVICE_MAX_CODE 0x{:03X}U\n'.format(max_code))
+	out.write('static const uint8_t kt_device_index[KT_DEVICE_MAX_CODE + 1U] = {\n')
+	by_code = {code: index[model] + 1 for model, code in devices}
+	cells = [by_code.get(code, 0) for code in range(max_code + 1)]
+	for i in range(0, len(cells), 16):
+		out.write('\t' + ', '.join('{:3}'.format(v) for v in cells[i:i + 16]) + ',\n')
+	out.write('};\n\n')
+
+	out.write('// The devices behind each -d value, in header order\n')
+	out.write('static const struct kt_device_set kt_device_sets[] = {\n')
+	for code, unknown, model in sets:
+		out.write('\t{{ 0x{:03X}, {} }},    // {}\n'.format(code, 'true' if unknown else 'false', model))
+	out.write('};\n\n')
+
+	out.write('// Every -d value (devices & aliases), sorted by name\n')
+	out.write('static const struct kt_device_alias kt_device_aliases[] = {\n')
+	for name, magic, unknown_only, first, count in names:
+		out.write('\t{{ "{}", "{}", {}, {}, {} }},\n'.format(name, magic, 'true' if unknown_only else 'false', first,
+								   count))
+	out.write('};\n\n')
+
+	out.write('// Open addressing (linear probing) hash table of the -d values, as indices in kt_device_aliases + 1\n')
+	out.write('#define KT_DEVICE_HASH_SIZE {}U\n'.format(HASH_SIZE))
+	out.write('static const uint16_t kt_device_hash[KT_DEVICE_HASH_SIZE] = {\n')
+	for i in range(0, HASH_SIZE, 16):
+		out.write('\t' + ', '.join('{:3}'.format(v) for v in table[i:i + 16]) + ',\n')
+	out.write('};\n\n')
+	out.write('#endif\n')
+
+
+HEADER = """/*
+**  KindleTool, kindle_devices.h
+**
+**  Copyright (C) 2011-2012  Yifan Lu
+**  Copyright (C) 2012-2020  NiLuJe
+**  Concept based on an original Python implementation by Igor Skochinsky & Jean-Yves Avenard,
+**    cf., http://www.mobileread.com/forums/showthread.php?t=63225
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Device look-up tables, generated by tools/kindle_device_table.py (don't edit by hand!).
+   To add a device, add it to kindle_model_sort.py & kindle_device_table.py, and regenerate this.
+*/
+
+#ifndef __KINDLETOOL_DEVICES_H
+#define __KINDLETOOL_DEVICES_H
+
+#include "kindle_tool.h"
+
+"""
+
+if __name__ == '__main__':
+	main()
@@ -159,34 +159,36 @@ model_tuples = [
 	('KindleUnknown', 0x00)
 ]
 
-# We need the ID of a few very specific cutoff models...
-wario_cutoff_id = 0
-for i, v in enumerate(model_tuples):
-	if v[0] == 'KindleVoyageWiFi3GJapan':
-		wario_cutoff_id = v[1]
+# NOTE: The model list is also used by kindle_device_table.py, so only print stuff when run directly.
+if __name__ == '__main__':
+	# We need the ID of a few very specific cutoff models...
+	wario_cutoff_id = 0
+	for i, v in enumerate(model_tuples):
+		if v[0] == 'KindleVoyageWiFi3GJapan':
+			wario_cutoff_id = v[1]
 
 
-print('Kindle models sorted by device code\n')
-for t in sorted(model_tuples, key=itemgetter(1)):
-	# Handle the base32hex device IDs in a dedicated manner...
-	if t[1] > 0xFF:
-		print("{:<45} 0x{:03X} ({:0>3}) {:4} {:<14}".format(t[0], t[1], baseN(t[1], 32), '', t[2] if len(t) == 3 else ''))
-	else:
-		print("{:<45} 0x{:02X} {:12} {:<14}".format(t[0], t[1], '', t[2] if len(t) == 3 else ''))
-
-print('\nKindle models >= KindleVoyageWiFi3GJapan (i.e., Platform >= Wario)\n')
-for t in model_tuples:
-	if t[1] >= wario_cutoff_id:
+	print('Kindle models sorted by device code\n')
+	for t in sorted(model_tuples, key=itemgetter(1)):
+		# Handle the base32hex device IDs in a dedicated manner...
 		if t[1] > 0xFF:
-			print("{:<45} 0x{:03X} ({:0>3})".format(t[0], t[1], baseN(t[1], 32)))
+			print("{:<45} 0x{:03X} ({:0>3}) {:4} {:<14}".format(t[0], t[1], baseN(t[1], 32), '', t[2] if len(t) == 3 else ''))
 		else:
-			print("{:<45} 0x{:02X}".format(t[0], t[1]))
-#	# That's to double-check that everything's sane for KindleTool's info command...
-#	else:
-#		print("!!{:<44}!!".format(t[0]))
+			print("{:<45} 0x{:02X} {:12} {:<14}".format(t[0], t[1], '', t[2] if len(t) == 3 else ''))
 
-print('\nKindle models with new device code decoding (i.e., >= PW3)\n')
-for t in model_tuples:
-	if t[1] >= wario_cutoff_id:
-		if t[1] > 0xFF:
-			print("{:<45} 0x{:03X} ({:0>3} <-> 0x{:03X})".format(t[0], t[1], baseN(t[1], 32), devCode(baseN(t[1], 32))))
+	print('\nKindle models >= KindleVoyageWiFi3GJapan (i.e., Platform >= Wario)\n')
+	for t in model_tuples:
+		if t[1] >= wario_cutoff_id:
+			if t[1] > 0xFF:
+				print("{:<45} 0x{:03X} ({:0>3})".format(t[0], t[1], baseN(t[1], 32)))
+			else:
+				print("{:<45} 0x{:02X}".format(t[0], t[1]))
+	#	# That's to double-check that everything's sane for KindleTool's info command...
+	#	else:
+	#		print("!!{:<44}!!".format(t[0]))
+
+	print('\nKindle models with new device code decoding (i.e., >= PW3)\n')
+	for t in model_tuples:
+		if t[1] >= wario_cutoff_id:
+			if t[1] > 0xFF:
+				print("{:<45} 0x{:03X} ({:0>3} <-> 0x{:03X})".format(t[0], t[1], baseN(t[1], 32), devCode(baseN(t[1], 32))))
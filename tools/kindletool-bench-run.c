@@ -0,0 +1,78 @@
+/*
+**  KindleTool, kindletool-bench-run.c
+**
+**  Tiny helper for kindletool-bench.sh: runs a command, and reports its wall-clock time & peak RSS.
+**  We can't count on GNU time being around, and the shell's own time builtin doesn't know about memory usage.
+**
+**  Usage: kindletool-bench-run <result file> <command> [args...]
+**  Appends "<seconds> <peak RSS in KiB>" to the result file, and exits with the command's exit status.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int
+    main(int argc, char* argv[])
+{
+	struct timespec start;
+	struct timespec end;
+	struct rusage   usage;
+	pid_t           pid;
+	int             status;
+	FILE*           result;
+	long            peak_rss;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <result file> <command> [args...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((pid = fork()) == -1) {
+		fprintf(stderr, "Cannot fork: %s.\n", strerror(errno));
+		return EXIT_FAILURE;
+	} else if (pid == 0) {
+		execvp(argv[2], argv + 2);
+		fprintf(stderr, "Cannot run '%s': %s.\n", argv[2], strerror(errno));
+		_exit(127);
+	}
+	// NOTE: wait4 isn't POSIX, but the children's rusage after a wait is just as good, since we only have the one.
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			fprintf(stderr, "Cannot wait for '%s': %s.\n", argv[2], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_CHILDREN, &usage);
+	peak_rss = usage.ru_maxrss;
+#if defined(__APPLE__)
+	// NOTE: macOS reports it in bytes, everyone else in KiB
+	peak_rss /= 1024;
+#endif
+
+	if ((result = fopen(argv[1], "a")) == NULL) {
+		fprintf(stderr, "Cannot open result file '%s': %s.\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fprintf(result,
+		"%.6f %ld\n",
+		(double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9,
+		peak_rss);
+	fclose(result);
+
+	if (WIFEXITED(status)) {
+		return WEXITSTATUS(status);
+	}
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,167 @@
+#!/bin/bash -e
+#
+# Throughput benchmarks for KindleTool (usually run via make bench).
+#
+# Usage: kindletool-bench.sh <kindletool> <kindletool-bench-run> [<baseline>]
+#
+# Builds synthetic inputs (a tree of many small files, a single big image, and a package of every bundle version),
+# then times md, dm, create, convert & extract on them, and reports MB/s, files/s & peak RSS.
+# If a baseline file is given, every benchmark that got slower by more than KT_BENCH_TOLERANCE percent is flagged.
+#
+# Knobs (environment):
+#	KT_BENCH_DIR		Scratch directory (defaults to a fresh one in TMPDIR, removed afterwards)
+#	KT_BENCH_FILES		Number of files in the small files tree (defaults to 5000, 4KiB each)
+#	KT_BENCH_IMAGE_MB	Size of the big image, in MiB (defaults to 2048)
+#	KT_BENCH_TOLERANCE	Slowdown tolerated before flagging a benchmark, in percent (defaults to 10)
+#	KT_BENCH_SAVE		If set, write the results to the baseline file instead of comparing against it
+#	KT_BENCH_STRICT		If set, exit with status 2 when something got slower
+#
+# NOTE: The baseline is just the results file of a previous run, so it only makes sense on the same box.
+##
+
+KT="${1}"
+KT_RUN="${2}"
+BASELINE="${3}"
+
+if [[ ! -x "${KT}" || ! -x "${KT_RUN}" ]] ; then
+	echo "Usage: ${0} <kindletool> <kindletool-bench-run> [<baseline>]"
+	exit 1
+fi
+# We'll be moving around
+KT="$(cd "$(dirname "${KT}")" && pwd)/$(basename "${KT}")"
+KT_RUN="$(cd "$(dirname "${KT_RUN}")" && pwd)/$(basename "${KT_RUN}")"
+if [[ -n "${BASELINE}" ]] ; then
+	BASELINE="$(cd "$(dirname "${BASELINE}")" && pwd)/$(basename "${BASELINE}")"
+fi
+
+NUM_FILES="${KT_BENCH_FILES:-5000}"
+IMAGE_MB="${KT_BENCH_IMAGE_MB:-2048}"
+TOLERANCE="${KT_BENCH_TOLERANCE:-10}"
+
+if [[ -n "${KT_BENCH_DIR}" ]] ; then
+	WORKDIR="${KT_BENCH_DIR}"
+	mkdir -p "${WORKDIR}"
+else
+	WORKDIR="$(mktemp -d "${TMPDIR:-/tmp}/kindletool-bench.XXXXXX")"
+	trap 'rm -rf "${WORKDIR}"' EXIT
+fi
+cd "${WORKDIR}"
+RESULTS="${WORKDIR}/results"
+: > "${RESULTS}"
+
+# Don't let the user's environment skew anything
+unset KT_WITH_UNKNOWN_DEVCODES
+
+## Inputs
+echo "* Building synthetic inputs in ${WORKDIR} . . ."
+rm -rf small image pkg out
+mkdir -p small image pkg out
+# Many small files, spread over a few directories
+FILES_PER_DIR=100
+for (( dir = 0; dir * FILES_PER_DIR < NUM_FILES; dir++ )) ; do
+	count=$(( NUM_FILES - dir * FILES_PER_DIR ))
+	(( count > FILES_PER_DIR )) && count=${FILES_PER_DIR}
+	mkdir -p "small/d${dir}"
+	head -c $(( count * 4096 )) /dev/urandom | split -b 4096 -a 3 - "small/d${dir}/f"
+done
+printf '#!/bin/sh\necho bench\n' > small/install.sh
+# A single big image
+head -c $(( IMAGE_MB * 1024 * 1024 )) /dev/urandom > image/rootfs.img
+printf '#!/bin/sh\necho bench\n' > image/install.sh
+
+SMALL_BYTES=$(( NUM_FILES * 4096 ))
+IMAGE_BYTES=$(( IMAGE_MB * 1024 * 1024 ))
+
+## Benchmarks
+# run <name> <bytes> <files> <command...>
+run() {
+	local name="${1}" bytes="${2}" files="${3}"
+	shift 3
+	rm -f "${WORKDIR}/run"
+	if ! "${KT_RUN}" "${WORKDIR}/run" "$@" </dev/null >/dev/null 2>"${WORKDIR}/run.log" ; then
+		echo "!! ${name} failed:"
+		cat "${WORKDIR}/run.log"
+		exit 1
+	fi
+	read -r seconds rss < "${WORKDIR}/run"
+	echo "${name} ${seconds} ${bytes} ${files} ${rss}" | awk '{
+		mbs = ($2 > 0) ? $3 / 1048576 / $2 : 0
+		fps = ($2 > 0 && $4 > 0) ? $4 / $2 : 0
+		printf "%s %.3f %.2f %.1f %d\n", $1, $2, mbs, fps, $5
+	}' >> "${RESULTS}"
+	tail -n 1 "${RESULTS}" | awk '{ printf "  %-28s %9.3fs %10.2f MB/s %10.1f files/s %8.1f MiB peak\n", $1, $2, $3, $4, $5 / 1024 }'
+}
+
+size_of() {
+	wc -c < "${1}" | tr -d ' '
+}
+
+echo "* Running benchmarks . . ."
+run "md-image" "${IMAGE_BYTES}" 0 "${KT}" md image/rootfs.img out/md.img
+run "dm-image" "${IMAGE_BYTES}" 0 "${KT}" dm out/md.img out/dm.img
+rm -f out/md.img out/dm.img
+
+# One package per bundle version, out of the small files tree
+cd small
+run "create-ota2-small" "${SMALL_BYTES}" "${NUM_FILES}" "${KT}" create ota2 -d kt2 . ../pkg/update_ota2.bin
+run "create-ota-small" "${SMALL_BYTES}" "${NUM_FILES}" "${KT}" create ota -d k3w . ../pkg/update_ota.bin
+run "create-recovery-small" "${SMALL_BYTES}" "${NUM_FILES}" "${KT}" create recovery -d k3w . ../pkg/update_recovery.bin
+run "create-recovery2-small" "${SMALL_BYTES}" "${NUM_FILES}" "${KT}" create recovery2 -d pw4 . ../pkg/update_recovery2.bin
+mkdir -p ../pkg/sig ../pkg/fake
+cd ..
+# NOTE: Userdata & fake packages are built out of a single tarball
+tar -czf pkg/small.tgz -C small .
+run "create-userdata-small" "$(size_of pkg/small.tgz)" "${NUM_FILES}" "${KT}" create sig -U pkg/small.tgz pkg/sig/data.stgz
+run "create-fake-small" "$(size_of pkg/small.tgz)" "${NUM_FILES}" "${KT}" create ota2 -d kt2 -u pkg/small.tgz pkg/fake/data.stgz
+run "create-legacy-small" "${SMALL_BYTES}" "${NUM_FILES}" "${KT}" create ota2 -d kt2 -C small pkg/update_legacy.bin
+cd image
+run "create-ota2-image" "${IMAGE_BYTES}" 0 "${KT}" create ota2 -d kt2 . ../pkg/update_image.bin
+cd ..
+
+for pkg in ota2 ota recovery recovery2 ; do
+	run "convert-${pkg}-small" "$(size_of "pkg/update_${pkg}.bin")" "${NUM_FILES}" "${KT}" convert -k -c "pkg/update_${pkg}.bin"
+done
+run "convert-userdata-small" "$(size_of pkg/sig/data.stgz)" "${NUM_FILES}" "${KT}" convert -k -c pkg/sig/data.stgz
+run "convert-fake-small" "$(size_of pkg/fake/data.stgz)" "${NUM_FILES}" "${KT}" convert -k -c -u pkg/fake/data.stgz
+run "convert-ota2-image" "$(size_of pkg/update_image.bin)" 0 "${KT}" convert -k -c pkg/update_image.bin
+
+run "extract-ota2-small" "$(size_of pkg/update_ota2.bin)" "${NUM_FILES}" "${KT}" extract pkg/update_ota2.bin out
+rm -rf out && mkdir out
+run "extract-ota2-image" "$(size_of pkg/update_image.bin)" 0 "${KT}" extract pkg/update_image.bin out
+rm -rf out
+
+## Baseline
+if [[ -z "${BASELINE}" ]] ; then
+	exit 0
+fi
+if [[ -n "${KT_BENCH_SAVE}" ]] ; then
+	cp "${RESULTS}" "${BASELINE}"
+	echo "* Saved results to baseline ${BASELINE}"
+	exit 0
+fi
+if [[ ! -f "${BASELINE}" ]] ; then
+	echo "* No baseline (${BASELINE}) to compare against, run make bench-baseline (or set KT_BENCH_SAVE) to create one."
+	exit 0
+fi
+
+echo "* Comparing against baseline ${BASELINE} (tolerance: ${TOLERANCE}%) . . ."
+# NOTE: We compare MB/s, or files/s for benchmarks without a byte count
+slower="$(awk -v tol="${TOLERANCE}" '
+	NR == FNR { base[$1] = ($3 > 0) ? $3 : $4; next }
+	($1 in base) && base[$1] > 0 {
+		cur = ($3 > 0) ? $3 : $4
+		delta = (cur - base[$1]) * 100 / base[$1]
+		if (delta < -tol) {
+			printf "  WARNING: %-28s %.1f%% slower than baseline\n", $1, -delta
+		}
+	}' "${BASELINE}" "${RESULTS}")"
+if [[ -n "${slower}" ]] ; then
+	echo "${slower}"
+	if [[ -n "${KT_BENCH_STRICT}" ]] ; then
+		exit 2
+	fi
+else
+	echo "  Nothing got slower."
+fi
+
+exit 0
@@ -0,0 +1,173 @@
+/*
+**  KindleTool, kindletool-munge-check.c
+**
+**  Checks every md/dm vector kernel this machine can run (SSSE3, AVX2, NEON) against the reference tables
+**  in kindle_table.h, on random buffers, with every head misalignment, and tails of every length.
+**  The kernels are static, so we build kindle_tool.c right in here (as for libkindletool), c.f., make check.
+**
+**  Usage: kindletool-munge-check [seed]
+**  Exits with a non-zero status on the first mismatch.
+*/
+
+#include "../KindleTool/kindle_tool.c"
+
+// How far off from the buffer's (aligned) start we begin, and how much we run the kernels over.
+#define CHECK_MAX_HEAD   64U
+#define CHECK_MAX_LENGTH 4096U
+#define CHECK_ROUNDS     2048U
+// What we fill the bytes around the checked range with, to catch kernels writing past it.
+#define CHECK_GUARD      0xE5U
+
+struct check_kernel
+{
+	const char* name;
+	size_t (*fn)(unsigned char*, size_t, uint8_t);
+	size_t width;
+};
+
+// NOTE: xorshift64, we only need it to be cheap, and reproducible from the seed we print.
+static uint64_t
+    check_rand(uint64_t* state)
+{
+	*state ^= *state << 13U;
+	*state ^= *state >> 7U;
+	*state ^= *state << 17U;
+	return *state;
+}
+
+static size_t
+    check_kernels(struct check_kernel* kernels)
+{
+	size_t num_kernels = 0U;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("ssse3")) {
+		kernels[num_kernels++] = (struct check_kernel) { "SSSE3", swap_xor_ssse3, 16U };
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[num_kernels++] = (struct check_kernel) { "AVX2", swap_xor_avx2, 32U };
+	}
+#elif defined(__ARM_NEON)
+	kernels[num_kernels++] = (struct check_kernel) { "NEON", swap_xor_neon, 16U };
+#else
+	(void) kernels;
+#endif
+	return num_kernels;
+}
+
+// Run one kernel (and the table over what it leaves over, like md & dm do) over [head, head + length) of work,
+// and compare that to the table alone, as well as make sure nothing around that range was touched.
+static int
+    check_run(const struct check_kernel* kernel,
+	      const char*                name,
+	      uint8_t                    key,
+	      const unsigned char*       table,
+	      const unsigned char*       input,
+	      unsigned char*             work,
+	      size_t                     head,
+	      size_t                     length)
+{
+	size_t done;
+
+	memset(work, CHECK_GUARD, CHECK_MAX_HEAD + CHECK_MAX_LENGTH + CHECK_MAX_HEAD);
+	memcpy(work + head, input, length);
+	done = kernel->fn(work + head, length, key);
+	// The kernels are supposed to handle every full vector, and leave only the tail to the table
+	if (done != length - (length % kernel->width)) {
+		fprintf(stderr,
+			"%s %s: processed %zu bytes out of %zu (head: %zu), expected %zu.\n",
+			kernel->name,
+			name,
+			done,
+			length,
+			head,
+			length - (length % kernel->width));
+		return -1;
+	}
+	for (size_t i = done; i < length; i++) {
+		work[head + i] = table[work[head + i]];
+	}
+
+	for (size_t i = 0U; i < CHECK_MAX_HEAD + CHECK_MAX_LENGTH + CHECK_MAX_HEAD; i++) {
+		unsigned char expected = (i >= head && i < head + length) ? table[input[i - head]] : CHECK_GUARD;
+		if (work[i] != expected) {
+			fprintf(stderr,
+				"%s %s: byte %zd of %zu (head: %zu) is 0x%02X, expected 0x%02X.\n",
+				kernel->name,
+				name,
+				(ssize_t) i - (ssize_t) head,
+				length,
+				head,
+				work[i],
+				expected);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+    main(int argc, char* argv[])
+{
+	struct check_kernel kernels[2];
+	size_t              num_kernels;
+	unsigned char       input[CHECK_MAX_LENGTH];
+	unsigned char*      work;
+	uint64_t            seed = (argc > 1) ? strtoull(argv[1], NULL, 0) : (uint64_t) time(NULL);
+	uint64_t            state;
+	size_t              head;
+	size_t              length;
+	int                 ret = EXIT_SUCCESS;
+
+	// NOTE: xorshift gets stuck on 0
+	state = (seed != 0U) ? seed : 1U;
+	fprintf(stderr, "Seed: %" PRIu64 "\n", seed);
+
+	num_kernels = check_kernels(kernels);
+	if (num_kernels == 0U) {
+		fprintf(stderr, "No vector kernel to check on this machine, md & dm only use the tables.\n");
+		return EXIT_SUCCESS;
+	}
+
+	// NOTE: Aligned like the munging buffers, so that head really is the misalignment
+	if ((work = alloc_munge_buffer()) == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (size_t k = 0U; k < num_kernels && ret == EXIT_SUCCESS; k++) {
+		for (size_t round = 0U; round < CHECK_ROUNDS; round++) {
+			for (size_t i = 0U; i < sizeof(input); i++) {
+				input[i] = (unsigned char) check_rand(&state);
+			}
+			// Every head & every short length first, random ones after that
+			head = round % CHECK_MAX_HEAD;
+			if (round < CHECK_MAX_HEAD * 2U) {
+				length = round;
+			} else {
+				length = (size_t) (check_rand(&state) % (CHECK_MAX_LENGTH + 1U));
+			}
+			if (check_run(&kernels[k], "md", MD_XOR_KEY, ptog, input, work, head, length) != 0 ||
+			    check_run(&kernels[k], "dm", DM_XOR_KEY, gtop, input, work, head, length) != 0) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+		}
+		if (ret == EXIT_SUCCESS) {
+			fprintf(stderr, "%s: OK\n", kernels[k].name);
+		}
+	}
+
+	// And whatever md & dm picked had better round-trip
+	if (ret == EXIT_SUCCESS) {
+		memcpy(work, input, sizeof(input));
+		md(work, sizeof(input));
+		dm(work, sizeof(input));
+		if (memcmp(work, input, sizeof(input)) != 0) {
+			fprintf(stderr, "dm(md()) doesn't round-trip.\n");
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	free_munge_buffer(work);
+	return ret;
+}